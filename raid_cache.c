@@ -11,63 +11,688 @@
 // Includes
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 
 // Project includes
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 #include <raid_cache.h>
+#include <raid_cache_mrc.h>
+
+// Defines
+#define CACHE_MAX_SHARDS      16  // Upper bound on the number of shards
+#define CACHE_MIN_SHARD_SIZE  64  // Don't split the cache finer than this
+#define CACHE_MAX_DEDUP       64  // Upper bound on the keys indexed per payload frame
+#define CACHE_HUGE_PAGE       (2 * 1024 * 1024)
+#define CACHE_TUNE_MIN_GETS   1024   // Sampled gets needed before the curve is trusted
+#define CACHE_TUNE_SLACK      0.002  // Hit ratio worth giving up for a smaller cache
+#define CACHE_PIN_SPARE       8   // Payload blocks per shard that views can pin at once
+#define CACHE_BENCH_HOT       1024       // Blocks the hot gets of the benchmark go to
+#define CACHE_BENCH_OPS       (1 << 20)  // Gets timed per round (a sixteenth as many puts)
+#define CACHE_BENCH_ROUNDS    5          // Rounds of each, the fastest is reported
 
 //data structures
-struct block {
-  int diskId;
-  int blockId;
-  char buf[RAID_BLOCK_SIZE];
-  int accessCounter;
-};
+//
+//The metadata (keys, dirty bits, policy entries) lives in dense arrays apart
+//from the payload, so scanning or probing it never pulls block data through
+//the CPU cache.  The payload of every shard is carved out of one arena that
+//is mapped once at init (page aligned, optionally on huge pages).
+//
+//The cache is split into shards by hashing (disk, block), each shard has its
+//own lock, payload and policy so threads touching different shards never
+//contend.  Within a shard the replacement policy decides which keys are
+//resident and in which payload slot, the shard itself only owns the bytes.
+//When comparing policies, every other policy runs as a shadow on the same
+//access stream with no payload at all.
+//
+//In dedup mode the slots no longer own a block of payload each.  The payload
+//is a pool of frames indexed by a hash of their contents, every slot points
+//at a (reference counted) frame, and the policy indexes more slots than there
+//are frames.  Identical blocks then cost one frame between them.
+//
+//A view pins the payload block (or frame) it points at.  Frames never change
+//while referenced, so a view simply holds a reference.  Plain slots are
+//written in place, so every shard keeps CACHE_PIN_SPARE extra payload
+//blocks: a slot whose block is pinned when it is about to be overwritten
+//moves to a spare, and the pinned block becomes the spare once released.
+struct cache_shard {
+  pthread_mutex_t lock;
+  char *payload;                               // numFrames blocks of data
+  RAIDCacheKey *keys;                          // key held by each slot
+  uint8_t *dirty;                              // 1 if the slot is newer than the disk
+  uint32_t dirtyCount;
+  uint32_t maxSize;                            // slots (keys) the policy manages
+  uint32_t numFrames;                          // blocks of payload
+  int32_t *frameOf;                            // dedup: frame of each slot, NULL otherwise
+  uint32_t *frameRefs;                         // dedup: slots pointing at each frame
+  uint64_t *frameHash;                         // dedup: content hash of each frame
+  int32_t *frameNext;                          // dedup: hash chain, or free chain
+  int32_t *frameBuckets;                       // dedup: content hash index
+  uint32_t frameMask;
+  int32_t freeFrame;
+  uint32_t framesUsed;
+  uint64_t dedupHits;                          // puts that found their contents already cached
+  int32_t *blockOf;                            // plain: payload block of each slot
+  int32_t *slotOf;                             // plain: slot of each payload block, CACHE_NIL if none
+  uint16_t *pins;                              // views pinning each payload block (or frame)
+  uint32_t pinnedBlocks;                       // payload blocks with at least one view
+  int32_t spares[CACHE_PIN_SPARE];             // plain: payload blocks no slot uses
+  uint32_t numSpares;
+  uint64_t views;                              // views handed out pinned
+  uint64_t viewCopies;                         // views copied because the pins ran out
+  CachePolicy live;                            // the policy serving the driver
+  CachePolicy shadows[RAID_CACHE_POLICY_MAX];  // metadata only, for comparison
+  CacheVictim pending[RAID_CACHE_POLICY_MAX];  // shadow misses waiting to be filled
+} __attribute__((aligned(64)));
 
 struct caches {
-  struct block *blocks;
-  int currentSize;
-  int maxSize;
-  int lastAccessed;
-  int prime;
+  char *arena;                                 // payload of every shard
+  size_t arenaBytes;
+  int arenaHuge;                               // 0 normal, 1 transparent huge, 2 reserved huge pages
+  struct cache_shard *shards;
+  uint32_t numShards;                          // always a power of two
+  uint32_t maxSize;
+  int compare;
+  uint32_t dedup;                              // keys per payload frame, 0 when off
+  RAIDCacheWriteback writeback;                // takes dirty blocks on eviction
 };
 
 struct caches cache;
 
+//What outlives a resize: the statistics of the caches that were replaced
+//and the miss ratio curve, which is independent of the cache size
+struct cache_tuning {
+  uint64_t hits[RAID_CACHE_POLICY_MAX];
+  uint64_t misses[RAID_CACHE_POLICY_MAX];
+  MRCEstimator mrc;
+  pthread_mutex_t mrcLock;
+  int mrcOn;
+  int rebuilding;                              // 1 while a resize re-inserts blocks
+  uint32_t resizes;
+};
+
+struct cache_tuning tuning = { .mrcLock = PTHREAD_MUTEX_INITIALIZER };
+
+//Configuration used by the next init_raid_cache
+RAIDCachePolicy cachePolicy = RAID_CACHE_LRU;
+int cacheCompare = 0;
+uint32_t cacheShards = 0;                      // 0 picks from the cache size
+uint32_t cacheDedup = 0;                       // 0 stores a payload per key
+int cacheHugepages = 0;
+int cacheMrcShift = -1;                        // -1 for no miss ratio curve
+RAIDCacheWriteback cacheWriteback = NULL;
+
+//
+// Cache helpers
+
+static void cache_teardown(void);
+static int cache_put(RAIDDiskID dsk, RAIDBlockID blk, void *buf, int dirty);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : shadow_access
+// Description  : Replay an access on the shadow policies the same way the
+//                live policy sees it.  A shadow that misses on a get is
+//                filled by the driver's following put, or (when the live
+//                cache hit and there is no put) just before its next access
+//
+// Inputs       : sh - the (locked) shard of the block
+//                dsk - the disk number of the block
+//                blk - the block number of the block
+//                put - 1 for a put (insert on a miss), 0 for a get (count it)
+// Outputs      : none
+
+static void shadow_access(struct cache_shard *sh, RAIDDiskID dsk, RAIDBlockID blk, int put) {
+  RAIDCachePolicy i;
+  CachePolicy *cp;
+  CacheVictim victim;
+
+  for (i = 0; i < RAID_CACHE_POLICY_MAX; i++) {
+    cp = &sh->shadows[i];
+    if (cp->capacity == 0) {
+      continue;
+    }
+    if (sh->pending[i].valid && !(put && (sh->pending[i].disk == dsk) && (sh->pending[i].block == blk))) {
+      cache_policy_insert(cp, sh->pending[i].disk, sh->pending[i].block, &victim);
+    }
+    sh->pending[i].valid = 0;
+
+    if (cache_policy_lookup(cp, dsk, blk) != CACHE_NIL) {
+      cp->hits += !put;
+    } else if (put) {
+      cache_policy_insert(cp, dsk, blk, &victim);
+    } else {
+      cp->misses++;
+      sh->pending[i].valid = 1;
+      sh->pending[i].disk = dsk;
+      sh->pending[i].block = blk;
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_shard_of
+// Description  : Find the shard responsible for a block
+//
+// Inputs       : dsk - the disk number of the block
+//                blk - the block number of the block
+// Outputs      : the shard
+
+static struct cache_shard *cache_shard_of(RAIDDiskID dsk, RAIDBlockID blk) {
+  uint64_t key = (((uint64_t)dsk << 32) | blk) * 0x9E3779B97F4A7C15ULL;
+
+  //use the top bits, the policies index their buckets with the middle ones
+  return &cache.shards[(key >> 58) & (cache.numShards - 1)];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mrc_feed
+// Description  : Pass an access on to the miss ratio curve if the key is in
+//                its sample, the test itself needs no lock
+//
+// Inputs       : dsk, blk - the key
+//                get - 1 for a get, 0 for a put
+// Outputs      : none
+
+static void mrc_feed(RAIDDiskID dsk, RAIDBlockID blk, int get) {
+  if (!tuning.mrcOn || tuning.rebuilding || !mrc_sampled(&tuning.mrc, dsk, blk)) {
+    return;
+  }
+  pthread_mutex_lock(&tuning.mrcLock);
+  mrc_access(&tuning.mrc, dsk, blk, get);
+  pthread_mutex_unlock(&tuning.mrcLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : arena_map
+// Description  : Map the payload arena, on huge pages when asked for.  Falls
+//                back to transparent huge pages, then to normal pages
+//
+// Inputs       : bytes - the size of the arena
+//                huge - 1 to try huge pages
+// Outputs      : the arena or NULL on failure
+
+static char *arena_map(size_t bytes, int huge) {
+  void *arena = MAP_FAILED;
+
+  cache.arenaHuge = 0;
+  if (huge) {
+    bytes = (bytes + CACHE_HUGE_PAGE - 1) & ~((size_t)CACHE_HUGE_PAGE - 1);
+#ifdef MAP_HUGETLB
+    arena = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    cache.arenaHuge = (arena != MAP_FAILED) ? 2 : 0;
+#endif
+  }
+  if (arena == MAP_FAILED) {
+    arena = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+      return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge) {
+      cache.arenaHuge = (madvise(arena, bytes, MADV_HUGEPAGE) == 0) ? 1 : 0;
+    }
+#endif
+  }
+  cache.arenaBytes = bytes;
+  return arena;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : slot_data
+// Description  : Find the payload of a slot
+//
+// Inputs       : sh - the shard
+//                slot - the slot
+// Outputs      : pointer to the block of data
+
+static inline char *slot_data(struct cache_shard *sh, int32_t slot) {
+  slot = (sh->frameOf != NULL) ? sh->frameOf[slot] : sh->blockOf[slot];
+  return &sh->payload[(size_t)slot * RAID_BLOCK_SIZE];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : slot_unpin
+// Description  : Move a plain slot off its payload block if a view has it
+//                pinned, so the slot can be written without the view seeing
+//
+// Inputs       : sh - the (locked) shard
+//                slot - the slot about to be written
+// Outputs      : none
+
+static void slot_unpin(struct cache_shard *sh, int32_t slot) {
+  int32_t b = sh->blockOf[slot], spare;
+
+  //there are never more pinned blocks than spares, so one is always free here
+  if (sh->pins[b] == 0) {
+    return;
+  }
+  spare = sh->spares[--sh->numSpares];
+  sh->slotOf[b] = CACHE_NIL;
+  sh->slotOf[spare] = slot;
+  sh->blockOf[slot] = spare;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : content_hash
+// Description  : Hash the contents of a block, a word at a time
+//
+// Inputs       : buf - the block
+// Outputs      : the hash value
+
+static uint64_t content_hash(const void *buf) {
+  const char *p = buf;
+  uint64_t h = 0xCBF29CE484222325ULL, w;
+  int i;
+
+  for (i = 0; i < RAID_BLOCK_SIZE; i += sizeof(uint64_t)) {
+    memcpy(&w, &p[i], sizeof(uint64_t));
+    h = (h ^ w) * 0x100000001B3ULL;
+    h ^= h >> 29;
+  }
+  return h;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : frame_release
+// Description  : Drop a slot's reference to a frame, freeing the frame when
+//                no slot points at it any more
+//
+// Inputs       : sh - the (locked) shard
+//                f - the frame
+// Outputs      : none
+
+static void frame_release(struct cache_shard *sh, int32_t f) {
+  int32_t *link;
+
+  if (--sh->frameRefs[f] > 0) {
+    return;
+  }
+  for (link = &sh->frameBuckets[(sh->frameHash[f] >> 32) & sh->frameMask]; *link != f; link = &sh->frameNext[*link]);
+  *link = sh->frameNext[f];
+  sh->frameNext[f] = sh->freeFrame;
+  sh->freeFrame = f;
+  sh->framesUsed--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : slot_evicted
+// Description  : Finish the eviction of a block the policy replaced, handing
+//                it to the write back function if it is dirty
+//
+// Inputs       : sh - the (locked) shard
+//                victim - the eviction report from the policy
+// Outputs      : none
+
+static void slot_evicted(struct cache_shard *sh, CacheVictim *victim) {
+  int32_t slot = victim->slot;
+
+  if (sh->dirty[slot]) {
+    if (cache.writeback != NULL) {
+      cache.writeback(victim->disk, victim->block, slot_data(sh, slot));
+    }
+    sh->dirty[slot] = 0;
+    sh->dirtyCount--;
+  }
+  if (sh->frameOf != NULL) {
+    frame_release(sh, sh->frameOf[slot]);
+    sh->frameOf[slot] = CACHE_NIL;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : frame_acquire
+// Description  : Find the frame holding a block's contents, or copy them into
+//                a free frame, evicting blocks until one frees up
+//
+// Inputs       : sh - the (locked) shard
+//                dsk, blk - the block being put
+//                buf - the block contents
+//                dirty - 1 if the new contents are dirty
+//                wasDirty - set to 1 if an evicted dirty copy of the block
+//                           itself was dropped because the put replaces it
+// Outputs      : the frame (holding a reference for the caller), or CACHE_NIL
+
+static int32_t frame_acquire(struct cache_shard *sh, RAIDDiskID dsk, RAIDBlockID blk, const void *buf, int dirty, int *wasDirty) {
+  uint64_t h = content_hash(buf);
+  int32_t f, *bucket = &sh->frameBuckets[(h >> 32) & sh->frameMask];
+  CacheVictim victim;
+
+  for (f = *bucket; f != CACHE_NIL; f = sh->frameNext[f]) {
+    if ((sh->frameHash[f] == h) && (memcmp(&sh->payload[(size_t)f * RAID_BLOCK_SIZE], buf, RAID_BLOCK_SIZE) == 0)) {
+      sh->frameRefs[f]++;
+      sh->dedupHits++;
+      return f;
+    }
+  }
+
+  //every used frame has a resident slot, so evicting always frees one eventually
+  while (sh->freeFrame == CACHE_NIL) {
+    if (cache_policy_evict(&sh->live, &victim) == CACHE_NIL) {
+      return CACHE_NIL;
+    }
+    //no point writing back the old copy of the block the put is replacing
+    if (dirty && (victim.disk == dsk) && (victim.block == blk) && sh->dirty[victim.slot]) {
+      sh->dirty[victim.slot] = 0;
+      *wasDirty = 1;
+    }
+    slot_evicted(sh, &victim);
+  }
+
+  f = sh->freeFrame;
+  sh->freeFrame = sh->frameNext[f];
+  memcpy(&sh->payload[(size_t)f * RAID_BLOCK_SIZE], buf, RAID_BLOCK_SIZE);
+  sh->frameHash[f] = h;
+  sh->frameRefs[f] = 1;
+  sh->frameNext[f] = *bucket;
+  *bucket = f;
+  sh->framesUsed++;
+  return f;
+}
+
 //
 // TAGLINE Cache interface
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : init_raid_cache
-// Description  : Initialize the cache and note maximum blocks
+// Function     : set_raid_cache_policy
+// Description  : Select the replacement policy used by the next init
 //
-// Inputs       : max_items - the maximum number of items your cache can hold
+// Inputs       : policy - the replacement policy
+//                compare - 1 to also run the other policies as shadows
 // Outputs      : 0 if successful, -1 if failure
 
-int init_raid_cache(uint32_t max_items) {
-  int i;
+int set_raid_cache_policy(RAIDCachePolicy policy, int compare) {
+  if (policy >= RAID_CACHE_POLICY_MAX) {
+    return(-1);
+  }
+  cachePolicy = policy;
+  cacheCompare = compare;
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_raid_cache_shards
+// Description  : Select the number of shards used by the next init
+//
+// Inputs       : shards - number of shards (rounded down to a power of two,
+//                         0 to size them from the cache capacity)
+// Outputs      : 0 if successful, -1 if failure
 
-  //initialize the max_iem of codes 
-  cache.blocks = malloc(max_items * sizeof(struct block));
+int set_raid_cache_shards(uint32_t shards) {
+  if (shards > CACHE_MAX_SHARDS) {
+    return(-1);
+  }
+  cacheShards = shards;
+  return(0);
+}
 
-  //initialize blockId and diskId 
-  for (i = 0; i < max_items; i++) {
-    cache.blocks[i].diskId = -1;
-    cache.blocks[i].blockId = -1;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_raid_cache_dedup
+// Description  : Select content-addressed (deduplicating) payload storage for
+//                the next init.  The payload budget is unchanged, but it is
+//                indexed by keys_per_block times as many keys
+//
+// Inputs       : keys_per_block - keys indexed per payload frame, 0 for off
+// Outputs      : 0 if successful, -1 if failure
+
+int set_raid_cache_dedup(uint32_t keys_per_block) {
+  if (keys_per_block > CACHE_MAX_DEDUP) {
+    return(-1);
   }
+  cacheDedup = keys_per_block;
+  return(0);
+}
 
-  i = 0;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_raid_cache_hugepages
+// Description  : Ask for the payload arena of the next init to be mapped on
+//                huge pages (transparent huge pages if none are reserved)
+//
+// Inputs       : enable - 1 for huge pages, 0 for normal pages
+// Outputs      : 0 if successful, -1 if failure
+
+int set_raid_cache_hugepages(int enable) {
+  cacheHugepages = (enable != 0);
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_raid_cache_mrc
+// Description  : Run the miss ratio curve estimator next to the cache from
+//                the next init, sampling 1 in 2^shift keys
+//
+// Inputs       : shift - log2 of the sampling period (-1 for off)
+// Outputs      : 0 if successful, -1 if failure
+
+int set_raid_cache_mrc(int shift) {
+  if (shift > 16) {
+    return(-1);
+  }
+  cacheMrcShift = (shift < 0) ? -1 : shift;
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_raid_cache_writeback
+// Description  : Register the function that takes dirty blocks as they are
+//                evicted.  It is called with the shard locked, so it must
+//                only copy the block away, not call back into the cache
+//
+// Inputs       : fn - the write back function (NULL for none)
+// Outputs      : 0 if successful, -1 if failure
+
+int set_raid_cache_writeback(RAIDCacheWriteback fn) {
+  cacheWriteback = fn;
+  cache.writeback = fn;
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_build
+// Description  : Allocate the shards, arena and policies of a cache
+//
+// Inputs       : max_items - the maximum number of items the cache can hold
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_build(uint32_t max_items) {
+  uint32_t s, f, share, keys, numShards, first;
+  RAIDCachePolicy i;
+  struct cache_shard *sh;
+
+  //default to as many shards as possible while keeping each a useful size
+  numShards = cacheShards;
+  if (numShards == 0) {
+    for (numShards = CACHE_MAX_SHARDS; (numShards > 1) && (max_items / numShards < CACHE_MIN_SHARD_SIZE); numShards >>= 1);
+  }
+  for (s = 1; (s << 1) <= numShards; s <<= 1);
+  numShards = (s > max_items) ? 1 : s;
+
+  memset(&cache, 0, sizeof(cache));
+  if (posix_memalign((void **)&cache.shards, 64, numShards * sizeof(struct cache_shard))) {
+    logMessage(LOG_ERROR_LEVEL, "Unable to allocate %u cache shards", numShards);
+    cache.shards = NULL;
+    return(-1);
+  }
+  memset(cache.shards, 0, numShards * sizeof(struct cache_shard));
+  cache.numShards = numShards;
+  cache.compare = cacheCompare;
+  cache.dedup = cacheDedup;
+  cache.writeback = cacheWriteback;
+
+  //one mapping holds every shard's payload (and pin spares), no allocation per shard or block
+  cache.arena = arena_map(((size_t)max_items + ((cache.dedup) ? 0 : numShards * CACHE_PIN_SPARE)) * RAID_BLOCK_SIZE, cacheHugepages);
+  if (cache.arena == NULL) {
+    logMessage(LOG_ERROR_LEVEL, "Unable to map cache arena of %u blocks", max_items);
+    cache_teardown();
+    return(-1);
+  }
+
+  for (s = 0, first = 0; s < numShards; s++) {
+    sh = &cache.shards[s];
+    pthread_mutex_init(&sh->lock, NULL);
+
+    //spread the capacity, the first shards take the remainder
+    share = max_items / numShards + ((s < max_items % numShards) ? 1 : 0);
+    keys = (cache.dedup) ? share * cache.dedup : share;
+    sh->payload = &cache.arena[(size_t)first * RAID_BLOCK_SIZE];
+    first += (cache.dedup) ? share : share + CACHE_PIN_SPARE;
+    sh->keys = malloc(keys * sizeof(RAIDCacheKey));
+    sh->dirty = calloc(keys, sizeof(uint8_t));
+    sh->pins = calloc((cache.dedup) ? share : share + CACHE_PIN_SPARE, sizeof(uint16_t));
+    if ((sh->keys == NULL) || (sh->dirty == NULL) || (sh->pins == NULL) ||
+        cache_policy_init(&sh->live, cachePolicy, keys)) {
+      logMessage(LOG_ERROR_LEVEL, "Unable to allocate cache of %u blocks", max_items);
+      cache_teardown();
+      return(-1);
+    }
+    sh->maxSize = keys;
+    sh->numFrames = share;
+
+    //plain slots start on the payload block of the same number, the spares follow
+    if (!cache.dedup) {
+      sh->blockOf = malloc(keys * sizeof(int32_t));
+      sh->slotOf = malloc((share + CACHE_PIN_SPARE) * sizeof(int32_t));
+      if ((sh->blockOf == NULL) || (sh->slotOf == NULL)) {
+        logMessage(LOG_ERROR_LEVEL, "Unable to allocate cache of %u blocks", max_items);
+        cache_teardown();
+        return(-1);
+      }
+      for (f = 0; f < share; f++) {
+        sh->blockOf[f] = sh->slotOf[f] = f;
+      }
+      for (f = 0; f < CACHE_PIN_SPARE; f++) {
+        sh->slotOf[share + f] = CACHE_NIL;
+        sh->spares[f] = share + f;
+      }
+      sh->numSpares = CACHE_PIN_SPARE;
+    }
+
+    //dedup frames start out on the free chain with an empty content index
+    if (cache.dedup) {
+      for (sh->frameMask = 1; sh->frameMask < share; sh->frameMask <<= 1);
+      sh->frameOf = malloc(keys * sizeof(int32_t));
+      sh->frameRefs = calloc(share, sizeof(uint32_t));
+      sh->frameHash = malloc(share * sizeof(uint64_t));
+      sh->frameNext = malloc(share * sizeof(int32_t));
+      sh->frameBuckets = malloc(sh->frameMask * sizeof(int32_t));
+      if ((sh->frameOf == NULL) || (sh->frameRefs == NULL) || (sh->frameHash == NULL) ||
+          (sh->frameNext == NULL) || (sh->frameBuckets == NULL)) {
+        logMessage(LOG_ERROR_LEVEL, "Unable to allocate dedup index of %u blocks", max_items);
+        cache_teardown();
+        return(-1);
+      }
+      for (f = 0; f < sh->frameMask; f++) {
+        sh->frameBuckets[f] = CACHE_NIL;
+      }
+      for (f = 0; f < share; f++) {
+        sh->frameNext[f] = (f + 1 < share) ? (int32_t)(f + 1) : CACHE_NIL;
+      }
+      sh->frameMask--;
+      sh->freeFrame = 0;
+    }
+
+    //the shadows only hold keys, so they are cheap enough to run side by side
+    for (i = 0; cache.compare && (i < RAID_CACHE_POLICY_MAX); i++) {
+      if ((i != cachePolicy) && cache_policy_init(&sh->shadows[i], i, keys)) {
+        logMessage(LOG_ERROR_LEVEL, "Unable to allocate %s shadow cache", RAID_CACHE_POLICY_LABELS[i]);
+        cache_teardown();
+        return(-1);
+      }
+    }
+  }
+  cache.maxSize = max_items;
 
-  //set problem currentSize to 0 and 
-  cache.currentSize = 0; 
-  cache.maxSize = max_items; 
 	// Return successfully
 	return(0);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_teardown
+// Description  : Release the shards, arena and policies of the cache
+//
+// Inputs       : none
+// Outputs      : none
+
+static void cache_teardown(void) {
+  uint32_t s;
+  RAIDCachePolicy i;
+  struct cache_shard *sh;
+
+  for (s = 0; s < cache.numShards; s++) {
+    sh = &cache.shards[s];
+    cache_policy_free(&sh->live);
+    for (i = 0; i < RAID_CACHE_POLICY_MAX; i++) {
+      cache_policy_free(&sh->shadows[i]);
+    }
+    free(sh->keys);
+    free(sh->dirty);
+    free(sh->frameOf);
+    free(sh->frameRefs);
+    free(sh->frameHash);
+    free(sh->frameNext);
+    free(sh->frameBuckets);
+    free(sh->blockOf);
+    free(sh->slotOf);
+    free(sh->pins);
+    if (sh->pinnedBlocks) {
+      logMessage(LOG_ERROR_LEVEL, "Cache released with %u blocks still pinned by views", sh->pinnedBlocks);
+    }
+    pthread_mutex_destroy(&sh->lock);
+  }
+  free(cache.shards);
+  if (cache.arena != NULL) {
+    munmap(cache.arena, cache.arenaBytes);
+  }
+  cache.arena = NULL;
+  cache.shards = NULL;
+  cache.numShards = 0;
+  cache.maxSize = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : init_raid_cache
+// Description  : Initialize the cache and note maximum blocks
+//
+// Inputs       : max_items - the maximum number of items your cache can hold
+// Outputs      : 0 if successful, -1 if failure
+
+int init_raid_cache(uint32_t max_items) {
+  pthread_mutex_lock(&tuning.mrcLock);
+  if (tuning.mrcOn) {
+    mrc_free(&tuning.mrc);
+  }
+  memset(tuning.hits, 0, sizeof(tuning.hits));
+  memset(tuning.misses, 0, sizeof(tuning.misses));
+  tuning.resizes = 0;
+  tuning.rebuilding = 0;
+  tuning.mrcOn = (cacheMrcShift >= 0) && (mrc_init(&tuning.mrc, cacheMrcShift) == 0);
+  pthread_mutex_unlock(&tuning.mrcLock);
+
+  return cache_build(max_items);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : close_raid_cache
@@ -77,23 +702,321 @@ int init_raid_cache(uint32_t max_items) {
 // Outputs      : o if successful, -1 if failure
 
 int close_raid_cache(void) {
+  cache_teardown();
+  pthread_mutex_lock(&tuning.mrcLock);
+  if (tuning.mrcOn) {
+    mrc_free(&tuning.mrc);
+    tuning.mrcOn = 0;
+  }
+  pthread_mutex_unlock(&tuning.mrcLock);
+
+	// Return successfully
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_total_gets
+// Description  : Count the gets of the live cache, across resizes
+//
+// Inputs       : none
+// Outputs      : the number of gets
+
+static uint64_t cache_total_gets(void) {
+  uint64_t total;
+  uint32_t s;
+  int live;
+
+  if (cache.numShards == 0) {
+    return 0;
+  }
+  live = cache.shards[0].live.type;
+  total = tuning.hits[live] + tuning.misses[live];
+  for (s = 0; s < cache.numShards; s++) {
+    pthread_mutex_lock(&cache.shards[s].lock);
+    total += cache.shards[s].live.hits + cache.shards[s].live.misses;
+    pthread_mutex_unlock(&cache.shards[s].lock);
+  }
+  return total;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : resize_raid_cache
+// Description  : Rebuild the cache with a new capacity, keeping the blocks
+//                that fit.  The cache must not be in use by another thread,
+//                and dirty blocks that no longer fit go to the write back
+//                function, so callers usually clean the cache first
+//
+// Inputs       : max_items - the new maximum number of items
+// Outputs      : 0 if successful, -1 if failure
+
+int resize_raid_cache(uint32_t max_items) {
+  RAIDCacheBlock *blocks;
+  uint8_t *dirty;
+  uint32_t s, n = 0, count = 0;
+  int32_t slot;
+  int i, live;
+  struct cache_shard *sh;
+
+  if ((cache.numShards == 0) || (max_items == cache.maxSize)) {
+    return(0);
+  }
+
+  //views point into the arena, which a rebuild replaces
+  for (s = 0; s < cache.numShards; s++) {
+    pthread_mutex_lock(&cache.shards[s].lock);
+    count += cache.shards[s].pinnedBlocks;
+    pthread_mutex_unlock(&cache.shards[s].lock);
+  }
+  if (count > 0) {
+    logMessage(LOG_INFO_LEVEL, "Cache not resized, %u blocks are pinned by views", count);
+    return(-1);
+  }
+
+  //copy the resident blocks out, the slots in use are the ones the policy still maps
+  for (s = 0; s < cache.numShards; s++) {
+    count += cache.shards[s].live.resident;
+  }
+  blocks = malloc(((size_t)count + 1) * sizeof(RAIDCacheBlock));
+  dirty = malloc((size_t)count + 1);
+  if ((blocks == NULL) || (dirty == NULL)) {
+    free(blocks);
+    free(dirty);
+    return(-1);
+  }
+  live = cache.shards[0].live.type;
+  for (s = 0; s < cache.numShards; s++) {
+    sh = &cache.shards[s];
+    pthread_mutex_lock(&sh->lock);
+    for (slot = 0; (slot < sh->live.nextSlot) && (n < count); slot++) {
+      if (cache_policy_peek(&sh->live, sh->keys[slot].disk, sh->keys[slot].block) == slot) {
+        blocks[n].disk = sh->keys[slot].disk;
+        blocks[n].block = sh->keys[slot].block;
+        memcpy(blocks[n].buf, slot_data(sh, slot), RAID_BLOCK_SIZE);
+        dirty[n++] = sh->dirty[slot];
+      }
+    }
+    for (i = 0; i < RAID_CACHE_POLICY_MAX; i++) {
+      tuning.hits[i] += (i == live) ? sh->live.hits : sh->shadows[i].hits;
+      tuning.misses[i] += (i == live) ? sh->live.misses : sh->shadows[i].misses;
+    }
+    pthread_mutex_unlock(&sh->lock);
+  }
+
+  cache_teardown();
+  if (cache_build(max_items)) {
+    free(blocks);
+    free(dirty);
+    return(-1);
+  }
+
+  tuning.rebuilding = 1;
+  for (s = 0; s < n; s++) {
+    cache_put(blocks[s].disk, blocks[s].block, blocks[s].buf, dirty[s]);
+  }
+  tuning.rebuilding = 0;
+  tuning.resizes++;
+  logMessage(LOG_INFO_LEVEL, "Cache resized to %u blocks, kept %u of %u blocks", max_items,
+      (n < max_items) ? n : max_items, n);
+
+  free(blocks);
+  free(dirty);
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tune_raid_cache
+// Description  : Pick the cache size from the miss ratio curve: the smallest
+//                size within the budget whose hit ratio is about as good as
+//                the best size within the budget.  Nothing changes until the
+//                curve has seen enough gets
+//
+// Inputs       : budget - the most blocks the cache may use
+// Outputs      : the size picked (blocks), 0 if the curve is not ready
+
+uint32_t tune_raid_cache(uint32_t budget) {
+  double best = -1.0, ratio[MRC_SIZES];
+  uint64_t total = cache_total_gets();
+  uint32_t size, keysPer = (cache.dedup) ? cache.dedup : 1;
   int i;
 
-  //for each cache item, set block and disk id to -1, set buf to NULL and accessed times to 0
-  for (i = 0; i < cache.currentSize; i++) {
-    cache.blocks[i].diskId = -1;
-    cache.blocks[i].blockId = -1;
-    cache.blocks[i].accessCounter = 0;
-   // memset(cache.blocks[i].buf, NULL, 1024);
+  pthread_mutex_lock(&tuning.mrcLock);
+  if (!tuning.mrcOn || (tuning.mrc.gets < CACHE_TUNE_MIN_GETS)) {
+    pthread_mutex_unlock(&tuning.mrcLock);
+    return 0;
+  }
+  for (i = 0; i < MRC_SIZES; i++) {
+    ratio[i] = mrc_hit_ratio(&tuning.mrc, i, total);
   }
+  pthread_mutex_unlock(&tuning.mrcLock);
 
-  cache.lastAccessed = 0;
-  cache.currentSize = 0;
+  //the curve counts keys, a dedup cache indexes several keys per block of budget
+  for (i = 0; (i < MRC_SIZES) && (mrc_size(i) <= budget * keysPer); i++) {
+    best = (ratio[i] > best) ? ratio[i] : best;
+  }
+  if (i == 0) {
+    return 0;
+  }
+  for (i = 0; ratio[i] < best - CACHE_TUNE_SLACK; i++);
+  size = mrc_size(i) / keysPer;
+  size = (size < MRC_MIN_SIZE) ? MRC_MIN_SIZE : size;
 
-	// Return successfully
-	return(0);
+  if ((size != cache.maxSize) && resize_raid_cache(size)) {
+    return 0;
+  }
+  return size;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : report_raid_cache
+// Description  : Log the hit ratio of the live policy (and the shadows),
+//                merging the statistics of every shard
+//
+// Inputs       : none
+// Outputs      : none
+
+void report_raid_cache(void) {
+  uint64_t hits, misses, blocks, frames, dedupHits, total, views, viewCopies;
+  uint32_t s;
+  int i, live;
+  CachePolicy *cp;
+
+  if (cache.numShards == 0) {
+    return;
+  }
+
+  live = cache.shards[0].live.type;
+  for (i = 0; i < RAID_CACHE_POLICY_MAX; i++) {
+    hits = tuning.hits[i];
+    misses = tuning.misses[i];
+    for (s = 0; s < cache.numShards; s++) {
+      pthread_mutex_lock(&cache.shards[s].lock);
+      cp = (i == live) ? &cache.shards[s].live : &cache.shards[s].shadows[i];
+      hits += cp->hits;
+      misses += cp->misses;
+      pthread_mutex_unlock(&cache.shards[s].lock);
+    }
+    if ((i != live) && !cache.compare) {
+      continue;
+    }
+    logMessage(LOG_OUTPUT_LEVEL, "Cache policy %-9s hit ratio %.4f (%lu hits / %lu gets)%s",
+        RAID_CACHE_POLICY_LABELS[i],
+        (hits + misses) ? (double)hits / (double)(hits + misses) : 0.0,
+        (unsigned long)hits, (unsigned long)(hits + misses),
+        (i == live) ? " [live]" : "");
+  }
+  logMessage(LOG_OUTPUT_LEVEL, "Cache shards %u x %u blocks", cache.numShards, cache.shards[0].maxSize);
+  if (tuning.resizes) {
+    logMessage(LOG_OUTPUT_LEVEL, "Cache resized %u times, now %u blocks", tuning.resizes, cache.maxSize);
+  }
+
+  //the curve is for an LRU cache of each size, from sampled reuse distances
+  total = cache_total_gets();
+  pthread_mutex_lock(&tuning.mrcLock);
+  for (i = 0; tuning.mrcOn && (i < MRC_SIZES); i++) {
+    logMessage(LOG_OUTPUT_LEVEL, "Cache MRC %6u blocks est. hit ratio %.4f%s",
+        mrc_size(i), mrc_hit_ratio(&tuning.mrc, i, total),
+        (mrc_size(i) == cache.maxSize) ? " [current]" : "");
+  }
+  if (tuning.mrcOn) {
+    logMessage(LOG_OUTPUT_LEVEL, "Cache MRC sampled 1/%u keys (%u keys, %lu gets)",
+        1 << tuning.mrc.shift, tuning.mrc.numKeys, (unsigned long)tuning.mrc.gets);
+  }
+  pthread_mutex_unlock(&tuning.mrcLock);
+
+  //without dedup every resident block holds its own frame
+  blocks = frames = dedupHits = views = viewCopies = 0;
+  for (s = 0; s < cache.numShards; s++) {
+    pthread_mutex_lock(&cache.shards[s].lock);
+    blocks += cache.shards[s].live.resident;
+    frames += (cache.dedup) ? cache.shards[s].framesUsed : cache.shards[s].live.resident;
+    dedupHits += cache.shards[s].dedupHits;
+    views += cache.shards[s].views;
+    viewCopies += cache.shards[s].viewCopies;
+    pthread_mutex_unlock(&cache.shards[s].lock);
+  }
+  if (views + viewCopies) {
+    logMessage(LOG_OUTPUT_LEVEL, "Cache views %lu pinned, %lu copied (no pin left)",
+        (unsigned long)views, (unsigned long)viewCopies);
+  }
+  if (cache.dedup) {
+    logMessage(LOG_OUTPUT_LEVEL, "Cache dedup ratio %.2f (%lu blocks in %lu payloads, %lu duplicate puts)",
+        (frames) ? (double)blocks / (double)frames : 0.0,
+        (unsigned long)blocks, (unsigned long)frames, (unsigned long)dedupHits);
+  }
+  logMessage(LOG_OUTPUT_LEVEL, "Cache resident bytes %lu (%lu blocks of payload)",
+      (unsigned long)(frames * RAID_BLOCK_SIZE), (unsigned long)frames);
+  logMessage(LOG_OUTPUT_LEVEL, "Cache arena %lu KB on %s pages",
+      (unsigned long)(cache.arenaBytes / 1024),
+      (cache.arenaHuge == 2) ? "huge" : (cache.arenaHuge == 1) ? "transparent huge" : "normal");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_put
+// Description  : Put a block into its shard, handing an evicted dirty block
+//                to the write back function first
+//
+// Inputs       : dsk - this is the disk number of the block to cache
+//                blk - this is the block number of the block to cache
+//                buf - the buffer to insert into the cache
+//                dirty - 1 if the block has not been written to disk
+// Outputs      : 1 if the block was already dirty, 0 if successful, -1 if failure
+
+static int cache_put(RAIDDiskID dsk, RAIDBlockID blk, void *buf, int dirty) {
+  int32_t slot, frame = CACHE_NIL;
+  int wasDirty = 0;
+  CacheVictim victim;
+  struct cache_shard *sh;
+
+  if (cache.maxSize == 0) {
+    return(-1);
+  }
+  sh = cache_shard_of(dsk, blk);
+  pthread_mutex_lock(&sh->lock);
+
+  //in dedup mode find a frame for the contents first, that may evict this very block
+  if ((sh->frameOf != NULL) && ((frame = frame_acquire(sh, dsk, blk, buf, dirty, &wasDirty)) == CACHE_NIL)) {
+    pthread_mutex_unlock(&sh->lock);
+    return(-1);
+  }
+
+  //refresh the block if it is already cached, otherwise let the policy find it a slot
+  slot = cache_policy_lookup(&sh->live, dsk, blk);
+  if (slot != CACHE_NIL) {
+    wasDirty = sh->dirty[slot];
+    if (frame != CACHE_NIL) {
+      frame_release(sh, sh->frameOf[slot]);
+    }
+  } else {
+    slot = cache_policy_insert(&sh->live, dsk, blk, &victim);
+    if (victim.valid) {
+      slot_evicted(sh, &victim);
+    }
+    sh->keys[slot].disk = dsk;
+    sh->keys[slot].block = blk;
+  }
+  if (frame != CACHE_NIL) {
+    sh->frameOf[slot] = frame;
+  } else {
+    slot_unpin(sh, slot);
+    memcpy(slot_data(sh, slot), buf, RAID_BLOCK_SIZE);
+  }
+
+  sh->dirtyCount += dirty - wasDirty;
+  sh->dirty[slot] = dirty;
+
+  if (cache.compare) {
+    shadow_access(sh, dsk, blk, 1);
+  }
+  mrc_feed(dsk, blk, 0);
+
+  pthread_mutex_unlock(&sh->lock);
+  return(wasDirty && dirty);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -106,73 +1029,399 @@ int close_raid_cache(void) {
 // Outputs      : 0 if successful, -1 if failure
 
 int put_raid_cache(RAIDDiskID dsk, RAIDBlockID blk, void *buf) {
+  return (cache_put(dsk, blk, buf, 0) < 0) ? -1 : 0;
+}
 
-  int i;
-  int low = 999;
-  int tracker;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dirty_raid_cache
+// Description  : Put an object into the block cache that is not yet on disk,
+//                it is written back when evicted or cleaned
+//
+// Inputs       : dsk - this is the disk number of the block to cache
+//                blk - this is the block number of the block to cache
+//                buf - the buffer to insert into the cache
+// Outputs      : 1 if it replaced a dirty copy, 0 if successful, -1 if failure
 
-  //from start to for how ever many writes in the cache, look for disk and block and if found, update lastAccessed member and update the buffer in the cache
-  for (i = 0; i < cache.currentSize; i++) {
-    if (cache.blocks[i].accessCounter < low) {
-      low = cache.blocks[i].accessCounter;                        //keep track of the least accessed so that after this iteration, if there is no space in the cache, just replace the least recently used by using the 'tracker' as the index
-      tracker = i;
-    }
-    //if disk and blocks id found in the cache, update the lastAccessed field and copy over the buffer
-    if ((cache.blocks[i].diskId == dsk) && (cache.blocks[i].blockId == blk)) {
-      cache.blocks[i].accessCounter = cache.lastAccessed;
-      memset(cache.blocks[i].buf, *(char*)buf, RAID_BLOCK_SIZE);
+int dirty_raid_cache(RAIDDiskID dsk, RAIDBlockID blk, void *buf) {
+  return cache_put(dsk, blk, buf, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clean_raid_cache
+// Description  : Copy dirty objects out of the cache and mark them clean
+//
+// Inputs       : blocks - where to copy the dirty blocks
+//                max - the most blocks to copy
+// Outputs      : the number of blocks copied
+
+uint32_t clean_raid_cache(RAIDCacheBlock *blocks, uint32_t max) {
+  uint32_t s, slot, n = 0;
+  struct cache_shard *sh;
+
+  for (s = 0; (s < cache.numShards) && (n < max); s++) {
+    sh = &cache.shards[s];
+    pthread_mutex_lock(&sh->lock);
+    for (slot = 0; (slot < sh->maxSize) && (sh->dirtyCount > 0) && (n < max); slot++) {
+      if (sh->dirty[slot]) {
+        blocks[n].disk = sh->keys[slot].disk;
+        blocks[n].block = sh->keys[slot].block;
+        memcpy(blocks[n].buf, slot_data(sh, slot), RAID_BLOCK_SIZE);
+        sh->dirty[slot] = 0;
+        sh->dirtyCount--;
+        n++;
+      }
     }
+    pthread_mutex_unlock(&sh->lock);
   }
+  return n;
+}
 
-  // If no item was found in the cache, and if there is space in the cache, just insert the new disk and blocks id into the cache
-  if ((cache.maxSize - cache.currentSize) > 0) {
-    cache.blocks[cache.currentSize + 1].diskId = dsk;
-    cache.blocks[cache.currentSize + 1].blockId = blk;
-    cache.blocks[cache.currentSize + 1].accessCounter = cache.lastAccessed;
-    memset(cache.blocks[cache.currentSize + 1].buf, *(char*)buf, RAID_BLOCK_SIZE);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dirty_count_raid_cache
+// Description  : Count the dirty objects in the cache
+//
+// Inputs       : none
+// Outputs      : the number of dirty blocks
+
+uint32_t dirty_count_raid_cache(void) {
+  uint32_t s, n = 0;
 
-    cache.currentSize++;
-  } else {                // Else, just replace the least recently used item in the cache!
-    cache.blocks[tracker].diskId = dsk;
-    cache.blocks[tracker].blockId = dsk;
-    memset(cache.blocks[tracker].buf, *(char*)buf, RAID_BLOCK_SIZE);
+  for (s = 0; s < cache.numShards; s++) {
+    pthread_mutex_lock(&cache.shards[s].lock);
+    n += cache.shards[s].dirtyCount;
+    pthread_mutex_unlock(&cache.shards[s].lock);
   }
+  return n;
+}
 
-  cache.lastAccessed++;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_lookup
+// Description  : Look a block up in its (locked) shard, counting the access
+//
+// Inputs       : sh - the shard of the block
+//                dsk - this is the disk number of the block to find
+//                blk - this is the block number of the block to find
+// Outputs      : the slot of the block or CACHE_NIL if not found
 
-	// Return successfully
-	return(0);
+static int32_t cache_lookup(struct cache_shard *sh, RAIDDiskID dsk, RAIDBlockID blk) {
+  int32_t slot;
+
+  if (cache.compare) {
+    shadow_access(sh, dsk, blk, 0);
+  }
+  mrc_feed(dsk, blk, 1);
 
+  slot = cache_policy_lookup(&sh->live, dsk, blk);
+  if (slot == CACHE_NIL) {
+    sh->live.misses++;
+    return CACHE_NIL;
+  }
+  sh->live.hits++;
+  return slot;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : get_raid_cache
-// Description  : Get an object from the cache (and return it)
+// Description  : Get an object from the cache (and return it).  The pointer
+//                is only good until the next put, so threaded callers should
+//                use copy_raid_cache instead
 //
 // Inputs       : dsk - this is the disk number of the block to find
 //                blk - this is the block number of the block to find
 // Outputs      : pointer to cached object or NULL if not found
 
 void * get_raid_cache(RAIDDiskID dsk, RAIDBlockID blk) {
-  int i;
+  char *data = NULL;
+  int32_t slot;
+  struct cache_shard *sh;
+
+  if (cache.maxSize == 0) {
+    return NULL;
+  }
+  sh = cache_shard_of(dsk, blk);
+  pthread_mutex_lock(&sh->lock);
+  slot = cache_lookup(sh, dsk, blk);
+  if (slot != CACHE_NIL) {
+    data = slot_data(sh, slot);
+  }
+  pthread_mutex_unlock(&sh->lock);
+
+  //return cache block
+  return data;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : copy_raid_cache
+// Description  : Copy an object out of the cache while its shard is locked
+//
+// Inputs       : dsk - this is the disk number of the block to find
+//                blk - this is the block number of the block to find
+//                buf - the buffer to copy the block into
+// Outputs      : 0 if found, -1 if not found
+
+int copy_raid_cache(RAIDDiskID dsk, RAIDBlockID blk, void *buf) {
+  int32_t slot;
+  struct cache_shard *sh;
+
+  if (cache.maxSize == 0) {
+    return(-1);
+  }
+  sh = cache_shard_of(dsk, blk);
+  pthread_mutex_lock(&sh->lock);
+  slot = cache_lookup(sh, dsk, blk);
+  if (slot != CACHE_NIL) {
+    memcpy(buf, slot_data(sh, slot), RAID_BLOCK_SIZE);
+  }
+  pthread_mutex_unlock(&sh->lock);
+
+  return (slot != CACHE_NIL) ? 0 : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pin_raid_cache
+// Description  : Get a read-only view of a cached object without copying it.
+//                The block it points at stays put (even if the object is
+//                evicted or overwritten) until the view is released.  When
+//                the shard already has CACHE_PIN_SPARE blocks pinned the
+//                object is copied into the view instead
+//
+// Inputs       : dsk - this is the disk number of the block to find
+//                blk - this is the block number of the block to find
+//                view - the view to fill in
+// Outputs      : 0 if found, -1 if not found
+
+int pin_raid_cache(RAIDDiskID dsk, RAIDBlockID blk, RAIDCacheView *view) {
+  int32_t slot, b;
+  struct cache_shard *sh;
+
+  view->block = CACHE_NIL;
+  if (cache.maxSize == 0) {
+    return(-1);
+  }
+  sh = cache_shard_of(dsk, blk);
+  pthread_mutex_lock(&sh->lock);
+  slot = cache_lookup(sh, dsk, blk);
+  if (slot == CACHE_NIL) {
+    pthread_mutex_unlock(&sh->lock);
+    return(-1);
+  }
+
+  b = (sh->frameOf != NULL) ? sh->frameOf[slot] : sh->blockOf[slot];
+  if ((sh->pins[b] == 0) && (sh->pinnedBlocks >= CACHE_PIN_SPARE)) {
+    memcpy(view->buf, slot_data(sh, slot), RAID_BLOCK_SIZE);
+    view->data = view->buf;
+    sh->viewCopies++;
+  } else {
+    if (sh->pins[b]++ == 0) {
+      sh->pinnedBlocks++;
+    }
+    //a frame is only freed when its last reference goes, so the view holds one
+    if (sh->frameOf != NULL) {
+      sh->frameRefs[b]++;
+    }
+    view->data = &sh->payload[(size_t)b * RAID_BLOCK_SIZE];
+    view->shard = sh - cache.shards;
+    view->block = b;
+    sh->views++;
+  }
+  pthread_mutex_unlock(&sh->lock);
+
+	// Return successfully
+	return(0);
+}
 
-  //for cache size, check if the disk and block is equal to the params sent into this function
-  for (i = 0; i < cache.currentSize; i++) {
-    if ((cache.blocks[i].diskId == (int)dsk) && (cache.blocks[i].blockId == (int)blk)) {
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_raid_cache
+// Description  : Release a view from pin_raid_cache, a payload block that
+//                lost its slot while pinned becomes a spare again
+//
+// Inputs       : view - the view (its data must not be used afterwards)
+// Outputs      : none
 
-      //update the counter to the most recent access time
-      cache.blocks[i].accessCounter = cache.lastAccessed;
-      cache.lastAccessed++;
+void release_raid_cache(RAIDCacheView *view) {
+  struct cache_shard *sh;
+  int32_t b = view->block;
 
-      //return cache block
-      return cache.blocks[i].buf;
+  if ((b == CACHE_NIL) || (view->shard >= cache.numShards)) {
+    return;
+  }
+  sh = &cache.shards[view->shard];
+  pthread_mutex_lock(&sh->lock);
+  if (--sh->pins[b] == 0) {
+    sh->pinnedBlocks--;
+    if ((sh->frameOf == NULL) && (sh->slotOf[b] == CACHE_NIL)) {
+      sh->spares[sh->numSpares++] = b;
     }
   }
+  if (sh->frameOf != NULL) {
+    frame_release(sh, b);
+  }
+  pthread_mutex_unlock(&sh->lock);
+  view->block = CACHE_NIL;
+  view->data = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : peek_raid_cache
+// Description  : Copy an object out of the cache without counting the access
+//                or changing its place in the replacement order
+//
+// Inputs       : dsk - this is the disk number of the block to find
+//                blk - this is the block number of the block to find
+//                buf - the buffer to copy the block into (NULL to only test for it)
+//                dirty - set to the block's dirty bit (may be NULL)
+// Outputs      : 0 if found, -1 if not found
 
-  cache.lastAccessed++;
-  return NULL;
+int peek_raid_cache(RAIDDiskID dsk, RAIDBlockID blk, void *buf, int *dirty) {
+  int32_t slot;
+  struct cache_shard *sh;
 
+  if (cache.maxSize == 0) {
+    return(-1);
+  }
+  sh = cache_shard_of(dsk, blk);
+  pthread_mutex_lock(&sh->lock);
+  slot = cache_policy_peek(&sh->live, dsk, blk);
+  if ((slot != CACHE_NIL) && (buf != NULL)) {
+    memcpy(buf, slot_data(sh, slot), RAID_BLOCK_SIZE);
+  }
+  if (slot != CACHE_NIL) {
+    if (dirty != NULL) {
+      *dirty = sh->dirty[slot];
+    }
+  }
+  pthread_mutex_unlock(&sh->lock);
+
+  return (slot != CACHE_NIL) ? 0 : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_bench_ns
+// Description  : The nanoseconds per operation between two clock readings
+//
+// Inputs       : start, end - the readings
+//                ops - the operations between them
+// Outputs      : nanoseconds per operation
+
+static double cache_bench_ns(const struct timespec *start, const struct timespec *end, uint32_t ops) {
+  return ((end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec)) / ops;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : raid_cache_benchmark
+// Description  : Time the cache at 1K to 1M blocks with the configured policy.
+//                Gets of the same CACHE_BENCH_HOT resident blocks at every
+//                size measure the lookup itself, which should not depend on
+//                how many blocks are cached.  Gets spread over every resident
+//                block add the memory misses of a large cache, and puts of new
+//                blocks each evict one.  Each is the best of CACHE_BENCH_ROUNDS
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int raid_cache_benchmark(void) {
+  static const uint32_t sizes[] = { 1 << 10, 1 << 14, 1 << 17, 1 << 20 };
+  uint32_t *resident, *order, s, i, n, r, hotKeys, next, misses;
+  double hot[sizeof(sizes) / sizeof(sizes[0])], spread, putNs, ns;
+  struct timespec start, end;
+  char buf[RAID_BLOCK_SIZE];
 
+  resident = malloc(sizes[3] * sizeof(uint32_t));
+  order = malloc(CACHE_BENCH_OPS * sizeof(uint32_t));
+  if ((resident == NULL) || (order == NULL)) {
+    free(resident);
+    free(order);
+    return(-1);
+  }
+  memset(buf, 0x5a, RAID_BLOCK_SIZE);
+
+  logMessage(LOG_OUTPUT_LEVEL, "Cache %s, ns per operation:", RAID_CACHE_POLICY_LABELS[cachePolicy]);
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    if (init_raid_cache(sizes[s])) {
+      free(resident);
+      free(order);
+      return(-1);
+    }
+
+    //block i of the benchmark is block i / RAID_DISKS of disk i % RAID_DISKS
+    for (i = 0; i < sizes[s]; i++) {
+      put_raid_cache(i % RAID_DISKS, i / RAID_DISKS, buf);
+    }
+
+    //the shards fill unevenly, so only the blocks that stayed are looked up
+    for (i = 0, n = 0; i < sizes[s]; i++) {
+      if (peek_raid_cache(i % RAID_DISKS, i / RAID_DISKS, NULL, NULL) == 0) {
+        resident[n++] = i;
+      }
+    }
+    if (n == 0) {
+      logMessage(LOG_ERROR_LEVEL, "  %7u blocks: none of the blocks put stayed in the cache", sizes[s]);
+      close_raid_cache();
+      free(resident);
+      free(order);
+      return(-1);
+    }
+    for (i = 0; i < CACHE_BENCH_OPS; i++) {
+      order[i] = resident[(uint32_t)(i * 2654435761u) % n];
+    }
+
+    misses = 0;
+    hotKeys = (n < CACHE_BENCH_HOT) ? n : CACHE_BENCH_HOT;
+    hot[s] = spread = putNs = 1e9;
+    for (r = 0, next = sizes[s]; r < CACHE_BENCH_ROUNDS; r++) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (i = 0; i < CACHE_BENCH_OPS; i++) {
+        misses += (get_raid_cache(resident[i % hotKeys] % RAID_DISKS, resident[i % hotKeys] / RAID_DISKS) == NULL);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      ns = cache_bench_ns(&start, &end, CACHE_BENCH_OPS);
+      hot[s] = (ns < hot[s]) ? ns : hot[s];
+
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (i = 0; i < CACHE_BENCH_OPS; i++) {
+        misses += (get_raid_cache(order[i] % RAID_DISKS, order[i] / RAID_DISKS) == NULL);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      ns = cache_bench_ns(&start, &end, CACHE_BENCH_OPS);
+      spread = (ns < spread) ? ns : spread;
+    }
+
+    //the puts come last, their evictions take blocks the gets look up
+    for (r = 0; r < CACHE_BENCH_ROUNDS; r++) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (i = 0; i < CACHE_BENCH_OPS / 16; i++, next++) {
+        put_raid_cache(next % RAID_DISKS, next / RAID_DISKS, buf);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      ns = cache_bench_ns(&start, &end, CACHE_BENCH_OPS / 16);
+      putNs = (ns < putNs) ? ns : putNs;
+    }
+    close_raid_cache();
+
+    if (misses > 0) {
+      logMessage(LOG_ERROR_LEVEL, "  %7u blocks: %u gets of resident blocks missed", sizes[s], misses);
+      free(resident);
+      free(order);
+      return(-1);
+    }
+    logMessage(LOG_OUTPUT_LEVEL, "  %7u blocks (%u resident): hot gets %.0f, spread gets %.0f, puts with eviction %.0f",
+        sizes[s], n, hot[s], spread, putNs);
+  }
+  logMessage(LOG_OUTPUT_LEVEL, "Hot gets at %u blocks cost %.2fx those at %u", sizes[3], hot[3] / hot[0], sizes[0]);
+
+  free(resident);
+  free(order);
+  return(0);
+}
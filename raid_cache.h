@@ -13,23 +13,101 @@
 
 // Includes
 #include <tagline_driver.h>
+#include <raid_cache_policy.h>
 
 // Defines
 #define TAGLINE_CACHE_SIZE 1024
 
+// Type definitions
+
+// The key of a cached block
+typedef struct {
+	RAIDDiskID  disk;
+	RAIDBlockID block;
+} RAIDCacheKey;
+
+// A block copied out of the cache
+typedef struct {
+	RAIDDiskID  disk;
+	RAIDBlockID block;
+	char        buf[RAID_BLOCK_SIZE];
+} RAIDCacheBlock;
+
+// A read-only view of a cached block, pinned until it is released
+typedef struct raid_cache_view {
+	const char *data;                  // the block (RAID_BLOCK_SIZE bytes)
+	uint32_t    shard;                 // where the pin is held
+	int32_t     block;                 // payload block pinned, CACHE_NIL if data is buf
+	char        buf[RAID_BLOCK_SIZE];  // the block when it could not be pinned
+} RAIDCacheView;
+
+// Called (with the cache locked) for each dirty block that is evicted
+typedef void (*RAIDCacheWriteback)(RAIDDiskID dsk, RAIDBlockID blk, void *buf);
+
 ///
 // Cache Interfaces
 
+int set_raid_cache_policy(RAIDCachePolicy policy, int compare);
+	// Select the replacement policy (and shadow comparison) for the next init
+
+int set_raid_cache_shards(uint32_t shards);
+	// Select the number of independently locked shards for the next init
+
+int set_raid_cache_dedup(uint32_t keys_per_block);
+	// Store identical blocks once, indexing keys_per_block keys per payload block (0 = off)
+
+int set_raid_cache_hugepages(int enable);
+	// Map the payload arena of the next init on huge pages
+
+int set_raid_cache_mrc(int shift);
+	// Estimate the miss ratio curve from the next init, sampling 1 in 2^shift keys (-1 = off)
+
+int set_raid_cache_writeback(RAIDCacheWriteback fn);
+	// Register the function that takes dirty blocks as they are evicted
+
 int init_raid_cache(uint32_t max_blocks);
 	// Initialize the cache and note maximum blocks
 
 int close_raid_cache(void);
 	// Clear all of the contents of the cache, cleanup
 
+int resize_raid_cache(uint32_t max_blocks);
+	// Rebuild the cache with a new capacity, keeping the blocks that fit
+
+uint32_t tune_raid_cache(uint32_t budget);
+	// Resize the cache to the best size within budget blocks per the miss ratio curve
+
 int put_raid_cache(RAIDDiskID dsk, RAIDBlockID blk, void *buf);
 	// Put an object into the object cache, evicting other items as necessary
 
+int dirty_raid_cache(RAIDDiskID dsk, RAIDBlockID blk, void *buf);
+	// Put an object that is not yet on disk into the cache (write-back)
+
+uint32_t clean_raid_cache(RAIDCacheBlock *blocks, uint32_t max);
+	// Copy out up to max dirty objects and mark them clean
+
+uint32_t dirty_count_raid_cache(void);
+	// Count the dirty objects in the cache
+
 void * get_raid_cache(RAIDDiskID dsk, RAIDBlockID blk);
 	// Get an object from the cache (and return it)
 
+int copy_raid_cache(RAIDDiskID dsk, RAIDBlockID blk, void *buf);
+	// Copy an object out of the cache (safe against concurrent eviction)
+
+int pin_raid_cache(RAIDDiskID dsk, RAIDBlockID blk, RAIDCacheView *view);
+	// Get a pinned view of an object without copying it (safe against eviction)
+
+void release_raid_cache(RAIDCacheView *view);
+	// Release a view from pin_raid_cache
+
+int peek_raid_cache(RAIDDiskID dsk, RAIDBlockID blk, void *buf, int *dirty);
+	// Copy an object out of the cache without counting it as an access (buf may be NULL)
+
+void report_raid_cache(void);
+	// Log the hit ratio of the cache policy (and of any shadow policies)
+
+int raid_cache_benchmark(void);
+	// Time gets and puts of the cache at 1K to 1M blocks
+
 #endif
@@ -0,0 +1,303 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : raid_cache_mrc.c
+//  Description    : This is the implementation of the miss ratio curve
+//                   estimator for the TAGLINE block cache.  Keys are sampled
+//                   spatially (a key is in or out of the sample for good, as
+//                   in SHARDS), and the reuse distance of every sampled access
+//                   is the number of distinct sampled keys touched since the
+//                   key's previous access, counted with a Fenwick tree over
+//                   access times and scaled back up by the sampling rate.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+
+// Project includes
+#include <cmpsc311_log.h>
+#include <raid_cache_mrc.h>
+
+// Defines
+#define MRC_MIN_TREE  4096   // Smallest Fenwick tree (access times)
+#define MRC_MIN_TABLE 1024   // Smallest key table
+
+//
+// Helpers
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mrc_hash
+// Description  : Mix a key into 64 bits, the sample test uses the top bits
+//
+// Inputs       : key - the packed key
+// Outputs      : the hash value
+
+static uint64_t mrc_hash(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xFF51AFD7ED558CCDULL;
+  key ^= key >> 33;
+  key *= 0xC4CEB9FE1A85EC53ULL;
+  return key ^ (key >> 33);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tree_add
+// Description  : Add to one access time of the Fenwick tree
+//
+// Inputs       : m - the estimator
+//                t - the time (1 based)
+//                v - the value to add
+// Outputs      : none
+
+static void tree_add(MRCEstimator *m, uint32_t t, int32_t v) {
+  for (; t <= m->treeSize; t += t & -t) {
+    m->tree[t - 1] += v;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tree_sum
+// Description  : Count the keys last accessed at or before a time
+//
+// Inputs       : m - the estimator
+//                t - the time (1 based)
+// Outputs      : the count
+
+static uint32_t tree_sum(MRCEstimator *m, uint32_t t) {
+  uint32_t sum = 0;
+
+  for (; t > 0; t -= t & -t) {
+    sum += m->tree[t - 1];
+  }
+  return sum;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_key_times
+// Description  : Order sampled keys by the time of their last access
+//
+// Inputs       : a, b - the keys
+// Outputs      : <0, 0, >0 as for qsort
+
+static int compare_key_times(const void *a, const void *b) {
+  uint32_t ta = (*(MRCKey * const *)a)->time, tb = (*(MRCKey * const *)b)->time;
+
+  return (ta > tb) - (ta < tb);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mrc_compact
+// Description  : Renumber the last access times 1..numKeys (keeping their
+//                order) once the tree runs out of times, growing the tree
+//                and the key table when they are getting full
+//
+// Inputs       : m - the estimator
+// Outputs      : 0 if successful, -1 if failure
+
+static int mrc_compact(MRCEstimator *m) {
+  MRCKey **order, *table, *old = m->table;
+  uint32_t *tree = m->tree;
+  uint32_t i, n = 0, oldMask = m->tableMask, tableSize = m->tableMask + 1, treeSize = m->treeSize, j;
+
+  if (m->numKeys * 2 > tableSize) {
+    tableSize *= 2;
+  }
+  if (m->numKeys * 2 > treeSize) {
+    treeSize *= 2;
+  }
+
+  //rehash into the (possibly larger) table, then number the keys by age
+  table = calloc(tableSize, sizeof(MRCKey));
+  order = malloc(m->numKeys * sizeof(MRCKey *));
+  if ((treeSize != m->treeSize) && (table != NULL) && (order != NULL)) {
+    tree = realloc(m->tree, treeSize * sizeof(uint32_t));
+  }
+  if ((table == NULL) || (order == NULL) || (tree == NULL)) {
+    free(table);
+    free(order);
+    return(-1);
+  }
+  m->tree = tree;
+  for (i = 0; i <= oldMask; i++) {
+    if (old[i].key == 0) {
+      continue;
+    }
+    for (j = mrc_hash(old[i].key) & (tableSize - 1); table[j].key != 0; j = (j + 1) & (tableSize - 1));
+    table[j] = old[i];
+    order[n++] = &table[j];
+  }
+  qsort(order, n, sizeof(MRCKey *), compare_key_times);
+  free(old);
+  m->table = table;
+  m->tableMask = tableSize - 1;
+  m->treeSize = treeSize;
+
+  //every key holds one bit, so the tree is rebuilt in place in linear time
+  memset(m->tree, 0, treeSize * sizeof(uint32_t));
+  for (i = 0; i < n; i++) {
+    order[i]->time = i + 1;
+    m->tree[i] = 1;
+  }
+  for (i = 1; i <= treeSize; i++) {
+    j = i + (i & -i);
+    if (j <= treeSize) {
+      m->tree[j - 1] += m->tree[i - 1];
+    }
+  }
+  m->now = n;
+  free(order);
+  return(0);
+}
+
+//
+// Estimator interface
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mrc_init
+// Description  : Create an estimator sampling 1 in 2^shift keys
+//
+// Inputs       : m - the estimator to initialize
+//                shift - the log2 of the sampling period
+// Outputs      : 0 if successful, -1 if failure
+
+int mrc_init(MRCEstimator *m, uint32_t shift) {
+  memset(m, 0, sizeof(MRCEstimator));
+  if (shift > 16) {
+    return(-1);
+  }
+  m->shift = shift;
+  m->table = calloc(MRC_MIN_TABLE, sizeof(MRCKey));
+  m->tree = calloc(MRC_MIN_TREE, sizeof(uint32_t));
+  if ((m->table == NULL) || (m->tree == NULL)) {
+    mrc_free(m);
+    return(-1);
+  }
+  m->tableMask = MRC_MIN_TABLE - 1;
+  m->treeSize = MRC_MIN_TREE;
+
+	// Return successfully
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mrc_free
+// Description  : Release the estimator
+//
+// Inputs       : m - the estimator
+// Outputs      : none
+
+void mrc_free(MRCEstimator *m) {
+  free(m->table);
+  free(m->tree);
+  m->table = NULL;
+  m->tree = NULL;
+  m->treeSize = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mrc_sampled
+// Description  : Check if a key is in the sample
+//
+// Inputs       : m - the estimator
+//                dsk, blk - the key
+// Outputs      : 1 if sampled, 0 if not
+
+int mrc_sampled(MRCEstimator *m, RAIDDiskID dsk, RAIDBlockID blk) {
+  uint64_t h = mrc_hash(((uint64_t)dsk << 32) | blk);
+
+  return (m->tree != NULL) && ((m->shift == 0) || ((h >> (64 - m->shift)) == 0));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mrc_access
+// Description  : Record an access to a sampled key.  A get also finds the
+//                scaled reuse distance and counts a hit at every size larger
+//                than it
+//
+// Inputs       : m - the estimator
+//                dsk, blk - the key (already known to be sampled)
+//                get - 1 for a get, 0 for a put
+// Outputs      : none
+
+void mrc_access(MRCEstimator *m, RAIDDiskID dsk, RAIDBlockID blk, int get) {
+  uint64_t key = (((uint64_t)dsk << 32) | blk) + 1, dist;
+  uint32_t j;
+  int i;
+
+  if (m->tree == NULL) {
+    return;
+  }
+  //compact when the tree runs out of times or the key table is 3/4 full
+  if (((m->now == m->treeSize) || (m->numKeys * 4 >= (m->tableMask + 1) * 3)) && mrc_compact(m)) {
+    logMessage(LOG_ERROR_LEVEL, "Unable to grow the miss ratio curve estimator");
+    mrc_free(m);
+    return;
+  }
+
+  for (j = mrc_hash(key) & m->tableMask; (m->table[j].key != 0) && (m->table[j].key != key); j = (j + 1) & m->tableMask);
+  m->gets += get;
+
+  if (m->table[j].key == 0) {
+    //first access, an infinite distance
+    m->table[j].key = key;
+    m->numKeys++;
+    m->cold += get;
+  } else {
+    //the keys touched since the last access are the ones with a later time
+    if (get) {
+      dist = (uint64_t)(tree_sum(m, m->now) - tree_sum(m, m->table[j].time)) << m->shift;
+      for (i = MRC_SIZES - 1; (i >= 0) && (dist < mrc_size(i)); i--) {
+        m->hits[i]++;
+      }
+    }
+    tree_add(m, m->table[j].time, -1);
+  }
+  m->table[j].time = ++m->now;
+  tree_add(m, m->now, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mrc_size
+// Description  : The cache size of a curve point
+//
+// Inputs       : i - the curve point
+// Outputs      : the size in blocks
+
+uint32_t mrc_size(int i) {
+  return MRC_MIN_SIZE << i;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mrc_hit_ratio
+// Description  : The estimated hit ratio of a curve point.  With the total
+//                number of gets known, the gap between the sampled gets and
+//                the expected share of them is put down to the hottest keys
+//                (the SHARDS adjustment), which makes up for a very popular
+//                key falling in or out of the sample
+//
+// Inputs       : m - the estimator
+//                i - the curve point
+//                total - every get seen by the cache, sampled or not (0 if unknown)
+// Outputs      : the hit ratio (0 before any sampled get)
+
+double mrc_hit_ratio(MRCEstimator *m, int i, uint64_t total) {
+  double expected = (double)total / (double)(1 << m->shift), hits = (double)m->hits[i];
+
+  if ((total == 0) || (expected < 1.0)) {
+    return (m->gets) ? hits / (double)m->gets : 0.0;
+  }
+  hits -= (double)m->gets - expected;
+  hits = (hits < 0.0) ? 0.0 : (hits > expected) ? expected : hits;
+  return hits / expected;
+}
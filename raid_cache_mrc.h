@@ -0,0 +1,63 @@
+#ifndef RAID_CACHE_MRC_INCLUDED
+#define RAID_CACHE_MRC_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : raid_cache_mrc.h
+//  Description    : This is the header file for the miss ratio curve
+//                   estimator of the TAGLINE block cache.  It samples keys
+//                   by hash (SHARDS) and measures their LRU reuse distance,
+//                   giving the hit ratio the cache would have at other sizes.
+//
+
+// Includes
+#include <raid_bus.h>
+
+// Defines
+#define MRC_MIN_SIZE  64     // Smallest cache size estimated (blocks)
+#define MRC_SIZES     11     // Sizes estimated, MRC_MIN_SIZE doubling each time
+
+// Type definitions
+
+// A sampled key and the (compacted) time of its last access
+typedef struct {
+	uint64_t key;              // (disk << 32 | block) + 1, 0 for an empty slot
+	uint32_t time;
+} MRCKey;
+
+// The state of the estimator
+typedef struct {
+	uint32_t shift;            // 1 in 2^shift keys is sampled
+	MRCKey  *table;            // Sampled keys, open addressing
+	uint32_t tableMask;
+	uint32_t numKeys;
+	uint32_t *tree;            // Fenwick tree, one bit per key at its last access time
+	uint32_t treeSize;
+	uint32_t now;              // Time of the latest sampled access
+	uint64_t gets;             // Sampled gets
+	uint64_t cold;             // Sampled gets of never seen keys
+	uint64_t hits[MRC_SIZES];  // Sampled gets that would hit at each size
+} MRCEstimator;
+
+//
+// Estimator interfaces
+
+int mrc_init(MRCEstimator *m, uint32_t shift);
+	// Create an estimator sampling 1 in 2^shift keys
+
+void mrc_free(MRCEstimator *m);
+	// Release the estimator
+
+int mrc_sampled(MRCEstimator *m, RAIDDiskID dsk, RAIDBlockID blk);
+	// Check if a key is in the sample (cheap, no state is touched)
+
+void mrc_access(MRCEstimator *m, RAIDDiskID dsk, RAIDBlockID blk, int get);
+	// Record an access to a sampled key, a get also counts towards the curve
+
+uint32_t mrc_size(int i);
+	// The cache size (blocks) of curve point i
+
+double mrc_hit_ratio(MRCEstimator *m, int i, uint64_t total);
+	// The estimated hit ratio at curve point i
+
+#endif
@@ -0,0 +1,983 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : raid_cache_policy.c
+//  Description    : This is the implementation of the replacement policies
+//                   for the TAGLINE block cache (LRU, ARC, 2Q, CLOCK-Pro and
+//                   W-TinyLFU).  Every policy keeps its keys in one hash
+//                   index and on intrusive queues, so accesses, inserts and
+//                   evictions are all constant time.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// Project includes
+#include <cmpsc311_log.h>
+#include <raid_cache_policy.h>
+
+// Queue ids used by each policy
+#define LRU_LIST       0
+
+#define ARC_T1         0  // Seen once recently (resident)
+#define ARC_T2         1  // Seen at least twice recently (resident)
+#define ARC_B1         2  // Ghosts evicted from T1
+#define ARC_B2         3  // Ghosts evicted from T2
+
+#define TWOQ_A1IN      0  // First-access FIFO (resident)
+#define TWOQ_AM        1  // Re-referenced LRU (resident)
+#define TWOQ_A1OUT     2  // Ghosts evicted from A1in
+
+#define CLOCK_RING     0  // The single CLOCK-Pro ring
+
+#define TLFU_WINDOW    0  // Admission window LRU
+#define TLFU_PROBATION 1  // Main SLRU probation segment
+#define TLFU_PROTECTED 2  // Main SLRU protected segment
+
+// Entry flags
+#define CP_REF         0x01 // Referenced since the hand last passed
+#define CP_HOT         0x02 // CLOCK-Pro hot page
+#define CP_TEST        0x04 // CLOCK-Pro cold page in its test period
+
+#define TLFU_MAX_COUNT 15   // Saturation of the sketch counters
+#define TLFU_ROWS      4
+
+const char *RAID_CACHE_POLICY_LABELS[RAID_CACHE_POLICY_MAX] = {
+	"LRU", "ARC", "2Q", "CLOCK-Pro", "W-TinyLFU"
+};
+
+//
+// Index and queue helpers
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : key_hash
+// Description  : Mix a disk/block pair into 64 bits
+//
+// Inputs       : dsk - the disk number
+//                blk - the block number
+// Outputs      : the hash value
+
+static uint64_t key_hash(RAIDDiskID dsk, RAIDBlockID blk) {
+  uint64_t key = ((uint64_t)dsk << 32) | blk;
+
+  //Fibonacci hashing, spreads the neighbouring block numbers across buckets
+  key *= 0x9E3779B97F4A7C15ULL;
+  return key ^ (key >> 29);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : entry_find
+// Description  : Find the entry (resident or ghost) of a key
+//
+// Inputs       : cp - the policy
+//                dsk, blk - the key
+// Outputs      : entry index or CACHE_NIL
+
+static int32_t entry_find(CachePolicy *cp, RAIDDiskID dsk, RAIDBlockID blk) {
+  int32_t e;
+
+  for (e = cp->buckets[(key_hash(dsk, blk) >> 32) & cp->bucketMask]; e != CACHE_NIL; e = cp->entries[e].hashNext) {
+    if ((cp->entries[e].disk == dsk) && (cp->entries[e].block == blk)) {
+      return e;
+    }
+  }
+  return CACHE_NIL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : entry_new
+// Description  : Take an unused entry for a key and add it to the index
+//
+// Inputs       : cp - the policy
+//                dsk, blk - the key
+// Outputs      : entry index
+
+static int32_t entry_new(CachePolicy *cp, RAIDDiskID dsk, RAIDBlockID blk) {
+  int32_t e = cp->freeEntry;
+  int32_t *bucket = &cp->buckets[(key_hash(dsk, blk) >> 32) & cp->bucketMask];
+
+  //the pool is sized for every policy's resident + ghost bound, so it never runs dry
+  cp->freeEntry = cp->entries[e].hashNext;
+  cp->entries[e].disk = dsk;
+  cp->entries[e].block = blk;
+  cp->entries[e].slot = CACHE_NIL;
+  cp->entries[e].flags = 0;
+  cp->entries[e].prev = CACHE_NIL;
+  cp->entries[e].next = CACHE_NIL;
+  cp->entries[e].hashNext = *bucket;
+  *bucket = e;
+  return e;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : entry_delete
+// Description  : Remove an entry (already off its queue) from the index
+//
+// Inputs       : cp - the policy
+//                e - the entry
+// Outputs      : none
+
+static void entry_delete(CachePolicy *cp, int32_t e) {
+  int32_t *link = &cp->buckets[(key_hash(cp->entries[e].disk, cp->entries[e].block) >> 32) & cp->bucketMask];
+
+  //walk the (short) chain to the link that points at this entry and splice it out
+  while (*link != e) {
+    link = &cp->entries[*link].hashNext;
+  }
+  *link = cp->entries[e].hashNext;
+
+  cp->entries[e].hashNext = cp->freeEntry;
+  cp->freeEntry = e;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : list_unlink
+// Description  : Take an entry off its queue
+//
+// Inputs       : cp - the policy
+//                e - the entry
+// Outputs      : none
+
+static void list_unlink(CachePolicy *cp, int32_t e) {
+  CacheEntry *ent = &cp->entries[e];
+  CacheList *l = &cp->lists[ent->list];
+
+  if (ent->prev != CACHE_NIL) {
+    cp->entries[ent->prev].next = ent->next;
+  } else {
+    l->head = ent->next;
+  }
+  if (ent->next != CACHE_NIL) {
+    cp->entries[ent->next].prev = ent->prev;
+  } else {
+    l->tail = ent->prev;
+  }
+  l->size--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : list_push_head
+// Description  : Put an entry at the head (most recent end) of a queue
+//
+// Inputs       : cp - the policy
+//                list - the queue
+//                e - the entry
+// Outputs      : none
+
+static void list_push_head(CachePolicy *cp, int list, int32_t e) {
+  CacheList *l = &cp->lists[list];
+
+  cp->entries[e].list = list;
+  cp->entries[e].prev = CACHE_NIL;
+  cp->entries[e].next = l->head;
+  if (l->head != CACHE_NIL) {
+    cp->entries[l->head].prev = e;
+  } else {
+    l->tail = e;
+  }
+  l->head = e;
+  l->size++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : list_move_head
+// Description  : Move an entry to the head of a (possibly different) queue
+//
+// Inputs       : cp - the policy
+//                list - the destination queue
+//                e - the entry
+// Outputs      : none
+
+static void list_move_head(CachePolicy *cp, int list, int32_t e) {
+  list_unlink(cp, e);
+  list_push_head(cp, list, e);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : take_slot
+// Description  : Strip the payload slot off a resident entry, noting the
+//                victim for the caller
+//
+// Inputs       : cp - the policy
+//                e - the resident entry losing its slot
+//                victim - the eviction report to fill in
+// Outputs      : the freed slot
+
+static int32_t take_slot(CachePolicy *cp, int32_t e, CacheVictim *victim) {
+  int32_t slot = cp->entries[e].slot;
+
+  victim->valid = 1;
+  victim->disk = cp->entries[e].disk;
+  victim->block = cp->entries[e].block;
+  victim->slot = slot;
+
+  cp->entries[e].slot = CACHE_NIL;
+  cp->resident--;
+  return slot;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : drop_tail
+// Description  : Evict the tail of a queue entirely (no ghost is kept)
+//
+// Inputs       : cp - the policy
+//                list - the queue
+//                victim - the eviction report to fill in
+// Outputs      : the freed slot (CACHE_NIL if the tail was a ghost)
+
+static int32_t drop_tail(CachePolicy *cp, int list, CacheVictim *victim) {
+  int32_t e = cp->lists[list].tail, slot = CACHE_NIL;
+
+  if (cp->entries[e].slot != CACHE_NIL) {
+    slot = take_slot(cp, e, victim);
+  }
+  list_unlink(cp, e);
+  entry_delete(cp, e);
+  return slot;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ghost_tail
+// Description  : Evict the tail of a resident queue, keeping it as a ghost
+//
+// Inputs       : cp - the policy
+//                from - the resident queue
+//                to - the ghost queue
+//                victim - the eviction report to fill in
+// Outputs      : the freed slot
+
+static int32_t ghost_tail(CachePolicy *cp, int from, int to, CacheVictim *victim) {
+  int32_t e = cp->lists[from].tail;
+  int32_t slot = take_slot(cp, e, victim);
+
+  list_move_head(cp, to, e);
+  return slot;
+}
+
+//
+// LRU
+
+static void lru_hit(CachePolicy *cp, int32_t e) {
+  list_move_head(cp, LRU_LIST, e);
+}
+
+//
+// ARC
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : arc_replace
+// Description  : The ARC REPLACE step, demote the LRU block of T1 or T2 to
+//                its ghost queue depending on the target size p
+//
+// Inputs       : cp - the policy
+//                inB2 - 1 if the missing key was found in B2
+//                victim - the eviction report to fill in
+// Outputs      : the freed slot
+
+static int32_t arc_replace(CachePolicy *cp, int inB2, CacheVictim *victim) {
+  uint32_t t1 = cp->lists[ARC_T1].size;
+
+  if ((t1 > 0) && ((t1 > cp->target) || (inB2 && (t1 == cp->target)) || (cp->lists[ARC_T2].size == 0))) {
+    return ghost_tail(cp, ARC_T1, ARC_B1, victim);
+  }
+  return ghost_tail(cp, ARC_T2, ARC_B2, victim);
+}
+
+static void arc_hit(CachePolicy *cp, int32_t e) {
+  list_move_head(cp, ARC_T2, e);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : arc_miss
+// Description  : Make a missing key resident under ARC
+//
+// Inputs       : cp - the policy
+//                e - the ghost entry of the key, or CACHE_NIL
+//                dsk, blk - the key
+//                slot - a free slot, or CACHE_NIL if one must be evicted
+//                victim - the eviction report to fill in
+// Outputs      : the slot for the key
+
+static int32_t arc_miss(CachePolicy *cp, int32_t e, RAIDDiskID dsk, RAIDBlockID blk, int32_t slot, CacheVictim *victim) {
+  uint32_t b1 = cp->lists[ARC_B1].size, b2 = cp->lists[ARC_B2].size, delta;
+  uint32_t c = cp->capacity;
+
+  if (e != CACHE_NIL) {
+    //ghost hit, adapt the T1 target towards the list that would have hit
+    if (cp->entries[e].list == ARC_B1) {
+      delta = (b2 > b1) ? b2 / b1 : 1;
+      cp->target = (cp->target + delta > c) ? c : cp->target + delta;
+    } else {
+      delta = (b1 > b2) ? b1 / b2 : 1;
+      cp->target = (cp->target < delta) ? 0 : cp->target - delta;
+    }
+    if (slot == CACHE_NIL) {
+      slot = arc_replace(cp, cp->entries[e].list == ARC_B2, victim);
+    }
+    list_move_head(cp, ARC_T2, e);
+    cp->entries[e].slot = slot;
+    return slot;
+  }
+
+  //complete miss, keep L1 = T1+B1 and L1+L2 within their bounds
+  if (cp->lists[ARC_T1].size + b1 == c) {
+    if (cp->lists[ARC_T1].size < c) {
+      drop_tail(cp, ARC_B1, victim);
+      if (slot == CACHE_NIL) {
+        slot = arc_replace(cp, 0, victim);
+      }
+    } else {
+      slot = drop_tail(cp, ARC_T1, victim);
+    }
+  } else {
+    if (cp->lists[ARC_T1].size + cp->lists[ARC_T2].size + b1 + b2 >= 2 * c) {
+      drop_tail(cp, ARC_B2, victim);
+    }
+    if (slot == CACHE_NIL) {
+      slot = arc_replace(cp, 0, victim);
+    }
+  }
+
+  e = entry_new(cp, dsk, blk);
+  list_push_head(cp, ARC_T1, e);
+  cp->entries[e].slot = slot;
+  return slot;
+}
+
+//
+// 2Q
+
+static void twoq_hit(CachePolicy *cp, int32_t e) {
+  //a hit in A1in is not re-ordered, only re-references from Am count as hot
+  if (cp->entries[e].list == TWOQ_AM) {
+    list_move_head(cp, TWOQ_AM, e);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : twoq_reclaim
+// Description  : Free a slot for 2Q, preferring to push A1in out to A1out
+//
+// Inputs       : cp - the policy
+//                victim - the eviction report to fill in
+// Outputs      : the freed slot
+
+static int32_t twoq_reclaim(CachePolicy *cp, CacheVictim *victim) {
+  int32_t slot;
+  uint32_t kout = (cp->capacity / 2) ? cp->capacity / 2 : 1;
+
+  if ((cp->lists[TWOQ_A1IN].size > cp->target) || (cp->lists[TWOQ_AM].size == 0)) {
+    slot = ghost_tail(cp, TWOQ_A1IN, TWOQ_A1OUT, victim);
+    if (cp->lists[TWOQ_A1OUT].size > kout) {
+      drop_tail(cp, TWOQ_A1OUT, victim);
+    }
+    return slot;
+  }
+  return drop_tail(cp, TWOQ_AM, victim);
+}
+
+static int32_t twoq_miss(CachePolicy *cp, RAIDDiskID dsk, RAIDBlockID blk, int32_t slot, CacheVictim *victim) {
+  int32_t e;
+
+  if (slot == CACHE_NIL) {
+    slot = twoq_reclaim(cp, victim);
+  }
+
+  //the reclaim may have trimmed this key's own ghost, so look again
+  e = entry_find(cp, dsk, blk);
+  if (e != CACHE_NIL) {
+    list_move_head(cp, TWOQ_AM, e);
+  } else {
+    e = entry_new(cp, dsk, blk);
+    list_push_head(cp, TWOQ_A1IN, e);
+  }
+  cp->entries[e].slot = slot;
+  return slot;
+}
+
+//
+// CLOCK-Pro
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_insert
+// Description  : Insert an entry into the CLOCK-Pro ring just behind the hot
+//                hand, so it is the last page every hand reaches
+//
+// Inputs       : cp - the policy
+//                e - the entry
+// Outputs      : none
+
+static void ring_insert(CachePolicy *cp, int32_t e) {
+  int32_t at = cp->handHot;
+
+  cp->entries[e].list = CLOCK_RING;
+  if (at == CACHE_NIL) {
+    cp->entries[e].prev = e;
+    cp->entries[e].next = e;
+    cp->handHot = cp->handCold = cp->handTest = e;
+  } else {
+    cp->entries[e].next = at;
+    cp->entries[e].prev = cp->entries[at].prev;
+    cp->entries[cp->entries[at].prev].next = e;
+    cp->entries[at].prev = e;
+  }
+  cp->lists[CLOCK_RING].size++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : ring_remove
+// Description  : Take an entry off the ring, moving any hand that points at it
+//
+// Inputs       : cp - the policy
+//                e - the entry
+// Outputs      : none
+
+static void ring_remove(CachePolicy *cp, int32_t e) {
+  int32_t next = cp->entries[e].next;
+
+  if (next == e) {
+    cp->handHot = cp->handCold = cp->handTest = CACHE_NIL;
+  } else {
+    cp->entries[cp->entries[e].prev].next = next;
+    cp->entries[next].prev = cp->entries[e].prev;
+    if (cp->handHot == e) cp->handHot = next;
+    if (cp->handCold == e) cp->handCold = next;
+    if (cp->handTest == e) cp->handTest = next;
+  }
+  cp->lists[CLOCK_RING].size--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clock_drop_ghost
+// Description  : Forget a non-resident cold page whose test period ended,
+//                shrinking the cold target
+//
+// Inputs       : cp - the policy
+//                e - the ghost entry
+// Outputs      : none
+
+static void clock_drop_ghost(CachePolicy *cp, int32_t e) {
+  ring_remove(cp, e);
+  entry_delete(cp, e);
+  cp->ghostCount--;
+  if (cp->target > 1) {
+    cp->target--;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clock_hand_hot
+// Description  : Run the hot hand until one hot page is demoted to cold,
+//                ending the test periods of the cold pages it passes
+//
+// Inputs       : cp - the policy
+// Outputs      : none
+
+static void clock_hand_hot(CachePolicy *cp) {
+  int32_t e;
+  CacheEntry *ent;
+
+  while (cp->hotCount > 0) {
+    e = cp->handHot;
+    ent = &cp->entries[e];
+    if (ent->flags & CP_HOT) {
+      cp->handHot = ent->next;
+      if (ent->flags & CP_REF) {
+        ent->flags &= ~CP_REF;
+      } else {
+        ent->flags &= ~CP_HOT;
+        cp->hotCount--;
+        cp->coldCount++;
+        return;
+      }
+    } else if (ent->slot == CACHE_NIL) {
+      clock_drop_ghost(cp, e);
+    } else {
+      ent->flags &= ~CP_TEST;
+      cp->handHot = ent->next;
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clock_hand_test
+// Description  : Run the test hand until one ghost page is forgotten
+//
+// Inputs       : cp - the policy
+// Outputs      : none
+
+static void clock_hand_test(CachePolicy *cp) {
+  int32_t e;
+  CacheEntry *ent;
+
+  while (cp->ghostCount > 0) {
+    e = cp->handTest;
+    ent = &cp->entries[e];
+    if (ent->slot == CACHE_NIL) {
+      clock_drop_ghost(cp, e);
+      return;
+    }
+    if (!(ent->flags & CP_HOT)) {
+      ent->flags &= ~CP_TEST;
+    }
+    cp->handTest = ent->next;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clock_hand_cold
+// Description  : Run the cold hand until a resident cold page is evicted,
+//                promoting re-referenced test pages to hot on the way
+//
+// Inputs       : cp - the policy
+//                victim - the eviction report to fill in
+// Outputs      : the freed slot
+
+static int32_t clock_hand_cold(CachePolicy *cp, CacheVictim *victim) {
+  int32_t e, slot;
+  CacheEntry *ent;
+
+  while (1) {
+    //keep at least one resident cold page for the hand to find
+    if (cp->coldCount == 0) {
+      clock_hand_hot(cp);
+    }
+
+    e = cp->handCold;
+    ent = &cp->entries[e];
+    cp->handCold = ent->next;
+    if ((ent->flags & CP_HOT) || (ent->slot == CACHE_NIL)) {
+      continue;
+    }
+
+    if (ent->flags & CP_REF) {
+      ent->flags &= ~CP_REF;
+      ring_remove(cp, e);
+      ring_insert(cp, e);
+      if (ent->flags & CP_TEST) {
+        //re-referenced within its test period, the page becomes hot
+        ent->flags = CP_HOT;
+        cp->coldCount--;
+        cp->hotCount++;
+        while (cp->hotCount > cp->capacity - cp->target) {
+          clock_hand_hot(cp);
+        }
+      } else {
+        ent->flags |= CP_TEST;
+      }
+      continue;
+    }
+
+    //unreferenced cold page, evict it but remember it while it is in test
+    slot = take_slot(cp, e, victim);
+    cp->coldCount--;
+    if (ent->flags & CP_TEST) {
+      cp->ghostCount++;
+      while (cp->ghostCount > cp->capacity) {
+        clock_hand_test(cp);
+      }
+    } else {
+      ring_remove(cp, e);
+      entry_delete(cp, e);
+    }
+    return slot;
+  }
+}
+
+static void clock_hit(CachePolicy *cp, int32_t e) {
+  cp->entries[e].flags |= CP_REF;
+}
+
+static int32_t clock_miss(CachePolicy *cp, RAIDDiskID dsk, RAIDBlockID blk, int32_t slot, CacheVictim *victim) {
+  int32_t e;
+
+  if (slot == CACHE_NIL) {
+    slot = clock_hand_cold(cp, victim);
+  }
+
+  //a miss on a page still in its test period means the cold area is too small
+  e = entry_find(cp, dsk, blk);
+  if (e != CACHE_NIL) {
+    if (cp->target < cp->capacity - 1) {
+      cp->target++;
+    }
+    ring_remove(cp, e);
+    cp->ghostCount--;
+    cp->entries[e].flags = CP_HOT;
+    cp->entries[e].slot = slot;
+    ring_insert(cp, e);
+    cp->hotCount++;
+    while ((cp->hotCount > cp->capacity - cp->target) && (cp->hotCount > 0)) {
+      clock_hand_hot(cp);
+    }
+    return slot;
+  }
+
+  e = entry_new(cp, dsk, blk);
+  cp->entries[e].flags = CP_TEST;
+  cp->entries[e].slot = slot;
+  ring_insert(cp, e);
+  cp->coldCount++;
+  return slot;
+}
+
+//
+// W-TinyLFU
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sketch_frequency
+// Description  : Estimate (and optionally count) the access frequency of a
+//                key in the count-min sketch
+//
+// Inputs       : cp - the policy
+//                dsk, blk - the key
+//                add - 1 to record an access first
+// Outputs      : the estimated frequency
+
+static uint32_t sketch_frequency(CachePolicy *cp, RAIDDiskID dsk, RAIDBlockID blk, int add) {
+  uint64_t h = key_hash(dsk, blk);
+  uint32_t row, idx, freq = TLFU_MAX_COUNT, i;
+  uint8_t *c;
+
+  for (row = 0; row < TLFU_ROWS; row++) {
+    idx = (uint32_t)(h >> (row * 16)) ^ (uint32_t)(h >> 40);
+    c = &cp->sketch[(row * (cp->sketchMask + 1)) + (idx & cp->sketchMask)];
+    if (add && (*c < TLFU_MAX_COUNT)) {
+      (*c)++;
+    }
+    if (*c < freq) {
+      freq = *c;
+    }
+  }
+
+  //age the sketch so old popularity fades
+  if (add && (++cp->sketchAdds >= cp->sketchReset)) {
+    for (i = 0; i < TLFU_ROWS * (cp->sketchMask + 1); i++) {
+      cp->sketch[i] >>= 1;
+    }
+    cp->sketchAdds /= 2;
+  }
+  return freq;
+}
+
+static void tlfu_hit(CachePolicy *cp, int32_t e) {
+  uint32_t mainSize = cp->capacity - cp->target;
+  uint32_t protectedMax = mainSize - (mainSize / 5);
+
+  switch (cp->entries[e].list) {
+  case TLFU_PROBATION:
+    //second access in main, promote and keep protected within its share
+    list_move_head(cp, TLFU_PROTECTED, e);
+    if (cp->lists[TLFU_PROTECTED].size > protectedMax) {
+      list_move_head(cp, TLFU_PROBATION, cp->lists[TLFU_PROTECTED].tail);
+    }
+    break;
+  default:
+    list_move_head(cp, cp->entries[e].list, e);
+    break;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tlfu_miss
+// Description  : Insert a key into the window; when full the window's LRU
+//                block competes with main's victim and the less frequent
+//                of the two is evicted
+//
+// Inputs       : cp - the policy
+//                dsk, blk - the key
+//                slot - a free slot, or CACHE_NIL if one must be evicted
+//                victim - the eviction report to fill in
+// Outputs      : the slot for the key
+
+static int32_t tlfu_miss(CachePolicy *cp, RAIDDiskID dsk, RAIDBlockID blk, int32_t slot, CacheVictim *victim) {
+  int32_t e, cand, prey;
+  int mainList;
+
+  if (slot == CACHE_NIL) {
+    cand = cp->lists[TLFU_WINDOW].tail;
+    mainList = (cp->lists[TLFU_PROBATION].size > 0) ? TLFU_PROBATION : TLFU_PROTECTED;
+    prey = cp->lists[mainList].tail;
+
+    if (cand == CACHE_NIL) {
+      slot = drop_tail(cp, mainList, victim);
+    } else if (prey == CACHE_NIL) {
+      slot = drop_tail(cp, TLFU_WINDOW, victim);
+    } else if (sketch_frequency(cp, cp->entries[cand].disk, cp->entries[cand].block, 0) >
+               sketch_frequency(cp, cp->entries[prey].disk, cp->entries[prey].block, 0)) {
+      slot = drop_tail(cp, mainList, victim);
+      list_move_head(cp, TLFU_PROBATION, cand);
+    } else {
+      slot = drop_tail(cp, TLFU_WINDOW, victim);
+    }
+  }
+
+  e = entry_new(cp, dsk, blk);
+  cp->entries[e].slot = slot;
+  list_push_head(cp, TLFU_WINDOW, e);
+
+  //while there is room, window overflow goes straight to probation
+  if (cp->lists[TLFU_WINDOW].size > cp->target) {
+    list_move_head(cp, TLFU_PROBATION, cp->lists[TLFU_WINDOW].tail);
+  }
+  return slot;
+}
+
+//
+// Policy interface
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_policy_init
+// Description  : Create a policy instance managing capacity payload slots
+//
+// Inputs       : cp - the policy to initialize
+//                type - the replacement policy
+//                capacity - the number of payload slots
+// Outputs      : 0 if successful, -1 if failure
+
+int cache_policy_init(CachePolicy *cp, RAIDCachePolicy type, uint32_t capacity) {
+  uint32_t i, numBuckets, width;
+
+  memset(cp, 0, sizeof(CachePolicy));
+  if ((capacity == 0) || (type >= RAID_CACHE_POLICY_MAX)) {
+    return(-1);
+  }
+
+  //ghosts are bounded by the capacity for every policy, so 2c entries always suffice
+  cp->numEntries = 2 * capacity + 1;
+  for (numBuckets = 1; numBuckets < cp->numEntries; numBuckets <<= 1);
+
+  cp->type = type;
+  cp->capacity = capacity;
+  if (posix_memalign((void **)&cp->entries, 64, cp->numEntries * sizeof(CacheEntry))) {
+    cp->entries = NULL;
+  }
+  cp->buckets = malloc(numBuckets * sizeof(int32_t));
+  cp->freeSlots = malloc(capacity * sizeof(int32_t));
+  if ((cp->entries == NULL) || (cp->buckets == NULL) || (cp->freeSlots == NULL)) {
+    cache_policy_free(cp);
+    return(-1);
+  }
+
+  for (i = 0; i < numBuckets; i++) {
+    cp->buckets[i] = CACHE_NIL;
+  }
+  for (i = 0; i < cp->numEntries; i++) {
+    cp->entries[i].hashNext = (i + 1 < cp->numEntries) ? (int32_t)(i + 1) : CACHE_NIL;
+  }
+  for (i = 0; i < CACHE_POLICY_LISTS; i++) {
+    cp->lists[i].head = cp->lists[i].tail = CACHE_NIL;
+  }
+  cp->bucketMask = numBuckets - 1;
+  cp->freeEntry = 0;
+  cp->handHot = cp->handCold = cp->handTest = CACHE_NIL;
+
+  //policy specific tuning
+  switch (type) {
+  case RAID_CACHE_2Q:
+    cp->target = (capacity / 4) ? capacity / 4 : 1;
+    break;
+  case RAID_CACHE_CLOCKPRO:
+    cp->target = (capacity / 100) ? capacity / 100 : 1;
+    break;
+  case RAID_CACHE_TINYLFU:
+    cp->target = (capacity / 100) ? capacity / 100 : 1;
+    for (width = 16; width < capacity; width <<= 1);
+    cp->sketchMask = width - 1;
+    cp->sketchReset = 10 * capacity;
+    cp->sketch = calloc(TLFU_ROWS * width, sizeof(uint8_t));
+    if (cp->sketch == NULL) {
+      cache_policy_free(cp);
+      return(-1);
+    }
+    break;
+  default:
+    break;
+  }
+
+	// Return successfully
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_policy_free
+// Description  : Release the policy instance
+//
+// Inputs       : cp - the policy
+// Outputs      : none
+
+void cache_policy_free(CachePolicy *cp) {
+  free(cp->entries);
+  free(cp->buckets);
+  free(cp->sketch);
+  free(cp->freeSlots);
+  cp->entries = NULL;
+  cp->buckets = NULL;
+  cp->sketch = NULL;
+  cp->freeSlots = NULL;
+  cp->capacity = 0;
+  cp->resident = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_policy_lookup
+// Description  : Record an access to a key
+//
+// Inputs       : cp - the policy
+//                dsk, blk - the key
+// Outputs      : the slot of the key if resident, CACHE_NIL otherwise
+
+int32_t cache_policy_lookup(CachePolicy *cp, RAIDDiskID dsk, RAIDBlockID blk) {
+  int32_t e;
+
+  if (cp->type == RAID_CACHE_TINYLFU) {
+    sketch_frequency(cp, dsk, blk, 1);
+  }
+
+  e = entry_find(cp, dsk, blk);
+  if ((e == CACHE_NIL) || (cp->entries[e].slot == CACHE_NIL)) {
+    return CACHE_NIL;
+  }
+
+  switch (cp->type) {
+  case RAID_CACHE_ARC:      arc_hit(cp, e); break;
+  case RAID_CACHE_2Q:       twoq_hit(cp, e); break;
+  case RAID_CACHE_CLOCKPRO: clock_hit(cp, e); break;
+  case RAID_CACHE_TINYLFU:  tlfu_hit(cp, e); break;
+  default:                  lru_hit(cp, e); break;
+  }
+  return cp->entries[e].slot;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_policy_peek
+// Description  : Find a resident key without counting it as an access
+//
+// Inputs       : cp - the policy
+//                dsk, blk - the key
+// Outputs      : the slot of the key if resident, CACHE_NIL otherwise
+
+int32_t cache_policy_peek(CachePolicy *cp, RAIDDiskID dsk, RAIDBlockID blk) {
+  int32_t e = entry_find(cp, dsk, blk);
+
+  return (e == CACHE_NIL) ? CACHE_NIL : cp->entries[e].slot;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_policy_insert
+// Description  : Make a missing key resident, evicting as needed
+//
+// Inputs       : cp - the policy
+//                dsk, blk - the key (must not be resident)
+//                victim - filled in with the evicted block, if any
+// Outputs      : the slot the caller should fill with the key's payload
+
+int32_t cache_policy_insert(CachePolicy *cp, RAIDDiskID dsk, RAIDBlockID blk, CacheVictim *victim) {
+  int32_t e, slot = CACHE_NIL;
+
+  //below capacity the policies get a free slot instead of evicting
+  victim->valid = 0;
+  if (cp->resident < cp->capacity) {
+    slot = (cp->numFreeSlots > 0) ? cp->freeSlots[--cp->numFreeSlots] : cp->nextSlot++;
+  }
+
+  switch (cp->type) {
+  case RAID_CACHE_ARC:      slot = arc_miss(cp, entry_find(cp, dsk, blk), dsk, blk, slot, victim); break;
+  case RAID_CACHE_2Q:       slot = twoq_miss(cp, dsk, blk, slot, victim); break;
+  case RAID_CACHE_CLOCKPRO: slot = clock_miss(cp, dsk, blk, slot, victim); break;
+  case RAID_CACHE_TINYLFU:  slot = tlfu_miss(cp, dsk, blk, slot, victim); break;
+  default:
+    if (slot == CACHE_NIL) {
+      slot = drop_tail(cp, LRU_LIST, victim);
+    }
+    e = entry_new(cp, dsk, blk);
+    cp->entries[e].slot = slot;
+    list_push_head(cp, LRU_LIST, e);
+    break;
+  }
+
+  cp->resident++;
+  return slot;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_policy_evict
+// Description  : Evict the block the policy would replace on its next insert,
+//                for callers that must free space other than a slot
+//
+// Inputs       : cp - the policy
+//                victim - filled in with the evicted block, if any
+// Outputs      : the freed slot, or CACHE_NIL if nothing is resident
+
+int32_t cache_policy_evict(CachePolicy *cp, CacheVictim *victim) {
+  int32_t slot;
+  int list;
+
+  victim->valid = 0;
+  if (cp->resident == 0) {
+    return CACHE_NIL;
+  }
+
+  switch (cp->type) {
+  case RAID_CACHE_ARC:      slot = arc_replace(cp, 0, victim); break;
+  case RAID_CACHE_2Q:       slot = twoq_reclaim(cp, victim); break;
+  case RAID_CACHE_CLOCKPRO: slot = clock_hand_cold(cp, victim); break;
+  case RAID_CACHE_TINYLFU:
+    //main's probation victim goes first, the window only when main is empty
+    for (list = TLFU_PROBATION; cp->lists[list].size == 0; list = (list == TLFU_PROBATION) ? TLFU_PROTECTED : TLFU_WINDOW);
+    slot = drop_tail(cp, list, victim);
+    break;
+  default:                  slot = drop_tail(cp, LRU_LIST, victim); break;
+  }
+
+  //the next insert takes the slot back before touching a fresh one
+  cp->freeSlots[cp->numFreeSlots++] = slot;
+  return slot;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_policy_by_name
+// Description  : Find a policy by its label
+//
+// Inputs       : name - the label (case insensitive)
+// Outputs      : the policy or RAID_CACHE_POLICY_MAX if unknown
+
+RAIDCachePolicy cache_policy_by_name(const char *name) {
+  int i;
+
+  for (i = 0; i < RAID_CACHE_POLICY_MAX; i++) {
+    if (strcasecmp(name, RAID_CACHE_POLICY_LABELS[i]) == 0) {
+      return (RAIDCachePolicy)i;
+    }
+  }
+  return RAID_CACHE_POLICY_MAX;
+}
@@ -0,0 +1,118 @@
+#ifndef RAID_CACHE_POLICY_INCLUDED
+#define RAID_CACHE_POLICY_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : raid_cache_policy.h
+//  Description    : This is the header file for the replacement policies of
+//                   the TAGLINE block cache.  A policy only tracks which
+//                   (disk, block) keys are resident and which payload slot
+//                   holds each of them; the payload bytes live in the cache.
+//
+
+// Includes
+#include <raid_bus.h>
+
+// Defines
+#define CACHE_NIL         -1  // Empty link / no slot
+#define CACHE_POLICY_LISTS 4  // Maximum number of queues a policy uses
+
+// Type definitions
+
+// These are the replacement policies
+typedef enum {
+	RAID_CACHE_LRU      = 0,  // Least recently used
+	RAID_CACHE_ARC      = 1,  // Adaptive replacement cache
+	RAID_CACHE_2Q       = 2,  // Full 2Q (A1in / A1out / Am)
+	RAID_CACHE_CLOCKPRO = 3,  // CLOCK-Pro (hot/cold clock with test period)
+	RAID_CACHE_TINYLFU  = 4,  // W-TinyLFU (LRU window + SLRU main + sketch)
+	RAID_CACHE_POLICY_MAX = 5,
+} RAIDCachePolicy;
+extern const char *RAID_CACHE_POLICY_LABELS[RAID_CACHE_POLICY_MAX];
+
+// A key known to the policy, either resident (has a slot) or a ghost.  Entries
+// are padded to 32 bytes so an index probe never straddles two cache lines
+typedef struct __attribute__((aligned(32))) {
+	RAIDDiskID  disk;      // Key: disk number
+	RAIDBlockID block;     // Key: block number
+	int32_t     hashNext;  // Next entry in the same hash bucket
+	int32_t     prev;      // Queue neighbour towards the head
+	int32_t     next;      // Queue neighbour towards the tail
+	int32_t     slot;      // Payload slot, CACHE_NIL for a ghost entry
+	uint8_t     list;      // Queue the entry is on
+	uint8_t     flags;     // Policy bits (reference, hot, test period)
+} CacheEntry;
+
+// A queue of entries, head is the most recent end
+typedef struct {
+	int32_t  head;
+	int32_t  tail;
+	uint32_t size;
+} CacheList;
+
+// The block that lost its slot to make room for an insert
+typedef struct {
+	int         valid;     // 1 if a resident block was evicted
+	RAIDDiskID  disk;
+	RAIDBlockID block;
+	int32_t     slot;      // The slot it occupied (now reused by the insert)
+} CacheVictim;
+
+// The state of one policy instance
+typedef struct {
+	RAIDCachePolicy type;
+	uint32_t    capacity;      // Maximum resident entries (payload slots)
+	uint32_t    resident;      // Current resident entries
+	CacheEntry *entries;       // Entry pool (resident and ghost entries)
+	uint32_t    numEntries;
+	int32_t     freeEntry;     // Head of the unused entry chain
+	int32_t    *buckets;       // Hash index over all entries
+	uint32_t    bucketMask;
+	int32_t     nextSlot;      // Next never-used payload slot
+	int32_t    *freeSlots;     // Slots given up by cache_policy_evict
+	uint32_t    numFreeSlots;
+	CacheList   lists[CACHE_POLICY_LISTS];
+
+	uint32_t    target;        // ARC p / 2Q Kin / CLOCK-Pro cold target / TinyLFU window
+
+	int32_t     handHot;       // CLOCK-Pro hands
+	int32_t     handCold;
+	int32_t     handTest;
+	uint32_t    hotCount;
+	uint32_t    coldCount;
+	uint32_t    ghostCount;
+
+	uint8_t    *sketch;        // TinyLFU count-min sketch (4 rows)
+	uint32_t    sketchMask;
+	uint32_t    sketchAdds;
+	uint32_t    sketchReset;
+
+	uint64_t    hits;          // Statistics kept by the cache layer
+	uint64_t    misses;
+} CachePolicy;
+
+//
+// Policy interfaces
+
+int cache_policy_init(CachePolicy *cp, RAIDCachePolicy type, uint32_t capacity);
+	// Create a policy instance managing capacity payload slots
+
+void cache_policy_free(CachePolicy *cp);
+	// Release the policy instance
+
+int32_t cache_policy_lookup(CachePolicy *cp, RAIDDiskID dsk, RAIDBlockID blk);
+	// Record an access, returning the slot of a resident key or CACHE_NIL
+
+int32_t cache_policy_peek(CachePolicy *cp, RAIDDiskID dsk, RAIDBlockID blk);
+	// Find the slot of a resident key without recording an access
+
+int32_t cache_policy_insert(CachePolicy *cp, RAIDDiskID dsk, RAIDBlockID blk, CacheVictim *victim);
+	// Make a missing key resident and return its slot, evicting as needed
+
+int32_t cache_policy_evict(CachePolicy *cp, CacheVictim *victim);
+	// Evict the block the policy would replace next, freeing its slot
+
+RAIDCachePolicy cache_policy_by_name(const char *name);
+	// Find a policy by its label, RAID_CACHE_POLICY_MAX if unknown
+
+#endif
@@ -16,6 +16,7 @@
 #include <unistd.h>
 #include <assert.h>
 #include <stdint.h>
+#include <pthread.h>
 
 // Project Include Files
 #include <tagline_driver.h>
@@ -28,7 +29,36 @@
 unsigned char *raid_network_address = NULL; // Address of CRUD server
 unsigned short raid_network_port = 0; // Port of CRUD server
 
-int64_t socketfd, length, lengthNBO, recvLength;
+int64_t socketfd;
+
+//The responses to one thread's requests, in the order it sent them
+struct bus_thread {
+  RAIDOpCode resp[RAID_MAX_PENDING];
+  int done[RAID_MAX_PENDING];
+  int head, count;
+};
+static __thread struct bus_thread busThread;
+
+//Requests sent whose responses have not been received yet, oldest first
+struct pending_request {
+  int64_t length;                  // most bytes the response may carry
+  void *buf;                       // where a READ response lands
+  struct bus_thread *owner;        // the thread that sent it
+  int slot;                        // where its response goes in the owner's
+};
+struct pending_request pending[RAID_MAX_PENDING];
+int pendingHead = 0, numPending = 0;
+
+//Any number of threads share the connection.  One of them at a time sends
+//and one of them at a time receives, whichever is waiting reads the oldest
+//response off the socket and hands it to the thread that sent its request
+pthread_mutex_t busLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t busCond = PTHREAD_COND_INITIALIZER;
+int busSending = 0, busReceiving = 0;
+
+//Set once a send or receive failed part way, the requests and responses
+//on the connection no longer line up, so nothing but INIT goes out on it
+int busBroken = 0;
 
 void close_connection() {
   close(socketfd);
@@ -63,30 +93,207 @@ int establish_connection() {
   return 1;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : raid_send_all
+// Description  : Write a whole buffer to the socket, retrying short writes
+//
+// Inputs       : buf - the bytes to send
+//                len - the number of bytes
+// Outputs      : 0 if successful, -1 if failure
+
+static int raid_send_all(const void *buf, int64_t len) {
+  const char *p = buf;
+  ssize_t n;
+
+  while (len > 0) {
+    n = write(socketfd, p, len);
+    if (n <= 0) {
+      if ((n < 0) && (errno == EINTR)) {
+        continue;
+      }
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : raid_recv_all
+// Description  : Read a whole buffer from the socket, retrying short reads
+//                (multi-block transfers rarely arrive in one segment)
+//
+// Inputs       : buf - where to put the bytes
+//                len - the number of bytes
+// Outputs      : 0 if successful, -1 if failure
+
+static int raid_recv_all(void *buf, int64_t len) {
+  char *p = buf;
+  ssize_t n;
+
+  while (len > 0) {
+    n = read(socketfd, p, len);
+    if (n <= 0) {
+      if ((n < 0) && (errno == EINTR)) {
+        continue;
+      }
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : raid_bus_poison
+// Description  : Give up on the connection after a failed send or receive:
+//                every request still waiting for a response fails, as the
+//                next bytes on the socket can no longer be matched up with
+//                one.  Called with busLock held
+//
+// Inputs       : none
+// Outputs      : none
+
+static void raid_bus_poison(void) {
+  struct pending_request *p;
+
+  //shut down rather than closed, a receiver may still be reading the socket
+  if (!busBroken) {
+    logMessage(LOG_ERROR_LEVEL, "Connection out of step, failing %d outstanding request(s)", numPending);
+    shutdown(socketfd, SHUT_RDWR);
+  }
+  busBroken = 1;
+  while (numPending > 0) {
+    p = &pending[pendingHead];
+    p->owner->resp[p->slot] = (RAIDOpCode)-1;
+    p->owner->done[p->slot] = 1;
+    pendingHead = (pendingHead + 1) % RAID_MAX_PENDING;
+    numPending--;
+  }
+  pthread_cond_broadcast(&busCond);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : raid_recv_next
+// Description  : Read the response to the oldest request on the connection
+//                and hand it to the thread that sent it.  Called with busLock
+//                held and nobody else receiving, the lock is let go while
+//                the socket is read
+//
+// Inputs       : none
+// Outputs      : none
+
+static void raid_recv_next(void) {
+  struct pending_request p = pending[pendingHead];
+  int64_t lengthNBO, recvLength;
+  RAIDOpCode op;
+  int failed = 1;
+
+  busReceiving = 1;
+  pthread_mutex_unlock(&busLock);
+
+  //Then read sequantially, the third read is conditional
+  if (raid_recv_all(&op, sizeof(op))) {
+    logMessage(LOG_ERROR_LEVEL, "Recieve opcode failed");
+  } else if (raid_recv_all(&lengthNBO, sizeof(lengthNBO))) {
+    logMessage(LOG_ERROR_LEVEL, "Receive from length failed!");
+  } else {
+    logMessage(LOG_INFO_LEVEL, "Opcode and length received!");
+
+    //convert  to host byte order to determine whether the buffer needs to be read in
+    recvLength = ntohll64(lengthNBO);
+    failed = 0;
+
+    //so if length received from the server is non-zero, then receive a buffer from the server,
+    //never taking more than the request's own buffer can hold
+    if ((recvLength != 0) && ((recvLength > p.length) || (p.buf == NULL))) {
+      logMessage(LOG_ERROR_LEVEL, "Unexpected response length %ld!", (long)recvLength);
+      failed = 1;
+    } else if ((recvLength != 0) && raid_recv_all(p.buf, recvLength)) {
+      logMessage(LOG_ERROR_LEVEL, "Buffer receive failed!");
+      failed = 1;
+    }
+  }
+
+  //convert opcode to host byte order
+  op = failed ? (RAIDOpCode)-1 : ntohll64(op);
+
+  // if type if Close, close connection, disconnect from socket
+  if (!failed && (extract_raid_response(op, "REQUEST_TYPE") == RAID_CLOSE)) {
+    close_connection();
+  }
+
+  pthread_mutex_lock(&busLock);
+  busReceiving = 0;
+  if (failed || busBroken) {
+    raid_bus_poison();
+    return;
+  }
+  pendingHead = (pendingHead + 1) % RAID_MAX_PENDING;
+  numPending--;
+  p.owner->resp[p.slot] = op;
+  p.owner->done[p.slot] = 1;
+  pthread_cond_broadcast(&busCond);
+}
+
 //
 // Functions
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : client_raid_bus_request
-// Description  : This the client operation that sends a request to the RAID
-//                server.   It will:
+// Function     : client_raid_bus_send
+// Description  : This sends a request to the RAID server without waiting for
+//                its response, so several can be outstanding on the
+//                connection at once.   It will:
 //
-//                1) if INIT make a connection to the server
-//                2) send any request to the server, returning results
-//                3) if CLOSE, will close the connection
+//                1) wait for its turn to send (receiving responses meanwhile)
+//                2) if INIT make a connection to the server
+//                3) send the request (and any blocks it writes)
+//                4) remember where its response is to go
 //
 // Inputs       : op - the request opcode for the command
 //                buf - the block to be read/written from (READ/WRITE)
-// Outputs      : the response structure encoded as needed
+// Outputs      : 0 if successful, -1 if failure
 
+int client_raid_bus_send(RAIDOpCode op, void *buf) {
+  int blocks = extract_raid_response(op, "BLOCKS"), failed = 0;
+  int64_t length = blocks*RAID_BLOCK_SIZE, lengthNBO;
+  struct pending_request *p;
 
-RAIDOpCode client_raid_bus_request(RAIDOpCode op, void *buf) {
-  int blocks = extract_raid_response(op, "BLOCKS");
-  length = blocks*RAID_BLOCK_SIZE;
+  if (busThread.count == RAID_MAX_PENDING) {
+    logMessage(LOG_ERROR_LEVEL, "Too many outstanding requests!");
+    return -1;
+  }
+
+  //wait for the connection, taking responses off it while others hold it up
+  pthread_mutex_lock(&busLock);
+  while (busSending || (numPending == RAID_MAX_PENDING)) {
+    if (!busReceiving && (numPending > 0)) {
+      raid_recv_next();
+    } else {
+      pthread_cond_wait(&busCond, &busLock);
+    }
+  }
+  if (busBroken && (extract_raid_response(op, "REQUEST_TYPE") != RAID_INIT)) {
+    pthread_mutex_unlock(&busLock);
+    logMessage(LOG_ERROR_LEVEL, "Connection out of step, request not sent!");
+    return -1;
+  }
+  busSending = 1;
+  pthread_mutex_unlock(&busLock);
 
   if (extract_raid_response(op, "REQUEST_TYPE") == RAID_INIT) {
+    if (busBroken) {
+      close_connection();
+    }
     establish_connection();
+    busBroken = 0;                 //a new connection starts in step
     length = 0;                    //length and blocks are zero for INIT
     blocks = 0;
   }
@@ -101,66 +308,96 @@ RAIDOpCode client_raid_bus_request(RAIDOpCode op, void *buf) {
   lengthNBO = htonll64(length);
 
   //Send opcode and get a response from server
-  if (write (socketfd, &op, sizeof(op)) != sizeof(op)){
+  if (raid_send_all(&op, sizeof(op))){
     logMessage(LOG_ERROR_LEVEL, "Opcode send failed!");
-    return -1;
+    failed = 1;
   }
-    logMessage(LOG_INFO_LEVEL, "Opcode sent");
 
   //Send the length to the server to determine whether we need to receive anything from the server
-  if (write(socketfd, &lengthNBO, sizeof(lengthNBO)) != sizeof(lengthNBO)) {
+  else if (raid_send_all(&lengthNBO, sizeof(lengthNBO))) {
     logMessage(LOG_ERROR_LEVEL, "Send 'length' failed!");
-    return -1;
+    failed = 1;
   }
 
-    logMessage(LOG_INFO_LEVEL, "Length sent!");
-
   //send the buffer to the server no matter what. The server will decide whether we'll it'll need it or not
-  if (write(socketfd, buf, RAID_BLOCK_SIZE*blocks) != RAID_BLOCK_SIZE*blocks) {
+  else if (raid_send_all(buf, RAID_BLOCK_SIZE*blocks)) {
     logMessage(LOG_ERROR_LEVEL, "Send 'buffer' failed!");
-    return -1;
+    failed = 1;
   }
 
-    logMessage(LOG_INFO_LEVEL, "Buffer sent!");
-
-  //Then read sequantially, the third read is conditional
-  if (read(socketfd, &op, sizeof(op)) != sizeof(op)) {
-    logMessage(LOG_ERROR_LEVEL, "Recieve opcode failed");
-    return -1;
+  //the server answers in order, so the response is matched up by position
+  pthread_mutex_lock(&busLock);
+  if (!failed) {
+    logMessage(LOG_INFO_LEVEL, "Request sent!");
+    p = &pending[(pendingHead + numPending) % RAID_MAX_PENDING];
+    p->length = length;
+    p->buf = buf;
+    p->owner = &busThread;
+    p->slot = (busThread.head + busThread.count) % RAID_MAX_PENDING;
+    busThread.done[p->slot] = 0;
+    busThread.count++;
+    numPending++;
+  } else {
+    //part of the request may be on the wire, the server's next response can't be matched up
+    raid_bus_poison();
   }
+  busSending = 0;
+  pthread_cond_broadcast(&busCond);
+  pthread_mutex_unlock(&busLock);
+  return failed ? -1 : 0;
+}
 
-  logMessage(LOG_INFO_LEVEL, "Opcode received!");
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_raid_bus_recv
+// Description  : This receives the response to the oldest request the
+//                calling thread has outstanding, reading any blocks it
+//                returns into that request's buffer.  Responses to other
+//                threads' requests ahead of it are read off on their behalf.
+//                If the request was CLOSE the connection is closed
+//
+// Inputs       : none
+// Outputs      : the response structure encoded as needed, -1 if failure
 
-  if (read(socketfd, &lengthNBO, sizeof(lengthNBO)) != sizeof(lengthNBO)) {
-    logMessage(LOG_ERROR_LEVEL, "Receive from length failed!");
+RAIDOpCode client_raid_bus_recv(void) {
+  RAIDOpCode op;
+  int slot = busThread.head;
+
+  if (busThread.count == 0) {
+    logMessage(LOG_ERROR_LEVEL, "No outstanding request to receive!");
     return -1;
   }
 
-  logMessage(LOG_INFO_LEVEL, "Length received!");
-
-  //convert  to host byte order to determine whether the buffer needs to be read in
-  recvLength = ntohll64(lengthNBO);
-
-
-  //so if length received from the server is non-zero, then receive a buffer from the server
-  if (recvLength != 0) {
-
-    logMessage(LOG_INFO_LEVEL, "Trying to receive buffer from server!");
-    if (read(socketfd, buf, recvLength*blocks) != recvLength*blocks) {
-      logMessage(LOG_ERROR_LEVEL, "Buffer receive failed!");
-      return -1;
+  pthread_mutex_lock(&busLock);
+  while (!busThread.done[slot]) {
+    if (!busReceiving) {
+      raid_recv_next();
+    } else {
+      pthread_cond_wait(&busCond, &busLock);
     }
-    logMessage(LOG_INFO_LEVEL, "Buffer read into 'buf'!");
   }
+  pthread_mutex_unlock(&busLock);
 
-    
-  //convert opcode to host byte order
-  op = ntohll64(op);
+  op = busThread.resp[slot];
+  busThread.head = (busThread.head + 1) % RAID_MAX_PENDING;
+  busThread.count--;
+  return op;
+}
 
-  // if type if Close, close connection, disconnect from socket
-  if (extract_raid_response(op, "REQUEST_TYPE") == RAID_CLOSE){
-    close_connection();
-  }
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_raid_bus_request
+// Description  : This the client operation that sends a request to the RAID
+//                server and waits for its response
+//
+// Inputs       : op - the request opcode for the command
+//                buf - the block to be read/written from (READ/WRITE)
+// Outputs      : the response structure encoded as needed
 
-  return op;
+
+RAIDOpCode client_raid_bus_request(RAIDOpCode op, void *buf) {
+  if (client_raid_bus_send(op, buf)) {
+    return -1;
+  }
+  return client_raid_bus_recv();
 }
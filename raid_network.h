@@ -20,6 +20,7 @@
 //
 #define RAID_DEFAULT_IP "127.0.0.1"
 #define RAID_DEFAULT_PORT 19878
+#define RAID_MAX_PENDING 16     // Most requests outstanding on the connection
 
 // Address information
 extern unsigned char *raid_network_address;  // Address of RAID server
@@ -29,6 +30,10 @@ extern unsigned short raid_network_port;     // Port of RAID server
 
 RAIDOpCode client_raid_bus_request(RAIDOpCode op, void *buf);
 
+int client_raid_bus_send(RAIDOpCode op, void *buf);
+
+RAIDOpCode client_raid_bus_recv(void);
+
 int establish_connection();
 
 void close_connection();
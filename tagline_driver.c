@@ -8,16 +8,57 @@
 //  Created        : ?????
 
 // Include Files
+#include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #include <cmpsc311_log.h>
 
 // Project Includes
 #include "raid_bus.h"
 #include "tagline_driver.h"
 #include "raid_cache.h"
+#include "tagline_journal.h"
+#include "tagline_parity.h"
 #include <raid_network.h>
 
+// Defines
+#define TAGLINE_WB_STAGE 16   // Dirty blocks evicted before they are written out (the staging grows past it)
+#define TAGLINE_SNAP_MAGIC   0x534c5454  // "TTLS"
+#define TAGLINE_SNAP_VERSION 1
+#define TAGLINE_JOURNAL_GROUP      256    // Journal records that force a group commit
+#define TAGLINE_JOURNAL_MS         10     // Longest a mapping update waits to be committed
+#define TAGLINE_JOURNAL_CHECKPOINT 65536  // Committed records that trigger a checkpoint
+#define TAGLINE_TUNE_PERIOD  8192        // Reads between cache size decisions
+#define TAGLINE_RA_TRIGGER    2   // Reads with the same stride before a stream is prefetched
+#define TAGLINE_RA_MAX_STRIDE 16  // Largest stride (blocks) followed by the prefetcher
+#define TAGLINE_RA_MIN_DEPTH  4   // Fewest reads a stream prefetches ahead
+#define TAGLINE_RA_START      8   // Read-ahead depth before any stream has been measured
+#define TAGLINE_UNMAPPED   0xff   // Disk of a tagline block that was never written
+#define TAGLINE_PRIMARY       0   // Roles of a disk block in the reverse map
+#define TAGLINE_BACKUP        1
+#define TAGLINE_WROTE_PRIMARY 1   // Replicas a mirrored write reached
+#define TAGLINE_WROTE_BACKUP  2
+#define TAGLINE_LAT_BUCKETS 128   // Read latency histogram, 4 buckets per power of 2 microseconds
+#define TAGLINE_LAT_RECENT  256   // Recent read latencies the hedge percentile is taken over
+#define TAGLINE_EWMA_SHIFT    3   // Weight of a new latency sample in the EWMA is 1/8
+#define TAGLINE_EWMA_DECAY    6   // Other disks' EWMA fades by 1/64 per read
+#define TAGLINE_REBUILD_DEPTH 4   // Rebuild runs in flight at once
+#define TAGLINE_STRIPE_CHUNK 32   // Rows of every disk in one parity stripe
+#define TAGLINE_STRIPES (RAID_DISKBLOCKS / TAGLINE_STRIPE_CHUNK)
+#define TAGLINE_STRIPE_GAP 4      // Untouched rows that split an update of a stripe in two
+#define TAGLINE_FETCH_WINDOW 8    // Most reads a fetch keeps on the bus at once
+#define TAGLINE_QUEUE_MAX   64    // Deepest queue of asynchronous operations
+#define TAGLINE_LINE_LOCKS  64    // Striped locks keeping a tagline (and its blocks) to one thread
+
 struct cache_statistics {
   long int inserts;
   long int hits;
@@ -25,21 +66,362 @@ struct cache_statistics {
   long int misses;
 };
 
-//This is the structure for a raid disk, and 'container' contains the 8192 blocks
-struct tagline {
-  int **taglineBlocks;
-} *taglines;
+//Requests sent on the bus, by request type
+struct bus_statistics {
+  long int requests[RAID_MAXVAL];
+  long int blocks[RAID_MAXVAL];     // blocks carried by reads and writes
+  long int waits;                   // receives inside tagline_bus_wait
+  long int yields;                  // of those, the ones other threads could run alongside
+};
+
+//A request sent on the bus whose response has not been received yet
+struct bus_pending {
+  int disk;
+  int type;
+  struct timespec sent;
+};
+
+//Which replica reads go to, and the read latency of every disk it is chosen by
+struct read_balance {
+  TaglineReadPolicy policy;
+  uint32_t hedgePercentile;         // steer runs off disks slower than this percentile (0 = off)
+  int rrNext;                       // disk the round robin prefers next
+  uint32_t outstanding[RAID_DISKS]; // requests sent to each disk and not yet answered
+  uint32_t ewma[RAID_DISKS];        // read latency of each disk, nanoseconds
+  uint32_t recent[TAGLINE_LAT_RECENT];
+  uint32_t numRecent;
+  uint32_t hedgeThreshold;          // the percentile of the recent latencies, microseconds
+  long int histogram[TAGLINE_LAT_BUCKETS];
+  long int diskBlocks[RAID_DISKS];  // blocks demand and read-ahead reads took from each disk
+  long int steered;                 // runs read from a mirror because their disk was slow
+};
+
+//Rebuild of failed disks a few blocks at a time, between foreground
+//operations.  Every block of a rebuilding disk below its cursor holds its
+//data again, the ones from there to the end are only on the other replica
+struct rebuild_state {
+  uint32_t step;                    // blocks rebuilt per foreground operation (0 = all at once)
+  uint32_t limit;                   // background rebuild bandwidth cap, blocks/s (0 = none)
+  int cursor[RAID_DISKS];           // next block to rebuild, -1 if the disk is not rebuilding
+  int end[RAID_DISKS];              // blocks the disk held when it failed
+  int active;                       // disks rebuilding
+  long int disks;                   // rebuilds started
+  long int blocks;                  // blocks rebuilt
+  long int fromCache;               // of them, copied out of the cache instead of read
+  long int lost;                    // blocks with no good copy left to rebuild from
+  long int signalUs;                // longest raid_disk_signal call
+  double tokens;                    // blocks the cap lets through right now
+  int64_t lastRefill;               // when the tokens were last topped up, microseconds
+  int64_t started[RAID_DISKS];      // when each rebuilding disk failed
+  long int requests;                // requests the rebuild sent
+  int64_t busyUs;                   // time spent rebuilding
+  long int finished;                // rebuilds that got their disk back to two copies
+  int64_t ttrUs;                    // their total time to redundancy
+  int64_t ttrMaxUs;
+};
+
+//A run of a rebuilding disk that is written back as one transfer
+struct rebuild_run {
+  int block;                        // first block on the rebuilding disk
+  int len;
+};
+
+//A read filling part of a run from the other replicas, which follow on from each other on one disk
+struct rebuild_read {
+  int run;                          // the run it fills
+  int offset;                       // first block of the run it fills
+  int srcDisk;
+  int srcBlock;
+  int len;
+};
+
+//A window of a disk checked against the window of another disk holding the backups of its primaries
+struct scrub_run {
+  int block;                        // first block of the window
+  int len;
+  int backDisk;
+  int backBlock;
+  int backLen;
+};
+
+//Where the two replicas of a tagline block live, packed into 12 bytes
+struct tagline_entry {
+  uint8_t primaryDisk;              // TAGLINE_UNMAPPED until the block is written
+  uint8_t backUpDisk;               // TAGLINE_UNMAPPED if there is no backup
+  uint16_t unused;
+  uint32_t primaryBlock;
+  uint32_t backUpBlock;
+};
+
+//Striped parity layouts.  Stripe s is rows s * TAGLINE_STRIPE_CHUNK onwards
+//of every disk, its P (then Q) on disk s % RAID_DISKS (and the one after)
+//and its data members on the disks after those.  Fresh writes fill the open
+//stripe a member at a time, its data is also kept in stripeData, and its
+//parity is only written once it is full, so filling a stripe needs no reads
+struct stripe_state {
+  TaglineLayout layout;             // chosen before init
+  int parityDisks;                  // 0 when mirrored, 1 for P, 2 for P and Q
+  int dataDisks;
+  uint32_t open;                    // the stripe fresh writes fill
+  uint32_t filled;                  // its data blocks written so far
+  long int written;                 // blocks handed to tagline_write
+  long int busBlocks;               // blocks moved on the bus writing them (and flushing them)
+  long int fullStripes;             // stripes whose parity was written once, when full
+  long int readModifyWrites;        // updates of a sealed stripe from its old data and parity
+  long int reconstructWrites;       // updates of a sealed stripe from the rest of its data
+  long int fullRows;                // updates covering whole rows, no reads at all
+  long int degradedReads;           // runs rebuilt from the rest of their stripe for a read
+  long int degradedBlocks;
+};
+
+//A block of an update to one stripe
+struct stripe_item {
+  int member;                       // data member, 0 to dataDisks - 1
+  int row;                          // row within the stripe
+  char *data;
+};
+
+//Reads a fetch has on the bus, oldest first, and the copies each one covers
+struct fetch_window {
+  int head;                         // slot of the oldest read in flight
+  int inFlight;
+  int received;                     // of them, the ones whose response is already in
+  uint32_t first[TAGLINE_FETCH_WINDOW];
+  uint32_t last[TAGLINE_FETCH_WINDOW];
+  int peak;                         // most reads ever in flight at once
+};
+
+//Asynchronous operations, submitted in order and run in batches when the
+//caller polls or waits.  A batch serves its reads together (one fetch for
+//all of their misses) ahead of any earlier write they do not overlap
+struct async_queue {
+  uint32_t outstanding;
+  TaglineIO *head, *tail;           // submitted, waiting for the next batch
+  TaglineIO *doneHead, *doneTail;   // completed without a callback, waiting to be reaped
+  long int batches;                 // batches run
+  long int ops;                     // operations they ran
+  long int readGroups;              // fetches serving the reads of a batch
+  long int hoisted;                 // reads served ahead of an earlier write
+  long int shared;                  // blocks fetched once for more than one read
+  long int vectored;                // tagline_readv and tagline_writev calls
+  long int segments;                // segments they were given
+  long int vectorRuns;              // runs a tagline_writev went out in
+};
+
+//A cache miss of a batch of reads
+struct async_miss {
+  TagLineNumber tag;
+  TagLineBlockNumber bnum;
+  char *dest;
+  uint32_t op;                      // the read it is for
+  uint32_t order;                   // its place in the batch, to keep the sort stable
+};
+
+//A block of a tagline_writev, where its data comes from and where it goes
+struct vector_block {
+  TagLineNumber tag;
+  TagLineBlockNumber bnum;
+  char *src;
+  uint32_t order;                   // its place in the call, the last write of a block wins
+  int primaryDisk, primaryBlock;    // where it is written (RAID_DISKS if it is not yet)
+  int backUpDisk, backUpBlock;
+};
+
+//What each thread calling the driver keeps to itself: its statistics, the
+//requests it has on the bus, its fetch window and its asynchronous queue
+struct tagline_thread {
+  int active;                       // 0 once its thread has exited, for the next new thread to take
+  struct cache_statistics stats;
+  struct bus_statistics bus;
+  struct bus_pending busPending[RAID_MAX_PENDING];
+  int busPendingHead;
+  int busNumPending;
+  int yield;                        // 1 while the driver lock may be let go waiting on the bus
+  int serial;                       // 1 while the thread holds the driver lock
+  int quiet;                        // 1 while no other thread's operation can be running
+  struct fetch_window fetchWindow;
+  struct async_queue asyncQueue;
+  struct async_miss asyncMisses[(TAGLINE_QUEUE_MAX + 1) * MAX_TAGLINE_BLOCK_NUMBER];
+  char fetchBuffer[TAGLINE_FETCH_WINDOW][RAID_MAX_XFER*RAID_BLOCK_SIZE];
+  struct tagline_thread *next;
+};
+
+//The tagline block a disk block holds and which replica of it it is
+struct block_owner {
+  uint16_t tag;
+  uint16_t bnum;
+  uint8_t role;                     // TAGLINE_PRIMARY, TAGLINE_BACKUP or TAGLINE_UNMAPPED
+  uint8_t unused;
+};
+
+//The mapping of every tagline is one table of maxlines * MAX_TAGLINE_BLOCK_NUMBER
+//entries, reserved (not committed) at init.  A tagline's entries are only
+//touched, and so only take memory, once the tagline is first written
+struct tagline_map {
+  struct tagline_entry *entries;
+  size_t bytes;
+  uint64_t *live;                   // one bit per tagline whose entries are set up
+  uint32_t liveLines;
+};
 
 struct raid_disks {
   int currentSize;
 };
 
+//Write-back state, dirty blocks live in the cache until they are flushed
+struct write_back {
+  int enabled;
+  uint32_t intervalMs;              // flush everything at least this often (0 = never)
+  struct timeval lastFlush;
+  RAIDCacheBlock *staged;           // dirty blocks the cache just evicted
+  uint32_t numStaged;
+  uint32_t maxStaged;               // room in staged, grown as evictions need it
+  uint32_t lost;                    // evicted blocks there was no room for, failing the next drain
+  long int absorbed;                // writes that replaced a block that was still dirty
+  long int flushedBlocks;           // blocks written back (both replicas count once)
+  long int flushRequests;           // RAID_WRITE requests used to write them back
+};
+
+//Read-ahead state of one tagline, the stride between the starts of its
+//reads and how far ahead (in reads of the same size) it has been prefetched
+struct read_stream {
+  int32_t last;                     // first block of the previous read (-1 for none)
+  int32_t stride;
+  uint32_t run;                     // reads in a row with this stride
+  int32_t frontier;                 // first block of the furthest prefetched read
+  uint64_t pending[MAX_TAGLINE_BLOCK_NUMBER/64]; // prefetched blocks not read yet
+};
+
+//Read-ahead settings and statistics
+struct read_ahead {
+  uint32_t maxDepth;                // deepest read-ahead (0 = off)
+  uint32_t limit;                   // maxDepth, kept to a quarter of the cache
+  uint32_t depth;                   // reads every stream keeps prefetched ahead
+  uint32_t epochUsed;               // prefetched blocks read since the depth last changed
+  uint32_t epochWasted;             // prefetched blocks evicted or skipped before being read
+  struct read_stream *streams;      // one per tagline
+  long int prefetched;              // blocks read ahead of demand
+  long int requests;                // RAID_READ requests used to read them
+  long int used;                    // prefetched blocks that were then read
+  long int demandRequests;          // RAID_READ requests for cache misses
+};
+
+//Layout of the cache snapshot file, a header and then one record per clean
+//cached block, tagged with the tagline block it held so it can be checked
+//against the mapping when it is loaded again
+struct snapshot_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t blockSize;
+  uint32_t count;
+};
+
+struct snapshot_record {
+  uint16_t tag;
+  uint16_t bnum;
+  uint32_t disk;
+  uint32_t block;
+  char data[RAID_BLOCK_SIZE];
+};
+
+const char *TAGLINE_READ_POLICY_LABELS[TAGLINE_READ_POLICY_MAX] = { "primary", "round-robin", "least-outstanding", "EWMA" };
+const char *TAGLINE_LAYOUT_LABELS[TAGLINE_LAYOUT_MAX] = { "mirror", "raid5", "raid6" };
+
 //Storing round robin 
 int currentDisk = 0;
 int gmaxLines;
 
 struct raid_disks disks[RAID_DISKS];
-struct cache_statistics stats;
+struct write_back writeBack;
+struct read_ahead readAhead;
+struct tagline_map mapping;
+struct read_balance balance;
+struct rebuild_state rebuild;
+static const struct tagline_entry unmappedEntry = { TAGLINE_UNMAPPED, TAGLINE_UNMAPPED, 0, 0, 0 };
+
+//The reverse map, which tagline block every written disk block holds
+struct block_owner owner[RAID_DISKS][RAID_DISKBLOCKS];
+
+//One bit per disk block holding a replica, so the rebuild and the scrub only visit written blocks
+uint64_t liveBlocks[RAID_DISKS][RAID_DISKBLOCKS / 64];
+
+//Verifying every primary against its backup at close
+struct scrub_state {
+  int atClose;                      // 1 to scrub when the driver is closed
+  long int blocks;                  // blocks compared
+  long int requests;                // requests the scrub sent
+  long int repaired;                // backups rewritten from their primary
+  long int us;                      // time spent scrubbing
+} scrub;
+
+//Where the cache is saved at close and reloaded at init (NULL for none)
+char *snapshotPath = NULL;
+
+//Where the mapping is journaled so a restart can get it back (NULL for none)
+char *journalPath = NULL;
+TaglineJournal journal;
+struct timeval journalLastCommit;
+int checkpointDue = 0;              // a commit found a checkpoint needed, left for driver_upkeep
+
+//Most blocks the cache may be resized to from its miss ratio curve (0 = fixed size)
+uint32_t cacheBudget = 0;
+uint32_t readsSinceTune;
+int tuneDue = 0;                    // the size is to be revisited by driver_upkeep
+
+//The redundancy layout, with the data of the open stripe and room for a row range of every member of one
+struct stripe_state stripe;
+char stripeData[RAID_DISKS][TAGLINE_STRIPE_CHUNK*RAID_BLOCK_SIZE];
+char stripeRows[RAID_DISKS][TAGLINE_STRIPE_CHUNK*RAID_BLOCK_SIZE];
+char stripeNew[RAID_DISKS][TAGLINE_STRIPE_CHUNK*RAID_BLOCK_SIZE];
+
+//Send the primary and backup writes together instead of one after the other
+int mirrorConcurrent = 0;
+long int mirrorRollbacks = 0;
+
+//Staging for multi-block transfers, write-back has its own as it runs in the middle of reads
+char runBuffer[RAID_MAX_XFER*RAID_BLOCK_SIZE];
+char flushBuffer[RAID_MAX_XFER*RAID_BLOCK_SIZE];
+char rebuildBuffer[TAGLINE_REBUILD_DEPTH][RAID_MAX_XFER*RAID_BLOCK_SIZE];
+
+//Deepest asynchronous queue, and the most reads a fetch keeps on the bus
+uint32_t queueDepth = 1;
+int fetchWindowSize = 1;
+
+//Every thread calling the driver has a context of its own, which is kept
+//(for a later thread to take over) when the thread exits, so its
+//statistics are still there at close
+struct tagline_thread *threads = NULL;
+static __thread struct tagline_thread *self = NULL;
+pthread_key_t threadKey;
+pthread_once_t threadOnce = PTHREAD_ONCE_INIT;
+pthread_mutex_t threadsLock = PTHREAD_MUTEX_INITIALIZER;
+
+//Operations of different threads run side by side.  A tagline being read
+//or written is kept to one thread by its striped line lock, which guards
+//the tagline's mapping entries, the reverse map entries and cached blocks
+//of the disk blocks it owns (a disk block is never given to another
+//tagline) and its read-ahead stream.  What the taglines share has locks
+//of its own: the free blocks of each disk, the read balancing state, the
+//journal's queued records and the read-ahead depth, while the live
+//bitmaps, the allocation cursor and the counters are updated atomically
+//and the cache has a lock per shard.  The driver lock is only taken by
+//operations when the driver has state no finer lock covers (a parity
+//layout, write-back or a rebuild going on), those run one at a time and
+//let it go only while a fetch or mirror write waits on its last response
+//(see tagline_bus_recv).  A checkpoint or a cache resize, which need the
+//whole mapping or cache to stand still, is left by the operation that
+//finds it due to run once it is over, with every line lock taken (see
+//driver_upkeep).  Locks are taken in the order quiesce, line, driver,
+//journal, disk, and the balance and read-ahead locks hold no other.  The
+//quiesce lock is held shared by operations, exclusive by disk failures,
+//scrubs, init and close, which have the driver to themselves
+pthread_mutex_t driverLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t lineLocks[TAGLINE_LINE_LOCKS];
+pthread_mutex_t diskLocks[RAID_DISKS];
+pthread_mutex_t balanceLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t readAheadLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t quiesceLock = PTHREAD_RWLOCK_INITIALIZER;
 
 
 //Globals
@@ -150,367 +532,4897 @@ RAIDOpCode create_raid_request(uint64_t request_type, uint64_t num_blocks, uint6
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : tagline_driver_init
-// Description  : Initialize the driver with a number of maximum lines to process
+// Function     : latency_bucket
+// Description  : The histogram bucket of a latency, buckets are a quarter of
+//                a power of 2 wide
 //
-// Inputs       : maxlines - the maximum number of tag lines in the system
-// Outputs      : 0 if successful, -1 if failure
-  
-int tagline_driver_init(uint32_t maxlines) {
-
-  init_raid_cache(TAGLINE_CACHE_SIZE); 
+// Inputs       : us - the latency in microseconds
+// Outputs      : the bucket
 
-  //assign global var 'gmaxlines' to maxlines so that it can be used in raid_disk_signal()
-  gmaxLines = maxlines;
-  int i,j;
-  RAIDOpCode respInit, respFormat;
+static uint32_t latency_bucket(uint32_t us) {
+  uint32_t e;
 
-  //Just initialize each array of disks to RAID_DISKBLOCKS
-  for (i = 0; i < RAID_DISKS; i++) {
-    disks[i].currentSize = RAID_DISKBLOCKS;
+  if (us < 4) {
+    return us;
   }
+  e = 31 - __builtin_clz(us);
+  return (e - 1) * 4 + ((us >> (e - 2)) & 3);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : latency_floor
+// Description  : The smallest latency that falls in a histogram bucket
+//
+// Inputs       : b - the bucket
+// Outputs      : the latency in microseconds
 
-  //Dynamically allocate memory for maxlines of taglines
-  taglines = malloc(maxlines * sizeof(struct tagline));
+static uint32_t latency_floor(uint32_t b) {
+  return (b < 4) ? b : (4 + (b % 4)) << (b / 4 - 1);
+}
 
-  //For each tagline, dynamically allocate memory for max taglineblocks to store information about the disk and block in the disk
-  for (i = 0; i < maxlines; i++) {
-    taglines[i].taglineBlocks = malloc(MAX_TAGLINE_BLOCK_NUMBER * sizeof(int*));
-    //For each tagline block, dynamically allocation an array of 4 integers. First two will hold primary disk and primary disk block and last two will hold backup disk and backup disk block
-    for (j = 0; j < MAX_TAGLINE_BLOCK_NUMBER; j++) {
-      taglines[i].taglineBlocks[j] = malloc (4 * sizeof(int));
-      taglines[i].taglineBlocks[j][0] = -1;                            //Initialize them to -1 so that when reading through the data structure, program knows whether this taglineblock was written to or not
-      taglines[i].taglineBlocks[j][2] = -1;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : latency_percentile
+// Description  : Find a percentile of every read latency recorded so far
+//
+// Inputs       : permille - the percentile, in tenths of a percent
+// Outputs      : the latency in microseconds (bucket floor)
+
+uint32_t latency_percentile(uint32_t permille) {
+  long int total = 0, seen = 0;
+  uint32_t b;
+
+  for (b = 0; b < TAGLINE_LAT_BUCKETS; b++) {
+    total += balance.histogram[b];
+  }
+  for (b = 0; b < TAGLINE_LAT_BUCKETS; b++) {
+    seen += balance.histogram[b];
+    if ((total > 0) && (seen * 1000 >= total * (long int)permille)) {
+      return latency_floor(b);
     }
   }
-  
-  //Initializes the raid arrays
-  respInit = client_raid_bus_request(create_raid_request(RAID_INIT, RAID_DISKBLOCKS/RAID_TRACK_BLOCKS, RAID_DISKS, 0, 0, 0), NULL);
+  return 0;
+}
 
-  //check if init fails or not
-  if (status_check_helper(respInit, "INIT")){
-    return -1;
-  }
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_latencies
+// Description  : qsort comparison for latencies
+//
+// Inputs       : a, b - the two latencies
+// Outputs      : <0, 0, >0
 
-  //Formats the disks
-  for (i = 0;i < RAID_DISKS; i++){
-    respFormat = client_raid_bus_request(create_raid_request(RAID_FORMAT, RAID_DISKBLOCKS/RAID_TRACK_BLOCKS, i, 0, 0, 0), NULL);
-    
-    //check if succeeded or not!
-    if (status_check_helper(respFormat, "FORMAT")){
-      return -1;
+static int compare_latencies(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readbalance_record
+// Description  : Account a read that has been answered, in its disk's EWMA,
+//                the histogram and the recent latencies (whose hedge
+//                percentile is refreshed a quarter of the window at a time)
+//
+// Inputs       : disk - the disk read from
+//                ns - how long it took, nanoseconds
+// Outputs      : none
+
+void readbalance_record(int disk, uint32_t ns) {
+  uint32_t sorted[TAGLINE_LAT_RECENT], n, us = ns / 1000;
+  int d;
+
+  if (balance.ewma[disk] == 0) {
+    balance.ewma[disk] = ns;
+  } else {
+    balance.ewma[disk] = balance.ewma[disk] + (((int64_t)ns - (int64_t)balance.ewma[disk]) >> TAGLINE_EWMA_SHIFT);
+  }
+  //the other disks' estimates fade, so one slow sample does not keep a disk unread for good
+  for (d = 0; d < RAID_DISKS; d++) {
+    if (d != disk) {
+      balance.ewma[d] -= balance.ewma[d] >> TAGLINE_EWMA_DECAY;
     }
   }
+  balance.histogram[latency_bucket(us)]++;
+  balance.recent[balance.numRecent++ % TAGLINE_LAT_RECENT] = us;
 
-	// Return successfully
-	logMessage(LOG_INFO_LEVEL, "TAGLINE: initialized storage (maxline=%u)", maxlines);
-	return(0);
+  if ((balance.hedgePercentile > 0) && (balance.numRecent % (TAGLINE_LAT_RECENT / 4) == 0)) {
+    n = (balance.numRecent < TAGLINE_LAT_RECENT) ? balance.numRecent : TAGLINE_LAT_RECENT;
+    memcpy(sorted, balance.recent, n * sizeof(uint32_t));
+    qsort(sorted, n, sizeof(uint32_t), compare_latencies);
+    balance.hedgeThreshold = sorted[(n - 1) * balance.hedgePercentile / 100];
+  }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : tagline_read
-// Description  : Read a number of blocks from the tagline driver
+// Function     : thread_exit
+// Description  : A thread that called the driver has exited, its context is
+//                left for the next new thread (its statistics are kept)
 //
-// Inputs       : tag - the number of the tagline to read from
-//                bnum - the starting block to read from
-//                blks - the number of blocks to read
-//                bug - memory block to read the blocks into
-// Outputs      : 0 if successful, -1 if failure
+// Inputs       : arg - the thread's context
+// Outputs      : none
 
-int tagline_read(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf) {
+static void thread_exit(void *arg) {
+  struct tagline_thread *t = arg;
 
-  RAIDOpCode readResp;
-  int i;
-  int primaryDisk, primaryDiskBlock;
-  char *cacheBuffer;
+  pthread_mutex_lock(&threadsLock);
+  t->active = 0;
+  pthread_mutex_unlock(&threadsLock);
+}
 
-  //For each number of blks, i, access the tagline by 'tab' and taglineblock by 'bnum+i' to fetch primary disk and primary disk block to read from
-  for (i=0;i<blks;i++) {
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : threads_init
+// Description  : Set up the locks and the key of the thread contexts, once
+//
+// Inputs       : none
+// Outputs      : none
+
+static void threads_init(void) {
+  int i;
 
-    primaryDisk = taglines[tag].taglineBlocks[bnum + i][0];             //Fetch primary disk
-    primaryDiskBlock = taglines[tag].taglineBlocks[bnum + i][1];        //Fetch primary disk block
+  pthread_key_create(&threadKey, thread_exit);
+  for (i = 0; i < TAGLINE_LINE_LOCKS; i++) {
+    pthread_mutex_init(&lineLocks[i], NULL);
+  }
+  for (i = 0; i < RAID_DISKS; i++) {
+    pthread_mutex_init(&diskLocks[i], NULL);
+  }
+}
 
-    logMessage(LOG_INFO_LEVEL, "Trying to read Disk : %d  Block: %d", primaryDisk, primaryDiskBlock);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : thread_enter
+// Description  : Find the calling thread's context, taking over the one of
+//                an exited thread or making a new one the first time
+//
+// Inputs       : none
+// Outputs      : the context, NULL if failure
 
-    //Call the raid bus to read the buffer into 'buf' in 1024 chunks
-     
-    cacheBuffer = get_raid_cache((RAIDDiskID)primaryDisk, (RAIDBlockID)primaryDiskBlock);
-    stats.gets++;
+static struct tagline_thread *thread_enter(void) {
+  struct tagline_thread *t;
 
-    if (cacheBuffer != NULL) {
-      memcpy(&buf[i*RAID_BLOCK_SIZE], cacheBuffer, RAID_BLOCK_SIZE);
-      logMessage(LOG_INFO_LEVEL, "Cache hit");
-      stats.hits++;
-    } else {
-      logMessage(LOG_INFO_LEVEL, "Cache miss!");
-      stats.misses++;
-      readResp = client_raid_bus_request(create_raid_request(RAID_READ, 1, primaryDisk, 0, 0, primaryDiskBlock), &buf[i*RAID_BLOCK_SIZE]);
-      if (status_check_helper(readResp, "READ")){
-        return -1;
-      }
-      put_raid_cache((RAIDDiskID)primaryDisk, (RAIDBlockID)primaryDiskBlock, &buf[i*RAID_BLOCK_SIZE]);
-      stats.inserts++;
-    }
+  if (self != NULL) {
+    return self;
   }
-
-	// Return successfully
-	logMessage(LOG_INFO_LEVEL, "TAGLINE : read %u blocks from tagline %u, starting block %u.",
-			blks, tag, bnum);
-	return(0);
+  pthread_once(&threadOnce, threads_init);
+  pthread_mutex_lock(&threadsLock);
+  for (t = threads; (t != NULL) && t->active; t = t->next);
+  if ((t == NULL) && ((t = calloc(1, sizeof(struct tagline_thread))) != NULL)) {
+    t->next = threads;
+    threads = t;
+  }
+  if (t != NULL) {
+    t->active = 1;
+    t->busPendingHead = t->busNumPending = 0;
+    t->asyncQueue.outstanding = 0;
+    t->asyncQueue.head = t->asyncQueue.tail = t->asyncQueue.doneHead = t->asyncQueue.doneTail = NULL;
+  }
+  pthread_mutex_unlock(&threadsLock);
+  if (t == NULL) {
+    logMessage(LOG_ERROR_LEVEL, "TAGLINE : no memory for the context of a new thread");
+    return NULL;
+  }
+  pthread_setspecific(threadKey, t);
+  self = t;
+  return t;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : raid_disk_signal
-// Description  : Upon signaling disk failure, checks whether each disk failed or not, then formats the disk and recovers the number of blocks written to the failed disk of the failed disk
+// Function     : driver_enter
+// Description  : Take the driver for an operation, shared with the other
+//                threads' operations or to itself
 //
-// Inputs       : void
+// Inputs       : exclusive - 1 to wait for every other operation to finish
 // Outputs      : 0 if successful, -1 if failure
 
+static int driver_enter(int exclusive) {
+  if (thread_enter() == NULL) {
+    return -1;
+  }
+  if (exclusive) {
+    pthread_rwlock_wrlock(&quiesceLock);
+  } else {
+    pthread_rwlock_rdlock(&quiesceLock);
+  }
+  pthread_mutex_lock(&driverLock);
+  self->serial = 1;
+  self->quiet = exclusive;
+  return 0;
+}
 
-int raid_disk_signal(){
-  //Declarations -> 
-  // 'i' iterates over each disks to check if it failed or not
-  // 'j' iterates over the number of blocks that was written to the failed disk (RAID_DISKBLOCKS - disks[i].currentSize)
-  // 'x' iterates over the maxlines of taglines
-  // 'y' iterates over the taglineblocks of each taglines
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : driver_leave
+// Description  : Let the driver go after driver_enter
+//
+// Inputs       : ret - the result of the operation
+// Outputs      : ret
 
-  int i,j, x, y, primaryDisk, primaryDiskBlock, backUpDisk, backUpDiskBlock, failedDiskCurrentSize, found;
-  failedDiskCurrentSize = 0;
-  int disk_fail_status;
-  char buf[RAID_BLOCK_SIZE];
-  RAIDOpCode statusResp, formatResp, readResp, writeResp;
+static int driver_leave(int ret) {
+  self->serial = self->quiet = 0;
+  pthread_mutex_unlock(&driverLock);
+  pthread_rwlock_unlock(&quiesceLock);
+  return ret;
+}
 
-  //Check each disk if it failed or not
-  for (i = 0; i < RAID_DISKS; i++) {
-    statusResp = client_raid_bus_request(create_raid_request(RAID_STATUS, 0, i, 0, 0, 0), NULL);
-    disk_fail_status = extract_raid_response(statusResp, "DISK_FAIL_CHECK");
-    // if disk fails, format the disk 
-    if (disk_fail_status == RAID_DISK_FAILED) {
-      formatResp = client_raid_bus_request(create_raid_request(RAID_FORMAT, RAID_DISKBLOCKS/RAID_TRACK_BLOCKS, i, 0, 0, 0), buf);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : disks_lock
+// Description  : Take the locks over the free blocks of a set of disks, in
+//                disk order so two threads never wait on each other
+//
+// Inputs       : set - a bit per disk
+// Outputs      : none
 
-      //if it is successful, go through each block of the disk that was written to and brute force search against the tagline data mapping
-      if (status_check_helper(formatResp, "Format disk")){
-        return 1;
-      } else {
+static void disks_lock(uint32_t set) {
+  int i;
 
-        //Go through each block of the failed disk that was written to, to search in the tagline data structure and recover
-        for (j= 0; j < (RAID_DISKBLOCKS - disks[i].currentSize);j++){
-
-          //For Each block in the failed disk. Check if it exists while iterating through the tagline mapping
-          for (x = 0; x < gmaxLines; x++) {
-            //Outer loop to iterate through maxlines of taglines
-            for (y = 0; y < MAX_TAGLINE_BLOCK_NUMBER;y++) {
-              //Inner loop to iterate through MAX_TAGLINE_BLOCKS of each tagline
-              //
-              //Get backup block
-              primaryDisk = taglines[x].taglineBlocks[y][0];
-              primaryDiskBlock = taglines[x].taglineBlocks[y][1];
-              backUpDisk = taglines[x].taglineBlocks[y][2];
-              backUpDiskBlock = taglines[x].taglineBlocks[y][3];
-
-              //Checck if primaryDisk and the corresponding block fethed from the tagline datastructure is equal to the disk and block to recover..same for backup because I'm storing backups on every disk, so I have to recover back ups as well
-              if (((primaryDisk > -1) && (primaryDisk == i) && (primaryDiskBlock == j)) || ((backUpDisk > -1) && (backUpDisk == i) && (backUpDiskBlock == j))){
-
-
-                logMessage(LOG_INFO_LEVEL, "Found!");
-                found = 1;
-
-                //if primary disk and block was found, then read from the corresponding backup disk and backup block else just read from corresponding primary disk and block
-                if ((primaryDisk == i) && (primaryDiskBlock == j)) {
-                  readResp = client_raid_bus_request(create_raid_request(RAID_READ, 1, backUpDisk, 0, 0, backUpDiskBlock), buf);
-                } else {
-                  readResp = client_raid_bus_request(create_raid_request(RAID_READ, 1, primaryDisk, 0, 0, primaryDiskBlock), buf);
-                }
-
-                // if read into the buffer was succesfull, write the buffer to the failed disk and block to recover
-                if (status_check_helper(readResp, "READ Disk FOR WRITE ON FAILED DISK")){
-                  return 1;
-                } else {
-
-                  logMessage(LOG_INFO_LEVEL, "Recovering diskblock...");
-                  writeResp = client_raid_bus_request(create_raid_request(RAID_WRITE, 1, i, 0, 0, j), buf);
-                  if (status_check_helper(writeResp, "WRITE TO FAILED DISK")){
-                  } else {
-                    logMessage(LOG_INFO_LEVEL, "Recovered DiskBlock!");
-                    failedDiskCurrentSize++;
-                  }
-                }
-              } else {
-                //Not found in tagline
-                //logMessage(LOG_INFO_LEVEL, "Fresh write to block in Primary Disk");
-              }
-            }
-          }
-        }
-          //If not found, then something went wrong in the mapping in the first place!
-          if (found == 0){
-            logMessage(LOG_INFO_LEVEL, "Not found in mapping!");
-            return 1;
-          }
-      }
+  for (i = 0; i < RAID_DISKS; i++) {
+    if ((set >> i) & 1) {
+      pthread_mutex_lock(&diskLocks[i]);
     }
-
   }
-  return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : tagline_write
-// Description  :  Write a number of blocks to raid disks in round-robin fashion
+// Function     : disks_unlock
+// Description  : Let the disks go after disks_lock
 //
-// Inputs       : tag - the number of the tagline to store mapping to
-//                bnum - the starting block  to store mapping to
-//                blks - the number of blocks to write to in the disk
-//                buf - memory block to write the blocks into
-// Outputs      : 0 if successful, -1 if failure
+// Inputs       : set - the bits disks_lock was given
+// Outputs      : none
 
-int tagline_write(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf) {
-  RAIDOpCode writeResOp;
-  int hasSpace;
-
-  //checks if write is successfull, if it is, it also checks if the block has been overwritten by by looking at the struct called 'disks' and logs it if it has. If write fails, it logs that it has failed!
-  int i = 1;
-
-  //for each block, write to disk in round robin fashion
-  for (i=0;i < blks; i++) {
-    //keep looping until a disk has space, if not then return -1
-    while (1) {
-      if (disks[currentDisk].currentSize > 0) {
-        hasSpace = 1;
-        // if the block hasn't been written to, then its a fresh write
-        if (taglines[tag].taglineBlocks[bnum+i][0] == -1) {
-
-          //Write to the 'currentDisk' and the block that is retrieved by RAID_DISKBLOCKS - disks[currentDisk].currentSize)
-          writeResOp = client_raid_bus_request(create_raid_request(RAID_WRITE, 1, currentDisk, 0, 0, RAID_DISKBLOCKS - disks[currentDisk].currentSize), &buf[i*RAID_BLOCK_SIZE]);
-
-
-          logMessage(LOG_INFO_LEVEL, "TAGLINE : wrote %u block(s) to tagline %u, starting block %u. ",
-              i, tag, bnum + i);
-          logMessage(LOG_INFO_LEVEL, "Fresh write to block in Primary Disk");
-          // if success, then map the 'currentDisk' and block to write to in 'currentDisk' to the tagline data structure
-          if (status_check_helper(writeResOp, "Fresh WRITE to Primary Disk")){
-            return -1;
-          } else {
-            taglines[tag].taglineBlocks[bnum + i][0] = currentDisk;
-            taglines[tag].taglineBlocks[bnum + i][1] = RAID_DISKBLOCKS - disks[currentDisk].currentSize;
-            put_raid_cache((RAIDDiskID)currentDisk, (RAIDBlockID)(RAID_DISKBLOCKS - disks[currentDisk].currentSize), &buf[i*RAID_BLOCK_SIZE]);
-            stats.inserts++;
-          }
+static void disks_unlock(uint32_t set) {
+  int i;
 
+  for (i = RAID_DISKS - 1; i >= 0; i--) {
+    if ((set >> i) & 1) {
+      pthread_mutex_unlock(&diskLocks[i]);
+    }
+  }
+}
 
-          // This is the backup write
-          logMessage(LOG_INFO_LEVEL, "Fresh write to block in Backup Disk");
-          writeResOp = client_raid_bus_request(create_raid_request(RAID_WRITE, 1, (currentDisk == (RAID_DISKS - 1)) ? 0 : (currentDisk + 1), 0, 0, RAID_DISKBLOCKS - disks[(currentDisk == (RAID_DISKS - 1)) ? 0 : (currentDisk + 1)].currentSize), &buf[i*RAID_BLOCK_SIZE]);
-          
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : threads_reset
+// Description  : Zero the bus and asynchronous statistics of every thread
+//
+// Inputs       : none
+// Outputs      : none
 
-          if (status_check_helper(writeResOp, "Fresh WRITE to Backup Disk")){
-            return -1;
-          }  else {
-            // This is round robin, so if currentDisk is 16, go to Disk 0 to store backup
-            taglines[tag].taglineBlocks[bnum + i][2] = (currentDisk == (RAID_DISKS - 1)) ? 0 : (currentDisk + 1);
-            taglines[tag].taglineBlocks[bnum + i][3] = RAID_DISKBLOCKS - disks[(currentDisk == (RAID_DISKS - 1)) ? 0 : (currentDisk + 1)].currentSize;
-          }
+static void threads_reset(void) {
+  struct tagline_thread *t;
 
-          //on successfull writes, decrease currentsize of disks that the primary block and backup block was written to so that on the next write, it writes to the next block in 'disks[currentDisk]'
-          disks[currentDisk].currentSize--;
-          disks[(currentDisk == (RAID_DISKS - 1)) ? 0 : (currentDisk + 1)].currentSize--;
+  pthread_mutex_lock(&threadsLock);
+  for (t = threads; t != NULL; t = t->next) {
+    memset(&t->bus, 0, sizeof(t->bus));
+    memset(&t->asyncQueue.batches, 0, sizeof(t->asyncQueue) - offsetof(struct async_queue, batches));
+    t->fetchWindow.peak = 0;
+  }
+  pthread_mutex_unlock(&threadsLock);
+}
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : threads_total
+// Description  : Add up the statistics every thread kept on its own
+//
+// Inputs       : stats - set to the cache statistics
+//                bus - set to the bus statistics
+//                async - set to the asynchronous queue statistics
+//                peak - set to the most reads a fetch had on the bus
+// Outputs      : the number of thread contexts
 
-          // This is round-robin so icrement currentDisk to go to the next disk. If it is 16, go to disk 0. Here is it -1 because currentDisk gets increment in the next line
-          currentDisk = (currentDisk == (RAID_DISKS - 1)) ? -1: currentDisk;
-          currentDisk++;
+static int threads_total(struct cache_statistics *stats, struct bus_statistics *bus, struct async_queue *async, int *peak) {
+  struct tagline_thread *t;
+  int i, n = 0;
 
-          break;
-        } else {
-          //This is implementation for overwite...no incrementing 'currentDisk' here or decrementing currentSize of 'disks[currentDisk]' beacuse this is an overwrite 
-          logMessage(LOG_INFO_LEVEL, "TAGLINE : wrote %u block(s) to tagline %u, starting block %u.\n ",
-              i, tag, bnum + i);
-
-          //fetch the primary disk and disk block from tagline data structure to overwrite
-          writeResOp = client_raid_bus_request(create_raid_request(RAID_WRITE, 1, taglines[tag].taglineBlocks[bnum + i][0], 0, 0, taglines[tag].taglineBlocks[bnum + i][1]), &buf[i*RAID_BLOCK_SIZE]);
-
-          if (status_check_helper(writeResOp, "Overwrite to Primary disk")){
-            return -1;
-          } 
-          put_raid_cache((RAIDDiskID)currentDisk, (RAIDBlockID)(RAID_DISKBLOCKS - disks[currentDisk].currentSize), &buf[i*RAID_BLOCK_SIZE]);
-          stats.inserts++;
-
-          logMessage(LOG_INFO_LEVEL, "Overwrite to block in Backup Disk");
-          //fetch the back up disk and disk block from tagline data structure to overwrite
-          writeResOp = client_raid_bus_request(create_raid_request(RAID_WRITE, 1, taglines[tag].taglineBlocks[bnum + i][2], 0, 0, taglines[tag].taglineBlocks[bnum + i][3]), &buf[i*RAID_BLOCK_SIZE]);
-
-          if (status_check_helper(writeResOp, "Overwrite to Backup disk")){
-            return -1;
-          } 
-          break;
-        }
-      }
+  memset(stats, 0, sizeof(*stats));
+  memset(bus, 0, sizeof(*bus));
+  memset(async, 0, sizeof(*async));
+  *peak = 0;
+  pthread_mutex_lock(&threadsLock);
+  for (t = threads; t != NULL; t = t->next, n++) {
+    stats->inserts += t->stats.inserts;
+    stats->hits += t->stats.hits;
+    stats->gets += t->stats.gets;
+    stats->misses += t->stats.misses;
+    for (i = 0; i < RAID_MAXVAL; i++) {
+      bus->requests[i] += t->bus.requests[i];
+      bus->blocks[i] += t->bus.blocks[i];
+    }
+    bus->waits += t->bus.waits;
+    bus->yields += t->bus.yields;
+    async->batches += t->asyncQueue.batches;
+    async->ops += t->asyncQueue.ops;
+    async->readGroups += t->asyncQueue.readGroups;
+    async->hoisted += t->asyncQueue.hoisted;
+    async->shared += t->asyncQueue.shared;
+    async->vectored += t->asyncQueue.vectored;
+    async->segments += t->asyncQueue.segments;
+    async->vectorRuns += t->asyncQueue.vectorRuns;
+    *peak = (t->fetchWindow.peak > *peak) ? t->fetchWindow.peak : *peak;
+  }
+  pthread_mutex_unlock(&threadsLock);
+  return n;
+}
 
-      if (currentDisk == 0) {
-        hasSpace = 0;
-      }
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_bus_send
+// Description  : Send a request on the bus without waiting, counting it and
+//                the blocks it moves.  Its response is collected (in sending
+//                order) with tagline_bus_recv
+//
+// Inputs       : op - the packed request
+//                buf - the data to send or receive
+// Outputs      : 0 if successful, -1 if failure
 
-      //If while loop looped through all disk and is at the end and hasSpace equal 0, that means there was no space in any disk...so return -1
-      if (currentDisk == (RAID_DISKS - 1) && (hasSpace == 0)){
+int tagline_bus_send(RAIDOpCode op, void *buf) {
+  uint32_t type = (op >> 56) & 0xff, disk = (op >> 40) & 0xff;
+  struct bus_pending *p;
 
-        logMessage(LOG_INFO_LEVEL, "No space on disks!");
-        return -1;
-      }
-      currentDisk = (currentDisk >= (RAID_DISKS - 1)) ? -1 : currentDisk;
-      currentDisk++;
+  if (type < RAID_MAXVAL) {
+    self->bus.requests[type]++;
+    if ((type == RAID_READ) || (type == RAID_WRITE)) {
+      self->bus.blocks[type] += (op >> 48) & 0xff;
     }
   }
-  
-	// Return successfully
-	logMessage(LOG_INFO_LEVEL, "TAGLINE : wrote %u blocks to tagline %u, starting block %u.",
-			blks, tag, bnum + i);
-	return(0);
+  if (client_raid_bus_send(op, buf)) {
+    return -1;
+  }
+
+  p = &self->busPending[(self->busPendingHead + self->busNumPending++) % RAID_MAX_PENDING];
+  p->type = type;
+  p->disk = ((type == RAID_READ) || (type == RAID_WRITE)) ? (int)disk : -1;
+  clock_gettime(CLOCK_MONOTONIC, &p->sent);
+  if (p->disk >= 0) {
+    pthread_mutex_lock(&balanceLock);
+    balance.outstanding[p->disk]++;
+    pthread_mutex_unlock(&balanceLock);
+  }
+  return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : tagline_close
-// Description  : Close the tagline interface
+// Function     : tagline_bus_recv
+// Description  : Receive the response to the oldest request the thread sent,
+//                timing it.  Inside tagline_bus_wait, an operation holding
+//                the driver lock lets it go while it is on the bus if it is
+//                the thread's last request out (so it holds nothing up
+//                waiting to get the lock back), nothing is staged for
+//                write-back and no disk is being rebuilt
 //
 // Inputs       : none
-// Outputs      : 0 if successful, -1 if failure
+// Outputs      : the packed response, -1 if failure
 
-int tagline_close(void) {
-  RAIDOpCode closeResp;
-  int i,j;
+RAIDOpCode tagline_bus_recv(void) {
+  struct bus_pending *p = &self->busPending[self->busPendingHead];
+  struct timespec now;
+  RAIDOpCode resp;
+  int64_t ns;
+  int yield = self->yield && self->serial && (self->busNumPending == 1) && (writeBack.numStaged == 0) && (rebuild.active == 0);
 
-  //Free the inner most malloc'ed items. Starting with the 4 integers (primDisk & block, backUpDisk & block
-  for (i = 0; i < gmaxLines; i++) {
-    for (j = 0; j < MAX_TAGLINE_BLOCK_NUMBER;j++){
-      free(taglines[i].taglineBlocks[j]);
-      taglines[i].taglineBlocks[j] = NULL;
-    }
-    free(taglines[i].taglineBlocks);
-    taglines[i].taglineBlocks = NULL;
+  //a wait is counted as a yield whenever the other threads can run during it
+  if (self->yield) {
+    self->bus.waits++;
+    self->bus.yields += yield || !self->serial;
   }
-  free(taglines);
-  taglines = NULL;
+  if (yield) {
+    pthread_mutex_unlock(&driverLock);
+  }
+  resp = client_raid_bus_recv();
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (yield) {
+    pthread_mutex_lock(&driverLock);
+  }
+  if (self->busNumPending == 0) {
+    return resp;
+  }
+  self->busPendingHead = (self->busPendingHead + 1) % RAID_MAX_PENDING;
+  self->busNumPending--;
 
-  closeResp = client_raid_bus_request(create_raid_request(RAID_CLOSE, 0, 0, 0, 0, 0),NULL);
+  if (p->disk >= 0) {
+    pthread_mutex_lock(&balanceLock);
+    balance.outstanding[p->disk]--;
+    if (p->type == RAID_READ) {
+      ns = (now.tv_sec - p->sent.tv_sec) * 1000000000LL + (now.tv_nsec - p->sent.tv_nsec);
+      readbalance_record(p->disk, (ns > UINT32_MAX) ? UINT32_MAX : (uint32_t)ns);
+    }
+    pthread_mutex_unlock(&balanceLock);
+  }
+  return resp;
+}
 
-  logMessage(LOG_OUTPUT_LEVEL, "** Cache statistics **");
-  logMessage(LOG_OUTPUT_LEVEL, "Total cache inserts %ld", stats.inserts);
-  logMessage(LOG_OUTPUT_LEVEL, "Total cache gets %ld", stats.gets);
-  logMessage(LOG_OUTPUT_LEVEL, "Total cache hits %ld", stats.hits);
-  logMessage(LOG_OUTPUT_LEVEL, "Total cache misses %ld", stats.misses);
-  logMessage(LOG_OUTPUT_LEVEL, "Cache efficiency %ld", (float)(stats.hits/stats.gets));
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_bus_request
+// Description  : Send a request on the bus and wait for its response
+//
+// Inputs       : op - the packed request
+//                buf - the data to send or receive
+// Outputs      : the packed response
 
-  if (status_check_helper(closeResp, "CLOSE")){
+RAIDOpCode tagline_bus_request(RAIDOpCode op, void *buf) {
+  if (tagline_bus_send(op, buf)) {
     return -1;
   }
-  close_raid_cache();
+  return tagline_bus_recv();
+}
 
-  close_connection();
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_bus_wait
+// Description  : Receive the response to the oldest request the thread sent,
+//                letting the other threads have the driver meanwhile when
+//                tagline_bus_recv can.  Only for a caller that relies on
+//                nothing but its own taglines' blocks across the wait
+//
+// Inputs       : none
+// Outputs      : the packed response, -1 if failure
 
-	// Return successfully
-	logMessage(LOG_INFO_LEVEL, "TAGLINE storage device: closing completed.");
-	return(0);
+RAIDOpCode tagline_bus_wait(void) {
+  RAIDOpCode resp;
+
+  self->yield = 1;
+  resp = tagline_bus_recv();
+  self->yield = 0;
+  return resp;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mapping_init
+// Description  : Reserve the mapping table for maxlines taglines, the pages
+//                are only committed as taglines are written
+//
+// Inputs       : maxlines - the maximum number of tag lines in the system
+// Outputs      : 0 if successful, -1 if failure
+
+int mapping_init(uint32_t maxlines) {
+  memset(&mapping, 0, sizeof(mapping));
+  mapping.bytes = (size_t)maxlines * MAX_TAGLINE_BLOCK_NUMBER * sizeof(struct tagline_entry);
+  mapping.live = calloc((maxlines + 63) / 64, sizeof(uint64_t));
+  if (mapping.bytes > 0) {
+    mapping.entries = mmap(NULL, mapping.bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  }
+  if ((mapping.live == NULL) || (mapping.entries == MAP_FAILED)) {
+    logMessage(LOG_ERROR_LEVEL, "TAGLINE : unable to reserve the mapping of %u taglines", maxlines);
+    free(mapping.live);
+    memset(&mapping, 0, sizeof(mapping));
+    return(-1);
+  }
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mapping_free
+// Description  : Release the mapping table
+//
+// Inputs       : none
+// Outputs      : none
+
+void mapping_free(void) {
+  if ((mapping.entries != NULL) && (mapping.entries != MAP_FAILED)) {
+    munmap(mapping.entries, mapping.bytes);
+  }
+  free(mapping.live);
+  memset(&mapping, 0, sizeof(mapping));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_live
+// Description  : Check if a tagline has been written (its entries are set up)
+//
+// Inputs       : tag - the tagline
+// Outputs      : 1 if written, 0 if not
+
+static inline int tagline_live(TagLineNumber tag) {
+  return (__atomic_load_n(&mapping.live[tag / 64], __ATOMIC_ACQUIRE) >> (tag % 64)) & 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_lookup
+// Description  : Find where a tagline block is, without touching the table
+//                for a tagline that was never written
+//
+// Inputs       : tag - the tagline
+//                bnum - the block in the tagline
+// Outputs      : the entry (primaryDisk is TAGLINE_UNMAPPED if never written)
+
+static inline const struct tagline_entry *tagline_lookup(TagLineNumber tag, TagLineBlockNumber bnum) {
+  if (!tagline_live(tag)) {
+    return &unmappedEntry;
+  }
+  return &mapping.entries[(size_t)tag * MAX_TAGLINE_BLOCK_NUMBER + bnum];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_entry
+// Description  : Find the entry of a tagline block to update it, setting up
+//                the tagline's entries the first time it is written.  Other
+//                taglines share its word of the live bitmap, so its bit is
+//                set atomically
+//
+// Inputs       : tag - the tagline
+//                bnum - the block in the tagline
+// Outputs      : the entry
+
+static struct tagline_entry *tagline_entry(TagLineNumber tag, TagLineBlockNumber bnum) {
+  struct tagline_entry *line = &mapping.entries[(size_t)tag * MAX_TAGLINE_BLOCK_NUMBER];
+
+  if (!tagline_live(tag)) {
+    memset(line, TAGLINE_UNMAPPED, MAX_TAGLINE_BLOCK_NUMBER * sizeof(struct tagline_entry));
+    __atomic_fetch_or(&mapping.live[tag / 64], 1ULL << (tag % 64), __ATOMIC_RELEASE);
+    __atomic_fetch_add(&mapping.liveLines, 1, __ATOMIC_RELAXED);
+  }
+  return &line[bnum];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : live_set
+// Description  : Mark whether a disk block holds a replica, atomically as
+//                the blocks sharing its word may be other taglines'
+//
+// Inputs       : dsk, blk - the disk block
+//                live - 1 if it now holds a replica, 0 if it is free again
+// Outputs      : none
+
+static inline void live_set(int dsk, int blk, int live) {
+  if (live) {
+    __atomic_fetch_or(&liveBlocks[dsk][blk / 64], 1ULL << (blk % 64), __ATOMIC_RELAXED);
+  } else {
+    __atomic_fetch_and(&liveBlocks[dsk][blk / 64], ~(1ULL << (blk % 64)), __ATOMIC_RELAXED);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : live_next
+// Description  : Find the next block of a disk that holds a replica, a word
+//                of the bitmap at a time
+//
+// Inputs       : dsk - the disk
+//                from - the first block to look at
+//                end - the block to stop at
+// Outputs      : the block, end if there is none
+
+static int live_next(int dsk, int from, int end) {
+  uint64_t word;
+  int w;
+
+  if (from >= end) {
+    return(end);
+  }
+  w = from / 64;
+  word = liveBlocks[dsk][w] & (~0ULL << (from % 64));
+  while (word == 0) {
+    if (++w * 64 >= end) {
+      return(end);
+    }
+    word = liveBlocks[dsk][w];
+  }
+  from = w * 64 + __builtin_ctzll(word);
+  return (from < end) ? from : end;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : live_end
+// Description  : Find the end of the written part of a disk
+//
+// Inputs       : dsk - the disk
+// Outputs      : one past the last block holding a replica, 0 if none does
+
+static int live_end(int dsk) {
+  int w;
+
+  for (w = RAID_DISKBLOCKS / 64 - 1; w >= 0; w--) {
+    if (liveBlocks[dsk][w] != 0) {
+      return w * 64 + 64 - __builtin_clzll(liveBlocks[dsk][w]);
+    }
+  }
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : live_count
+// Description  : Count the blocks of a disk that hold a replica
+//
+// Inputs       : dsk - the disk
+// Outputs      : the number of blocks
+
+static int live_count(int dsk) {
+  int w, n = 0;
+
+  for (w = 0; w < RAID_DISKBLOCKS / 64; w++) {
+    n += __builtin_popcountll(liveBlocks[dsk][w]);
+  }
+  return(n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replica_other
+// Description  : Find the other replica of a disk block through the reverse map
+//
+// Inputs       : dsk, blk - the disk block
+//                otherDisk, otherBlock - set to the other replica
+// Outputs      : 0 if successful, -1 if the block holds nothing (or has no other replica)
+
+int replica_other(int dsk, int blk, int *otherDisk, int *otherBlock) {
+  const struct block_owner *o = &owner[dsk][blk];
+  const struct tagline_entry *e;
+
+  if (o->role == TAGLINE_UNMAPPED) {
+    return(-1);
+  }
+  e = tagline_lookup(o->tag, o->bnum);
+  if (o->role == TAGLINE_PRIMARY) {
+    if (e->backUpDisk == TAGLINE_UNMAPPED) {
+      return(-1);
+    }
+    *otherDisk = e->backUpDisk;
+    *otherBlock = e->backUpBlock;
+  } else {
+    *otherDisk = e->primaryDisk;
+    *otherBlock = e->primaryBlock;
+  }
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replica_stale
+// Description  : Check if a disk block is waiting to be rebuilt
+//
+// Inputs       : dsk, blk - the disk block
+// Outputs      : 1 if it does not hold its data yet, 0 if it does
+
+static inline int replica_stale(int dsk, int blk) {
+  return (rebuild.cursor[dsk] >= 0) && (blk >= rebuild.cursor[dsk]) && (blk < rebuild.end[dsk]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_journal
+// Description  : Select the file mapping updates are journaled to, the
+//                mapping is replayed from it at the next init
+//
+// Inputs       : path - the journal file (NULL to turn journaling off)
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_journal(const char *path) {
+  free(journalPath);
+  journalPath = NULL;
+  if ((path != NULL) && ((journalPath = strdup(path)) == NULL)) {
+    return(-1);
+  }
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_record
+// Description  : Queue the current location of a tagline block for the next
+//                group commit.  The caller holds the tagline's line lock, so
+//                the records of a block are queued in the order it moved
+//
+// Inputs       : tag, bnum - the tagline block
+// Outputs      : 0 if successful, -1 if failure
+
+int journal_record(TagLineNumber tag, TagLineBlockNumber bnum) {
+  const struct tagline_entry *e;
+  JournalRecord rec;
+  int ret;
+
+  if (journal.path == NULL) {
+    return(0);
+  }
+  e = tagline_lookup(tag, bnum);
+  rec.tag = tag;
+  rec.bnum = bnum;
+  rec.primaryDisk = e->primaryDisk;
+  rec.backUpDisk = e->backUpDisk;
+  rec.unused = 0;
+  rec.primaryBlock = e->primaryBlock;
+  rec.backUpBlock = e->backUpBlock;
+  pthread_mutex_lock(&journalLock);
+  ret = journal_append(&journal, &rec);
+  pthread_mutex_unlock(&journalLock);
+  return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_apply
+// Description  : Put a replayed record into the mapping
+//
+// Inputs       : rec - the record
+// Outputs      : none
+
+static void journal_apply(const JournalRecord *rec) {
+  struct tagline_entry *entry;
+
+  if ((rec->tag >= gmaxLines) || (rec->bnum >= MAX_TAGLINE_BLOCK_NUMBER) ||
+      ((rec->primaryDisk != TAGLINE_UNMAPPED) && ((rec->primaryDisk >= RAID_DISKS) || (rec->primaryBlock >= RAID_DISKBLOCKS))) ||
+      ((rec->backUpDisk != TAGLINE_UNMAPPED) && ((rec->backUpDisk >= RAID_DISKS) || (rec->backUpBlock >= RAID_DISKBLOCKS)))) {
+    return;
+  }
+  entry = tagline_entry(rec->tag, rec->bnum);
+  entry->primaryDisk = rec->primaryDisk;
+  entry->primaryBlock = rec->primaryBlock;
+  entry->backUpDisk = rec->backUpDisk;
+  entry->backUpBlock = rec->backUpBlock;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_cursors
+// Description  : Gather the allocation cursors for a commit or a checkpoint,
+//                the free blocks of every disk as they stand together
+//
+// Inputs       : c - set to the cursors
+// Outputs      : none
+
+static void journal_cursors(JournalCursors *c) {
+  int i;
+
+  disks_lock((1U << RAID_DISKS) - 1);
+  c->currentDisk = __atomic_load_n(&currentDisk, __ATOMIC_RELAXED);
+  for (i = 0; i < RAID_DISKS; i++) {
+    c->currentSize[i] = disks[i].currentSize;
+  }
+  disks_unlock((1U << RAID_DISKS) - 1);
+  c->layout = stripe.layout;
+  c->openStripe = stripe.open;
+  c->filled = stripe.filled;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_restore
+// Description  : Set up the reverse map, the live bitmap and the allocation
+//                cursors from a replayed mapping
+//
+// Inputs       : c - the replayed cursors
+// Outputs      : none
+
+static void journal_restore(const JournalCursors *c) {
+  const struct tagline_entry *e;
+  int x, y, i;
+
+  currentDisk = c->currentDisk % RAID_DISKS;
+  for (i = 0; i < RAID_DISKS; i++) {
+    disks[i].currentSize = c->currentSize[i];
+  }
+  stripe.open = (c->openStripe > TAGLINE_STRIPES) ? TAGLINE_STRIPES : c->openStripe;
+  stripe.filled = (c->filled < (uint32_t)(stripe.dataDisks * TAGLINE_STRIPE_CHUNK)) ? c->filled : 0;
+  for (x = 0; x < gmaxLines; x++) {
+    for (y = 0; tagline_live(x) && (y < MAX_TAGLINE_BLOCK_NUMBER); y++) {
+      e = tagline_lookup(x, y);
+      if (e->primaryDisk == TAGLINE_UNMAPPED) {
+        continue;
+      }
+      owner[e->primaryDisk][e->primaryBlock] = (struct block_owner){ x, y, TAGLINE_PRIMARY, 0 };
+      live_set(e->primaryDisk, e->primaryBlock, 1);
+      if (e->backUpDisk != TAGLINE_UNMAPPED) {
+        owner[e->backUpDisk][e->backUpBlock] = (struct block_owner){ x, y, TAGLINE_BACKUP, 0 };
+        live_set(e->backUpDisk, e->backUpBlock, 1);
+      }
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_checkpoint
+// Description  : Write the whole mapping to the checkpoint, emptying the journal
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int journal_checkpoint(void) {
+  const struct tagline_entry *e;
+  JournalCursors c;
+  JournalRecord rec;
+  int x, y;
+
+  if (journal_checkpoint_begin(&journal)) {
+    return(-1);
+  }
+  rec.unused = 0;
+  for (x = 0; x < gmaxLines; x++) {
+    for (y = 0; tagline_live(x) && (y < MAX_TAGLINE_BLOCK_NUMBER); y++) {
+      e = tagline_lookup(x, y);
+      if (e->primaryDisk == TAGLINE_UNMAPPED) {
+        continue;
+      }
+      rec.tag = x;
+      rec.bnum = y;
+      rec.primaryDisk = e->primaryDisk;
+      rec.backUpDisk = e->backUpDisk;
+      rec.primaryBlock = e->primaryBlock;
+      rec.backUpBlock = e->backUpBlock;
+      if (journal_checkpoint_add(&journal, &rec)) {
+        logMessage(LOG_ERROR_LEVEL, "TAGLINE : unable to add tagline %d block %d to the journal checkpoint", x, y);
+        journal_checkpoint_abort(&journal);
+        return(-1);
+      }
+    }
+  }
+  journal_cursors(&c);
+  return journal_checkpoint_end(&journal, &c, gmaxLines);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_group_commit
+// Description  : Commit the queued mapping updates, as a checkpoint once the
+//                journal has grown long enough (or a failed commit could not
+//                be cut off its end).  A checkpoint reads the whole mapping,
+//                so unless the thread has the driver to itself it is left to
+//                driver_upkeep, the records staying queued for it.  Called
+//                with the journal lock held
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int journal_group_commit(void) {
+  JournalCursors c;
+
+  if ((journal.path == NULL) || (journal.numGroup == 0)) {
+    return(0);
+  }
+  if (journal.torn || (journal.sinceCheckpoint + journal.numGroup >= TAGLINE_JOURNAL_CHECKPOINT)) {
+    if (!self->quiet) {
+      __atomic_store_n(&checkpointDue, 1, __ATOMIC_RELAXED);
+      return(0);
+    }
+    gettimeofday(&journalLastCommit, NULL);
+    return journal_checkpoint();
+  }
+  gettimeofday(&journalLastCommit, NULL);
+  journal_cursors(&c);
+  return journal_commit(&journal, &c);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_sync
+// Description  : Commit the queued mapping updates now.  In write-back mode
+//                this is only called once the dirty blocks are on the disks,
+//                so a committed mapping never points at blocks not written yet
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int journal_sync(void) {
+  int ret;
+
+  pthread_mutex_lock(&journalLock);
+  ret = journal_group_commit();
+  pthread_mutex_unlock(&journalLock);
+  return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_forget
+// Description  : Throw a replayed mapping away (the disks lost the data it
+//                points at), starting the journal over with it empty
+//
+// Inputs       : maxlines - the taglines the driver was started with
+// Outputs      : 0 if successful, -1 if failure
+
+static int journal_forget(uint32_t maxlines) {
+  int i;
+
+  mapping_free();
+  if (mapping_init(maxlines)) {
+    return(-1);
+  }
+  memset(owner, TAGLINE_UNMAPPED, sizeof(owner));
+  memset(liveBlocks, 0, sizeof(liveBlocks));
+  currentDisk = 0;
+  for (i = 0; i < RAID_DISKS; i++) {
+    disks[i].currentSize = RAID_DISKBLOCKS;
+  }
+  stripe.open = stripe.filled = 0;
+  memset(stripeData, 0, sizeof(stripeData));
+  return journal_checkpoint();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_replay
+// Description  : Open the journal, replaying the checkpoint and the journal
+//                tail into the mapping
+//
+// Inputs       : none
+// Outputs      : the number of records replayed, -1 if failure
+
+static int journal_replay(void) {
+  struct timeval start, end;
+  JournalCursors c;
+  int replayed;
+
+  gettimeofday(&start, NULL);
+  journal_cursors(&c);
+  replayed = journal_open(&journal, journalPath, gmaxLines, journal_apply, &c);
+  if (replayed < 0) {
+    return(-1);
+  }
+
+  //a mapping written with another layout points at blocks that mean something else now
+  if ((replayed > 0) && (c.layout != stripe.layout)) {
+    logMessage(LOG_ERROR_LEVEL, "TAGLINE : journal %s was written with the %s layout, not starting over its %d mappings",
+        journalPath, (c.layout < TAGLINE_LAYOUT_MAX) ? TAGLINE_LAYOUT_LABELS[c.layout] : "unknown", replayed);
+    journal_close(&journal);
+    return(-1);
+  }
+  if (replayed > 0) {
+    journal_restore(&c);
+  }
+  gettimeofday(&end, NULL);
+  journalLastCommit = end;
+
+  logMessage(LOG_OUTPUT_LEVEL, "Journal replay of %d records in %.2f ms (%u taglines)", replayed,
+      ((end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec)) / 1000.0, mapping.liveLines);
+  return(replayed);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_tick
+// Description  : Group commit, called after each write: the queued updates
+//                go out once there are enough of them or the oldest has
+//                waited TAGLINE_JOURNAL_MS
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int journal_tick(void) {
+  struct timeval now;
+  long int ms;
+  int ret = 0;
+
+  if ((journal.path == NULL) || writeBack.enabled) {
+    return(0);
+  }
+  pthread_mutex_lock(&journalLock);
+  gettimeofday(&now, NULL);
+  ms = (now.tv_sec - journalLastCommit.tv_sec) * 1000L + (now.tv_usec - journalLastCommit.tv_usec) / 1000;
+  if ((journal.numGroup >= TAGLINE_JOURNAL_GROUP) || ((journal.numGroup > 0) && (ms >= TAGLINE_JOURNAL_MS))) {
+    ret = journal_group_commit();
+  }
+  pthread_mutex_unlock(&journalLock);
+  return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_layout
+// Description  : Choose how blocks are kept redundant from the next init on
+//
+// Inputs       : layout - mirroring, or a striped parity layout
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_layout(TaglineLayout layout) {
+  if (layout >= TAGLINE_LAYOUT_MAX) {
+    return(-1);
+  }
+  stripe.layout = layout;
+  stripe.parityDisks = (layout == TAGLINE_LAYOUT_RAID6) ? 2 : (layout == TAGLINE_LAYOUT_RAID5);
+  stripe.dataDisks = RAID_DISKS - stripe.parityDisks;
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_disk
+// Description  : Find the disk a member of a stripe is on
+//
+// Inputs       : s - the stripe
+//                k - the member, data first, then P and Q
+// Outputs      : the disk
+
+static inline int stripe_disk(uint32_t s, int k) {
+  if (k >= stripe.dataDisks) {
+    return (s + k - stripe.dataDisks) % RAID_DISKS;
+  }
+  return (s + stripe.parityDisks + k) % RAID_DISKS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_member
+// Description  : Find which member of its stripe a disk block is
+//
+// Inputs       : dsk, blk - the disk block
+// Outputs      : the member, data first, then P and Q
+
+static inline int stripe_member(int dsk, int blk) {
+  int off = (dsk - (blk / TAGLINE_STRIPE_CHUNK) % RAID_DISKS + RAID_DISKS) % RAID_DISKS;
+
+  return (off < stripe.parityDisks) ? stripe.dataDisks + off : off - stripe.parityDisks;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_end
+// Description  : Find the end of the stripes written so far
+//
+// Inputs       : none
+// Outputs      : the first row of every disk after them
+
+static int stripe_end(void) {
+  uint32_t used = stripe.open + (stripe.filled > 0);
+
+  return (used < TAGLINE_STRIPES) ? (int)used * TAGLINE_STRIPE_CHUNK : RAID_DISKBLOCKS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_span
+// Description  : Cut a row range of a stripe short where a member's rebuild
+//                cursor (or end) falls inside it, so every member is either
+//                stale or good over the whole range
+//
+// Inputs       : s - the stripe
+//                lo - the first row within the stripe
+//                len - the number of rows
+// Outputs      : the rows of the range to handle together
+
+static int stripe_span(uint32_t s, int lo, int len) {
+  int i, first = s * TAGLINE_STRIPE_CHUNK + lo;
+
+  for (i = 0; i < RAID_DISKS; i++) {
+    if (rebuild.cursor[i] < 0) {
+      continue;
+    }
+    if ((rebuild.cursor[i] > first) && (rebuild.cursor[i] < first + len)) {
+      len = rebuild.cursor[i] - first;
+    }
+    if ((rebuild.end[i] > first) && (rebuild.end[i] < first + len)) {
+      len = rebuild.end[i] - first;
+    }
+  }
+  return(len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_stale
+// Description  : Find the members of a stripe row still waiting to be rebuilt
+//
+// Inputs       : s - the stripe
+//                row - the row within the stripe
+// Outputs      : a bit per stale member
+
+static int stripe_stale(uint32_t s, int row) {
+  int k, mask = 0;
+
+  for (k = 0; k < RAID_DISKS; k++) {
+    if (replica_stale(stripe_disk(s, k), s * TAGLINE_STRIPE_CHUNK + row)) {
+      mask |= 1 << k;
+    }
+  }
+  return(mask);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_io_spans
+// Description  : Read or write a row range of each of some members of a
+//                stripe, all of the requests in flight together
+//
+// Inputs       : type - RAID_READ or RAID_WRITE
+//                s - the stripe
+//                lo - the first row within the stripe, per member
+//                len - the number of rows, per member
+//                mask - a bit per member to transfer
+//                bufs - a chunk per member, the rows at their offset in it
+// Outputs      : the number of requests, -1 if failure
+
+static int stripe_io_spans(int type, uint32_t s, const int *lo, const int *len, int mask, char (*bufs)[TAGLINE_STRIPE_CHUNK*RAID_BLOCK_SIZE]) {
+  int k, sent = 0, failed = 0;
+
+  for (k = 0; k < RAID_DISKS; k++) {
+    if (mask & (1 << k)) {
+      if (tagline_bus_send(create_raid_request(type, len[k], stripe_disk(s, k), 0, 0, s * TAGLINE_STRIPE_CHUNK + lo[k]), &bufs[k][lo[k] * RAID_BLOCK_SIZE])) {
+        failed = 1;
+        break;
+      }
+      sent++;
+    }
+  }
+
+  //the responses to what did go out are collected even on failure, or the
+  //thread's next requests would be handed them
+  for (k = 0; k < sent; k++) {
+    if (status_check_helper(tagline_bus_recv(), (type == RAID_READ) ? "STRIPE READ" : "STRIPE WRITE")) {
+      failed = 1;
+    }
+  }
+  return failed ? -1 : sent;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_io
+// Description  : Read or write the same row range of some members of a stripe
+//
+// Inputs       : type - RAID_READ or RAID_WRITE
+//                s - the stripe
+//                lo - the first row within the stripe
+//                len - the number of rows
+//                mask - a bit per member to transfer
+//                bufs - a chunk per member, the rows at their offset in it
+// Outputs      : the number of requests, -1 if failure
+
+static int stripe_io(int type, uint32_t s, int lo, int len, int mask, char (*bufs)[TAGLINE_STRIPE_CHUNK*RAID_BLOCK_SIZE]) {
+  int k, los[RAID_DISKS], lens[RAID_DISKS];
+
+  for (k = 0; k < RAID_DISKS; k++) {
+    los[k] = lo;
+    lens[k] = len;
+  }
+  return stripe_io_spans(type, s, los, lens, mask, bufs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_parity
+// Description  : Compute the parity members of a row range from its data members
+//
+// Inputs       : lo - the first row within the stripe
+//                len - the number of rows
+//                bufs - a chunk per member, the parity ones are overwritten
+// Outputs      : none
+
+static void stripe_parity(int lo, int len, char (*bufs)[TAGLINE_STRIPE_CHUNK*RAID_BLOCK_SIZE]) {
+  uint8_t *blocks[RAID_DISKS];
+  int k;
+
+  for (k = 0; k < RAID_DISKS; k++) {
+    blocks[k] = (uint8_t *)&bufs[k][lo * RAID_BLOCK_SIZE];
+  }
+  parity_compute(blocks, stripe.dataDisks, stripe.parityDisks, (size_t)len * RAID_BLOCK_SIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_fetch
+// Description  : Read a row range of a stripe, recovering the missing members
+//                from the rest.  Only dataDisks members are ever read, parity
+//                members beyond what is missing are recomputed instead
+//
+// Inputs       : s - the stripe
+//                lo - the first row within the stripe
+//                len - the number of rows
+//                missing - a bit per member that cannot be read
+//                bufs - a chunk per member, every member is filled in
+// Outputs      : the number of requests, -1 if failure
+
+static int stripe_fetch(uint32_t s, int lo, int len, int missing, char (*bufs)[TAGLINE_STRIPE_CHUNK*RAID_BLOCK_SIZE]) {
+  uint8_t *blocks[RAID_DISKS];
+  int k, n = 0, lost[RAID_DISKS], ret;
+
+  for (k = RAID_DISKS - 1; (k >= stripe.dataDisks) && (__builtin_popcount(missing) < stripe.parityDisks); k--) {
+    missing |= 1 << k;
+  }
+  ret = stripe_io(RAID_READ, s, lo, len, ((1 << RAID_DISKS) - 1) & ~missing, bufs);
+  if (ret < 0) {
+    return(-1);
+  }
+  for (k = 0; k < RAID_DISKS; k++) {
+    blocks[k] = (uint8_t *)&bufs[k][lo * RAID_BLOCK_SIZE];
+    if (missing & (1 << k)) {
+      lost[n++] = k;
+    }
+  }
+  if (parity_recover(blocks, stripe.dataDisks, stripe.parityDisks, lost, n, (size_t)len * RAID_BLOCK_SIZE)) {
+    return(-1);
+  }
+  return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_rebuild_rows
+// Description  : Rebuild a row range of one member of a stripe onto its disk.
+//                The open stripe's rows come from stripeData, the others are
+//                recovered from the rest of the stripe.  With more members
+//                stale than there is parity, the data nothing can recover
+//                (and the cache does not hold) is unmapped, and the range is
+//                made consistent again: the lost blocks zeroed and the parity
+//                recomputed over what is left
+//
+// Inputs       : dsk - the disk of the member
+//                blk - the first row, on every disk
+//                len - the number of rows (within one stripe span)
+// Outputs      : the number of requests, -1 if failure
+
+static int stripe_rebuild_rows(int dsk, int blk, int len) {
+  uint32_t s = blk / TAGLINE_STRIPE_CHUNK;
+  int lo = blk % TAGLINE_STRIPE_CHUNK, m = stripe_member(dsk, blk), parity, stale, k, i, d, b, dirty, ret, n;
+  char *data;
+
+  parity = ((1 << stripe.parityDisks) - 1) << stripe.dataDisks;
+  if (s == stripe.open) {
+    stripe_parity(lo, len, stripeData);
+    return stripe_io(RAID_WRITE, s, lo, len, 1 << m, stripeData);
+  }
+
+  stale = stripe_stale(s, lo) | (1 << m);
+  if (__builtin_popcount(stale) <= stripe.parityDisks) {
+    if ((n = stripe_fetch(s, lo, len, stale, stripeRows)) < 0) {
+      return(-1);
+    }
+    ret = stripe_io(RAID_WRITE, s, lo, len, 1 << m, stripeRows);
+    return (ret < 0) ? -1 : n + ret;
+  }
+
+  n = stripe_io(RAID_READ, s, lo, len, ((1 << stripe.dataDisks) - 1) & ~stale, stripeRows);
+  if (n < 0) {
+    return(-1);
+  }
+  for (k = 0; k < stripe.dataDisks; k++) {
+    for (i = 0; (stale & (1 << k)) && (i < len); i++) {
+      d = stripe_disk(s, k);
+      b = blk + i;
+      data = &stripeRows[k][(lo + i) * RAID_BLOCK_SIZE];
+      if ((owner[d][b].role == TAGLINE_PRIMARY) && (peek_raid_cache((RAIDDiskID)d, (RAIDBlockID)b, data, &dirty) == 0)) {
+        continue;
+      }
+      memset(data, 0, RAID_BLOCK_SIZE);
+      if (owner[d][b].role == TAGLINE_PRIMARY) {
+        logMessage(LOG_ERROR_LEVEL, "TAGLINE : disk %d block %d has too few stripe members left to rebuild from", d, b);
+        tagline_entry(owner[d][b].tag, owner[d][b].bnum)->primaryDisk = TAGLINE_UNMAPPED;
+        journal_record(owner[d][b].tag, owner[d][b].bnum);
+        owner[d][b].role = TAGLINE_UNMAPPED;
+        live_set(d, b, 0);
+        rebuild.lost++;
+      }
+    }
+  }
+  stripe_parity(lo, len, stripeRows);
+  ret = stripe_io(RAID_WRITE, s, lo, len, (stale & ((1 << stripe.dataDisks) - 1)) | parity, stripeRows);
+  return (ret < 0) ? -1 : n + ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_rebuild_batch
+// Description  : Rebuild the next rows of a disk in a parity layout, as far
+//                as the end of their stripe
+//
+// Inputs       : dsk - the rebuilding disk
+//                budget - the most rows to rebuild
+// Outputs      : the number of rows rebuilt, -1 if failure
+
+static int stripe_rebuild_batch(int dsk, uint32_t budget) {
+  int blk = rebuild.cursor[dsk], len, ret;
+
+  len = TAGLINE_STRIPE_CHUNK - blk % TAGLINE_STRIPE_CHUNK;
+  len = (len > rebuild.end[dsk] - blk) ? rebuild.end[dsk] - blk : len;
+  len = ((uint32_t)len > budget) ? (int)budget : len;
+  len = stripe_span(blk / TAGLINE_STRIPE_CHUNK, blk % TAGLINE_STRIPE_CHUNK, len);
+
+  logMessage(LOG_INFO_LEVEL, "Recovering %d diskblock(s)...", len);
+  if ((ret = stripe_rebuild_rows(dsk, blk, len)) < 0) {
+    return(-1);
+  }
+  rebuild.requests += ret;
+  rebuild.blocks += len;
+  rebuild.cursor[dsk] = blk + len;
+  return(len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_repair
+// Description  : Rebuild a row range of every stale member of a stripe ahead
+//                of its rebuild cursor, so the range can be updated in place
+//
+// Inputs       : s - the stripe
+//                lo - the first row within the stripe
+//                len - the number of rows
+// Outputs      : the number of requests, -1 if failure
+
+static int stripe_repair(uint32_t s, int lo, int len) {
+  int n, k, stale, ret, requests = 0;
+
+  while (len > 0) {
+    n = stripe_span(s, lo, len);
+    stale = stripe_stale(s, lo);
+    for (k = 0; stale && (k < RAID_DISKS); k++) {
+      if (stale & (1 << k)) {
+        if ((ret = stripe_rebuild_rows(stripe_disk(s, k), s * TAGLINE_STRIPE_CHUNK + lo, n)) < 0) {
+          return(-1);
+        }
+        requests += ret;
+      }
+    }
+    lo += n;
+    len -= n;
+  }
+  return(requests);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_reconstruct
+// Description  : Read blocks of a disk that is waiting for its rebuild by
+//                recovering them from the rest of their stripes
+//
+// Inputs       : dsk, blk - the first disk block
+//                len - the number of blocks
+//                out - where to put them
+// Outputs      : the number of requests, -1 if failure
+
+static int stripe_reconstruct(int dsk, int blk, int len, char *out) {
+  int n, lo, m, stale, ret, requests = 0;
+  uint32_t s;
+
+  while (len > 0) {
+    s = blk / TAGLINE_STRIPE_CHUNK;
+    lo = blk % TAGLINE_STRIPE_CHUNK;
+    m = stripe_member(dsk, blk);
+    n = (len > TAGLINE_STRIPE_CHUNK - lo) ? TAGLINE_STRIPE_CHUNK - lo : len;
+    n = stripe_span(s, lo, n);
+    if (s == stripe.open) {
+      memcpy(out, &stripeData[m][lo * RAID_BLOCK_SIZE], n * RAID_BLOCK_SIZE);
+    } else {
+      stale = stripe_stale(s, lo) | (1 << m);
+      if (__builtin_popcount(stale) > stripe.parityDisks) {
+        logMessage(LOG_ERROR_LEVEL, "TAGLINE : disk %d block %d has too few stripe members left to read it from", dsk, blk);
+        return(-1);
+      }
+      if ((ret = stripe_fetch(s, lo, n, stale, stripeRows)) < 0) {
+        return(-1);
+      }
+      requests += ret;
+      memcpy(out, &stripeRows[m][lo * RAID_BLOCK_SIZE], n * RAID_BLOCK_SIZE);
+    }
+    stripe.degradedBlocks += n;
+    blk += n;
+    len -= n;
+    out += n * RAID_BLOCK_SIZE;
+  }
+  stripe.degradedReads++;
+  return(requests);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_update_rows
+// Description  : Write new data blocks into a row range of a sealed stripe,
+//                each touched member over its own span of rows and the
+//                parity over all of them.  It takes the cheaper of a
+//                read-modify-write (old data and parity read, the parity
+//                moved by the difference) and a reconstruct-write (the data
+//                members not wholly rewritten read, the parity computed
+//                afresh), which needs no reads at all when the blocks cover
+//                whole rows
+//
+// Inputs       : s - the stripe
+//                items - the blocks, at most one per member row
+//                n - the number of blocks
+//                lo, hi - the first and last row they touch
+// Outputs      : the number of requests, -1 if failure
+
+static int stripe_update_rows(uint32_t s, struct stripe_item *items, int n, int lo, int hi) {
+  int los[RAID_DISKS], lens[RAID_DISKS], count[RAID_DISKS] = { 0 }, len = hi - lo + 1, k, i, touched = 0, whole = 0, parity, ret, requests;
+  long int moved;
+  uint8_t *delta;
+
+  //a member waiting for its rebuild gets these rows back first, so what is read is current
+  if ((requests = stripe_repair(s, lo, len)) < 0) {
+    return(-1);
+  }
+  moved = self->bus.blocks[RAID_READ] + self->bus.blocks[RAID_WRITE];
+
+  parity = ((1 << stripe.parityDisks) - 1) << stripe.dataDisks;
+  for (k = 0; k < RAID_DISKS; k++) {
+    los[k] = (k < stripe.dataDisks) ? hi + 1 : lo;
+    lens[k] = (k < stripe.dataDisks) ? 0 : len;
+  }
+  for (i = 0; i < n; i++) {
+    k = items[i].member;
+    touched |= 1 << k;
+    count[k]++;
+    lens[k] = (los[k] + lens[k] > items[i].row + 1) ? los[k] + lens[k] : items[i].row + 1;
+    los[k] = (items[i].row < los[k]) ? items[i].row : los[k];
+    lens[k] -= los[k];
+  }
+  for (k = 0; k < stripe.dataDisks; k++) {
+    whole |= (count[k] == len) << k;
+  }
+
+  if (stripe.dataDisks - __builtin_popcount(whole) < __builtin_popcount(touched) + stripe.parityDisks) {
+    //reconstruct-write, the rest of the data is read and the parity computed from scratch
+    ret = stripe_io(RAID_READ, s, lo, len, ((1 << stripe.dataDisks) - 1) & ~whole, stripeNew);
+    if (ret < 0) {
+      return(-1);
+    }
+    requests += ret;
+    for (i = 0; i < n; i++) {
+      memcpy(&stripeNew[items[i].member][items[i].row * RAID_BLOCK_SIZE], items[i].data, RAID_BLOCK_SIZE);
+    }
+    stripe_parity(lo, len, stripeNew);
+    if (ret == 0) {
+      stripe.fullRows++;
+    } else {
+      stripe.reconstructWrites++;
+    }
+  } else {
+    //read-modify-write, the parity takes the difference between the old and the new data
+    if ((ret = stripe_io_spans(RAID_READ, s, los, lens, touched | parity, stripeRows)) < 0) {
+      return(-1);
+    }
+    requests += ret;
+    for (k = 0; k < stripe.dataDisks; k++) {
+      if (touched & (1 << k)) {
+        memcpy(&stripeNew[k][los[k] * RAID_BLOCK_SIZE], &stripeRows[k][los[k] * RAID_BLOCK_SIZE], lens[k] * RAID_BLOCK_SIZE);
+      }
+    }
+    for (i = 0; i < n; i++) {
+      memcpy(&stripeNew[items[i].member][items[i].row * RAID_BLOCK_SIZE], items[i].data, RAID_BLOCK_SIZE);
+    }
+    for (k = 0; k < stripe.dataDisks; k++) {
+      if (touched & (1 << k)) {
+        delta = (uint8_t *)&stripeRows[k][los[k] * RAID_BLOCK_SIZE];
+        parity_xor(delta, (uint8_t *)&stripeNew[k][los[k] * RAID_BLOCK_SIZE], lens[k] * RAID_BLOCK_SIZE);
+        parity_xor((uint8_t *)&stripeRows[stripe.dataDisks][los[k] * RAID_BLOCK_SIZE], delta, lens[k] * RAID_BLOCK_SIZE);
+        if (stripe.parityDisks > 1) {
+          parity_mul_xor((uint8_t *)&stripeRows[stripe.dataDisks + 1][los[k] * RAID_BLOCK_SIZE], delta, parity_gf_pow(k), lens[k] * RAID_BLOCK_SIZE);
+        }
+      }
+    }
+    for (k = stripe.dataDisks; k < RAID_DISKS; k++) {
+      memcpy(&stripeNew[k][lo * RAID_BLOCK_SIZE], &stripeRows[k][lo * RAID_BLOCK_SIZE], len * RAID_BLOCK_SIZE);
+    }
+    stripe.readModifyWrites++;
+  }
+
+  if ((ret = stripe_io_spans(RAID_WRITE, s, los, lens, touched | parity, stripeNew)) < 0) {
+    return(-1);
+  }
+  stripe.busBlocks += self->bus.blocks[RAID_READ] + self->bus.blocks[RAID_WRITE] - moved;
+  return(requests + ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_update
+// Description  : Write new data blocks into one stripe.  The open stripe's
+//                members are rewritten around them from stripeData.  In a
+//                sealed stripe the blocks are updated a row range at a time,
+//                ranges split where TAGLINE_STRIPE_GAP rows go untouched
+//
+// Inputs       : s - the stripe
+//                items - the blocks, at most one per member row
+//                n - the number of blocks
+// Outputs      : the number of requests, -1 if failure
+
+static int stripe_update(uint32_t s, struct stripe_item *items, int n) {
+  struct stripe_item group[RAID_DISKS * TAGLINE_STRIPE_CHUNK];
+  int lo = TAGLINE_STRIPE_CHUNK, hi = -1, k, i, touched = 0, ret, requests = 0, m;
+  uint64_t rows = 0;
+  long int moved;
+
+  for (i = 0; i < n; i++) {
+    lo = (items[i].row < lo) ? items[i].row : lo;
+    hi = (items[i].row > hi) ? items[i].row : hi;
+    touched |= 1 << items[i].member;
+    rows |= 1ULL << items[i].row;
+  }
+
+  if (s == stripe.open) {
+    for (i = 0; i < n; i++) {
+      memcpy(&stripeData[items[i].member][items[i].row * RAID_BLOCK_SIZE], items[i].data, RAID_BLOCK_SIZE);
+    }
+    moved = self->bus.blocks[RAID_WRITE];
+    ret = stripe_io(RAID_WRITE, s, lo, hi - lo + 1, touched, stripeData);
+    stripe.busBlocks += self->bus.blocks[RAID_WRITE] - moved;
+    return(ret);
+  }
+
+  for (lo = 0; lo < TAGLINE_STRIPE_CHUNK; lo = hi + 1) {
+    //the next range runs on until TAGLINE_STRIPE_GAP rows in a row are untouched
+    for (; (lo < TAGLINE_STRIPE_CHUNK) && !(rows & (1ULL << lo)); lo++);
+    if (lo == TAGLINE_STRIPE_CHUNK) {
+      break;
+    }
+    for (hi = lo, k = lo + 1; (k < TAGLINE_STRIPE_CHUNK) && (k - hi <= TAGLINE_STRIPE_GAP); k++) {
+      hi = (rows & (1ULL << k)) ? k : hi;
+    }
+    for (i = 0, m = 0; i < n; i++) {
+      if ((items[i].row >= lo) && (items[i].row <= hi)) {
+        group[m++] = items[i];
+      }
+    }
+    if ((ret = stripe_update_rows(s, group, m, lo, hi)) < 0) {
+      return(-1);
+    }
+    requests += ret;
+  }
+  return(requests);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_write
+// Description  : Overwrite a run of data blocks of one disk, a stripe at a time
+//
+// Inputs       : dsk, blk - the first disk block
+//                len - the number of blocks
+//                buf - the new data
+// Outputs      : 0 if successful, -1 if failure
+
+static int stripe_write(int dsk, int blk, int len, char *buf) {
+  struct stripe_item items[TAGLINE_STRIPE_CHUNK];
+  int n, i;
+
+  while (len > 0) {
+    n = TAGLINE_STRIPE_CHUNK - blk % TAGLINE_STRIPE_CHUNK;
+    n = (n > len) ? len : n;
+    for (i = 0; i < n; i++) {
+      items[i].member = stripe_member(dsk, blk);
+      items[i].row = blk % TAGLINE_STRIPE_CHUNK + i;
+      items[i].data = &buf[i * RAID_BLOCK_SIZE];
+    }
+    if (stripe_update(blk / TAGLINE_STRIPE_CHUNK, items, n) < 0) {
+      return(-1);
+    }
+    blk += n;
+    len -= n;
+    buf += n * RAID_BLOCK_SIZE;
+  }
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_stripe_blocks
+// Description  : qsort comparison putting dirty blocks in stripe, member, row order
+//
+// Inputs       : a, b - pointers to the two RAIDCacheBlock pointers
+// Outputs      : <0, 0, >0
+
+static int compare_stripe_blocks(const void *a, const void *b) {
+  const RAIDCacheBlock *x = *(const RAIDCacheBlock **)a, *y = *(const RAIDCacheBlock **)b;
+  uint32_t sx = x->block / TAGLINE_STRIPE_CHUNK, sy = y->block / TAGLINE_STRIPE_CHUNK;
+  int mx, my;
+
+  if (sx != sy) {
+    return (sx < sy) ? -1 : 1;
+  }
+  mx = stripe_member(x->disk, x->block);
+  my = stripe_member(y->disk, y->block);
+  if (mx != my) {
+    return (mx < my) ? -1 : 1;
+  }
+  return (x->block < y->block) ? -1 : (x->block > y->block);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_flush
+// Description  : Write a batch of dirty blocks back in a parity layout, all
+//                of the blocks of a stripe in one update so that a batch
+//                covering whole rows needs no reads
+//
+// Inputs       : blocks - the dirty blocks
+//                n - the number of blocks
+// Outputs      : 0 if successful, -1 if failure
+
+static int stripe_flush(RAIDCacheBlock *blocks, uint32_t n) {
+  RAIDCacheBlock **order;
+  struct stripe_item *items;
+  uint32_t i, run, s;
+  int ret = 0;
+
+  order = malloc(n * sizeof(RAIDCacheBlock *));
+  items = malloc(n * sizeof(struct stripe_item));
+  if ((order == NULL) || (items == NULL)) {
+    free(order);
+    free(items);
+    return(-1);
+  }
+  for (i = 0; i < n; i++) {
+    order[i] = &blocks[i];
+  }
+  qsort(order, n, sizeof(RAIDCacheBlock *), compare_stripe_blocks);
+
+  for (i = 0; (i < n) && (ret >= 0); i += run) {
+    s = order[i]->block / TAGLINE_STRIPE_CHUNK;
+    for (run = 0; (i + run < n) && (order[i + run]->block / TAGLINE_STRIPE_CHUNK == s); run++) {
+      items[run].member = stripe_member(order[i + run]->disk, order[i + run]->block);
+      items[run].row = order[i + run]->block % TAGLINE_STRIPE_CHUNK;
+      items[run].data = (char *)order[i + run]->buf;
+    }
+    ret = stripe_update(s, items, run);
+    writeBack.flushRequests += (ret > 0) ? ret : 0;
+  }
+  if (ret >= 0) {
+    writeBack.flushedBlocks += n;
+  }
+
+  free(order);
+  free(items);
+  return (ret < 0) ? -1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_seal
+// Description  : Write the parity of the open stripe, computed from its data
+//                in stripeData.  A full stripe is then closed and the next
+//                one opened, otherwise (at close) the parity covers the rows
+//                filled so far
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int stripe_seal(void) {
+  int rows = (stripe.filled < TAGLINE_STRIPE_CHUNK) ? (int)stripe.filled : TAGLINE_STRIPE_CHUNK;
+
+  if ((stripe.open >= TAGLINE_STRIPES) || (stripe.filled == 0)) {
+    return(0);
+  }
+  stripe_parity(0, rows, stripeData);
+  if (stripe_io(RAID_WRITE, stripe.open, 0, rows, ((1 << stripe.parityDisks) - 1) << stripe.dataDisks, stripeData) < 0) {
+    return(-1);
+  }
+  stripe.busBlocks += rows * stripe.parityDisks;
+  if (stripe.filled == (uint32_t)(stripe.dataDisks * TAGLINE_STRIPE_CHUNK)) {
+    stripe.fullStripes++;
+    stripe.open++;
+    stripe.filled = 0;
+    memset(stripeData, 0, sizeof(stripeData));
+  }
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_reload
+// Description  : Read the data of the open stripe back into stripeData after
+//                a restart, recovering members on disks that came back blank
+//                from the parity written at close
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int stripe_reload(void) {
+  int stale;
+
+  if ((stripe.open >= TAGLINE_STRIPES) || (stripe.filled == 0)) {
+    return(0);
+  }
+  stale = stripe_stale(stripe.open, 0);
+  if (__builtin_popcount(stale) > stripe.parityDisks) {
+    logMessage(LOG_ERROR_LEVEL, "TAGLINE : too many disks of open stripe %u came back blank", stripe.open);
+    return(-1);
+  }
+  return (stripe_fetch(stripe.open, 0, TAGLINE_STRIPE_CHUNK, stale, stripeData) < 0) ? -1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_scrub
+// Description  : Read every sealed stripe whole and rewrite parity members
+//                that do not match its data
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int stripe_scrub(void) {
+  int k, row, bad, ret;
+  uint32_t s;
+
+  for (s = 0; s < stripe.open; s++) {
+    if ((ret = stripe_io(RAID_READ, s, 0, TAGLINE_STRIPE_CHUNK, (1 << RAID_DISKS) - 1, stripeRows)) < 0) {
+      return(-1);
+    }
+    scrub.requests += ret;
+    scrub.blocks += stripe.dataDisks * TAGLINE_STRIPE_CHUNK;
+    memcpy(stripeNew[stripe.dataDisks], stripeRows[stripe.dataDisks], stripe.parityDisks * sizeof(stripeRows[0]));
+    stripe_parity(0, TAGLINE_STRIPE_CHUNK, stripeRows);
+    for (k = stripe.dataDisks; k < RAID_DISKS; k++) {
+      for (row = 0, bad = 0; row < TAGLINE_STRIPE_CHUNK; row++) {
+        bad += (memcmp(&stripeRows[k][row * RAID_BLOCK_SIZE], &stripeNew[k][row * RAID_BLOCK_SIZE], RAID_BLOCK_SIZE) != 0);
+      }
+      if (bad == 0) {
+        continue;
+      }
+      logMessage(LOG_ERROR_LEVEL, "TAGLINE : stripe %u has %d parity blocks on disk %d that do not match its data, rewriting them", s, bad, stripe_disk(s, k));
+      if ((ret = stripe_io(RAID_WRITE, s, 0, TAGLINE_STRIPE_CHUNK, 1 << k, stripeRows)) < 0) {
+        return(-1);
+      }
+      scrub.requests += ret;
+      scrub.repaired += bad;
+    }
+  }
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_rebuild_rate
+// Description  : Choose how failed disks are rebuilt
+//
+// Inputs       : blocks_per_op - blocks rebuilt between foreground operations,
+//                    0 to rebuild the whole disk when the failure is signalled
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_rebuild_rate(uint32_t blocks_per_op) {
+  rebuild.step = blocks_per_op;
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_rebuild_limit
+// Description  : Cap the bandwidth of the background rebuild
+//
+// Inputs       : blocks_per_sec - the most blocks rebuilt a second (0 = no cap)
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_rebuild_limit(uint32_t blocks_per_sec) {
+  rebuild.limit = blocks_per_sec;
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : monotonic_us
+// Description  : Read the monotonic clock
+//
+// Inputs       : none
+// Outputs      : the time in microseconds
+
+static int64_t monotonic_us(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : rebuild_cached
+// Description  : Look for a block of a rebuilding disk in the cache, which
+//                holds it under its primary location
+//
+// Inputs       : dsk, blk - the disk block
+//                otherDisk, otherBlock - its other replica
+//                buf - where to copy it (NULL to only check)
+// Outputs      : 1 if it is cached, 0 if not
+
+static int rebuild_cached(int dsk, int blk, int otherDisk, int otherBlock, char *buf) {
+  int dirty;
+
+  if (owner[dsk][blk].role == TAGLINE_PRIMARY) {
+    return (peek_raid_cache((RAIDDiskID)dsk, (RAIDBlockID)blk, buf, &dirty) == 0);
+  }
+  return (peek_raid_cache((RAIDDiskID)otherDisk, (RAIDBlockID)otherBlock, buf, &dirty) == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : rebuild_plan
+// Description  : Split the next blocks of a rebuilding disk into runs that are
+//                each written back as one transfer, and the runs into reads
+//                of other replicas that follow on from each other on one
+//                disk.  Only blocks set in the live bitmap are visited.  A
+//                block in the cache whose other replica is stale is not read
+//                at all, and a block with no good copy left anywhere is
+//                unmapped here
+//
+// Inputs       : dsk - the rebuilding disk
+//                budget - the most blocks the runs may hold
+//                runs - the runs, at most TAGLINE_REBUILD_DEPTH
+//                reads - the reads, at most RAID_MAX_PENDING
+//                numReads - set to the number of reads
+//                next - set to the block after the last one planned
+// Outputs      : the number of runs
+
+static int rebuild_plan(int dsk, uint32_t budget, struct rebuild_run *runs, struct rebuild_read *reads, int *numReads, int *next) {
+  int n = 0, pos = rebuild.cursor[dsk], otherDisk, otherBlock, cached, stale;
+  struct tagline_entry *entry;
+  struct rebuild_read *rd;
+  struct rebuild_run *r;
+
+  *numReads = 0;
+  while ((n < TAGLINE_REBUILD_DEPTH) && (budget > 0) && ((pos = live_next(dsk, pos, rebuild.end[dsk])) < rebuild.end[dsk])) {
+    //a block with no other replica has nothing to rebuild from
+    if (replica_other(dsk, pos, &otherDisk, &otherBlock)) {
+      pos++;
+      continue;
+    }
+    if (replica_stale(otherDisk, otherBlock) && !rebuild_cached(dsk, pos, otherDisk, otherBlock, NULL)) {
+      //both replicas were on failed disks, so the block is unmapped rather than read back wrong
+      logMessage(LOG_ERROR_LEVEL, "TAGLINE : disk %d block %d has no good copy left to rebuild from", dsk, pos);
+      entry = tagline_entry(owner[dsk][pos].tag, owner[dsk][pos].bnum);
+      owner[dsk][pos].role = TAGLINE_UNMAPPED;
+      owner[otherDisk][otherBlock].role = TAGLINE_UNMAPPED;
+      live_set(dsk, pos, 0);
+      live_set(otherDisk, otherBlock, 0);
+      entry->primaryDisk = entry->backUpDisk = TAGLINE_UNMAPPED;
+      journal_record(owner[dsk][pos].tag, owner[dsk][pos].bnum);
+      rebuild.lost++;
+      pos++;
+      continue;
+    }
+
+    //the run takes every block that follows with something to rebuild from
+    r = &runs[n];
+    r->block = pos;
+    r->len = 0;
+    while ((r->len < RAID_MAX_XFER) && ((uint32_t)r->len < budget) && (pos < rebuild.end[dsk]) &&
+           !replica_other(dsk, pos, &otherDisk, &otherBlock)) {
+      stale = replica_stale(otherDisk, otherBlock);
+      cached = rebuild_cached(dsk, pos, otherDisk, otherBlock, NULL);
+      if (stale && !cached) {
+        break;
+      }
+      rd = (*numReads > 0) ? &reads[*numReads - 1] : NULL;
+      if (!stale && (rd != NULL) && (rd->run == n) && (rd->offset + rd->len == r->len) &&
+          (rd->srcDisk == otherDisk) && (rd->srcBlock + rd->len == otherBlock)) {
+        rd->len++;
+      } else if (!stale && !cached) {
+        if (*numReads == RAID_MAX_PENDING) {
+          break;
+        }
+        rd = &reads[(*numReads)++];
+        rd->run = n;
+        rd->offset = r->len;
+        rd->srcDisk = otherDisk;
+        rd->srcBlock = otherBlock;
+        rd->len = 1;
+      }
+      r->len++;
+      pos++;
+    }
+    if (r->len == 0) {
+      break;
+    }
+    budget -= r->len;
+    n++;
+  }
+
+  *next = pos;
+  return(n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : rebuild_batch
+// Description  : Rebuild the next runs of a disk with all of their reads in
+//                flight together, then all of their writes.  Blocks in the
+//                cache are copied over what was read (a dirty one is newer)
+//
+// Inputs       : dsk - the rebuilding disk
+//                budget - the most blocks to rebuild
+// Outputs      : the number of blocks rebuilt, -1 if failure
+
+static int rebuild_batch(int dsk, uint32_t budget) {
+  struct rebuild_run runs[TAGLINE_REBUILD_DEPTH];
+  struct rebuild_read reads[RAID_MAX_PENDING];
+  int n, numReads, k, i, next, sent, blocks = 0, failed = 0, otherDisk, otherBlock;
+
+  n = rebuild_plan(dsk, budget, runs, reads, &numReads, &next);
+
+  //every request sent has its response collected, even once the batch has failed
+  for (sent = 0; sent < numReads; sent++) {
+    if (tagline_bus_send(create_raid_request(RAID_READ, reads[sent].len, reads[sent].srcDisk, 0, 0, reads[sent].srcBlock),
+                         &rebuildBuffer[reads[sent].run][reads[sent].offset * RAID_BLOCK_SIZE])) {
+      failed = 1;
+      break;
+    }
+  }
+  for (k = 0; k < sent; k++) {
+    if (status_check_helper(tagline_bus_recv(), "READ Disk FOR WRITE ON FAILED DISK")) {
+      failed = 1;
+    }
+  }
+  if (failed) {
+    return(-1);
+  }
+
+  for (sent = 0; sent < n; sent++) {
+    for (i = 0; i < runs[sent].len; i++) {
+      replica_other(dsk, runs[sent].block + i, &otherDisk, &otherBlock);
+      rebuild.fromCache += rebuild_cached(dsk, runs[sent].block + i, otherDisk, otherBlock, &rebuildBuffer[sent][i * RAID_BLOCK_SIZE]);
+    }
+    logMessage(LOG_INFO_LEVEL, "Recovering %d diskblock(s)...", runs[sent].len);
+    if (tagline_bus_send(create_raid_request(RAID_WRITE, runs[sent].len, dsk, 0, 0, runs[sent].block), rebuildBuffer[sent])) {
+      failed = 1;
+      break;
+    }
+    blocks += runs[sent].len;
+  }
+  for (k = 0; k < sent; k++) {
+    if (status_check_helper(tagline_bus_recv(), "WRITE TO FAILED DISK")) {
+      failed = 1;
+    }
+  }
+  if (failed) {
+    return(-1);
+  }
+
+  rebuild.requests += numReads + n;
+  rebuild.blocks += blocks;
+  rebuild.cursor[dsk] = next;
+  return(blocks);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : rebuild_step
+// Description  : Rebuild the next blocks of a disk, moving its cursor on
+//
+// Inputs       : dsk - the rebuilding disk
+//                n - the most blocks to rebuild
+// Outputs      : the number of blocks rebuilt, -1 if failure
+
+int rebuild_step(int dsk, uint32_t n) {
+  int64_t start = monotonic_us(), ttr;
+  uint32_t done = 0;
+  int ret;
+
+  while ((done < n) && (rebuild.cursor[dsk] < rebuild.end[dsk])) {
+    ret = (stripe.parityDisks > 0) ? stripe_rebuild_batch(dsk, n - done) : rebuild_batch(dsk, n - done);
+    if (ret < 0) {
+      return(-1);
+    }
+    done += ret;
+  }
+  rebuild.busyUs += monotonic_us() - start;
+
+  if (rebuild.cursor[dsk] >= rebuild.end[dsk]) {
+    ttr = monotonic_us() - rebuild.started[dsk];
+    logMessage(LOG_INFO_LEVEL, "TAGLINE : disk %d rebuilt (%d blocks) in %.1f ms", dsk, rebuild.end[dsk], ttr / 1000.0);
+    rebuild.finished++;
+    rebuild.ttrUs += ttr;
+    rebuild.ttrMaxUs = (ttr > rebuild.ttrMaxUs) ? ttr : rebuild.ttrMaxUs;
+    rebuild.cursor[dsk] = -1;
+    __atomic_fetch_sub(&rebuild.active, 1, __ATOMIC_RELEASE);
+  }
+  return(done);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : rebuild_start
+// Description  : Mark every written block of a disk as waiting to be rebuilt,
+//                in a parity layout every row of the stripes in use
+//
+// Inputs       : dsk - the disk, which has lost its data
+// Outputs      : none
+
+static void rebuild_start(int dsk) {
+  if ((rebuild.active == 0) && (rebuild.limit > 0)) {
+    rebuild.tokens = 0;
+    rebuild.lastRefill = monotonic_us();
+  }
+  if (rebuild.cursor[dsk] < 0) {
+    rebuild.active++;
+  }
+  rebuild.cursor[dsk] = 0;
+  rebuild.end[dsk] = (stripe.parityDisks > 0) ? stripe_end() : live_end(dsk);
+  rebuild.started[dsk] = monotonic_us();
+  rebuild.disks++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : rebuild_tick
+// Description  : Move the rebuilding disks on by a step, called before each
+//                foreground operation.  With a bandwidth cap the step is cut
+//                to what the cap has let through since the last one
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int rebuild_tick(void) {
+  uint32_t budget = (rebuild.step > 0) ? rebuild.step : RAID_DISKBLOCKS;
+  int64_t now;
+  int i, ret;
+
+  if (rebuild.active == 0) {
+    return(0);
+  }
+
+  //the cap lets through limit blocks a second, saving up no more than one tick's worth
+  if (rebuild.limit > 0) {
+    now = monotonic_us();
+    rebuild.tokens += (double)(now - rebuild.lastRefill) * rebuild.limit / 1000000.0;
+    rebuild.lastRefill = now;
+    if (rebuild.tokens > ((rebuild.step > 0) ? rebuild.step : RAID_MAX_XFER)) {
+      rebuild.tokens = (rebuild.step > 0) ? rebuild.step : RAID_MAX_XFER;
+    }
+    budget = (budget > (uint32_t)rebuild.tokens) ? (uint32_t)rebuild.tokens : budget;
+  }
+
+  for (i = 0; (budget > 0) && (rebuild.active > 0) && (i < RAID_DISKS); i++) {
+    if (rebuild.cursor[i] >= 0) {
+      ret = rebuild_step(i, budget);
+      if (ret < 0) {
+        return(-1);
+      }
+      budget -= ((uint32_t)ret > budget) ? budget : (uint32_t)ret;
+      rebuild.tokens -= ret;
+    }
+  }
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : rebuild_drain
+// Description  : Finish every rebuild that is still going
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int rebuild_drain(void) {
+  int i;
+
+  for (i = 0; (rebuild.active > 0) && (i < RAID_DISKS); i++) {
+    if ((rebuild.cursor[i] >= 0) && (rebuild_step(i, RAID_DISKBLOCKS) < 0)) {
+      return(-1);
+    }
+  }
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : rebuild_exposed
+// Description  : Check if a rebuild still going has blocks left whose other
+//                copy was on a disk that just failed (in a parity layout any
+//                other failed disk, every stripe has a member on it)
+//
+// Inputs       : dsk - the rebuilding disk
+//                failed - a flag per disk, set if it just failed
+// Outputs      : 1 if it has, 0 if not
+
+static int rebuild_exposed(int dsk, const int *failed) {
+  int pos, otherDisk, otherBlock, i;
+
+  for (i = 0; (stripe.parityDisks > 0) && (i < RAID_DISKS); i++) {
+    if ((i != dsk) && failed[i]) {
+      return(1);
+    }
+  }
+  for (pos = live_next(dsk, rebuild.cursor[dsk], rebuild.end[dsk]); (stripe.parityDisks == 0) && (pos < rebuild.end[dsk]);
+       pos = live_next(dsk, pos + 1, rebuild.end[dsk])) {
+    if (!replica_other(dsk, pos, &otherDisk, &otherBlock) && failed[otherDisk]) {
+      return(1);
+    }
+  }
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_scrub_at_close
+// Description  : Choose whether the replicas are verified when the driver is closed
+//
+// Inputs       : enable - 1 to scrub at close, 0 not to
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_scrub_at_close(int enable) {
+  scrub.atClose = (enable != 0);
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : scrub_covered
+// Description  : Check if a block is a primary whose backup lies in a window
+//
+// Inputs       : dsk, blk - the disk block
+//                r - the window, the start of its backup window already set
+//                backBlock - set to the backup
+// Outputs      : 1 if it is, 0 if not
+
+static int scrub_covered(int dsk, int blk, struct scrub_run *r, int *backBlock) {
+  int otherDisk;
+
+  return (owner[dsk][blk].role == TAGLINE_PRIMARY) && !replica_other(dsk, blk, &otherDisk, backBlock) &&
+         (otherDisk == r->backDisk) && (*backBlock >= r->backBlock) && (*backBlock < r->backBlock + RAID_MAX_XFER);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : scrub_plan
+// Description  : Cut the next windows of a disk for the scrub.  A window
+//                reads a stretch of the disk in one transfer and the stretch
+//                of another disk holding the backups of its primaries in
+//                another, so interleaved primaries and backups still go out
+//                as multi-block reads.  A window stops before the first
+//                primary whose backup falls outside it
+//
+// Inputs       : dsk - the disk
+//                pos - the first block to look at, moved past the windows
+//                end - the end of the written part of the disk
+//                runs - the windows, at most TAGLINE_REBUILD_DEPTH / 2
+// Outputs      : the number of windows
+
+static int scrub_plan(int dsk, int *pos, int end, struct scrub_run *runs) {
+  int n = 0, blk, otherDisk, backBlock, last;
+  struct scrub_run *r;
+
+  while ((n < TAGLINE_REBUILD_DEPTH / 2) && ((*pos = live_next(dsk, *pos, end)) < end)) {
+    //a backup is checked from its primary, and a primary without one has nothing to match
+    if ((owner[dsk][*pos].role != TAGLINE_PRIMARY) || replica_other(dsk, *pos, &otherDisk, &backBlock)) {
+      (*pos)++;
+      continue;
+    }
+    r = &runs[n++];
+    r->block = *pos;
+    replica_other(dsk, *pos, &r->backDisk, &r->backBlock);
+    r->len = r->backLen = 1;
+    for (blk = *pos + 1; (blk < end) && (blk < r->block + RAID_MAX_XFER); blk++) {
+      if (owner[dsk][blk].role != TAGLINE_PRIMARY) {
+        continue;
+      }
+      if (!scrub_covered(dsk, blk, r, &backBlock)) {
+        break;
+      }
+      last = backBlock - r->backBlock + 1;
+      r->backLen = (last > r->backLen) ? last : r->backLen;
+      r->len = blk - r->block + 1;
+    }
+    *pos = r->block + r->len;
+  }
+  return(n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : scrub_all
+// Description  : Read every written primary and its backup, walking only the
+//                live bitmap, and rewrite a backup that does not match its
+//                primary.  A block dirty in the cache is skipped, both of its
+//                replicas are rewritten when it is flushed
+//                (a parity layout checks its stripes against their parity)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int scrub_all(void) {
+  struct scrub_run runs[TAGLINE_REBUILD_DEPTH / 2];
+  struct timeval start, end;
+  int dsk, pos, last, n, k, i, sent, backBlock, dirty, failed = 0;
+  char *primary, *backup;
+
+  //a rebuilding disk does not hold all of its blocks yet
+  if (rebuild_drain()) {
+    return(-1);
+  }
+  gettimeofday(&start, NULL);
+
+  //a parity layout has no backups, its stripes are checked against their parity instead
+  if ((stripe.parityDisks > 0) && stripe_scrub()) {
+    return(-1);
+  }
+
+  for (dsk = 0; (stripe.parityDisks == 0) && (dsk < RAID_DISKS); dsk++) {
+    last = live_end(dsk);
+    pos = 0;
+    while ((n = scrub_plan(dsk, &pos, last, runs)) > 0) {
+      //the two reads of every window are in flight together, whatever was
+      //sent before a failure is still received
+      for (sent = 0; sent < 2 * n; sent++) {
+        k = sent / 2;
+        if (((sent % 2) == 0) ? tagline_bus_send(create_raid_request(RAID_READ, runs[k].len, dsk, 0, 0, runs[k].block), rebuildBuffer[sent]) :
+                                tagline_bus_send(create_raid_request(RAID_READ, runs[k].backLen, runs[k].backDisk, 0, 0, runs[k].backBlock), rebuildBuffer[sent])) {
+          failed = 1;
+          break;
+        }
+      }
+      for (k = 0; k < sent; k++) {
+        if (status_check_helper(tagline_bus_recv(), "SCRUB READ")) {
+          failed = 1;
+        }
+      }
+      if (failed) {
+        return(-1);
+      }
+      scrub.requests += 2 * n;
+
+      for (k = 0; k < n; k++) {
+        for (i = 0; i < runs[k].len; i++) {
+          if (!scrub_covered(dsk, runs[k].block + i, &runs[k], &backBlock)) {
+            continue;
+          }
+          scrub.blocks++;
+          primary = &rebuildBuffer[2 * k][i * RAID_BLOCK_SIZE];
+          backup = &rebuildBuffer[2 * k + 1][(backBlock - runs[k].backBlock) * RAID_BLOCK_SIZE];
+          if ((memcmp(primary, backup, RAID_BLOCK_SIZE) == 0) ||
+              ((peek_raid_cache((RAIDDiskID)dsk, (RAIDBlockID)(runs[k].block + i), NULL, &dirty) == 0) && dirty)) {
+            continue;
+          }
+          logMessage(LOG_ERROR_LEVEL, "TAGLINE : disk %d block %d does not match its backup, rewriting it", dsk, runs[k].block + i);
+          if (status_check_helper(tagline_bus_request(create_raid_request(RAID_WRITE, 1, runs[k].backDisk, 0, 0, backBlock), primary), "SCRUB REPAIR")) {
+            return(-1);
+          }
+          scrub.requests++;
+          scrub.repaired++;
+        }
+      }
+    }
+  }
+
+  gettimeofday(&end, NULL);
+  scrub.us += (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec);
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_scrub
+// Description  : Scrub the replicas, with the driver to itself
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_scrub(void) {
+  if (driver_enter(1)) {
+    return(-1);
+  }
+  return driver_leave(scrub_all());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeback_stage
+// Description  : Takes a dirty block the cache is evicting, it is written out
+//                as soon as the cache call that evicted it returns.  The
+//                cache has already forgotten the block, so the staging grows
+//                to hold however many one call evicts, and a block that
+//                still finds no room fails the drain that follows
+//
+// Inputs       : dsk - the disk of the evicted block
+//                blk - the block number of the evicted block
+//                buf - the evicted data
+// Outputs      : none
+
+void writeback_stage(RAIDDiskID dsk, RAIDBlockID blk, void *buf) {
+  RAIDCacheBlock *more;
+  uint32_t max;
+
+  if (writeBack.numStaged == writeBack.maxStaged) {
+    max = (writeBack.maxStaged) ? writeBack.maxStaged * 2 : TAGLINE_WB_STAGE;
+    if ((more = realloc(writeBack.staged, max * sizeof(RAIDCacheBlock))) == NULL) {
+      logMessage(LOG_ERROR_LEVEL, "Write-back staging out of memory, block %u/%u is lost!", dsk, blk);
+      writeBack.lost++;
+      return;
+    }
+    writeBack.staged = more;
+    writeBack.maxStaged = max;
+  }
+  writeBack.staged[writeBack.numStaged].disk = dsk;
+  writeBack.staged[writeBack.numStaged].block = blk;
+  memcpy(writeBack.staged[writeBack.numStaged].buf, buf, RAID_BLOCK_SIZE);
+  writeBack.numStaged++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_write_items
+// Description  : qsort comparison putting block copies in disk, block order
+//
+// Inputs       : a, b - pointers to the two RAIDCacheBlock pointers
+// Outputs      : <0, 0, >0
+
+static int compare_write_items(const void *a, const void *b) {
+  const RAIDCacheBlock *x = *(const RAIDCacheBlock **)a, *y = *(const RAIDCacheBlock **)b;
+
+  if (x->disk != y->disk) {
+    return (x->disk < y->disk) ? -1 : 1;
+  }
+  return (x->block < y->block) ? -1 : (x->block > y->block);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeback_flush
+// Description  : Write a batch of dirty blocks to both of their replicas.
+//                The copies are sorted by disk and block and every
+//                contiguous run goes out as one multi-block RAID_WRITE.  A
+//                parity layout writes them back a stripe at a time instead
+//
+// Inputs       : blocks - the dirty blocks (keyed by their primary copy)
+//                n - the number of blocks
+// Outputs      : 0 if successful, -1 if failure
+
+int writeback_flush(RAIDCacheBlock *blocks, uint32_t n) {
+  RAIDCacheBlock *mirrors, **items;
+  RAIDOpCode writeResp;
+  uint32_t i, j, numItems = 0, run;
+  int otherDisk, otherBlock;
+
+  if (n == 0) {
+    return(0);
+  }
+  if (stripe.parityDisks > 0) {
+    return stripe_flush(blocks, n);
+  }
+  mirrors = malloc(n * sizeof(RAIDCacheBlock));
+  items = malloc(2 * n * sizeof(RAIDCacheBlock *));
+  if ((mirrors == NULL) || (items == NULL)) {
+    free(mirrors);
+    free(items);
+    return(-1);
+  }
+
+  //each dirty block goes to its own location and to its other replica
+  for (i = 0; i < n; i++) {
+    items[numItems++] = &blocks[i];
+    if (replica_other(blocks[i].disk, blocks[i].block, &otherDisk, &otherBlock) == 0) {
+      mirrors[i].disk = otherDisk;
+      mirrors[i].block = otherBlock;
+      memcpy(mirrors[i].buf, blocks[i].buf, RAID_BLOCK_SIZE);
+      items[numItems++] = &mirrors[i];
+    }
+  }
+  qsort(items, numItems, sizeof(RAIDCacheBlock *), compare_write_items);
+
+  for (i = 0; i < numItems; i += run) {
+    //extend the run while the next copy is the next block on the same disk
+    for (run = 1; (i + run < numItems) && (run < RAID_MAX_XFER) &&
+         (items[i + run]->disk == items[i]->disk) && (items[i + run]->block == items[i]->block + run); run++);
+
+    for (j = 0; j < run; j++) {
+      memcpy(&flushBuffer[j * RAID_BLOCK_SIZE], items[i + j]->buf, RAID_BLOCK_SIZE);
+    }
+    writeResp = tagline_bus_request(create_raid_request(RAID_WRITE, run, items[i]->disk, 0, 0, items[i]->block), flushBuffer);
+    writeBack.flushRequests++;
+    stripe.busBlocks += run;
+    if (status_check_helper(writeResp, "WRITE BACK")) {
+      free(mirrors);
+      free(items);
+      return(-1);
+    }
+  }
+  writeBack.flushedBlocks += n;
+
+  free(mirrors);
+  free(items);
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeback_drain
+// Description  : Write out the dirty blocks the cache evicted during the last
+//                cache call
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure (or any evicted block was lost)
+
+int writeback_drain(void) {
+  uint32_t n = writeBack.numStaged, lost = writeBack.lost;
+
+  writeBack.numStaged = 0;
+  writeBack.lost = 0;
+  if (writeback_flush(writeBack.staged, n) || lost) {
+    return(-1);
+  }
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeback_flush_all
+// Description  : Write every dirty block in the cache back to the disks
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int writeback_flush_all(void) {
+  RAIDCacheBlock *batch;
+  uint32_t n, max;
+  int ret = 0;
+
+  gettimeofday(&writeBack.lastFlush, NULL);
+  if (writeback_drain()) {
+    return(-1);
+  }
+
+  //take all the dirty blocks at once so the runs coalesce across the whole cache
+  max = dirty_count_raid_cache();
+  if (max == 0) {
+    return journal_sync();
+  }
+  batch = malloc(max * sizeof(RAIDCacheBlock));
+  if (batch == NULL) {
+    return(-1);
+  }
+  n = clean_raid_cache(batch, max);
+  if (writeback_flush(batch, n)) {
+    //put them back so a later flush can retry
+    for (max = 0; max < n; max++) {
+      dirty_raid_cache(batch[max].disk, batch[max].block, batch[max].buf);
+    }
+    ret = -1;
+  }
+  free(batch);
+
+  logMessage(LOG_INFO_LEVEL, "TAGLINE : flushed %u dirty blocks.", n);
+  return (ret || journal_sync()) ? -1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeback_tick
+// Description  : Flush the cache if the write-back interval has passed
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int writeback_tick(void) {
+  struct timeval now;
+  long elapsed;
+
+  if (!writeBack.enabled || (writeBack.intervalMs == 0)) {
+    return(0);
+  }
+  gettimeofday(&now, NULL);
+  elapsed = (now.tv_sec - writeBack.lastFlush.tv_sec) * 1000 + (now.tv_usec - writeBack.lastFlush.tv_usec) / 1000;
+  if (elapsed < (long)writeBack.intervalMs) {
+    return(0);
+  }
+  return writeback_flush_all();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_cache_write
+// Description  : Put a block that was just written into the cache, dirty in
+//                write-back mode, and write out anything that it evicted
+//
+// Inputs       : dsk - the primary disk of the block
+//                blk - the primary block number
+//                buf - the block data
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_cache_write(RAIDDiskID dsk, RAIDBlockID blk, char *buf) {
+  int ret;
+
+  self->stats.inserts++;
+  if (!writeBack.enabled) {
+    put_raid_cache(dsk, blk, buf);
+    return(0);
+  }
+
+  ret = dirty_raid_cache(dsk, blk, buf);
+  if (ret < 0) {
+    return(-1);
+  }
+  writeBack.absorbed += ret;
+  return writeback_drain();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_write_back
+// Description  : Turn write-back caching on or off for the next init
+//
+// Inputs       : enable - 1 to absorb writes in the cache, 0 for write-through
+//                interval_ms - flush all dirty blocks at least this often (0 = only on demand)
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_write_back(int enable, uint32_t interval_ms) {
+  writeBack.enabled = enable;
+  writeBack.intervalMs = interval_ms;
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_cache_budget
+// Description  : Let the cache resize itself, from its miss ratio curve, to
+//                any size up to a budget.  The curve must be turned on with
+//                set_raid_cache_mrc, otherwise the size never changes
+//
+// Inputs       : max_blocks - the budget in blocks (0 to keep the size fixed)
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_cache_budget(uint32_t max_blocks) {
+  cacheBudget = max_blocks;
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_cache_tick
+// Description  : Have the cache size revisited every TAGLINE_TUNE_PERIOD
+//                reads when there is a budget.  A resize needs the cache to
+//                itself, so it is left to driver_upkeep once the operation
+//                is over
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_cache_tick(void) {
+  if ((cacheBudget == 0) || (__atomic_add_fetch(&readsSinceTune, 1, __ATOMIC_RELAXED) % TAGLINE_TUNE_PERIOD)) {
+    return(0);
+  }
+  __atomic_store_n(&tuneDue, 1, __ATOMIC_RELAXED);
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_tune
+// Description  : Revisit the cache size from its miss ratio curve.  In
+//                write-back mode the cache is flushed first so a shrinking
+//                cache never has to evict dirty blocks
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int cache_tune(void) {
+  if (writeBack.enabled && writeback_flush_all()) {
+    return(-1);
+  }
+  tune_raid_cache(cacheBudget);
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lines_lock
+// Description  : Take the line locks of a set of taglines (in order, so two
+//                threads never wait on each other), then the driver lock if
+//                the driver has state only it covers: a parity layout,
+//                write-back or a disk being rebuilt.  A rebuild only starts
+//                with the driver quiesced, so one that is not going on
+//                when the line locks are taken cannot start under them
+//
+// Inputs       : lines - a bit per line lock to take
+// Outputs      : none
+
+static void lines_lock(uint64_t lines) {
+  int i;
+
+  pthread_rwlock_rdlock(&quiesceLock);
+  for (i = 0; i < TAGLINE_LINE_LOCKS; i++) {
+    if ((lines >> i) & 1) {
+      pthread_mutex_lock(&lineLocks[i]);
+    }
+  }
+  if ((stripe.parityDisks > 0) || writeBack.enabled || (__atomic_load_n(&rebuild.active, __ATOMIC_ACQUIRE) > 0)) {
+    pthread_mutex_lock(&driverLock);
+    self->serial = 1;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lines_unlock
+// Description  : Give the driver back after lines_lock
+//
+// Inputs       : lines - the bits lines_lock was given
+// Outputs      : none
+
+static void lines_unlock(uint64_t lines) {
+  int i;
+
+  if (self->serial) {
+    self->serial = 0;
+    pthread_mutex_unlock(&driverLock);
+  }
+  for (i = TAGLINE_LINE_LOCKS - 1; i >= 0; i--) {
+    if ((lines >> i) & 1) {
+      pthread_mutex_unlock(&lineLocks[i]);
+    }
+  }
+  pthread_rwlock_unlock(&quiesceLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : driver_upkeep
+// Description  : Run what an operation found due but could not do alongside
+//                the others, a journal checkpoint (which reads the whole
+//                mapping) and a cache resize, with every line lock taken so
+//                no operation is running.  In write-back mode the dirty
+//                blocks are flushed first, as the mapping may point at them
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int driver_upkeep(void) {
+  int ret = 0;
+
+  if (!__atomic_load_n(&tuneDue, __ATOMIC_RELAXED) && !__atomic_load_n(&checkpointDue, __ATOMIC_RELAXED)) {
+    return(0);
+  }
+  lines_lock(~0ULL);
+  self->quiet = 1;
+  if (__atomic_exchange_n(&tuneDue, 0, __ATOMIC_RELAXED) && cache_tune()) {
+    ret = -1;
+  }
+  if (__atomic_exchange_n(&checkpointDue, 0, __ATOMIC_RELAXED) && (writeBack.enabled ? writeback_flush_all() : journal_sync())) {
+    ret = -1;
+  }
+  self->quiet = 0;
+  lines_unlock(~0ULL);
+  return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_flush
+// Description  : Write every dirty block in the cache back to the disks,
+//                sharing the driver with the other threads' operations.
+//                Without write-back only the journal has anything queued
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_flush(void) {
+  int ret;
+
+  if (driver_enter(0)) {
+    return(-1);
+  }
+  ret = driver_leave(writeBack.enabled ? writeback_flush_all() : journal_sync());
+  return((driver_upkeep() || ret) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_cache_snapshot
+// Description  : Select the file the cache is saved to at close and warm
+//                started from at init
+//
+// Inputs       : path - the snapshot file (NULL to turn snapshots off)
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_cache_snapshot(const char *path) {
+  free(snapshotPath);
+  snapshotPath = NULL;
+  if ((path != NULL) && ((snapshotPath = strdup(path)) == NULL)) {
+    return(-1);
+  }
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : snapshot_save
+// Description  : Write every clean cached primary block, with the tagline
+//                block it belongs to, to the snapshot file.  The file is
+//                written aside and renamed so a crash never leaves half a
+//                snapshot behind
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int snapshot_save(void) {
+  struct snapshot_header hdr;
+  struct snapshot_record rec;
+  char tmp[1024];
+  FILE *fp;
+  const struct tagline_entry *e;
+  int x, y, dirty, ret = 0;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", snapshotPath);
+  if ((fp = fopen(tmp, "w")) == NULL) {
+    logMessage(LOG_ERROR_LEVEL, "TAGLINE : unable to create cache snapshot %s", tmp);
+    return(-1);
+  }
+
+  hdr.magic = TAGLINE_SNAP_MAGIC;
+  hdr.version = TAGLINE_SNAP_VERSION;
+  hdr.blockSize = RAID_BLOCK_SIZE;
+  hdr.count = 0;
+  ret |= (fwrite(&hdr, sizeof(hdr), 1, fp) != 1);
+
+  memset(&rec, 0, sizeof(rec));
+  for (x = 0; (x < gmaxLines) && !ret; x++) {
+    for (y = 0; tagline_live(x) && (y < MAX_TAGLINE_BLOCK_NUMBER); y++) {
+      e = tagline_lookup(x, y);
+      if ((e->primaryDisk == TAGLINE_UNMAPPED) || peek_raid_cache(e->primaryDisk, e->primaryBlock, rec.data, &dirty) || dirty) {
+        continue;
+      }
+      rec.tag = x;
+      rec.bnum = y;
+      rec.disk = e->primaryDisk;
+      rec.block = e->primaryBlock;
+      if (fwrite(&rec, sizeof(rec), 1, fp) != 1) {
+        ret = 1;
+        break;
+      }
+      hdr.count++;
+    }
+  }
+
+  //the count is only known at the end, so rewrite the header
+  ret |= (fseek(fp, 0, SEEK_SET) != 0) || (fwrite(&hdr, sizeof(hdr), 1, fp) != 1);
+  ret |= (fclose(fp) != 0);
+  if (ret || rename(tmp, snapshotPath)) {
+    logMessage(LOG_ERROR_LEVEL, "TAGLINE : unable to write cache snapshot %s", snapshotPath);
+    unlink(tmp);
+    return(-1);
+  }
+
+  logMessage(LOG_INFO_LEVEL, "TAGLINE : saved %u cached blocks to %s", hdr.count, snapshotPath);
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : snapshot_load
+// Description  : Warm start the cache from the snapshot file.  A record is
+//                only loaded if the mapping still places its tagline block
+//                at the same disk block, anything else is stale and dropped
+//
+// Inputs       : none
+// Outputs      : 0 if successful (or there is no snapshot), -1 if failure
+
+int snapshot_load(void) {
+  struct snapshot_header *hdr;
+  struct snapshot_record *rec;
+  struct stat st;
+  void *map;
+  uint32_t i, loaded = 0;
+  int fd;
+
+  if ((fd = open(snapshotPath, O_RDONLY)) == -1) {
+    logMessage(LOG_INFO_LEVEL, "TAGLINE : no cache snapshot at %s, cold start", snapshotPath);
+    return(0);
+  }
+  if ((fstat(fd, &st) == -1) || (st.st_size < (off_t)sizeof(struct snapshot_header))) {
+    close(fd);
+    return(0);
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    logMessage(LOG_ERROR_LEVEL, "TAGLINE : unable to map cache snapshot %s", snapshotPath);
+    return(-1);
+  }
+
+  //a snapshot from another layout or a truncated file is ignored altogether
+  hdr = map;
+  if ((hdr->magic != TAGLINE_SNAP_MAGIC) || (hdr->version != TAGLINE_SNAP_VERSION) || (hdr->blockSize != RAID_BLOCK_SIZE) ||
+      ((off_t)(sizeof(*hdr) + (size_t)hdr->count * sizeof(struct snapshot_record)) != st.st_size)) {
+    logMessage(LOG_WARNING_LEVEL, "TAGLINE : ignoring invalid cache snapshot %s", snapshotPath);
+    munmap(map, st.st_size);
+    return(0);
+  }
+
+  rec = (struct snapshot_record *)(hdr + 1);
+  for (i = 0; i < hdr->count; i++, rec++) {
+    if ((rec->tag < gmaxLines) && (rec->bnum < MAX_TAGLINE_BLOCK_NUMBER) &&
+        (tagline_lookup(rec->tag, rec->bnum)->primaryDisk == rec->disk) &&
+        (tagline_lookup(rec->tag, rec->bnum)->primaryBlock == rec->block)) {
+      put_raid_cache(rec->disk, rec->block, rec->data);
+      loaded++;
+    }
+  }
+
+  logMessage(LOG_OUTPUT_LEVEL, "Cache warm start %u of %u snapshot blocks (%u stale)", loaded, hdr->count, hdr->count - loaded);
+  munmap(map, st.st_size);
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_read_ahead
+// Description  : Turn sequential/strided read-ahead on or off for the next init
+//
+// Inputs       : max_depth - the most reads a stream is prefetched ahead (0 = off)
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_read_ahead(uint32_t max_depth) {
+  if (max_depth > MAX_TAGLINE_BLOCK_NUMBER) {
+    return(-1);
+  }
+  readAhead.maxDepth = (max_depth && (max_depth < TAGLINE_RA_MIN_DEPTH)) ? TAGLINE_RA_MIN_DEPTH : max_depth;
+  return(0);
+}
+
+//A place a wanted block can be read from, either of its two replicas
+struct fetch_copy {
+  int disk;
+  int block;
+  int item;
+  int primary;                      // 1 for the primary copy, 0 for the backup
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_read_balance
+// Description  : Choose which replica reads go to when either would do
+//
+// Inputs       : policy - the replica selection policy
+//                hedge_percentile - read from the mirror instead when a disk's
+//                    latency is above this percentile of recent reads (0 = off)
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_read_balance(TaglineReadPolicy policy, uint32_t hedge_percentile) {
+  if ((policy >= TAGLINE_READ_POLICY_MAX) || (hedge_percentile >= 100)) {
+    return(-1);
+  }
+  balance.policy = policy;
+  balance.hedgePercentile = hedge_percentile;
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readbalance_score
+// Description  : Rank a copy for the replica selection policy, lower is better
+//
+// Inputs       : c - the first copy of the run that would be read
+// Outputs      : the score
+
+static uint32_t readbalance_score(const struct fetch_copy *c) {
+  uint32_t rr = (c->disk - balance.rrNext + RAID_DISKS) % RAID_DISKS;
+
+  switch (balance.policy) {
+  case TAGLINE_READ_ROUND_ROBIN:
+    return rr;
+  case TAGLINE_READ_LEAST_OUTSTANDING:
+    return balance.outstanding[c->disk] * RAID_DISKS + rr;
+  case TAGLINE_READ_EWMA:
+    return (balance.ewma[c->disk] / 1000) * RAID_DISKS + rr;
+  default:
+    return !c->primary;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_fetch_copies
+// Description  : qsort comparison putting block copies in disk, block order
+//
+// Inputs       : a, b - pointers to the two fetch copies
+// Outputs      : <0, 0, >0
+
+static int compare_fetch_copies(const void *a, const void *b) {
+  const struct fetch_copy *x = a, *y = b;
+
+  if (x->disk != y->disk) {
+    return (x->disk < y->disk) ? -1 : 1;
+  }
+  return (x->block < y->block) ? -1 : (x->block > y->block);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fetch_recv
+// Description  : Receive the response to the oldest fetch read not received
+//                yet, its blocks stay in its buffer until they are delivered.
+//                The blocks read are the thread's own taglines', so other
+//                threads may have the driver while it waits
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int fetch_recv(void) {
+  self->fetchWindow.received++;
+  return status_check_helper(tagline_bus_wait(), "READ") ? -1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fetch_settle
+// Description  : Receive every fetch read still on the bus, so something else
+//                can use it (the responses come back in sending order)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if any of them failed
+
+static int fetch_settle(void) {
+  int failed = 0;
+
+  while (self->fetchWindow.received < self->fetchWindow.inFlight) {
+    failed |= fetch_recv();
+  }
+  return failed ? -1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_fetch
+// Description  : Read a set of tagline blocks into the cache with as few
+//                RAID_READs as possible.  Both replicas of a block hold the
+//                same data, so the copies are sorted by disk and block, and
+//                the contiguous run covering the most blocks still wanted is
+//                read (one multi-block request) until every block is in.
+//                Up to the fetch window of runs are on the bus at once, each
+//                delivered when its response comes in.  In a parity layout a
+//                block with no good copy is recovered from its stripe
+//                instead.  Demand reads also have each block scattered to
+//                its caller
+//
+// Inputs       : tags - the tagline of each block
+//                bnums - the (mapped, uncached) blocks wanted
+//                dests - where to copy each block as well (NULL for none)
+//                n - the number of blocks (at most MAX_TAGLINE_BLOCK_NUMBER)
+// Outputs      : number of RAID_READ requests used, -1 if failure
+
+int tagline_fetch(const TagLineNumber *tags, const TagLineBlockNumber *bnums, char **dests, uint32_t n) {
+  struct fetch_copy copies[2 * MAX_TAGLINE_BLOCK_NUMBER];
+  char covered[MAX_TAGLINE_BLOCK_NUMBER], take[2 * MAX_TAGLINE_BLOCK_NUMBER];
+  uint32_t degraded[MAX_TAGLINE_BLOCK_NUMBER], numDegraded = 0;
+  uint32_t numCopies = 0, remaining = n, i, j, len, first, last, fresh, best, bestFirst = 0, bestLast = 0;
+  uint32_t score, bestScore = 0, plain, plainFirst = 0, plainLast = 0, plainScore = 0;
+  int requests = 0, slow, bestSlow = 0, ret, slot;
+  const struct tagline_entry *e;
+  char *data;
+
+  //a copy on a disk that is still being rebuilt is only good once the cursor has passed it
+  for (i = 0; i < n; i++) {
+    e = tagline_lookup(tags[i], bnums[i]);
+    covered[i] = 0;
+    j = numCopies;
+    if (!replica_stale(e->primaryDisk, e->primaryBlock)) {
+      copies[numCopies].disk = e->primaryDisk;
+      copies[numCopies].block = e->primaryBlock;
+      copies[numCopies].primary = 1;
+      copies[numCopies++].item = i;
+    }
+    if ((e->backUpDisk != TAGLINE_UNMAPPED) && !replica_stale(e->backUpDisk, e->backUpBlock)) {
+      copies[numCopies].disk = e->backUpDisk;
+      copies[numCopies].block = e->backUpBlock;
+      copies[numCopies].primary = 0;
+      copies[numCopies++].item = i;
+    }
+    if ((numCopies == j) && (stripe.parityDisks > 0)) {
+      degraded[numDegraded++] = i;
+    } else if (numCopies == j) {
+      logMessage(LOG_ERROR_LEVEL, "TAGLINE : block %u of tagline %u has no copy left to read", bnums[i], tags[i]);
+      return(-1);
+    }
+  }
+  qsort(copies, numCopies, sizeof(struct fetch_copy), compare_fetch_copies);
+
+  //in a parity layout a block on a disk still being rebuilt is recovered from the rest of its stripe, a run at a time
+  for (i = 0; i < numDegraded; i += len) {
+    e = tagline_lookup(tags[degraded[i]], bnums[degraded[i]]);
+    for (len = 1; (i + len < numDegraded) && (len < RAID_MAX_XFER) &&
+         (tagline_lookup(tags[degraded[i + len]], bnums[degraded[i + len]])->primaryDisk == e->primaryDisk) &&
+         (tagline_lookup(tags[degraded[i + len]], bnums[degraded[i + len]])->primaryBlock == e->primaryBlock + len); len++);
+    if ((ret = stripe_reconstruct(e->primaryDisk, e->primaryBlock, len, runBuffer)) < 0) {
+      return(-1);
+    }
+    requests += ret;
+    for (j = 0; j < len; j++) {
+      put_raid_cache((RAIDDiskID)e->primaryDisk, (RAIDBlockID)(e->primaryBlock + j), &runBuffer[j * RAID_BLOCK_SIZE]);
+      if (dests != NULL) {
+        memcpy(dests[degraded[i + j]], &runBuffer[j * RAID_BLOCK_SIZE], RAID_BLOCK_SIZE);
+      }
+      covered[degraded[i + j]] = 1;
+      remaining--;
+      if ((writeBack.numStaged >= TAGLINE_WB_STAGE) && writeback_drain()) {
+        return(-1);
+      }
+    }
+    if (writeback_drain()) {
+      return(-1);
+    }
+  }
+
+  self->fetchWindow.head = self->fetchWindow.inFlight = self->fetchWindow.received = 0;
+  while ((remaining > 0) || (self->fetchWindow.inFlight > 0)) {
+    if ((remaining > 0) && (self->fetchWindow.inFlight < fetchWindowSize)) {
+      //find the run (trimmed to its wanted ends and the transfer limit) with the most wanted blocks,
+      //the shortest and then the one the balancing policy prefers breaking ties
+      best = plain = 0;
+      pthread_mutex_lock(&balanceLock);
+      for (i = 0; i < numCopies; i += len) {
+        for (len = 1; (i + len < numCopies) && (copies[i + len].disk == copies[i].disk) &&
+             (copies[i + len].block == copies[i].block + (int)len); len++);
+        for (first = i; (first < i + len) && covered[copies[first].item]; first++);
+        fresh = 0;
+        for (j = first, last = first; (j < i + len) && (j < first + RAID_MAX_XFER); j++) {
+          if (!covered[copies[j].item]) {
+            fresh++;
+            last = j;
+          }
+        }
+        if (fresh == 0) {
+          continue;
+        }
+
+        //with hedging on, a disk slower than the percentile only wins if nothing else will do
+        score = readbalance_score(&copies[first]);
+        slow = (balance.hedgePercentile > 0) && (balance.hedgeThreshold > 0) && (balance.ewma[copies[first].disk] > balance.hedgeThreshold * 1000);
+        if ((fresh > best) || ((fresh == best) && ((last - first < bestLast - bestFirst) ||
+            ((last - first == bestLast - bestFirst) && ((slow < bestSlow) || ((slow == bestSlow) && (score < bestScore))))))) {
+          best = fresh;
+          bestFirst = first;
+          bestLast = last;
+          bestSlow = slow;
+          bestScore = score;
+        }
+        //the choice the policy alone would have made, to count the runs hedging moved
+        if ((fresh > plain) || ((fresh == plain) && ((last - first < plainLast - plainFirst) ||
+            ((last - first == plainLast - plainFirst) && (score < plainScore))))) {
+          plain = fresh;
+          plainFirst = first;
+          plainLast = last;
+          plainScore = score;
+        }
+      }
+      if (plainFirst != bestFirst) {
+        balance.steered++;
+      }
+      pthread_mutex_unlock(&balanceLock);
+
+      //the blocks are claimed by this run as it is sent, so the next choice already leaves them out
+      for (j = bestFirst; j <= bestLast; j++) {
+        take[j] = !covered[copies[j].item];
+        covered[copies[j].item] = 1;
+      }
+      remaining -= best;
+      len = bestLast - bestFirst + 1;
+      slot = (self->fetchWindow.head + self->fetchWindow.inFlight) % fetchWindowSize;
+      self->fetchWindow.first[slot] = bestFirst;
+      self->fetchWindow.last[slot] = bestLast;
+      if (tagline_bus_send(create_raid_request(RAID_READ, len, copies[bestFirst].disk, 0, 0, copies[bestFirst].block), self->fetchBuffer[slot])) {
+        fetch_settle();
+        return(-1);
+      }
+      self->fetchWindow.inFlight++;
+      self->fetchWindow.peak = (self->fetchWindow.inFlight > self->fetchWindow.peak) ? self->fetchWindow.inFlight : self->fetchWindow.peak;
+      requests++;
+      pthread_mutex_lock(&balanceLock);
+      balance.rrNext = (copies[bestFirst].disk + 1) % RAID_DISKS;
+      balance.diskBlocks[copies[bestFirst].disk] += len;
+      pthread_mutex_unlock(&balanceLock);
+      continue;
+    }
+
+    //the window is full (or nothing is left to send), so the oldest run is delivered
+    if ((self->fetchWindow.received == 0) && fetch_recv()) {
+      fetch_settle();
+      return(-1);
+    }
+    slot = self->fetchWindow.head;
+    self->fetchWindow.head = (self->fetchWindow.head + 1) % fetchWindowSize;
+    self->fetchWindow.inFlight--;
+    self->fetchWindow.received--;
+    bestFirst = self->fetchWindow.first[slot];
+    bestLast = self->fetchWindow.last[slot];
+
+    //every block is cached under its primary location, whichever copy was read
+    for (j = bestFirst; j <= bestLast; j++) {
+      if (take[j]) {
+        data = &self->fetchBuffer[slot][(j - bestFirst) * RAID_BLOCK_SIZE];
+        e = tagline_lookup(tags[copies[j].item], bnums[copies[j].item]);
+        put_raid_cache((RAIDDiskID)e->primaryDisk, (RAIDBlockID)e->primaryBlock, data);
+        if (dests != NULL) {
+          memcpy(dests[copies[j].item], data, RAID_BLOCK_SIZE);
+        }
+        //a long run can evict more dirty blocks than there is room to stage, the flush needs the bus to itself
+        if ((writeBack.numStaged >= TAGLINE_WB_STAGE) && (fetch_settle() || writeback_drain())) {
+          fetch_settle();
+          return(-1);
+        }
+      }
+    }
+    if ((self->fetchWindow.inFlight == 0) && writeback_drain()) {
+      return(-1);
+    }
+  }
+
+  self->stats.inserts += n;
+  return(requests);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readahead_note
+// Description  : Account a demand read of one block against its stream, a hit
+//                on a prefetched block is useful, a miss on one means it was
+//                evicted before it was needed
+//
+// Inputs       : tag - the tagline
+//                bnum - the block read
+//                hit - 1 if it was found in the cache
+// Outputs      : none
+
+void readahead_note(TagLineNumber tag, TagLineBlockNumber bnum, int hit) {
+  struct read_stream *s = &readAhead.streams[tag];
+  uint64_t bit = 1ULL << (bnum % 64);
+
+  if (s->pending[bnum / 64] & bit) {
+    s->pending[bnum / 64] &= ~bit;
+    pthread_mutex_lock(&readAheadLock);
+    if (hit) {
+      readAhead.epochUsed++;
+      readAhead.used++;
+    } else {
+      readAhead.epochWasted++;
+    }
+    pthread_mutex_unlock(&readAheadLock);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readahead_advance
+// Description  : Follow the stride of a tagline's reads and, once it has held
+//                for TAGLINE_RA_TRIGGER reads, keep the next depth reads of the
+//                stream in the cache, topping it up when half has been used.
+//                The depth is shared by all streams (under the read-ahead
+//                lock), it doubles while nearly every prefetched block is
+//                used and halves when too many are evicted or skipped unread
+//
+// Inputs       : tag - the tagline
+//                bnum - the first block of the read just done
+//                blks - the number of blocks it read
+// Outputs      : 0 if successful, -1 if failure
+
+int readahead_advance(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks) {
+  struct read_stream *s = &readAhead.streams[tag];
+  TagLineBlockNumber wanted[MAX_TAGLINE_BLOCK_NUMBER];
+  TagLineNumber tags[MAX_TAGLINE_BLOCK_NUMBER];
+  int32_t stride = (int32_t)bnum - s->last, start, b;
+  uint32_t n = 0, steps, i, limit, wasted = 0, depth;
+  int ret;
+
+  if ((s->last >= 0) && (stride == s->stride) && (stride != 0)) {
+    s->run++;
+  } else {
+    //a new stream, whatever was prefetched for the old one will not be read
+    for (i = 0; i < MAX_TAGLINE_BLOCK_NUMBER/64; i++) {
+      wasted += __builtin_popcountll(s->pending[i]);
+      s->pending[i] = 0;
+    }
+    s->stride = stride;
+    s->run = 1;
+    s->frontier = bnum;
+  }
+  s->last = bnum;
+  pthread_mutex_lock(&readAheadLock);
+  readAhead.epochWasted += wasted;
+  if ((s->run < TAGLINE_RA_TRIGGER) || (stride > TAGLINE_RA_MAX_STRIDE) || (stride < -TAGLINE_RA_MAX_STRIDE)) {
+    pthread_mutex_unlock(&readAheadLock);
+    return(0);
+  }
+
+  //adapt once enough prefetched blocks have been read or lost
+  if (readAhead.epochUsed + readAhead.epochWasted >= readAhead.depth * blks) {
+    if (readAhead.epochWasted * 2 > readAhead.epochUsed + readAhead.epochWasted) {
+      readAhead.depth = (readAhead.depth / 2 < TAGLINE_RA_MIN_DEPTH) ? TAGLINE_RA_MIN_DEPTH : readAhead.depth / 2;
+    } else if ((readAhead.epochWasted * 16 <= readAhead.epochUsed) && (readAhead.depth < readAhead.limit)) {
+      readAhead.depth = (readAhead.depth * 2 > readAhead.limit) ? readAhead.limit : readAhead.depth * 2;
+    }
+    readAhead.epochUsed = readAhead.epochWasted = 0;
+  }
+  depth = readAhead.depth;
+  pthread_mutex_unlock(&readAheadLock);
+
+  //reads already prefetched ahead of this one, top up only once half are gone
+  if ((s->frontier - (int32_t)bnum) / stride < 0) {
+    s->frontier = bnum;
+  }
+  steps = (s->frontier - (int32_t)bnum) / stride;
+  if (steps * 2 > depth) {
+    return(0);
+  }
+  limit = MAX_TAGLINE_BLOCK_NUMBER / blks;
+  for (; (steps < depth) && (steps < limit); steps++) {
+    start = s->frontier + stride;
+    if ((start < 0) || (start + blks > MAX_TAGLINE_BLOCK_NUMBER)) {
+      break;
+    }
+    for (i = 0, b = start; (i < blks) && (tagline_lookup(tag, b)->primaryDisk != TAGLINE_UNMAPPED); i++, b++);
+    if (i < blks) {
+      break;
+    }
+    s->frontier = start;
+    for (i = 0, b = start; i < blks; i++, b++) {
+      if ((n < MAX_TAGLINE_BLOCK_NUMBER) && !(s->pending[b / 64] & (1ULL << (b % 64))) &&
+          peek_raid_cache((RAIDDiskID)tagline_lookup(tag, b)->primaryDisk, (RAIDBlockID)tagline_lookup(tag, b)->primaryBlock, NULL, NULL)) {
+        tags[n] = tag;
+        wanted[n++] = b;
+        s->pending[b / 64] |= 1ULL << (b % 64);
+      }
+    }
+  }
+  if (n == 0) {
+    return(0);
+  }
+
+  ret = tagline_fetch(tags, wanted, NULL, n);
+  if (ret < 0) {
+    return(-1);
+  }
+  pthread_mutex_lock(&readAheadLock);
+  readAhead.prefetched += n;
+  readAhead.requests += ret;
+  pthread_mutex_unlock(&readAheadLock);
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readahead_init
+// Description  : Set up an idle stream for every tagline when read-ahead is on
+//
+// Inputs       : maxlines - the number of taglines
+//                cache_blocks - the cache size, which bounds the depth
+// Outputs      : 0 if successful, -1 if failure
+
+int readahead_init(uint32_t maxlines, uint32_t cache_blocks) {
+  uint32_t i;
+
+  readAhead.prefetched = readAhead.requests = readAhead.used = readAhead.demandRequests = 0;
+  readAhead.streams = NULL;
+  if (readAhead.maxDepth == 0) {
+    return(0);
+  }
+  readAhead.limit = (readAhead.maxDepth > cache_blocks / 4) ? cache_blocks / 4 : readAhead.maxDepth;
+  if (readAhead.limit < TAGLINE_RA_MIN_DEPTH) {
+    readAhead.limit = TAGLINE_RA_MIN_DEPTH;
+  }
+  readAhead.streams = calloc(maxlines, sizeof(struct read_stream));
+  if (readAhead.streams == NULL) {
+    return(-1);
+  }
+  readAhead.depth = (TAGLINE_RA_START > readAhead.limit) ? readAhead.limit : TAGLINE_RA_START;
+  readAhead.epochUsed = readAhead.epochWasted = 0;
+  for (i = 0; i < maxlines; i++) {
+    readAhead.streams[i].last = -1;
+  }
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_driver_init
+// Description  : Initialize the driver with a number of maximum lines to process
+//
+// Inputs       : maxlines - the maximum number of tag lines in the system
+// Outputs      : 0 if successful, -1 if failure
+  
+int tagline_driver_init(uint32_t maxlines) {
+  return tagline_driver_init_cache(maxlines, TAGLINE_CACHE_SIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : driver_init
+// Description  : Initialize the driver with a number of maximum lines to
+//                process and a cache of a given size
+//
+// Inputs       : maxlines - the maximum number of tag lines in the system
+//                cache_blocks - the number of blocks the cache holds
+// Outputs      : 0 if successful, -1 if failure
+
+static int driver_init(uint32_t maxlines, uint32_t cache_blocks) {
+
+  //dirty blocks evicted from the cache are handed back to the driver to write out
+  set_raid_cache_writeback(writeBack.enabled ? writeback_stage : NULL);
+  if (init_raid_cache(cache_blocks)) {
+    return -1;
+  }
+  readsSinceTune = 0;
+  writeBack.numStaged = 0;
+  writeBack.lost = 0;
+  threads_reset();
+  memset(&rebuild.cursor, 0, sizeof(rebuild) - offsetof(struct rebuild_state, cursor));
+  memset(rebuild.cursor, 0xff, sizeof(rebuild.cursor));
+  memset(&balance.rrNext, 0, sizeof(balance) - offsetof(struct read_balance, rrNext));
+  memset(&stripe.open, 0, sizeof(stripe) - offsetof(struct stripe_state, open));
+  memset(stripeData, 0, sizeof(stripeData));
+  parity_init();
+  if (readahead_init(maxlines, cache_blocks)) {
+    return -1;
+  }
+  gettimeofday(&writeBack.lastFlush, NULL);
+  memset(owner, TAGLINE_UNMAPPED, sizeof(owner));
+
+  //assign global var 'gmaxlines' to maxlines so that it can be used in raid_disk_signal()
+  gmaxLines = maxlines;
+  int i, replayed = 0, kept = 0, blank[RAID_DISKS];
+  RAIDOpCode respInit, respFormat, respStatus;
+
+  //Just initialize each array of disks to RAID_DISKBLOCKS
+  for (i = 0; i < RAID_DISKS; i++) {
+    disks[i].currentSize = RAID_DISKBLOCKS;
+  }
+
+  //Reserve the mapping of every tagline, taglines only take memory once written
+  if (mapping_init(maxlines)) {
+    return -1;
+  }
+
+  //a journal from an earlier run gives the mapping back
+  if ((journalPath != NULL) && ((replayed = journal_replay()) < 0)) {
+    return -1;
+  }
+  
+  //Initializes the raid arrays
+  respInit = tagline_bus_request(create_raid_request(RAID_INIT, RAID_DISKBLOCKS/RAID_TRACK_BLOCKS, RAID_DISKS, 0, 0, 0), NULL);
+
+  //check if init fails or not
+  if (status_check_helper(respInit, "INIT")){
+    return -1;
+  }
+
+  //with a replayed mapping only the disks that came back without their data are formatted
+  for (i = 0; i < RAID_DISKS; i++) {
+    blank[i] = 1;
+    if (replayed > 0) {
+      respStatus = tagline_bus_request(create_raid_request(RAID_STATUS, 0, i, 0, 0, 0), NULL);
+      blank[i] = (extract_raid_response(respStatus, "DISK_FAIL_CHECK") != RAID_DISK_READY);
+      kept += !blank[i];
+    }
+  }
+  if ((replayed > 0) && (kept == 0)) {
+    logMessage(LOG_WARNING_LEVEL, "TAGLINE : every disk came back blank, dropping the %d journaled mappings", replayed);
+    if (journal_forget(maxlines)) {
+      return -1;
+    }
+  }
+
+  //Formats the disks
+  for (i = 0;i < RAID_DISKS; i++){
+    if (!blank[i]) {
+      continue;
+    }
+    respFormat = tagline_bus_request(create_raid_request(RAID_FORMAT, RAID_DISKBLOCKS/RAID_TRACK_BLOCKS, i, 0, 0, 0), NULL);
+    
+    //check if succeeded or not!
+    if (status_check_helper(respFormat, "FORMAT")){
+      return -1;
+    }
+
+    //a disk that lost its data while the others kept theirs is rebuilt like a failed one
+    if (kept > 0) {
+      logMessage(LOG_WARNING_LEVEL, "TAGLINE : disk %d came back blank, %d live blocks to rebuild", i, live_count(i));
+      rebuild_start(i);
+    }
+  }
+  if ((kept > 0) && (stripe.parityDisks > 0) && stripe_reload()) {
+    return -1;
+  }
+  if ((kept > 0) && (rebuild.step == 0) && (rebuild.limit == 0) && rebuild_drain()) {
+    return -1;
+  }
+
+  //the mapping is set up, so the snapshot can be checked against it
+  if ((snapshotPath != NULL) && snapshot_load()) {
+    return -1;
+  }
+
+	// Return successfully
+	logMessage(LOG_INFO_LEVEL, "TAGLINE: initialized storage (maxline=%u)", maxlines);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_driver_init_cache
+// Description  : Initialize the driver with a number of maximum lines to
+//                process and a cache of a given size, with the driver to
+//                itself
+//
+// Inputs       : maxlines - the maximum number of tag lines in the system
+//                cache_blocks - the number of blocks the cache holds
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_driver_init_cache(uint32_t maxlines, uint32_t cache_blocks) {
+  if (driver_enter(1)) {
+    return -1;
+  }
+  return driver_leave(driver_init(maxlines, cache_blocks));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_views
+// Description  : Unpin the cached blocks of a number of views
+//
+// Inputs       : views - the views (NULL for none)
+//                blks - the number of views
+// Outputs      : none
+
+static void release_views(RAIDCacheView *views, uint8_t blks) {
+  int i;
+
+  for (i = 0; (views != NULL) && (i < blks); i++) {
+    release_raid_cache(&views[i]);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_async_misses
+// Description  : qsort comparison putting the misses of a batch of reads in
+//                tagline, block order (and in batch order for the same block)
+//
+// Inputs       : a, b - pointers to the two misses
+// Outputs      : <0, 0, >0
+
+static int compare_async_misses(const void *a, const void *b) {
+  const struct async_miss *x = a, *y = b;
+
+  if (x->tag != y->tag) {
+    return (x->tag < y->tag) ? -1 : 1;
+  }
+  if (x->bnum != y->bnum) {
+    return (x->bnum < y->bnum) ? -1 : 1;
+  }
+  return (x->order < y->order) ? -1 : (x->order > y->order);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_read_batch
+// Description  : Serve a batch of reads, either copying the blocks into each
+//                read's buffer or handing out views of them.  The misses of
+//                all of them go out together, so runs are merged across the
+//                reads, and a block more than one read wants is fetched once
+//
+// Inputs       : ios - the reads, each gets its result set
+//                n - the number of reads
+// Outputs      : 0 if successful, -1 if the batch could not be served at all
+
+static int tagline_read_batch(TaglineIO **ios, uint32_t n) {
+  TagLineNumber tags[MAX_TAGLINE_BLOCK_NUMBER];
+  TagLineBlockNumber bnums[MAX_TAGLINE_BLOCK_NUMBER];
+  char *dests[MAX_TAGLINE_BLOCK_NUMBER], missed[TAGLINE_QUEUE_MAX + 1];
+  uint32_t numMisses = 0, numFetch, start, i, j, k;
+  int primaryDisk, primaryDiskBlock, hit, ret, failed = 0;
+  const struct tagline_entry *e;
+  TaglineIO *io;
+  char *dest;
+
+  if (rebuild_tick() || writeback_tick() || tagline_cache_tick()) {
+    return -1;
+  }
+
+  //For each number of blks, i, access the tagline by 'tab' and taglineblock by 'bnum+i' to fetch primary disk and primary disk block to read from
+  for (k = 0; k < n; k++) {
+    io = ios[k];
+    io->result = 0;
+    start = numMisses;
+    for (i = 0; i < io->blks; i++) {
+
+      e = tagline_lookup(io->tag, io->bnum + i);
+      if (e->primaryDisk == TAGLINE_UNMAPPED) {
+        logMessage(LOG_ERROR_LEVEL, "TAGLINE : read of unwritten block %u of tagline %u", io->bnum + i, io->tag);
+        release_views(io->views, i);
+        io->result = -1;
+        numMisses = start;
+        break;
+      }
+      primaryDisk = e->primaryDisk;                                       //Fetch primary disk
+      primaryDiskBlock = e->primaryBlock;                                 //Fetch primary disk block
+
+      logMessage(LOG_INFO_LEVEL, "Trying to read Disk : %d  Block: %d", primaryDisk, primaryDiskBlock);
+
+      self->stats.gets++;
+
+      if (io->views != NULL) {
+        hit = (pin_raid_cache((RAIDDiskID)primaryDisk, (RAIDBlockID)primaryDiskBlock, &io->views[i]) == 0);
+        dest = io->views[i].buf;
+      } else {
+        hit = (copy_raid_cache((RAIDDiskID)primaryDisk, (RAIDBlockID)primaryDiskBlock, &io->buf[i*RAID_BLOCK_SIZE]) == 0);
+        dest = &io->buf[i*RAID_BLOCK_SIZE];
+      }
+
+      if (hit) {
+        logMessage(LOG_INFO_LEVEL, "Cache hit");
+        self->stats.hits++;
+      } else {
+        logMessage(LOG_INFO_LEVEL, "Cache miss!");
+        self->stats.misses++;
+        //a miss has to land somewhere anyway, so a view of one just points at its own copy
+        if (io->views != NULL) {
+          io->views[i].data = io->views[i].buf;
+        }
+        self->asyncMisses[numMisses] = (struct async_miss){ io->tag, io->bnum + i, dest, k, numMisses };
+        numMisses++;
+      }
+      if (readAhead.streams != NULL) {
+        readahead_note(io->tag, io->bnum + i, hit);
+      }
+    }
+    missed[k] = (numMisses > start);
+  }
+
+  //the misses go out together, contiguous ones (on either replica, of any of the reads) in one RAID_READ
+  qsort(self->asyncMisses, numMisses, sizeof(struct async_miss), compare_async_misses);
+  for (i = 0; (i < numMisses) && !failed; i = j) {
+    for (j = i, numFetch = 0; (j < numMisses) && (numFetch < MAX_TAGLINE_BLOCK_NUMBER); j++) {
+      if ((j == 0) || (self->asyncMisses[j].tag != self->asyncMisses[j - 1].tag) || (self->asyncMisses[j].bnum != self->asyncMisses[j - 1].bnum)) {
+        tags[numFetch] = self->asyncMisses[j].tag;
+        bnums[numFetch] = self->asyncMisses[j].bnum;
+        dests[numFetch++] = self->asyncMisses[j].dest;
+      }
+    }
+    if ((ret = tagline_fetch(tags, bnums, dests, numFetch)) < 0) {
+      failed = 1;
+      break;
+    }
+    __atomic_fetch_add(&readAhead.demandRequests, ret, __ATOMIC_RELAXED);
+
+    //a block another read of the batch also missed is copied from the one that fetched it
+    for (k = i; k < j; k++) {
+      if ((k > 0) && (self->asyncMisses[k].tag == self->asyncMisses[k - 1].tag) && (self->asyncMisses[k].bnum == self->asyncMisses[k - 1].bnum)) {
+        memcpy(self->asyncMisses[k].dest, self->asyncMisses[k - 1].dest, RAID_BLOCK_SIZE);
+        self->asyncQueue.shared++;
+      }
+    }
+  }
+
+  for (k = 0; k < n; k++) {
+    io = ios[k];
+    if (io->result) {
+      continue;
+    }
+    //keep the tagline's stream prefetched ahead of the next read
+    if ((failed && missed[k]) || ((readAhead.streams != NULL) && readahead_advance(io->tag, io->bnum, io->blks))) {
+      release_views(io->views, io->blks);
+      io->result = -1;
+      continue;
+    }
+
+    logMessage(LOG_INFO_LEVEL, "TAGLINE : read %u blocks from tagline %u, starting block %u.",
+        io->blks, io->tag, io->bnum);
+  }
+
+	// Return successfully
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_release_view
+// Description  : Release the views from a tagline_read_view
+//
+// Inputs       : views - the views
+//                blks - the number of views
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_release_view(RAIDCacheView *views, uint8_t blks) {
+  release_views(views, blks);
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : disk_signal
+// Description  : Upon signaling disk failure, checks whether each disk failed or not, then formats the disk and
+//                starts rebuilding the blocks written to it.  Unless a rebuild rate is set the disk is rebuilt
+//                before returning, otherwise reads use the other replica until the rebuild has passed a block
+//
+// Inputs       : void
+// Outputs      : 0 if successful, -1 if failure
+
+static int disk_signal(void) {
+  // 'i' iterates over each disks to check if it failed or not
+  int i, failed[RAID_DISKS];
+  char buf[RAID_BLOCK_SIZE];
+  RAIDOpCode statusResp, formatResp;
+  struct timeval start, end;
+  long int us;
+
+  gettimeofday(&start, NULL);
+
+  //Check each disk if it failed or not, a failed disk holds nothing until its rebuild has passed a block
+  for (i = 0; i < RAID_DISKS; i++) {
+    statusResp = tagline_bus_request(create_raid_request(RAID_STATUS, 0, i, 0, 0, 0), NULL);
+    failed[i] = (extract_raid_response(statusResp, "DISK_FAIL_CHECK") == RAID_DISK_FAILED);
+    if (failed[i]) {
+      logMessage(LOG_INFO_LEVEL, "TAGLINE : disk %d failed, %d live blocks to rebuild", i, live_count(i));
+      rebuild_start(i);
+    }
+  }
+
+  //a rebuild still going is finished first, the blocks it has left now have only one good copy
+  //(or none, if the other one was on the disk that just failed, when only the cache still has them).
+  //Under a bandwidth cap it goes on at the capped rate, unless it is one of those that may have to
+  //take blocks out of the cache before they are evicted
+  for (i = 0; i < RAID_DISKS; i++) {
+    if (!failed[i] && (rebuild.cursor[i] >= 0) && ((rebuild.limit == 0) || rebuild_exposed(i, failed)) &&
+        (rebuild_step(i, RAID_DISKBLOCKS) < 0)) {
+      return 1;
+    }
+  }
+
+  // if disk fails, format the disk, then every block of the disk that was written to is recovered from its other replica
+  for (i = 0; i < RAID_DISKS; i++) {
+    if (failed[i]) {
+      formatResp = tagline_bus_request(create_raid_request(RAID_FORMAT, RAID_DISKBLOCKS/RAID_TRACK_BLOCKS, i, 0, 0, 0), buf);
+      if (status_check_helper(formatResp, "Format disk")){
+        return 1;
+      }
+    }
+  }
+
+  //without a rebuild rate or cap nothing is served until the disks are whole again
+  if ((rebuild.step == 0) && (rebuild.limit == 0) && rebuild_drain()) {
+    return 1;
+  }
+
+  //the rebuilt disks can now take the blocks still dirty in the cache (writes to a rebuilding disk are fine too)
+  if (writeBack.enabled && writeback_flush_all()) {
+    return 1;
+  }
+
+  //blocks the rebuild found no good copy of are unmapped for good
+  if (!writeBack.enabled && journal_sync()) {
+    return 1;
+  }
+
+  gettimeofday(&end, NULL);
+  us = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec);
+  rebuild.signalUs = (us > rebuild.signalUs) ? us : rebuild.signalUs;
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : raid_disk_signal
+// Description  : A disk has failed, once every operation in progress has
+//                finished the failed disks are formatted and rebuilt with the
+//                driver to itself
+//
+// Inputs       : void
+// Outputs      : 0 if successful, 1 if failure
+
+int raid_disk_signal(){
+  if (driver_enter(1)) {
+    return 1;
+  }
+  return driver_leave(disk_signal());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_mirror_writes
+// Description  : Choose how the two replicas of a write are sent
+//
+// Inputs       : concurrent - 1 to send both before waiting, 0 for one after the other
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_mirror_writes(int concurrent) {
+  mirrorConcurrent = (concurrent != 0);
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mirror_write
+// Description  : Write a run of blocks to both of its replicas.  Concurrent
+//                mode has both requests outstanding before either response
+//                is read, otherwise the backup is only sent once the primary
+//                has succeeded.  The blocks are the thread's own taglines'
+//                (or an extent it has claimed), so other threads may have
+//                the driver while it waits
+//
+// Inputs       : run - the number of blocks
+//                pd, pb - the primary disk and its first block
+//                bd, bb - the backup disk (TAGLINE_UNMAPPED for none) and its first block
+//                buf - the blocks to write
+//                done - set to the replicas written (TAGLINE_WROTE_*)
+// Outputs      : 0 if every replica was written, -1 if not
+
+int mirror_write(uint32_t run, int pd, int pb, int bd, int bb, char *buf, int *done) {
+  int sent = 0, want = TAGLINE_WROTE_PRIMARY;
+
+  *done = 0;
+  if (bd != TAGLINE_UNMAPPED) {
+    want |= TAGLINE_WROTE_BACKUP;
+  }
+  __atomic_fetch_add(&stripe.busBlocks, (want & TAGLINE_WROTE_BACKUP) ? 2 * run : run, __ATOMIC_RELAXED);
+
+  if (mirrorConcurrent && (want & TAGLINE_WROTE_BACKUP)) {
+    //the server answers in order, so the first response is the primary's
+    if (tagline_bus_send(create_raid_request(RAID_WRITE, run, pd, 0, 0, pb), buf) == 0) {
+      sent |= TAGLINE_WROTE_PRIMARY;
+    }
+    if (tagline_bus_send(create_raid_request(RAID_WRITE, run, bd, 0, 0, bb), buf) == 0) {
+      sent |= TAGLINE_WROTE_BACKUP;
+    }
+    if ((sent & TAGLINE_WROTE_PRIMARY) && !status_check_helper(tagline_bus_wait(), "WRITE to Primary Disk")) {
+      *done |= TAGLINE_WROTE_PRIMARY;
+    }
+    if ((sent & TAGLINE_WROTE_BACKUP) && !status_check_helper(tagline_bus_wait(), "WRITE to Backup Disk")) {
+      *done |= TAGLINE_WROTE_BACKUP;
+    }
+  } else {
+    if (tagline_bus_send(create_raid_request(RAID_WRITE, run, pd, 0, 0, pb), buf) ||
+        status_check_helper(tagline_bus_wait(), "WRITE to Primary Disk")) {
+      return -1;
+    }
+    *done |= TAGLINE_WROTE_PRIMARY;
+    if (want & TAGLINE_WROTE_BACKUP) {
+      if (tagline_bus_send(create_raid_request(RAID_WRITE, run, bd, 0, 0, bb), buf) ||
+          status_check_helper(tagline_bus_wait(), "WRITE to Backup Disk")) {
+        return -1;
+      }
+      *done |= TAGLINE_WROTE_BACKUP;
+    }
+  }
+
+  return (*done == want) ? 0 : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mirror_rollback
+// Description  : An overwrite reached only one replica of a run, so the other
+//                one still holds the old data.  It is dropped from the mapping
+//                (the backup is promoted if it was the one written), leaving
+//                the blocks readable with the new data but without a backup
+//
+// Inputs       : tag - the tagline
+//                bnum - the first block of the run
+//                run - the number of blocks
+//                done - the replica that was written (TAGLINE_WROTE_*)
+//                buf - the new data
+// Outputs      : none
+
+void mirror_rollback(TagLineNumber tag, TagLineBlockNumber bnum, uint32_t run, int done, char *buf) {
+  struct tagline_entry *entry;
+  uint32_t j;
+
+  for (j = 0; j < run; j++) {
+    entry = tagline_entry(tag, bnum + j);
+    if (done == TAGLINE_WROTE_BACKUP) {
+      owner[entry->primaryDisk][entry->primaryBlock].role = TAGLINE_UNMAPPED;
+      live_set(entry->primaryDisk, entry->primaryBlock, 0);
+      owner[entry->backUpDisk][entry->backUpBlock].role = TAGLINE_PRIMARY;
+      entry->primaryDisk = entry->backUpDisk;
+      entry->primaryBlock = entry->backUpBlock;
+    } else {
+      owner[entry->backUpDisk][entry->backUpBlock].role = TAGLINE_UNMAPPED;
+      live_set(entry->backUpDisk, entry->backUpBlock, 0);
+    }
+    entry->backUpDisk = TAGLINE_UNMAPPED;
+    journal_record(tag, bnum + j);
+    tagline_cache_write((RAIDDiskID)entry->primaryDisk, (RAIDBlockID)entry->primaryBlock, &buf[j*RAID_BLOCK_SIZE]);
+  }
+  __atomic_fetch_add(&mirrorRollbacks, run, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stripe_place
+// Description  : Write a run of fresh blocks into the open stripe, as far as
+//                its current data member goes, sealing the stripe once it is
+//                full.  The blocks go to the disk straight away even in
+//                write-back mode and are cached clean, only their parity
+//                waits for the stripe to fill
+//
+// Inputs       : tag - the tagline
+//                bnum - the first block of the run
+//                run - the number of blocks
+//                buf - the blocks
+// Outputs      : the number of blocks placed, -1 if failure
+
+static int stripe_place(TagLineNumber tag, TagLineBlockNumber bnum, uint32_t run, char *buf) {
+  int k, lo, dsk, blk;
+  uint32_t j;
+
+  if (stripe.open >= TAGLINE_STRIPES) {
+    logMessage(LOG_INFO_LEVEL, "No space on disks!");
+    return -1;
+  }
+  k = stripe.filled / TAGLINE_STRIPE_CHUNK;
+  lo = stripe.filled % TAGLINE_STRIPE_CHUNK;
+  run = (run > (uint32_t)(TAGLINE_STRIPE_CHUNK - lo)) ? (uint32_t)(TAGLINE_STRIPE_CHUNK - lo) : run;
+  dsk = stripe_disk(stripe.open, k);
+  blk = stripe.open * TAGLINE_STRIPE_CHUNK + lo;
+
+  logMessage(LOG_INFO_LEVEL, "Fresh write of %u block(s) to stripe %u", run, stripe.open);
+  if (status_check_helper(tagline_bus_request(create_raid_request(RAID_WRITE, run, dsk, 0, 0, blk), buf), "WRITE to Stripe")) {
+    logMessage(LOG_ERROR_LEVEL, "TAGLINE : fresh write of tagline %u block %u failed, not mapped", tag, bnum);
+    return -1;
+  }
+  stripe.busBlocks += run;
+  memcpy(&stripeData[k][lo * RAID_BLOCK_SIZE], buf, run * RAID_BLOCK_SIZE);
+
+  for (j = 0; j < run; j++) {
+    tagline_entry(tag, bnum + j)->primaryDisk = dsk;
+    tagline_entry(tag, bnum + j)->primaryBlock = blk + j;
+    owner[dsk][blk + j] = (struct block_owner){ tag, bnum + j, TAGLINE_PRIMARY, 0 };
+    live_set(dsk, blk + j, 1);
+    if (journal_record(tag, bnum + j)) {
+      return -1;
+    }
+    self->stats.inserts++;
+    put_raid_cache((RAIDDiskID)dsk, (RAIDBlockID)(blk + j), &buf[j * RAID_BLOCK_SIZE]);
+    if ((writeBack.numStaged >= TAGLINE_WB_STAGE) && writeback_drain()) {
+      return -1;
+    }
+  }
+  stripe.filled += run;
+
+  if (writeback_drain() || ((stripe.filled == (uint32_t)(stripe.dataDisks * TAGLINE_STRIPE_CHUNK)) && stripe_seal())) {
+    return -1;
+  }
+  return(run);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : extent_claim
+// Description  : Take the next extent of fresh blocks, round robin from the
+//                first disk that has room along with the disk after it, or
+//                once no such pair is left, the two disks with the most room
+//                (extents of different sizes can leave that space stranded),
+//                no more than keeps them from dropping below the third so
+//                the rest can still be paired up to the last block.  Each
+//                claim moves the cursor on by one before it looks, so
+//                threads claiming at once start on different pairs, and
+//                takes the blocks under the locks of its two disks.  The
+//                extent is the caller's from then on, to write and map
+//
+// Inputs       : run - the most blocks wanted
+//                pd, pb - set to the primary disk and its first block
+//                bd, bb - set to the backup disk and its first block
+// Outputs      : the number of blocks claimed, 0 if the disks are full
+
+static uint32_t extent_claim(uint32_t run, int *pd, int *pb, int *bd, int *bb) {
+  int primaryDisk, backUpDisk = 0, room = 0, tried, third, i, next;
+  uint32_t set = 0;
+
+  primaryDisk = __atomic_load_n(&currentDisk, __ATOMIC_RELAXED);
+  do {
+    next = (primaryDisk == (RAID_DISKS - 1)) ? 0 : (primaryDisk + 1);
+  } while (!__atomic_compare_exchange_n(&currentDisk, &primaryDisk, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  //keep moving round robin until a disk and the one after it both have space
+  for (tried = 0; tried < RAID_DISKS; tried++) {
+    backUpDisk = (primaryDisk == (RAID_DISKS - 1)) ? 0 : (primaryDisk + 1);
+    set = (1U << primaryDisk) | (1U << backUpDisk);
+    disks_lock(set);
+    room = (disks[primaryDisk].currentSize < disks[backUpDisk].currentSize) ? disks[primaryDisk].currentSize : disks[backUpDisk].currentSize;
+    if (room > 0) {
+      break;
+    }
+    disks_unlock(set);
+    primaryDisk = backUpDisk;
+  }
+  if (tried == RAID_DISKS) {
+    set = (1U << RAID_DISKS) - 1;
+    disks_lock(set);
+    for (i = 0, primaryDisk = 0, backUpDisk = 1; i < RAID_DISKS; i++) {
+      if (disks[i].currentSize > disks[primaryDisk].currentSize) {
+        backUpDisk = primaryDisk;
+        primaryDisk = i;
+      } else if ((i != primaryDisk) && (disks[i].currentSize > disks[backUpDisk].currentSize)) {
+        backUpDisk = i;
+      }
+    }
+    for (i = 0, third = 0; i < RAID_DISKS; i++) {
+      if ((i != primaryDisk) && (i != backUpDisk) && (disks[i].currentSize > third)) {
+        third = disks[i].currentSize;
+      }
+    }
+    room = disks[backUpDisk].currentSize - third;
+    room = ((room == 0) && (third > 0)) ? 1 : room;
+  }
+  if (room <= 0) {
+    disks_unlock(set);
+    logMessage(LOG_INFO_LEVEL, "No space on disks!");
+    return 0;
+  }
+  run = ((int)run > room) ? (uint32_t)room : run;
+
+  //The primaries go to the next blocks of 'primaryDisk' (RAID_DISKBLOCKS - disks[primaryDisk].currentSize), the backups to the next blocks of the disk after it
+  *pd = primaryDisk;
+  *pb = RAID_DISKBLOCKS - disks[primaryDisk].currentSize;
+  *bd = backUpDisk;
+  *bb = RAID_DISKBLOCKS - disks[backUpDisk].currentSize;
+  disks[primaryDisk].currentSize -= run;
+  disks[backUpDisk].currentSize -= run;
+  disks_unlock(set);
+
+  // This is round-robin so the next extent starts on the next disk (the last disk wraps to disk 0), a pair found further on moves the cursor past it
+  if (tried > 0) {
+    __atomic_store_n(&currentDisk, backUpDisk, __ATOMIC_RELAXED);
+  }
+  return run;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : block_map
+// Description  : Map a freshly written block to both of its replicas, in the
+//                tagline table, the reverse map, the live bitmaps and the
+//                journal, and cache its primary
+//
+// Inputs       : tag - the tagline
+//                bnum - the block of the tagline
+//                primaryDisk, primaryBlock - where the primary was written
+//                backUpDisk, backUpBlock - where the backup was written
+//                buf - the block
+// Outputs      : 0 if successful, -1 if failure
+
+static int block_map(TagLineNumber tag, TagLineBlockNumber bnum, int primaryDisk, int primaryBlock,
+    int backUpDisk, int backUpBlock, char *buf) {
+  struct tagline_entry *entry;
+
+  entry = tagline_entry(tag, bnum);
+  entry->primaryDisk = primaryDisk;
+  entry->primaryBlock = primaryBlock;
+  entry->backUpDisk = backUpDisk;
+  entry->backUpBlock = backUpBlock;
+  owner[primaryDisk][primaryBlock].tag = tag;
+  owner[primaryDisk][primaryBlock].bnum = bnum;
+  owner[primaryDisk][primaryBlock].role = TAGLINE_PRIMARY;
+  live_set(primaryDisk, primaryBlock, 1);
+  owner[backUpDisk][backUpBlock].tag = tag;
+  owner[backUpDisk][backUpBlock].bnum = bnum;
+  owner[backUpDisk][backUpBlock].role = TAGLINE_BACKUP;
+  live_set(backUpDisk, backUpBlock, 1);
+  if (journal_record(tag, bnum)) {
+    return -1;
+  }
+  return tagline_cache_write((RAIDDiskID)primaryDisk, (RAIDBlockID)primaryBlock, buf);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_write_blocks
+// Description  :  Write a number of blocks to raid disks in round-robin fashion.
+//                 Unwritten blocks are placed as extents, contiguous on the
+//                 primary disk and on the backup disk after it, so a run of
+//                 them goes out as one RAID_WRITE per replica (as does an
+//                 overwrite of blocks that were placed together).  In a
+//                 parity layout they fill the open stripe instead
+//
+// Inputs       : tag - the number of the tagline to store mapping to
+//                bnum - the starting block  to store mapping to
+//                blks - the number of blocks to write to in the disk
+//                buf - memory block to write the blocks into
+// Outputs      : 0 if successful, -1 if failure
+
+static int tagline_write_blocks(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf) {
+  int primaryDisk, backUpDisk, primaryBlock, backUpBlock, done, placed;
+  uint32_t i, j, run;
+  const struct tagline_entry *e, *f;
+
+  if (rebuild_tick() || writeback_tick()) {
+    return -1;
+  }
+  __atomic_fetch_add(&stripe.written, blks, __ATOMIC_RELAXED);
+
+  //write the blocks a run at a time, each run is one request per replica
+  for (i = 0; i < blks; i += run) {
+    e = tagline_lookup(tag, bnum + i);
+
+    // if the block hasn't been written to, then its a fresh write
+    if (e->primaryDisk == TAGLINE_UNMAPPED) {
+
+      //the run is every unwritten block that follows, as far as the disk pair has room
+      for (run = 1; (i + run < blks) && (run < RAID_MAX_XFER) && (tagline_lookup(tag, bnum + i + run)->primaryDisk == TAGLINE_UNMAPPED); run++);
+
+      //a parity layout puts the run into the open stripe instead of on a disk pair
+      if (stripe.parityDisks > 0) {
+        if ((placed = stripe_place(tag, bnum + i, run, &buf[i*RAID_BLOCK_SIZE])) < 0) {
+          return -1;
+        }
+        run = placed;
+        continue;
+      }
+
+      //the extent is claimed before it is written, so other threads place theirs after it meanwhile
+      if ((run = extent_claim(run, &primaryDisk, &primaryBlock, &backUpDisk, &backUpBlock)) == 0) {
+        return -1;
+      }
+
+      //in write-back mode the blocks only go to the cache here, both replicas are written when they are flushed
+      //nothing is mapped unless both replicas were written, so a failed extent is simply left unused
+      logMessage(LOG_INFO_LEVEL, "Fresh write of %u block(s) to Primary and Backup Disk", run);
+      if (!writeBack.enabled && mirror_write(run, primaryDisk, primaryBlock, backUpDisk, backUpBlock, &buf[i*RAID_BLOCK_SIZE], &done)) {
+        logMessage(LOG_ERROR_LEVEL, "TAGLINE : fresh write of tagline %u block %u failed, not mapped", tag, bnum + i);
+        return -1;
+      }
+
+      // if success, then map each block of the extent in the tagline data structure and in the reverse map
+      for (j = 0; j < run; j++) {
+        if (block_map(tag, bnum + i + j, primaryDisk, primaryBlock + j, backUpDisk, backUpBlock + j, &buf[(i + j)*RAID_BLOCK_SIZE])) {
+          return -1;
+        }
+      }
+
+    } else {
+      //This is implementation for overwite...no incrementing 'currentDisk' here or decrementing currentSize of 'disks[currentDisk]' beacuse this is an overwrite
+      //the run is every following block that sits right after this one on both replicas
+      for (run = 1; (i + run < blks) && (run < RAID_MAX_XFER); run++) {
+        f = tagline_lookup(tag, bnum + i + run);
+        if ((f->primaryDisk != e->primaryDisk) || (f->primaryBlock != e->primaryBlock + run) ||
+            (f->backUpDisk != e->backUpDisk) || ((f->backUpDisk != TAGLINE_UNMAPPED) && (f->backUpBlock != e->backUpBlock + run))) {
+          break;
+        }
+      }
+
+      //fetch the primary and back up disk and disk block from tagline data structure to overwrite
+      logMessage(LOG_INFO_LEVEL, "Overwrite of %u block(s) to Primary and Backup Disk", run);
+      if (!writeBack.enabled && (stripe.parityDisks > 0)) {
+        if (stripe_write(e->primaryDisk, e->primaryBlock, run, &buf[i*RAID_BLOCK_SIZE])) {
+          return -1;
+        }
+      } else if (!writeBack.enabled && mirror_write(run, e->primaryDisk, e->primaryBlock, e->backUpDisk, e->backUpBlock, &buf[i*RAID_BLOCK_SIZE], &done)) {
+        if (done != 0) {
+          logMessage(LOG_ERROR_LEVEL, "TAGLINE : overwrite of tagline %u block %u reached one replica, the other is dropped", tag, bnum + i);
+          mirror_rollback(tag, bnum + i, run, done, &buf[i*RAID_BLOCK_SIZE]);
+        }
+        return -1;
+      }
+
+      //refresh the cached copies of the primary blocks that were just overwritten
+      for (j = 0; j < run; j++) {
+        if (tagline_cache_write((RAIDDiskID)e->primaryDisk, (RAIDBlockID)(e->primaryBlock + j), &buf[(i + j)*RAID_BLOCK_SIZE])) {
+          return -1;
+        }
+      }
+    }
+  }
+
+  //the new mappings are only committed once the data they point at is on both replicas
+  if (journal_tick()) {
+    return -1;
+  }
+  
+	// Return successfully
+	logMessage(LOG_INFO_LEVEL, "TAGLINE : wrote %u blocks to tagline %u, starting block %u.",
+			blks, tag, bnum);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_queue_depth
+// Description  : Set how many asynchronous operations each thread may have
+//                outstanding.  A batch keeps as many of its reads'
+//                RAID_READs on the bus at once, up to the fetch window
+//
+// Inputs       : depth - the most operations submitted and not yet reaped
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_queue_depth(uint32_t depth) {
+  if ((depth == 0) || (depth > TAGLINE_QUEUE_MAX) || ((self != NULL) && (depth < self->asyncQueue.outstanding))) {
+    return(-1);
+  }
+  queueDepth = depth;
+  fetchWindowSize = (depth > TAGLINE_FETCH_WINDOW) ? TAGLINE_FETCH_WINDOW : (int)depth;
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : async_valid
+// Description  : Check an operation is a read or write within range
+//
+// Inputs       : io - the operation
+// Outputs      : 0 if it is, -1 if not
+
+static int async_valid(const TaglineIO *io) {
+  if ((io->type != TAGLINE_IO_READ) && (io->type != TAGLINE_IO_WRITE)) {
+    logMessage(LOG_ERROR_LEVEL, "TAGLINE : unknown operation type %d", io->type);
+    return(-1);
+  }
+  if ((io->tag >= gmaxLines) || (io->bnum + io->blks > MAX_TAGLINE_BLOCK_NUMBER)) {
+    logMessage(LOG_ERROR_LEVEL, "TAGLINE : %s of blocks %u-%u of tagline %u out of range", (io->type == TAGLINE_IO_READ) ? "read" : "write",
+        io->bnum, io->bnum + io->blks - 1, io->tag);
+    return(-1);
+  }
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : async_enqueue
+// Description  : Add an operation to the ones waiting for the next batch
+//
+// Inputs       : io - the operation
+// Outputs      : none
+
+static void async_enqueue(TaglineIO *io) {
+  io->next = NULL;
+  io->result = 0;
+  if (self->asyncQueue.tail != NULL) {
+    self->asyncQueue.tail->next = io;
+  } else {
+    self->asyncQueue.head = io;
+  }
+  self->asyncQueue.tail = io;
+  self->asyncQueue.outstanding++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : async_complete
+// Description  : Hand a finished operation back, to its callback or to the
+//                completions waiting to be reaped
+//
+// Inputs       : io - the operation, its result set
+// Outputs      : none
+
+static void async_complete(TaglineIO *io) {
+  io->next = NULL;
+  if (io->done != NULL) {
+    self->asyncQueue.outstanding--;
+    io->done(io);
+    return;
+  }
+  if (self->asyncQueue.doneTail != NULL) {
+    self->asyncQueue.doneTail->next = io;
+  } else {
+    self->asyncQueue.doneHead = io;
+  }
+  self->asyncQueue.doneTail = io;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : async_reads
+// Description  : Serve a group of reads of a batch together and complete them
+//
+// Inputs       : reads - the reads
+//                n - the number of reads
+// Outputs      : none
+
+static void async_reads(TaglineIO **reads, uint32_t n) {
+  uint32_t i;
+
+  if (n == 0) {
+    return;
+  }
+  self->asyncQueue.readGroups++;
+  if (tagline_read_batch(reads, n)) {
+    for (i = 0; i < n; i++) {
+      reads[i]->result = -1;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    async_complete(reads[i]);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : async_run
+// Description  : Run everything submitted so far as one batch.  The reads no
+//                earlier write of the batch overlaps are served first, all
+//                together, then the rest goes in submission order: each
+//                write on its own and the reads between writes together.
+//                What the callbacks submit waits for the next batch
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int async_run(void) {
+  TaglineIO *ops[TAGLINE_QUEUE_MAX + 1], *reads[TAGLINE_QUEUE_MAX + 1], *io;
+  char served[TAGLINE_QUEUE_MAX + 1];
+  uint32_t n = 0, numReads = 0, i, j, writes = 0;
+
+  for (io = self->asyncQueue.head; io != NULL; io = io->next) {
+    ops[n++] = io;
+  }
+  self->asyncQueue.head = self->asyncQueue.tail = NULL;
+  if (n == 0) {
+    return(0);
+  }
+  self->asyncQueue.batches++;
+  self->asyncQueue.ops += n;
+
+  //a read goes first unless an earlier write is to one of its blocks
+  for (i = 0; i < n; i++) {
+    served[i] = 0;
+    if (ops[i]->type == TAGLINE_IO_WRITE) {
+      writes++;
+      continue;
+    }
+    for (j = 0; (j < i) && !((ops[j]->type == TAGLINE_IO_WRITE) && (ops[j]->tag == ops[i]->tag) &&
+         (ops[j]->bnum < ops[i]->bnum + ops[i]->blks) && (ops[i]->bnum < ops[j]->bnum + ops[j]->blks)); j++);
+    if (j == i) {
+      served[i] = 1;
+      reads[numReads++] = ops[i];
+      self->asyncQueue.hoisted += (writes > 0);
+    }
+  }
+  async_reads(reads, numReads);
+
+  for (i = 0; i < n; i = j) {
+    if (ops[i]->type == TAGLINE_IO_WRITE) {
+      ops[i]->result = tagline_write_blocks(ops[i]->tag, ops[i]->bnum, ops[i]->blks, ops[i]->buf);
+      async_complete(ops[i]);
+      j = i + 1;
+      continue;
+    }
+    for (j = i, numReads = 0; (j < n) && (ops[j]->type == TAGLINE_IO_READ); j++) {
+      if (!served[j]) {
+        reads[numReads++] = ops[j];
+      }
+    }
+    async_reads(reads, numReads);
+  }
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : async_batch
+// Description  : Run the thread's queue as one batch, alongside the other
+//                threads' operations, holding the line locks of all of its
+//                taglines
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int async_batch(void) {
+  uint64_t lines = 0;
+  TaglineIO *io;
+  int ret;
+
+  if (self->asyncQueue.head == NULL) {
+    return(0);
+  }
+  for (io = self->asyncQueue.head; io != NULL; io = io->next) {
+    lines |= 1ULL << (io->tag % TAGLINE_LINE_LOCKS);
+  }
+  lines_lock(lines);
+  ret = async_run();
+  lines_unlock(lines);
+  return((driver_upkeep() || ret) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_submit
+// Description  : Queue an asynchronous read or write.  It runs with the rest
+//                of the queue at the next tagline_poll or tagline_wait and
+//                completes to its callback, or to be reaped by them.  The
+//                buffer (or views) must be left alone until then.  Every
+//                thread has a queue of its own, and callbacks run with the
+//                taglines locked so they may only call tagline_submit
+//
+// Inputs       : io - the operation
+// Outputs      : 0 if successful, -1 if it is out of range or the queue is full
+
+int tagline_submit(TaglineIO *io) {
+  if (thread_enter() == NULL) {
+    return(-1);
+  }
+  if (self->asyncQueue.outstanding >= queueDepth) {
+    logMessage(LOG_INFO_LEVEL, "TAGLINE : queue full, %u operations outstanding", self->asyncQueue.outstanding);
+    return(-1);
+  }
+  if (async_valid(io)) {
+    return(-1);
+  }
+  async_enqueue(io);
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_poll
+// Description  : Reap completed operations.  If none are waiting, the queued
+//                operations are run first (this is where the driver talks to
+//                the bus)
+//
+// Inputs       : done - filled in with the completed operations
+//                max - room in done
+// Outputs      : the number reaped, -1 if failure
+
+int tagline_poll(TaglineIO **done, uint32_t max) {
+  uint32_t n;
+
+  if (thread_enter() == NULL) {
+    return(-1);
+  }
+  if ((self->asyncQueue.doneHead == NULL) && async_batch()) {
+    return(-1);
+  }
+  for (n = 0; (n < max) && (self->asyncQueue.doneHead != NULL); n++) {
+    done[n] = self->asyncQueue.doneHead;
+    self->asyncQueue.doneHead = done[n]->next;
+    done[n]->next = NULL;
+    self->asyncQueue.outstanding--;
+  }
+  if (self->asyncQueue.doneHead == NULL) {
+    self->asyncQueue.doneTail = NULL;
+  }
+  return(n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_wait
+// Description  : Run queued operations until at least min completed ones
+//                have been reaped.  It returns early with fewer if nothing is
+//                left queued (operations with callbacks are never reaped)
+//
+// Inputs       : done - filled in with the completed operations
+//                min - the fewest to wait for
+//                max - room in done
+// Outputs      : the number reaped, -1 if failure
+
+int tagline_wait(TaglineIO **done, uint32_t min, uint32_t max) {
+  uint32_t n = 0;
+  int ret;
+
+  if ((min > max) || (thread_enter() == NULL)) {
+    return(-1);
+  }
+  while (n < min) {
+    if ((self->asyncQueue.doneHead == NULL) && (self->asyncQueue.head == NULL)) {
+      break;
+    }
+    if ((ret = tagline_poll(&done[n], max - n)) < 0) {
+      return(-1);
+    }
+    n += ret;
+  }
+  return(n);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : async_sync_done
+// Description  : The completion of a synchronous call, its caller is still
+//                there to look at the result
+//
+// Inputs       : io - the operation
+// Outputs      : none
+
+static void async_sync_done(TaglineIO *io) {
+  (void)io;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : async_sync
+// Description  : Run one operation to completion, with whatever else is
+//                queued.  It does not count against the queue depth
+//
+// Inputs       : io - the operation
+// Outputs      : 0 if successful, -1 if failure
+
+static int async_sync(TaglineIO *io) {
+  if ((thread_enter() == NULL) || async_valid(io)) {
+    return(-1);
+  }
+  io->done = async_sync_done;
+  async_enqueue(io);
+  if (async_batch()) {
+    return(-1);
+  }
+  return(io->result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_read
+// Description  : Read a number of blocks from the tagline driver
+//
+// Inputs       : tag - the number of the tagline to read from
+//                bnum - the starting block to read from
+//                blks - the number of blocks to read
+//                bug - memory block to read the blocks into
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_read(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf) {
+  TaglineIO io = { .type = TAGLINE_IO_READ, .tag = tag, .bnum = bnum, .blks = blks, .buf = buf };
+
+  return async_sync(&io);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_read_view
+// Description  : Read a number of blocks from the tagline driver as views,
+//                cached blocks are pinned in the cache rather than copied.
+//                The views must be released with tagline_release_view
+//
+// Inputs       : tag - the number of the tagline to read from
+//                bnum - the starting block to read from
+//                blks - the number of blocks to read
+//                views - the views to fill in, one per block
+// Outputs      : 0 if successful, -1 if failure (nothing is left pinned)
+
+int tagline_read_view(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, RAIDCacheView *views) {
+  TaglineIO io = { .type = TAGLINE_IO_READ, .tag = tag, .bnum = bnum, .blks = blks, .views = views };
+
+  return async_sync(&io);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_write
+// Description  : Write a number of blocks to the tagline driver
+//
+// Inputs       : tag - the number of the tagline to write to
+//                bnum - the starting block to write to
+//                blks - the number of blocks to write
+//                buf - memory block holding the blocks
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_write(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf) {
+  TaglineIO io = { .type = TAGLINE_IO_WRITE, .tag = tag, .bnum = bnum, .blks = blks, .buf = buf };
+
+  return async_sync(&io);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : vector_pieces
+// Description  : Split the segments of a vectored call into one operation per
+//                buffer, each buffer holding a whole number of blocks
+//
+// Inputs       : segs - the segments
+//                n - the number of segments
+//                type - TAGLINE_IO_READ or TAGLINE_IO_WRITE
+//                pieces - set to the operations (to be freed)
+//                lines - set to a bit per line lock the taglines need
+// Outputs      : the number of operations, -1 if failure
+
+static int vector_pieces(const TaglineSegment *segs, uint32_t n, TaglineIOType type, TaglineIO **pieces, uint64_t *lines) {
+  uint32_t i, num = 0, off;
+  int k;
+
+  for (i = 0; i < n; i++) {
+    num += (segs[i].iovcnt > 0) ? segs[i].iovcnt : 0;
+  }
+  if ((*pieces = calloc((num > 0) ? num : 1, sizeof(TaglineIO))) == NULL) {
+    return(-1);
+  }
+  *lines = 0;
+  for (i = 0, num = 0; i < n; i++) {
+    for (k = 0, off = 0; k < segs[i].iovcnt; k++) {
+      if ((segs[i].iov[k].iov_len % RAID_BLOCK_SIZE) || (off + segs[i].iov[k].iov_len / RAID_BLOCK_SIZE > segs[i].blks)) {
+        break;
+      }
+      if (segs[i].iov[k].iov_len == 0) {
+        continue;
+      }
+      (*pieces)[num] = (TaglineIO){ .type = type, .tag = segs[i].tag, .bnum = segs[i].bnum + off,
+          .blks = segs[i].iov[k].iov_len / RAID_BLOCK_SIZE, .buf = segs[i].iov[k].iov_base };
+      if (async_valid(&(*pieces)[num])) {
+        free(*pieces);
+        return(-1);
+      }
+      off += (*pieces)[num++].blks;
+    }
+    if (off != segs[i].blks) {
+      logMessage(LOG_ERROR_LEVEL, "TAGLINE : segment %u of tagline %u has buffers for %u blocks, not %u (whole blocks each)",
+          i, segs[i].tag, off, segs[i].blks);
+      free(*pieces);
+      return(-1);
+    }
+    *lines |= 1ULL << (segs[i].tag % TAGLINE_LINE_LOCKS);
+  }
+  return(num);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_readv
+// Description  : Read a number of segments, each scattered over buffers of
+//                its own.  They are served as one batch of reads, so their
+//                misses are fetched together: runs are merged across the
+//                segments and a block more than one wants is fetched once.
+//                Anything the thread has queued runs first
+//
+// Inputs       : segs - the segments
+//                n - the number of segments
+// Outputs      : 0 if successful, -1 if any of them failed
+
+int tagline_readv(const TaglineSegment *segs, uint32_t n) {
+  TaglineIO *pieces, *ios[TAGLINE_QUEUE_MAX];
+  uint64_t lines;
+  int num, i, k, m, ret = 0;
+
+  if ((thread_enter() == NULL) || async_batch() || ((num = vector_pieces(segs, n, TAGLINE_IO_READ, &pieces, &lines)) < 0)) {
+    return(-1);
+  }
+  lines_lock(lines);
+  self->asyncQueue.vectored++;
+  self->asyncQueue.segments += n;
+
+  //a batch of reads holds at most a queue's worth
+  for (i = 0; (i < num) && !ret; i += m) {
+    for (m = 0; (m < TAGLINE_QUEUE_MAX) && (i + m < num); m++) {
+      ios[m] = &pieces[i + m];
+    }
+    ret = tagline_read_batch(ios, m);
+    for (k = 0; k < m; k++) {
+      ret |= ios[k]->result;
+    }
+  }
+  lines_unlock(lines);
+  free(pieces);
+  return((driver_upkeep() || ret) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_vector_blocks
+// Description  : Order the blocks of a tagline_writev by tagline and block,
+//                the copies of a block in the order they were given
+//
+// Inputs       : a, b - the blocks
+// Outputs      : <0, 0 or >0
+
+static int compare_vector_blocks(const void *a, const void *b) {
+  const struct vector_block *x = a, *y = b;
+
+  if (x->tag != y->tag) {
+    return (x->tag < y->tag) ? -1 : 1;
+  }
+  if (x->bnum != y->bnum) {
+    return (x->bnum < y->bnum) ? -1 : 1;
+  }
+  return (x->order < y->order) ? -1 : (x->order > y->order);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_vector_places
+// Description  : Order the blocks of a tagline_writev by where their primary
+//                is, the unwritten ones last (by tagline and block)
+//
+// Inputs       : a, b - the blocks
+// Outputs      : <0, 0 or >0
+
+static int compare_vector_places(const void *a, const void *b) {
+  const struct vector_block *x = a, *y = b;
+
+  if (x->primaryDisk != y->primaryDisk) {
+    return (x->primaryDisk < y->primaryDisk) ? -1 : 1;
+  }
+  if (x->primaryBlock != y->primaryBlock) {
+    return (x->primaryBlock < y->primaryBlock) ? -1 : 1;
+  }
+  return compare_vector_blocks(a, b);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : vector_mirror
+// Description  : Write the blocks of a tagline_writev to their mirrors.  The
+//                blocks that are already written go out a run of adjacent
+//                primaries (and backups) at a time, whatever segments they
+//                came from, and the unwritten ones are placed together in
+//                as few extents as there is room for
+//
+// Inputs       : blocks - the blocks, one per tagline block
+//                n - the number of blocks
+//                gather - room for RAID_MAX_XFER blocks
+// Outputs      : 0 if successful, -1 if failure
+
+static int vector_mirror(struct vector_block *blocks, uint32_t n, char *gather) {
+  int primaryDisk, primaryBlock, backUpDisk, backUpBlock, done;
+  const struct tagline_entry *e;
+  struct vector_block *b;
+  uint32_t i, j, k, run;
+
+  for (i = 0; i < n; i++) {
+    e = tagline_lookup(blocks[i].tag, blocks[i].bnum);
+    blocks[i].primaryDisk = (e->primaryDisk == TAGLINE_UNMAPPED) ? RAID_DISKS : e->primaryDisk;
+    blocks[i].primaryBlock = (e->primaryDisk == TAGLINE_UNMAPPED) ? 0 : e->primaryBlock;
+    blocks[i].backUpDisk = e->backUpDisk;
+    blocks[i].backUpBlock = e->backUpBlock;
+  }
+  qsort(blocks, n, sizeof(struct vector_block), compare_vector_places);
+
+  //an overwrite run is blocks whose primaries, and backups, follow each other
+  for (i = 0; (i < n) && (blocks[i].primaryDisk < RAID_DISKS); i = j) {
+    b = &blocks[i];
+    for (j = i + 1; (j < n) && (j - i < RAID_MAX_XFER) && (blocks[j].primaryDisk == b->primaryDisk) &&
+         (blocks[j].primaryBlock == b->primaryBlock + (int)(j - i)) && (blocks[j].backUpDisk == b->backUpDisk) &&
+         ((b->backUpDisk == TAGLINE_UNMAPPED) || (blocks[j].backUpBlock == b->backUpBlock + (int)(j - i))); j++);
+    for (k = i; k < j; k++) {
+      memcpy(&gather[(k - i)*RAID_BLOCK_SIZE], blocks[k].src, RAID_BLOCK_SIZE);
+    }
+    self->asyncQueue.vectorRuns++;
+    if (mirror_write(j - i, b->primaryDisk, b->primaryBlock, b->backUpDisk, b->backUpBlock, gather, &done)) {
+      for (k = i; (k < j) && (done != 0); k++) {
+        logMessage(LOG_ERROR_LEVEL, "TAGLINE : overwrite of tagline %u block %u reached one replica, the other is dropped", blocks[k].tag, blocks[k].bnum);
+        mirror_rollback(blocks[k].tag, blocks[k].bnum, 1, done, blocks[k].src);
+      }
+      return -1;
+    }
+    for (k = i; k < j; k++) {
+      if (tagline_cache_write((RAIDDiskID)blocks[k].primaryDisk, (RAIDBlockID)blocks[k].primaryBlock, blocks[k].src)) {
+        return -1;
+      }
+    }
+  }
+
+  //the unwritten blocks of every segment fill extents together
+  for (; i < n; i += run) {
+    run = ((n - i) > RAID_MAX_XFER) ? RAID_MAX_XFER : (n - i);
+    if ((run = extent_claim(run, &primaryDisk, &primaryBlock, &backUpDisk, &backUpBlock)) == 0) {
+      return -1;
+    }
+    for (k = 0; k < run; k++) {
+      memcpy(&gather[k*RAID_BLOCK_SIZE], blocks[i + k].src, RAID_BLOCK_SIZE);
+    }
+    self->asyncQueue.vectorRuns++;
+    logMessage(LOG_INFO_LEVEL, "Fresh write of %u block(s) to Primary and Backup Disk", run);
+    if (mirror_write(run, primaryDisk, primaryBlock, backUpDisk, backUpBlock, gather, &done)) {
+      logMessage(LOG_ERROR_LEVEL, "TAGLINE : fresh write of tagline %u block %u failed, not mapped", blocks[i].tag, blocks[i].bnum);
+      return -1;
+    }
+    for (k = 0; k < run; k++) {
+      if (block_map(blocks[i + k].tag, blocks[i + k].bnum, primaryDisk, primaryBlock + k, backUpDisk, backUpBlock + k, blocks[i + k].src)) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_writev
+// Description  : Write a number of segments, each gathered from buffers of
+//                its own, as if they were written in turn (where two overlap
+//                the later one wins).  The blocks are planned together: on
+//                mirrors each run of adjacent disk blocks goes out as one
+//                request per replica whichever segments it came from, and
+//                otherwise the blocks of each tagline are written in as few
+//                calls as they are contiguous.  Anything the thread has
+//                queued runs first
+//
+// Inputs       : segs - the segments
+//                n - the number of segments
+// Outputs      : 0 if successful, -1 if failure
+
+int tagline_writev(const TaglineSegment *segs, uint32_t n) {
+  struct vector_block *blocks;
+  TaglineIO *pieces;
+  uint64_t lines;
+  uint32_t num = 0, i, j, k;
+  char *gather;
+  int numPieces, p, ret = 0;
+
+  if ((thread_enter() == NULL) || async_batch() || ((numPieces = vector_pieces(segs, n, TAGLINE_IO_WRITE, &pieces, &lines)) < 0)) {
+    return(-1);
+  }
+  for (p = 0; p < numPieces; p++) {
+    num += pieces[p].blks;
+  }
+  blocks = malloc(((num > 0) ? num : 1) * sizeof(struct vector_block));
+  gather = malloc(MAX_TAGLINE_BLOCK_NUMBER * RAID_BLOCK_SIZE);
+  if ((blocks == NULL) || (gather == NULL)) {
+    free(pieces);
+    free(blocks);
+    free(gather);
+    return(-1);
+  }
+
+  //one block per tagline block, the last copy of each
+  for (p = 0, num = 0; p < numPieces; p++) {
+    for (i = 0; i < pieces[p].blks; i++, num++) {
+      blocks[num] = (struct vector_block){ .tag = pieces[p].tag, .bnum = pieces[p].bnum + i,
+          .src = &pieces[p].buf[i*RAID_BLOCK_SIZE], .order = num };
+    }
+  }
+  qsort(blocks, num, sizeof(struct vector_block), compare_vector_blocks);
+  for (i = 0, j = 0; i < num; i++) {
+    if ((i + 1 < num) && (blocks[i + 1].tag == blocks[i].tag) && (blocks[i + 1].bnum == blocks[i].bnum)) {
+      continue;
+    }
+    blocks[j++] = blocks[i];
+  }
+  num = j;
+
+  lines_lock(lines);
+  self->asyncQueue.vectored++;
+  self->asyncQueue.segments += n;
+  if (!writeBack.enabled && (stripe.parityDisks == 0)) {
+    if (rebuild_tick() || writeback_tick()) {
+      ret = -1;
+    } else {
+      __atomic_fetch_add(&stripe.written, num, __ATOMIC_RELAXED);
+      ret = (vector_mirror(blocks, num, gather) || journal_tick()) ? -1 : 0;
+    }
+  } else {
+
+    //the cache (or the open stripe) takes each tagline's contiguous blocks in one call, as many as a call can count
+    for (i = 0; (i < num) && !ret; i = j) {
+      for (j = i + 1; (j < num) && (j - i < RAID_MAX_XFER) && (blocks[j].tag == blocks[i].tag) && (blocks[j].bnum == blocks[i].bnum + (j - i)); j++);
+      for (k = i; k < j; k++) {
+        memcpy(&gather[(k - i)*RAID_BLOCK_SIZE], blocks[k].src, RAID_BLOCK_SIZE);
+      }
+      self->asyncQueue.vectorRuns++;
+      ret = tagline_write_blocks(blocks[i].tag, blocks[i].bnum, j - i, gather);
+    }
+  }
+  lines_unlock(lines);
+  free(pieces);
+  free(blocks);
+  free(gather);
+  return((driver_upkeep() || ret) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : driver_close
+// Description  : Close the tagline interface
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int driver_close(void) {
+  struct cache_statistics stats;
+  struct bus_statistics bus;
+  struct async_queue async;
+  RAIDOpCode closeResp;
+  long int busTotal = 0;
+  char diskReads[RAID_DISKS * 24];
+  int t, n, peak, numThreads;
+
+  //what the closing thread still has queued runs first, its completions are left to be reaped
+  if (async_run()) {
+    return -1;
+  }
+
+  //the disks are left whole, and nothing may stay dirty in the cache once they are closed
+  if (rebuild_drain() || (writeBack.enabled && writeback_flush_all()) || (scrub.atClose && scrub_all())) {
+    return -1;
+  }
+
+  //the open stripe's parity goes out as it stands, so its data survives a disk lost while the driver is down
+  if ((stripe.parityDisks > 0) && stripe_seal()) {
+    return -1;
+  }
+
+  //a checkpoint at close leaves the next init only the checkpoint to replay
+  if ((journal.path != NULL) && journal_checkpoint()) {
+    return -1;
+  }
+  journal_close(&journal);
+
+  //the snapshot needs the mapping, so save it before the mapping is freed
+  if (snapshotPath != NULL) {
+    snapshot_save();
+  }
+
+  //Release the mapping table
+  logMessage(LOG_INFO_LEVEL, "TAGLINE : %u of %u taglines were written", mapping.liveLines, gmaxLines);
+  mapping_free();
+
+  closeResp = tagline_bus_request(create_raid_request(RAID_CLOSE, 0, 0, 0, 0, 0),NULL);
+  numThreads = threads_total(&stats, &bus, &async, &peak);
+
+  logMessage(LOG_OUTPUT_LEVEL, "** Cache statistics **");
+  logMessage(LOG_OUTPUT_LEVEL, "Total cache inserts %ld", stats.inserts);
+  logMessage(LOG_OUTPUT_LEVEL, "Total cache gets %ld", stats.gets);
+  logMessage(LOG_OUTPUT_LEVEL, "Total cache hits %ld", stats.hits);
+  logMessage(LOG_OUTPUT_LEVEL, "Total cache misses %ld", stats.misses);
+  logMessage(LOG_OUTPUT_LEVEL, "Cache efficiency %.4f", (stats.gets) ? (float)stats.hits/(float)stats.gets : 0.0);
+  for (t = 0; t < RAID_MAXVAL; t++) {
+    busTotal += bus.requests[t];
+  }
+  logMessage(LOG_OUTPUT_LEVEL, "Bus requests %ld: %ld reads (%ld blocks), %ld writes (%ld blocks), %ld other", busTotal,
+      bus.requests[RAID_READ], bus.blocks[RAID_READ], bus.requests[RAID_WRITE], bus.blocks[RAID_WRITE],
+      busTotal - bus.requests[RAID_READ] - bus.requests[RAID_WRITE]);
+  if (balance.numRecent > 0) {
+    logMessage(LOG_OUTPUT_LEVEL, "Read latency p50 %u us, p99 %u us, p99.9 %u us (%s balancing, %ld runs hedged to a mirror)",
+        latency_percentile(500), latency_percentile(990), latency_percentile(999), TAGLINE_READ_POLICY_LABELS[balance.policy], balance.steered);
+    for (t = 0, n = 0; t < RAID_DISKS; t++) {
+      n += snprintf(&diskReads[n], sizeof(diskReads) - n, " %ld", balance.diskBlocks[t]);
+    }
+    logMessage(LOG_OUTPUT_LEVEL, "Read blocks per disk%s", diskReads);
+  }
+  if (rebuild.disks > 0) {
+    logMessage(LOG_OUTPUT_LEVEL, "Rebuilds %ld, %ld blocks (%ld from the cache, %ld lost) in %ld requests, longest disk failure stall %ld us",
+        rebuild.disks, rebuild.blocks, rebuild.fromCache, rebuild.lost, rebuild.requests, rebuild.signalUs);
+    logMessage(LOG_OUTPUT_LEVEL, "Rebuild throughput %.0f blocks/s, time to redundancy %.2f ms average, %.2f ms longest",
+        (rebuild.busyUs > 0) ? rebuild.blocks * 1000000.0 / rebuild.busyUs : 0.0,
+        (rebuild.finished > 0) ? rebuild.ttrUs / 1000.0 / rebuild.finished : 0.0, rebuild.ttrMaxUs / 1000.0);
+  }
+  logMessage(LOG_OUTPUT_LEVEL, "Layout %s, %ld blocks written with %ld bus blocks (%.2f bus bytes per byte written)",
+      TAGLINE_LAYOUT_LABELS[stripe.layout], stripe.written, stripe.busBlocks, (stripe.written) ? (double)stripe.busBlocks / stripe.written : 0.0);
+  if (stripe.parityDisks > 0) {
+    logMessage(LOG_OUTPUT_LEVEL, "Parity stripes %ld full, %ld read-modify-writes, %ld reconstruct-writes, %ld full-row updates, %ld degraded reads (%ld blocks), %s kernels",
+        stripe.fullStripes, stripe.readModifyWrites, stripe.reconstructWrites, stripe.fullRows, stripe.degradedReads, stripe.degradedBlocks, parity_kernel());
+  }
+  if (scrub.atClose) {
+    logMessage(LOG_OUTPUT_LEVEL, "Scrub of %ld blocks in %ld requests (%ld us), %ld %s repaired",
+        scrub.blocks, scrub.requests, scrub.us, scrub.repaired, (stripe.parityDisks > 0) ? "parity blocks" : "backups");
+  }
+  if (journalPath != NULL) {
+    logMessage(LOG_OUTPUT_LEVEL, "Journal %lu records in %lu group commits (%lu us syncing), %lu checkpoints, %lu bytes",
+        (unsigned long)journal.records, (unsigned long)journal.commits, (unsigned long)journal.syncUs,
+        (unsigned long)journal.checkpoints, (unsigned long)journal.bytes);
+  }
+  if (queueDepth > 1) {
+    logMessage(LOG_OUTPUT_LEVEL, "Async %ld operations in %ld batches, %ld read groups (%ld reads ahead of a write, %ld blocks shared), %d reads on the bus at most",
+        async.ops, async.batches, async.readGroups, async.hoisted, async.shared, peak);
+  }
+  if (async.vectored > 0) {
+    logMessage(LOG_OUTPUT_LEVEL, "Vectored %ld calls of %ld segments, writes in %ld runs",
+        async.vectored, async.segments, async.vectorRuns);
+  }
+  if (numThreads > 1) {
+    logMessage(LOG_OUTPUT_LEVEL, "Threads %d called the driver, which ran alongside %ld of %ld bus waits",
+        numThreads, bus.yields, bus.waits);
+  }
+  if (mirrorRollbacks > 0) {
+    logMessage(LOG_OUTPUT_LEVEL, "Mirror writes left %ld blocks without a backup", mirrorRollbacks);
+  }
+  report_raid_cache();
+  if (writeBack.enabled) {
+    logMessage(LOG_OUTPUT_LEVEL, "Write-back absorbed overwrites %ld", writeBack.absorbed);
+    logMessage(LOG_OUTPUT_LEVEL, "Write-back flushed %ld blocks in %ld requests", writeBack.flushedBlocks, writeBack.flushRequests);
+  }
+  if (readAhead.streams != NULL) {
+    logMessage(LOG_OUTPUT_LEVEL, "Read-ahead prefetched %ld blocks in %ld requests, %ld used (%.4f)", readAhead.prefetched,
+               readAhead.requests, readAhead.used, (readAhead.prefetched) ? (float)readAhead.used/(float)readAhead.prefetched : 0.0);
+    logMessage(LOG_OUTPUT_LEVEL, "Read requests %ld (%ld for misses)", readAhead.requests + readAhead.demandRequests, readAhead.demandRequests);
+    free(readAhead.streams);
+    readAhead.streams = NULL;
+  }
+
+  if (status_check_helper(closeResp, "CLOSE")){
+    return -1;
+  }
+  close_raid_cache();
+  set_raid_cache_writeback(NULL);
+  free(writeBack.staged);
+  writeBack.staged = NULL;
+  writeBack.maxStaged = 0;
+
+  close_connection();
+
+  //a block no rebuild had a good copy of is gone, so the run is not a success however it ended
+  if (rebuild.lost > 0) {
+    logMessage(LOG_ERROR_LEVEL, "TAGLINE : %ld blocks were lost to disk failures", rebuild.lost);
+    return -1;
+  }
+
+	// Return successfully
+	logMessage(LOG_INFO_LEVEL, "TAGLINE storage device: closing completed.");
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : tagline_close
+// Description  : Close the tagline interface, once every operation in
+//                progress has finished
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure (or a disk failure lost blocks)
+
+int tagline_close(void) {
+  if (driver_enter(1)) {
+    return -1;
+  }
+  return driver_leave(driver_close());
 }
@@ -12,6 +12,7 @@
 //
 
 // Includes
+#include <sys/uio.h>
 #include "raid_bus.h"
 
 // Project Includes
@@ -23,6 +24,55 @@
 // Type definitions
 typedef uint16_t TagLineNumber;
 typedef uint32_t TagLineBlockNumber;
+struct raid_cache_view;
+
+// Which replica a read goes to when either would do
+typedef enum {
+	TAGLINE_READ_PRIMARY           = 0,  // The primary copy
+	TAGLINE_READ_ROUND_ROBIN       = 1,  // The disk after the last one read
+	TAGLINE_READ_LEAST_OUTSTANDING = 2,  // The disk with the fewest unanswered requests
+	TAGLINE_READ_EWMA              = 3,  // The disk with the lowest recent read latency
+	TAGLINE_READ_POLICY_MAX        = 4,
+} TaglineReadPolicy;
+extern const char *TAGLINE_READ_POLICY_LABELS[TAGLINE_READ_POLICY_MAX];
+
+// How the redundancy of a block is kept
+typedef enum {
+	TAGLINE_LAYOUT_MIRROR = 0,  // A backup copy on the disk after the primary
+	TAGLINE_LAYOUT_RAID5  = 1,  // Stripes with one rotating XOR parity block per row
+	TAGLINE_LAYOUT_RAID6  = 2,  // Stripes with rotating P and Q parity blocks per row
+	TAGLINE_LAYOUT_MAX    = 3,
+} TaglineLayout;
+extern const char *TAGLINE_LAYOUT_LABELS[TAGLINE_LAYOUT_MAX];
+
+// What an asynchronous operation does
+typedef enum {
+	TAGLINE_IO_READ  = 0,  // Read blocks into buf (or views)
+	TAGLINE_IO_WRITE = 1,  // Write blocks from buf
+} TaglineIOType;
+
+// An asynchronous read or write, the driver's from submission until it completes
+typedef struct tagline_io {
+	TaglineIOType type;
+	TagLineNumber tag;
+	TagLineBlockNumber bnum;
+	uint8_t blks;
+	char *buf;                            // the blocks to write, or room for the blocks read
+	struct raid_cache_view *views;        // a read fills these instead of buf (NULL for buf)
+	void (*done)(struct tagline_io *io);  // called on completion (NULL to reap it with tagline_poll/tagline_wait)
+	void *ctx;                            // the caller's own
+	int result;                           // 0 if it succeeded, -1 if not, set on completion
+	struct tagline_io *next;              // the driver's own
+} TaglineIO;
+
+// A segment of a vectored read or write, its blocks laid out over the buffers in turn
+typedef struct {
+	TagLineNumber tag;
+	TagLineBlockNumber bnum;
+	uint8_t blks;
+	const struct iovec *iov;              // each a whole number of blocks long, blks blocks in all
+	int iovcnt;
+} TaglineSegment;
 
 //
 // Interface functions
@@ -32,15 +82,81 @@ int extract_raid_response(RAIDOpCode, char*);
 int tagline_driver_init(uint32_t maxlines);
 	// Initialize the driver with a number of maximum lines to process
 
+int tagline_driver_init_cache(uint32_t maxlines, uint32_t cache_blocks);
+	// Initialize the driver with a number of maximum lines and a cache size (blocks)
+
 int tagline_read(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf);
 	// Read a number of blocks from the tagline driver
 
+int tagline_read_view(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, struct raid_cache_view *views);
+	// Read a number of blocks as pinned cache views instead of copies
+
+int tagline_release_view(struct raid_cache_view *views, uint8_t blks);
+	// Release the views from tagline_read_view
+
 int tagline_write(TagLineNumber tag, TagLineBlockNumber bnum, uint8_t blks, char *buf);
 	// Write a number of blocks from the tagline driver
 
+int tagline_readv(const TaglineSegment *segs, uint32_t n);
+	// Read a number of segments, their misses fetched together in as few requests as possible
+
+int tagline_writev(const TaglineSegment *segs, uint32_t n);
+	// Write a number of segments, merging their blocks into as few runs as possible
+
+int tagline_queue_depth(uint32_t depth);
+	// Most asynchronous operations outstanding, and reads a batch keeps on the bus at once
+
+int tagline_submit(TaglineIO *io);
+	// Queue an asynchronous read or write, -1 if it is out of range or the queue is full
+
+int tagline_poll(TaglineIO **done, uint32_t max);
+	// Reap up to max completed operations, running the queued ones if none are waiting
+
+int tagline_wait(TaglineIO **done, uint32_t min, uint32_t max);
+	// Run queued operations until min (up to max) are reaped, fewer if nothing else is queued
+
 int tagline_close(void);
 	// Close the tagline interface
 
+int tagline_write_back(int enable, uint32_t interval_ms);
+	// Absorb writes in the cache (flushed on eviction, timer, flush and close)
+
+int tagline_cache_budget(uint32_t max_blocks);
+	// Let the cache resize itself up to max_blocks from its miss ratio curve (0 = fixed)
+
+int tagline_layout(TaglineLayout layout);
+	// Choose mirroring or a striped parity layout for the next init
+
+int tagline_mirror_writes(int concurrent);
+	// Send the primary and backup writes of a block together (1) or one after the other (0)
+
+int tagline_read_balance(TaglineReadPolicy policy, uint32_t hedge_percentile);
+	// Balance reads over the replicas, steering off disks slower than a latency percentile (0 = off)
+
+int tagline_read_ahead(uint32_t max_depth);
+	// Prefetch sequential and strided tagline reads up to max_depth reads ahead (0 = off)
+
+int tagline_cache_snapshot(const char *path);
+	// Save the cache to path at close and warm start from it at init
+
+int tagline_journal(const char *path);
+	// Journal mapping updates to path, replaying them at the next init (NULL = off)
+
+int tagline_flush(void);
+	// Write every dirty cached block back to the disks
+
+int tagline_rebuild_rate(uint32_t blocks_per_op);
+	// Rebuild failed disks blocks_per_op blocks between foreground operations (0 = all at once)
+
+int tagline_rebuild_limit(uint32_t blocks_per_sec);
+	// Cap the background rebuild at blocks_per_sec (0 = no cap)
+
+int tagline_scrub_at_close(int enable);
+	// Verify every backup against its primary when the driver is closed
+
+int tagline_scrub(void);
+	// Read every written primary and backup, rewriting backups that do not match
+
 int raid_disk_signal(void);
 	// A disk has failed which needs to be recovered
 
@@ -0,0 +1,519 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : tagline_journal.c
+//  Description    : This is the implementation of the metadata journal of the
+//                   TAGLINE driver.  The journal is a run of group commits,
+//                   each a header (sequence number, allocation cursors,
+//                   checksum) and the mapping updates it carries.  A
+//                   checkpoint holds the whole mapping under the sequence
+//                   number it was taken at, so commits left in the journal
+//                   from before it are skipped, and a torn commit at the end
+//                   of the journal (a crash mid-write) is cut off at replay.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+// Project includes
+#include <cmpsc311_log.h>
+#include <tagline_journal.h>
+
+// Defines
+#define JOURNAL_MIN_GROUP 256  // Records a group starts with room for
+#define JOURNAL_SUM_SEED  0x811c9dc5
+
+// Type definitions
+
+// The header of a group commit, followed by count records
+struct journal_group {
+  uint32_t magic;
+  uint32_t count;
+  uint64_t seq;
+  JournalCursors cursors;
+  uint32_t sum;                     // over the records, then the cursors
+  uint32_t unused;
+};
+
+// The header of a checkpoint, followed by count records
+struct journal_ckpt {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t maxLines;
+  uint32_t count;
+  uint64_t seq;
+  JournalCursors cursors;
+  uint32_t sum;                     // over the records, then the cursors
+  uint32_t unused;
+};
+
+//
+// Helpers
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_sum
+// Description  : Fold bytes into a checksum (FNV-1a)
+//
+// Inputs       : sum - the checksum so far (JOURNAL_SUM_SEED to start)
+//                buf, len - the bytes
+// Outputs      : the new checksum
+
+static uint32_t journal_sum(uint32_t sum, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+
+  while (len-- > 0) {
+    sum = (sum ^ *p++) * 0x01000193;
+  }
+  return sum;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_map
+// Description  : Map a whole file read only
+//
+// Inputs       : path - the file
+//                size - set to its size
+// Outputs      : the mapping, NULL if there is no file (or it is empty)
+
+static void *journal_map(const char *path, off_t *size) {
+  struct stat st;
+  void *map;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    return(NULL);
+  }
+  if ((fstat(fd, &st) == -1) || (st.st_size == 0)) {
+    close(fd);
+    return(NULL);
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  *size = st.st_size;
+  return (map == MAP_FAILED) ? NULL : map;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_replay_checkpoint
+// Description  : Apply the checkpoint, if there is a valid one
+//
+// Inputs       : j - the journal
+//                path - the checkpoint file
+//                maxlines - the taglines the driver was started with
+//                apply - called with every record
+//                cursors - set to the cursors of the checkpoint
+// Outputs      : the number of records, 0 if there is no checkpoint, -1 if it is not valid
+
+static int journal_replay_checkpoint(TaglineJournal *j, const char *path, uint32_t maxlines, void (*apply)(const JournalRecord *rec), JournalCursors *cursors) {
+  struct journal_ckpt *hdr;
+  JournalRecord *rec;
+  uint32_t i, sum;
+  off_t size;
+
+  if ((hdr = journal_map(path, &size)) == NULL) {
+    return(0);
+  }
+
+  //the whole file is checked before anything is applied
+  rec = (JournalRecord *)(hdr + 1);
+  if ((size < (off_t)sizeof(*hdr)) || (hdr->magic != JOURNAL_CKPT_MAGIC) || (hdr->version != JOURNAL_VERSION) ||
+      (hdr->maxLines != maxlines) || (size != (off_t)(sizeof(*hdr) + (size_t)hdr->count * sizeof(JournalRecord)))) {
+    munmap(hdr, size);
+    return(-1);
+  }
+  sum = journal_sum(JOURNAL_SUM_SEED, rec, (size_t)hdr->count * sizeof(JournalRecord));
+  if (journal_sum(sum, &hdr->cursors, sizeof(hdr->cursors)) != hdr->sum) {
+    munmap(hdr, size);
+    return(-1);
+  }
+
+  for (i = 0; i < hdr->count; i++) {
+    apply(&rec[i]);
+  }
+  *cursors = hdr->cursors;
+  j->seq = hdr->seq;
+  i = hdr->count;
+  munmap(hdr, size);
+  return(i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_replay_tail
+// Description  : Apply the group commits made after the checkpoint, cutting
+//                the journal off at the first torn or corrupt one
+//
+// Inputs       : j - the journal
+//                apply - called with every record
+//                cursors - set to the cursors of the last commit applied
+// Outputs      : the number of records, -1 if failure
+
+static int journal_replay_tail(TaglineJournal *j, void (*apply)(const JournalRecord *rec), JournalCursors *cursors) {
+  struct journal_group *hdr;
+  JournalRecord *rec;
+  char *map;
+  off_t size, pos = 0;
+  uint32_t i, sum;
+  int replayed = 0;
+
+  if ((map = journal_map(j->path, &size)) == NULL) {
+    return(0);
+  }
+
+  while (pos + (off_t)sizeof(*hdr) <= size) {
+    hdr = (struct journal_group *)&map[pos];
+    rec = (JournalRecord *)(hdr + 1);
+    if ((hdr->magic != JOURNAL_MAGIC) || (pos + (off_t)(sizeof(*hdr) + (size_t)hdr->count * sizeof(JournalRecord)) > size)) {
+      break;
+    }
+    sum = journal_sum(JOURNAL_SUM_SEED, rec, (size_t)hdr->count * sizeof(JournalRecord));
+    if (journal_sum(sum, &hdr->cursors, sizeof(hdr->cursors)) != hdr->sum) {
+      break;
+    }
+
+    //commits from before the checkpoint are already in it
+    if (hdr->seq > j->seq) {
+      for (i = 0; i < hdr->count; i++) {
+        apply(&rec[i]);
+      }
+      *cursors = hdr->cursors;
+      j->seq = hdr->seq;
+      j->sinceCheckpoint += hdr->count;
+      replayed += hdr->count;
+    }
+    pos += sizeof(*hdr) + (size_t)hdr->count * sizeof(JournalRecord);
+  }
+  munmap(map, size);
+
+  if (pos < size) {
+    logMessage(LOG_WARNING_LEVEL, "TAGLINE : cutting a torn commit of %ld bytes off journal %s", (long)(size - pos), j->path);
+    if (truncate(j->path, pos) == -1) {
+      return(-1);
+    }
+  }
+  return(replayed);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_sync_dir
+// Description  : Sync the directory holding a file, making a rename into it
+//                durable
+//
+// Inputs       : path - the file
+// Outputs      : 0 if successful, -1 if failure
+
+static int journal_sync_dir(const char *path) {
+  char dir[1024], *slash;
+  int fd, ret;
+
+  snprintf(dir, sizeof(dir), "%s", path);
+  if ((slash = strrchr(dir, '/')) == NULL) {
+    snprintf(dir, sizeof(dir), ".");
+  } else {
+    slash[(slash == dir) ? 1 : 0] = '\0';
+  }
+  if ((fd = open(dir, O_RDONLY | O_DIRECTORY)) == -1) {
+    return(-1);
+  }
+  ret = fsync(fd);
+  close(fd);
+  return (ret == -1) ? -1 : 0;
+}
+
+//
+// Journal interface
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_open
+// Description  : Replay the checkpoint and the journal tail, then open the
+//                journal for appending.  A checkpoint that is not valid (or
+//                is from another number of taglines) fails the open, leaving
+//                both files for the operator, as the journal alone is only a
+//                tail of changes and starting empty would format the disks
+//
+// Inputs       : j - the journal to initialize
+//                path - the journal file, the checkpoint is path.ckpt
+//                maxlines - the taglines the driver was started with
+//                apply - called with every record replayed, oldest first
+//                cursors - set to the replayed cursors (left alone if nothing was replayed)
+// Outputs      : the number of records replayed, -1 if failure
+
+int journal_open(TaglineJournal *j, const char *path, uint32_t maxlines, void (*apply)(const JournalRecord *rec), JournalCursors *cursors) {
+  char ckptPath[1024];
+  int fromCkpt, fromTail;
+
+  memset(j, 0, sizeof(TaglineJournal));
+  j->fd = -1;
+  if ((j->path = strdup(path)) == NULL) {
+    return(-1);
+  }
+  snprintf(ckptPath, sizeof(ckptPath), "%s.ckpt", path);
+
+  fromCkpt = journal_replay_checkpoint(j, ckptPath, maxlines, apply, cursors);
+  if (fromCkpt < 0) {
+    logMessage(LOG_ERROR_LEVEL, "TAGLINE : journal checkpoint %s is not valid or is for another number of taglines", ckptPath);
+    journal_close(j);
+    return(-1);
+  }
+  fromTail = journal_replay_tail(j, apply, cursors);
+
+  j->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if ((fromTail < 0) || (j->fd == -1)) {
+    logMessage(LOG_ERROR_LEVEL, "TAGLINE : unable to open journal %s", path);
+    journal_close(j);
+    return(-1);
+  }
+
+	// Return successfully
+	return(fromCkpt + fromTail);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_close
+// Description  : Close the journal, dropping records that were never committed
+//
+// Inputs       : j - the journal
+// Outputs      : none
+
+void journal_close(TaglineJournal *j) {
+  if (j->fd != -1) {
+    close(j->fd);
+  }
+  if (j->ckpt != NULL) {
+    fclose(j->ckpt);
+  }
+  free(j->group);
+  free(j->path);
+  j->fd = -1;
+  j->ckpt = NULL;
+  j->group = NULL;
+  j->path = NULL;
+  j->numGroup = j->maxGroup = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_append
+// Description  : Add a mapping update to the next group commit
+//
+// Inputs       : j - the journal
+//                rec - the update
+// Outputs      : 0 if successful, -1 if failure
+
+int journal_append(TaglineJournal *j, const JournalRecord *rec) {
+  JournalRecord *group;
+  uint32_t max;
+
+  if (j->numGroup == j->maxGroup) {
+    max = (j->maxGroup > 0) ? j->maxGroup * 2 : JOURNAL_MIN_GROUP;
+    if ((group = realloc(j->group, max * sizeof(JournalRecord))) == NULL) {
+      return(-1);
+    }
+    j->group = group;
+    j->maxGroup = max;
+  }
+  j->group[j->numGroup++] = *rec;
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_commit
+// Description  : Write the waiting records and the cursors to the journal as
+//                one group and sync it.  A failed write is cut back off so
+//                the commits after it stay readable
+//
+// Inputs       : j - the journal
+//                cursors - the allocation cursors after the records
+// Outputs      : 0 if successful, -1 if failure
+
+int journal_commit(TaglineJournal *j, const JournalCursors *cursors) {
+  struct journal_group hdr;
+  struct timeval start, end;
+  struct iovec iov[2];
+  size_t len;
+  off_t pos;
+
+  if ((j->fd == -1) || (j->numGroup == 0)) {
+    return(0);
+  }
+
+  //replay stops at the torn commit, anything appended after it would be lost
+  if (j->torn) {
+    logMessage(LOG_ERROR_LEVEL, "TAGLINE : journal %s ends in a torn commit, a checkpoint is needed", j->path);
+    return(-1);
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = JOURNAL_MAGIC;
+  hdr.count = j->numGroup;
+  hdr.seq = j->seq + 1;
+  hdr.cursors = *cursors;
+  hdr.sum = journal_sum(journal_sum(JOURNAL_SUM_SEED, j->group, (size_t)j->numGroup * sizeof(JournalRecord)), cursors, sizeof(*cursors));
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = j->group;
+  iov[1].iov_len = (size_t)j->numGroup * sizeof(JournalRecord);
+  len = iov[0].iov_len + iov[1].iov_len;
+
+  gettimeofday(&start, NULL);
+  pos = lseek(j->fd, 0, SEEK_END);
+  if ((writev(j->fd, iov, 2) != (ssize_t)len) || (fdatasync(j->fd) == -1)) {
+    logMessage(LOG_ERROR_LEVEL, "TAGLINE : unable to commit %u records to journal %s", j->numGroup, j->path);
+    if ((pos != -1) && (ftruncate(j->fd, pos) == -1)) {
+      logMessage(LOG_ERROR_LEVEL, "TAGLINE : unable to cut the failed commit off journal %s", j->path);
+      j->torn = 1;
+    }
+    return(-1);
+  }
+  gettimeofday(&end, NULL);
+
+  j->seq++;
+  j->commits++;
+  j->records += j->numGroup;
+  j->bytes += len;
+  j->syncUs += (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec);
+  j->sinceCheckpoint += j->numGroup;
+  j->numGroup = 0;
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_checkpoint_begin
+// Description  : Start writing a checkpoint, aside from the current one
+//
+// Inputs       : j - the journal
+// Outputs      : 0 if successful, -1 if failure
+
+int journal_checkpoint_begin(TaglineJournal *j) {
+  struct journal_ckpt hdr;
+  char tmp[1024];
+
+  snprintf(tmp, sizeof(tmp), "%s.ckpt.tmp", j->path);
+  if ((j->ckpt = fopen(tmp, "w")) == NULL) {
+    logMessage(LOG_ERROR_LEVEL, "TAGLINE : unable to create journal checkpoint %s", tmp);
+    return(-1);
+  }
+
+  //the header is only known at the end, this holds its place
+  memset(&hdr, 0, sizeof(hdr));
+  j->ckptRecords = 0;
+  j->ckptSum = JOURNAL_SUM_SEED;
+  if (fwrite(&hdr, sizeof(hdr), 1, j->ckpt) != 1) {
+    journal_checkpoint_abort(j);
+    return(-1);
+  }
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_checkpoint_add
+// Description  : Add one mapped block to the checkpoint being written
+//
+// Inputs       : j - the journal
+//                rec - the block and where it lives
+// Outputs      : 0 if successful, -1 if failure
+
+int journal_checkpoint_add(TaglineJournal *j, const JournalRecord *rec) {
+  if ((j->ckpt == NULL) || (fwrite(rec, sizeof(JournalRecord), 1, j->ckpt) != 1)) {
+    return(-1);
+  }
+  j->ckptSum = journal_sum(j->ckptSum, rec, sizeof(JournalRecord));
+  j->ckptRecords++;
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_checkpoint_abort
+// Description  : Throw away the checkpoint being written, the last good
+//                checkpoint and the journal are left as they are
+//
+// Inputs       : j - the journal
+// Outputs      : none
+
+void journal_checkpoint_abort(TaglineJournal *j) {
+  char tmp[1024];
+
+  if (j->ckpt == NULL) {
+    return;
+  }
+  snprintf(tmp, sizeof(tmp), "%s.ckpt.tmp", j->path);
+  fclose(j->ckpt);
+  j->ckpt = NULL;
+  unlink(tmp);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_checkpoint_end
+// Description  : Finish the checkpoint and rename it over the old one.  It
+//                holds everything the journal did, so the journal and the
+//                records waiting for a commit are dropped
+//
+// Inputs       : j - the journal
+//                cursors - the allocation cursors
+//                maxlines - the taglines the driver was started with
+// Outputs      : 0 if successful, -1 if failure
+
+int journal_checkpoint_end(TaglineJournal *j, const JournalCursors *cursors, uint32_t maxlines) {
+  struct journal_ckpt hdr;
+  char tmp[1024], ckptPath[1024];
+  int ret = 0;
+
+  if (j->ckpt == NULL) {
+    return(-1);
+  }
+  snprintf(tmp, sizeof(tmp), "%s.ckpt.tmp", j->path);
+  snprintf(ckptPath, sizeof(ckptPath), "%s.ckpt", j->path);
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = JOURNAL_CKPT_MAGIC;
+  hdr.version = JOURNAL_VERSION;
+  hdr.maxLines = maxlines;
+  hdr.count = j->ckptRecords;
+  hdr.seq = j->seq + 1;
+  hdr.cursors = *cursors;
+  hdr.sum = journal_sum(j->ckptSum, cursors, sizeof(*cursors));
+  ret |= (fseek(j->ckpt, 0, SEEK_SET) != 0) || (fwrite(&hdr, sizeof(hdr), 1, j->ckpt) != 1);
+  ret |= (fflush(j->ckpt) != 0) || (fsync(fileno(j->ckpt)) == -1);
+  ret |= (fclose(j->ckpt) != 0);
+  j->ckpt = NULL;
+  if (ret || rename(tmp, ckptPath)) {
+    logMessage(LOG_ERROR_LEVEL, "TAGLINE : unable to write journal checkpoint %s", ckptPath);
+    unlink(tmp);
+    return(-1);
+  }
+
+  //a crash before the journal is emptied is fine, its commits are older than the checkpoint
+  j->seq++;
+  j->checkpoints++;
+  j->numGroup = 0;
+  j->sinceCheckpoint = 0;
+  if (journal_sync_dir(j->path)) {
+    logMessage(LOG_ERROR_LEVEL, "TAGLINE : unable to sync the directory of journal checkpoint %s", ckptPath);
+    return(-1);
+  }
+  if (ftruncate(j->fd, 0) == -1) {
+    logMessage(LOG_ERROR_LEVEL, "TAGLINE : unable to empty journal %s", j->path);
+    return(-1);
+  }
+  j->torn = 0;
+
+	// Return successfully
+	return(0);
+}
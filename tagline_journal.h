@@ -0,0 +1,93 @@
+#ifndef TAGLINE_JOURNAL_INCLUDED
+#define TAGLINE_JOURNAL_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : tagline_journal.h
+//  Description    : This is the header file for the metadata journal of the
+//                   TAGLINE driver.  Mapping updates and the disk allocation
+//                   cursors are appended to a local file in group commits,
+//                   and the whole mapping is checkpointed to a second file
+//                   now and then, so a restarted driver gets its mapping
+//                   back from the checkpoint and the journal tail.
+//
+
+// Includes
+#include <stdio.h>
+#include <tagline_driver.h>
+
+// Defines
+#define JOURNAL_MAGIC       0x4c4e524a  // "JRNL", a group commit
+#define JOURNAL_CKPT_MAGIC  0x54504b43  // "CKPT", a checkpoint
+#define JOURNAL_VERSION     2
+
+// Type definitions
+
+// The new location of one tagline block (0xff disks to unmap it)
+typedef struct {
+	uint16_t tag;
+	uint16_t bnum;
+	uint8_t  primaryDisk;
+	uint8_t  backUpDisk;
+	uint16_t unused;
+	uint32_t primaryBlock;
+	uint32_t backUpBlock;
+} JournalRecord;
+
+// Where fresh writes are allocated
+typedef struct {
+	uint32_t currentDisk;               // disk the next fresh write starts on
+	int32_t  currentSize[RAID_DISKS];   // free blocks left at the end of each disk
+	uint32_t layout;                    // TaglineLayout the mapping was written with
+	uint32_t openStripe;                // stripe fresh writes fill in a parity layout
+	uint32_t filled;                    // data blocks of it written
+} JournalCursors;
+
+// The state of the journal
+typedef struct {
+	char    *path;             // the journal, the checkpoint is path.ckpt
+	int      fd;               // the journal, open for appending (-1 if closed)
+	uint64_t seq;              // sequence number of the last commit or checkpoint
+	JournalRecord *group;      // records waiting for the next commit
+	uint32_t numGroup;
+	uint32_t maxGroup;
+	uint32_t sinceCheckpoint;  // records committed since the last checkpoint
+	int      torn;             // a failed commit could not be cut off, only a checkpoint clears it
+	FILE    *ckpt;             // checkpoint being written
+	uint32_t ckptRecords;
+	uint32_t ckptSum;
+	uint64_t commits;          // statistics
+	uint64_t records;
+	uint64_t checkpoints;
+	uint64_t bytes;
+	uint64_t syncUs;
+} TaglineJournal;
+
+//
+// Journal interfaces
+
+int journal_open(TaglineJournal *j, const char *path, uint32_t maxlines, void (*apply)(const JournalRecord *rec), JournalCursors *cursors);
+	// Replay the checkpoint and the journal tail, then open the journal for appending
+
+void journal_close(TaglineJournal *j);
+	// Close the journal, dropping records that were never committed
+
+int journal_append(TaglineJournal *j, const JournalRecord *rec);
+	// Add a mapping update to the next group commit
+
+int journal_commit(TaglineJournal *j, const JournalCursors *cursors);
+	// Write the waiting records and the cursors to the journal and sync it
+
+int journal_checkpoint_begin(TaglineJournal *j);
+	// Start writing a checkpoint of the whole mapping
+
+int journal_checkpoint_add(TaglineJournal *j, const JournalRecord *rec);
+	// Add one mapped block to the checkpoint
+
+void journal_checkpoint_abort(TaglineJournal *j);
+	// Throw the checkpoint being written away, keeping the last one and the journal
+
+int journal_checkpoint_end(TaglineJournal *j, const JournalCursors *cursors, uint32_t maxlines);
+	// Finish the checkpoint, which replaces the journal and its waiting records
+
+#endif
@@ -0,0 +1,851 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : tagline_parity.c
+//  Description    : This is the implementation of the parity arithmetic of
+//                   the TAGLINE striped layouts.  The kernels (XOR, GF(2^8)
+//                   multiply-accumulate and P+Q generation) come in scalar,
+//                   SSE2, AVX2 and AVX-512 variants; every variant the CPU
+//                   has is checked against the scalar one at init and the
+//                   widest that agrees is used from then on.  Recovery
+//                   handles every case of one or two missing blocks: data
+//                   from P, data from Q, two data blocks from P and Q, and
+//                   lost parity recomputed from the data.
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PARITY_X86
+#endif
+
+// Project includes
+#include <cmpsc311_log.h>
+#include <tagline_parity.h>
+
+// Defines
+#define PARITY_POLY 0x11d      // x^8 + x^4 + x^3 + x^2 + 1
+#define PARITY_CHECK_LEN 4133  // Bytes per block in the self-check, not a multiple of any vector
+#define PARITY_BENCH_LEN 32768 // Bytes per block in the benchmark, one stripe chunk
+#define PARITY_BENCH_NS 50000000L // How long each benchmark runs
+
+// Type definitions
+typedef struct {
+  const char *name;
+  int (*supported)(void);
+  void (*xor)(uint8_t *dst, const uint8_t *src, size_t len);
+  void (*mul)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+  void (*mulXor)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+  void (*gen)(uint8_t **blocks, int ndata, int nparity, size_t len);
+} ParityKernel;
+
+// Globals
+static uint8_t gfExp[512];     // g^i, doubled so a sum of two logs needs no modulo
+static uint8_t gfLog[256];
+static const ParityKernel *kernel; // the variant in use
+
+//
+// Parity interface
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parity_gf_mul
+// Description  : Multiply two GF(2^8) elements
+//
+// Inputs       : a, b - the elements
+// Outputs      : the product
+
+uint8_t parity_gf_mul(uint8_t a, uint8_t b) {
+  if ((a == 0) || (b == 0)) {
+    return(0);
+  }
+  return gfExp[gfLog[a] + gfLog[b]];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parity_gf_pow
+// Description  : The generator to a power
+//
+// Inputs       : i - the power (may be negative)
+// Outputs      : g^i
+
+uint8_t parity_gf_pow(int i) {
+  i %= 255;
+  return gfExp[(i < 0) ? i + 255 : i];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parity_gf_inv
+// Description  : The inverse of a non-zero GF(2^8) element
+//
+// Inputs       : a - the element
+// Outputs      : 1/a
+
+static uint8_t parity_gf_inv(uint8_t a) {
+  return gfExp[255 - gfLog[a]];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parity_gen_tail
+// Description  : Generate P (and Q) for the bytes of a row past the last
+//                whole vector, Q by Horner's rule (Q = Q.g + D from the
+//                highest data block down)
+//
+// Inputs       : blocks - the data blocks, then P (and Q)
+//                ndata - the number of data blocks
+//                nparity - 1 for P, 2 for P and Q
+//                from - the first byte
+//                len - the length of each block in bytes
+// Outputs      : none
+
+static void parity_gen_tail(uint8_t **blocks, int ndata, int nparity, size_t from, size_t len) {
+  uint8_t p, q;
+  size_t i;
+  int k;
+
+  for (i = from; i < len; i++) {
+    p = q = blocks[ndata - 1][i];
+    for (k = ndata - 2; k >= 0; k--) {
+      p ^= blocks[k][i];
+      q = (uint8_t)((q << 1) ^ ((q & 0x80) ? (PARITY_POLY & 0xff) : 0)) ^ blocks[k][i];
+    }
+    blocks[ndata][i] = p;
+    if (nparity > 1) {
+      blocks[ndata + 1][i] = q;
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parity_scalar_*
+// Description  : The scalar kernels, a byte at a time through the log/exp
+//                tables.  These are the reference the others are checked
+//                against, so they keep to the definitions (Q is the sum of
+//                g^i times data block i)
+//
+// Inputs       : dst - the buffer updated
+//                src - the buffer XORed in or multiplied
+//                c - the coefficient
+//                blocks, ndata, nparity - the row, as for parity_compute
+//                len - the length in bytes
+// Outputs      : none
+
+static int parity_scalar_supported(void) {
+  return(1);
+}
+
+static void parity_scalar_xor(uint8_t *dst, const uint8_t *src, size_t len) {
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    dst[i] ^= src[i];
+  }
+}
+
+static void parity_scalar_mul(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    dst[i] = parity_gf_mul(c, src[i]);
+  }
+}
+
+static void parity_scalar_mul_xor(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  const uint8_t *row;
+  size_t i;
+
+  if (c == 0) {
+    return;
+  }
+  row = &gfExp[gfLog[c]];
+  for (i = 0; i < len; i++) {
+    if (src[i] != 0) {
+      dst[i] ^= row[gfLog[src[i]]];
+    }
+  }
+}
+
+static void parity_scalar_gen(uint8_t **blocks, int ndata, int nparity, size_t len) {
+  int i;
+
+  memset(blocks[ndata], 0, len);
+  if (nparity > 1) {
+    memset(blocks[ndata + 1], 0, len);
+  }
+  for (i = 0; i < ndata; i++) {
+    parity_scalar_xor(blocks[ndata], blocks[i], len);
+    if (nparity > 1) {
+      parity_scalar_mul_xor(blocks[ndata + 1], blocks[i], parity_gf_pow(i), len);
+    }
+  }
+}
+
+#ifdef PARITY_X86
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parity_sse2_*
+// Description  : The SSE2 kernels, 16 bytes at a time.  SSE2 has no byte
+//                shuffle, so a multiply by c is shift-and-add: the source
+//                is doubled (xtime) once per bit of c and added in where
+//                the bit is set
+//
+// Inputs       : as for the scalar kernels
+// Outputs      : none
+
+static int parity_sse2_supported(void) {
+  return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) __m128i parity_sse2_xtime(__m128i v) {
+  __m128i high = _mm_cmplt_epi8(v, _mm_setzero_si128());
+
+  return _mm_xor_si128(_mm_add_epi8(v, v), _mm_and_si128(high, _mm_set1_epi8(PARITY_POLY & 0xff)));
+}
+
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) __m128i parity_sse2_times(__m128i x, __m128i acc, uint8_t c) {
+  for (; c; c >>= 1) {
+    if (c & 1) {
+      acc = _mm_xor_si128(acc, x);
+    }
+    x = parity_sse2_xtime(x);
+  }
+  return(acc);
+}
+
+__attribute__((target("sse2")))
+static void parity_sse2_xor(uint8_t *dst, const uint8_t *src, size_t len) {
+  size_t i;
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    _mm_storeu_si128((__m128i *)&dst[i], _mm_xor_si128(_mm_loadu_si128((const __m128i *)&dst[i]), _mm_loadu_si128((const __m128i *)&src[i])));
+  }
+  parity_scalar_xor(&dst[i], &src[i], len - i);
+}
+
+__attribute__((target("sse2")))
+static void parity_sse2_mul(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  size_t i;
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    _mm_storeu_si128((__m128i *)&dst[i], parity_sse2_times(_mm_loadu_si128((const __m128i *)&src[i]), _mm_setzero_si128(), c));
+  }
+  parity_scalar_mul(&dst[i], &src[i], c, len - i);
+}
+
+__attribute__((target("sse2")))
+static void parity_sse2_mul_xor(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  size_t i;
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    _mm_storeu_si128((__m128i *)&dst[i], parity_sse2_times(_mm_loadu_si128((const __m128i *)&src[i]), _mm_loadu_si128((const __m128i *)&dst[i]), c));
+  }
+  parity_scalar_mul_xor(&dst[i], &src[i], c, len - i);
+}
+
+__attribute__((target("sse2")))
+static void parity_sse2_gen(uint8_t **blocks, int ndata, int nparity, size_t len) {
+  __m128i p, q, d;
+  size_t i;
+  int k;
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    p = q = _mm_loadu_si128((const __m128i *)&blocks[ndata - 1][i]);
+    for (k = ndata - 2; k >= 0; k--) {
+      d = _mm_loadu_si128((const __m128i *)&blocks[k][i]);
+      p = _mm_xor_si128(p, d);
+      q = _mm_xor_si128(parity_sse2_xtime(q), d);
+    }
+    _mm_storeu_si128((__m128i *)&blocks[ndata][i], p);
+    if (nparity > 1) {
+      _mm_storeu_si128((__m128i *)&blocks[ndata + 1][i], q);
+    }
+  }
+  parity_gen_tail(blocks, ndata, nparity, i, len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parity_avx2_*
+// Description  : The AVX2 kernels, 32 bytes at a time.  A multiply by c
+//                looks up the low and high nibble of each byte in two
+//                16-entry product tables with a byte shuffle
+//
+// Inputs       : as for the scalar kernels
+// Outputs      : none
+
+static int parity_avx2_supported(void) {
+  return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) __m256i parity_avx2_xtime(__m256i v) {
+  __m256i high = _mm256_cmpgt_epi8(_mm256_setzero_si256(), v);
+
+  return _mm256_xor_si256(_mm256_add_epi8(v, v), _mm256_and_si256(high, _mm256_set1_epi8(PARITY_POLY & 0xff)));
+}
+
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) __m256i parity_avx2_times(__m256i x, __m256i lo, __m256i hi) {
+  __m256i nibble = _mm256_set1_epi8(0x0f);
+
+  return _mm256_xor_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(x, nibble)),
+                          _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble)));
+}
+
+static void parity_nibble_tables(uint8_t c, uint8_t *lo, uint8_t *hi) {
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    lo[i] = parity_gf_mul(c, (uint8_t)i);
+    hi[i] = parity_gf_mul(c, (uint8_t)(i << 4));
+  }
+}
+
+__attribute__((target("avx2")))
+static void parity_avx2_xor(uint8_t *dst, const uint8_t *src, size_t len) {
+  size_t i;
+
+  for (i = 0; i + 32 <= len; i += 32) {
+    _mm256_storeu_si256((__m256i *)&dst[i], _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&dst[i]), _mm256_loadu_si256((const __m256i *)&src[i])));
+  }
+  parity_scalar_xor(&dst[i], &src[i], len - i);
+}
+
+__attribute__((target("avx2")))
+static void parity_avx2_mul(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  uint8_t lo[16], hi[16];
+  __m256i tlo, thi;
+  size_t i;
+
+  parity_nibble_tables(c, lo, hi);
+  tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+  thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+  for (i = 0; i + 32 <= len; i += 32) {
+    _mm256_storeu_si256((__m256i *)&dst[i], parity_avx2_times(_mm256_loadu_si256((const __m256i *)&src[i]), tlo, thi));
+  }
+  parity_scalar_mul(&dst[i], &src[i], c, len - i);
+}
+
+__attribute__((target("avx2")))
+static void parity_avx2_mul_xor(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  uint8_t lo[16], hi[16];
+  __m256i tlo, thi;
+  size_t i;
+
+  parity_nibble_tables(c, lo, hi);
+  tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+  thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+  for (i = 0; i + 32 <= len; i += 32) {
+    _mm256_storeu_si256((__m256i *)&dst[i], _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&dst[i]),
+                        parity_avx2_times(_mm256_loadu_si256((const __m256i *)&src[i]), tlo, thi)));
+  }
+  parity_scalar_mul_xor(&dst[i], &src[i], c, len - i);
+}
+
+__attribute__((target("avx2")))
+static void parity_avx2_gen(uint8_t **blocks, int ndata, int nparity, size_t len) {
+  __m256i p, q, d;
+  size_t i;
+  int k;
+
+  for (i = 0; i + 32 <= len; i += 32) {
+    p = q = _mm256_loadu_si256((const __m256i *)&blocks[ndata - 1][i]);
+    for (k = ndata - 2; k >= 0; k--) {
+      d = _mm256_loadu_si256((const __m256i *)&blocks[k][i]);
+      p = _mm256_xor_si256(p, d);
+      q = _mm256_xor_si256(parity_avx2_xtime(q), d);
+    }
+    _mm256_storeu_si256((__m256i *)&blocks[ndata][i], p);
+    if (nparity > 1) {
+      _mm256_storeu_si256((__m256i *)&blocks[ndata + 1][i], q);
+    }
+  }
+  parity_gen_tail(blocks, ndata, nparity, i, len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parity_avx512_*
+// Description  : The AVX-512 kernels, 64 bytes at a time, as the AVX2 ones
+//                (AVX-512BW has the byte shuffle and byte masks)
+//
+// Inputs       : as for the scalar kernels
+// Outputs      : none
+
+static int parity_avx512_supported(void) {
+  return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __attribute__((always_inline)) __m512i parity_avx512_xtime(__m512i v) {
+  __mmask64 high = _mm512_movepi8_mask(v);
+
+  return _mm512_xor_si512(_mm512_add_epi8(v, v), _mm512_maskz_mov_epi8(high, _mm512_set1_epi8(PARITY_POLY & 0xff)));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __attribute__((always_inline)) __m512i parity_avx512_times(__m512i x, __m512i lo, __m512i hi) {
+  __m512i nibble = _mm512_set1_epi8(0x0f);
+
+  return _mm512_xor_si512(_mm512_shuffle_epi8(lo, _mm512_and_si512(x, nibble)),
+                          _mm512_shuffle_epi8(hi, _mm512_and_si512(_mm512_srli_epi16(x, 4), nibble)));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void parity_avx512_xor(uint8_t *dst, const uint8_t *src, size_t len) {
+  size_t i;
+
+  for (i = 0; i + 64 <= len; i += 64) {
+    _mm512_storeu_si512(&dst[i], _mm512_xor_si512(_mm512_loadu_si512(&dst[i]), _mm512_loadu_si512(&src[i])));
+  }
+  parity_scalar_xor(&dst[i], &src[i], len - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void parity_avx512_mul(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  uint8_t lo[16], hi[16];
+  __m512i tlo, thi;
+  size_t i;
+
+  parity_nibble_tables(c, lo, hi);
+  tlo = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)lo));
+  thi = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)hi));
+  for (i = 0; i + 64 <= len; i += 64) {
+    _mm512_storeu_si512(&dst[i], parity_avx512_times(_mm512_loadu_si512(&src[i]), tlo, thi));
+  }
+  parity_scalar_mul(&dst[i], &src[i], c, len - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void parity_avx512_mul_xor(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  uint8_t lo[16], hi[16];
+  __m512i tlo, thi;
+  size_t i;
+
+  parity_nibble_tables(c, lo, hi);
+  tlo = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)lo));
+  thi = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)hi));
+  for (i = 0; i + 64 <= len; i += 64) {
+    _mm512_storeu_si512(&dst[i], _mm512_xor_si512(_mm512_loadu_si512(&dst[i]), parity_avx512_times(_mm512_loadu_si512(&src[i]), tlo, thi)));
+  }
+  parity_scalar_mul_xor(&dst[i], &src[i], c, len - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void parity_avx512_gen(uint8_t **blocks, int ndata, int nparity, size_t len) {
+  __m512i p, q, d;
+  size_t i;
+  int k;
+
+  for (i = 0; i + 64 <= len; i += 64) {
+    p = q = _mm512_loadu_si512(&blocks[ndata - 1][i]);
+    for (k = ndata - 2; k >= 0; k--) {
+      d = _mm512_loadu_si512(&blocks[k][i]);
+      p = _mm512_xor_si512(p, d);
+      q = _mm512_xor_si512(parity_avx512_xtime(q), d);
+    }
+    _mm512_storeu_si512(&blocks[ndata][i], p);
+    if (nparity > 1) {
+      _mm512_storeu_si512(&blocks[ndata + 1][i], q);
+    }
+  }
+  parity_gen_tail(blocks, ndata, nparity, i, len);
+}
+
+#endif
+
+// The variants, widest first
+static const ParityKernel parityKernels[] = {
+#ifdef PARITY_X86
+  { "avx512", parity_avx512_supported, parity_avx512_xor, parity_avx512_mul, parity_avx512_mul_xor, parity_avx512_gen },
+  { "avx2", parity_avx2_supported, parity_avx2_xor, parity_avx2_mul, parity_avx2_mul_xor, parity_avx2_gen },
+  { "sse2", parity_sse2_supported, parity_sse2_xor, parity_sse2_mul, parity_sse2_mul_xor, parity_sse2_gen },
+#endif
+  { "scalar", parity_scalar_supported, parity_scalar_xor, parity_scalar_mul, parity_scalar_mul_xor, parity_scalar_gen },
+};
+#define PARITY_KERNELS ((int)(sizeof(parityKernels) / sizeof(parityKernels[0])))
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parity_xor
+// Description  : XOR one buffer into another
+//
+// Inputs       : dst - the buffer updated
+//                src - the buffer XORed in
+//                len - the length in bytes
+// Outputs      : none
+
+void parity_xor(uint8_t *dst, const uint8_t *src, size_t len) {
+  kernel->xor(dst, src, len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parity_mul_xor
+// Description  : XOR a GF(2^8) multiple of one buffer into another
+//
+// Inputs       : dst - the buffer updated
+//                src - the buffer multiplied
+//                c - the coefficient
+//                len - the length in bytes
+// Outputs      : none
+
+void parity_mul_xor(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+  if (c == 0) {
+    return;
+  }
+  if (c == 1) {
+    kernel->xor(dst, src, len);
+    return;
+  }
+  kernel->mulXor(dst, src, c, len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parity_compute
+// Description  : Compute the parity of a stripe row
+//
+// Inputs       : blocks - the data blocks, then P (and Q)
+//                ndata - the number of data blocks
+//                nparity - 1 for P, 2 for P and Q
+//                len - the length of each block in bytes
+// Outputs      : none
+
+void parity_compute(uint8_t **blocks, int ndata, int nparity, size_t len) {
+  kernel->gen(blocks, ndata, nparity, len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parity_recover
+// Description  : Recompute the missing blocks of a stripe row.  Missing data
+//                is recovered first (from P where it is there, otherwise
+//                from Q), then missing parity is recomputed from the data
+//
+// Inputs       : blocks - the data blocks, then P (and Q), the missing ones
+//                    are overwritten
+//                ndata - the number of data blocks
+//                nparity - 1 for P, 2 for P and Q
+//                missing - the indexes of the missing blocks
+//                nmissing - how many there are
+//                len - the length of each block in bytes
+// Outputs      : 0 if successful, -1 if too many blocks are missing
+
+int parity_recover(uint8_t **blocks, int ndata, int nparity, const int *missing, int nmissing, size_t len) {
+  int i, x = -1, y = -1, lostP = 0, lostQ = 0;
+  uint8_t a, b, *dx, *dy, *p = blocks[ndata], *q = (nparity > 1) ? blocks[ndata + 1] : NULL;
+
+  if (nmissing > nparity) {
+    return(-1);
+  }
+  for (i = 0; i < nmissing; i++) {
+    if (missing[i] == ndata) {
+      lostP = 1;
+    } else if (missing[i] == ndata + 1) {
+      lostQ = 1;
+    } else if (x < 0) {
+      x = missing[i];
+    } else {
+      y = missing[i];
+    }
+  }
+
+  if ((x >= 0) && (y >= 0)) {
+    //two data blocks: with Pxy and Qxy the sums over the others, Dx = A.Pxy + B.Qxy and Dy = Pxy + Dx
+    dx = blocks[x];
+    dy = blocks[y];
+    memcpy(dy, p, len);
+    memcpy(dx, q, len);
+    for (i = 0; i < ndata; i++) {
+      if ((i != x) && (i != y)) {
+        parity_xor(dy, blocks[i], len);
+        parity_mul_xor(dx, blocks[i], parity_gf_pow(i), len);
+      }
+    }
+    a = parity_gf_pow(y - x);
+    b = parity_gf_inv(a ^ 1);
+    kernel->mul(dx, dx, parity_gf_mul(parity_gf_pow(-x), b), len);
+    parity_mul_xor(dx, dy, parity_gf_mul(a, b), len);
+    parity_xor(dy, dx, len);
+  } else if ((x >= 0) && !lostP) {
+    //one data block from P
+    memcpy(blocks[x], p, len);
+    for (i = 0; i < ndata; i++) {
+      if (i != x) {
+        parity_xor(blocks[x], blocks[i], len);
+      }
+    }
+  } else if (x >= 0) {
+    //one data block from Q, P is gone too
+    memcpy(blocks[x], q, len);
+    for (i = 0; i < ndata; i++) {
+      if (i != x) {
+        parity_mul_xor(blocks[x], blocks[i], parity_gf_pow(i), len);
+      }
+    }
+    kernel->mul(blocks[x], blocks[x], parity_gf_pow(-x), len);
+  }
+
+  //the data is whole again, so lost parity is simply recomputed (a good P comes out the same)
+  if (lostP || lostQ) {
+    kernel->gen(blocks, ndata, 1 + lostQ, len);
+  }
+  return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parity_check
+// Description  : Check a kernel variant against the scalar one: XOR,
+//                multiply and multiply-accumulate for every coefficient,
+//                P+Q generation for every stripe width, and the recovery of
+//                every pair of blocks of the widest stripe
+//
+// Inputs       : k - the variant
+// Outputs      : 0 if it agrees, -1 if not
+
+static int parity_check(const ParityKernel *k) {
+  uint32_t seed = 311;
+  uint8_t *buf, *blocks[PARITY_MAX_MEMBERS], *ref[PARITY_MAX_MEMBERS], *want, *got;
+  const ParityKernel *saved = kernel;
+  int i, c, n, x, y, missing[2], failed = 0;
+  size_t len = PARITY_CHECK_LEN;
+
+  if ((buf = malloc(len * (2 * PARITY_MAX_MEMBERS + 2))) == NULL) {
+    return(-1);
+  }
+  for (i = 0; i < PARITY_MAX_MEMBERS; i++) {
+    blocks[i] = &buf[i * len];
+    ref[i] = &buf[(PARITY_MAX_MEMBERS + i) * len];
+  }
+  want = &buf[2 * PARITY_MAX_MEMBERS * len];
+  got = &buf[(2 * PARITY_MAX_MEMBERS + 1) * len];
+  for (i = 0; i < (int)(len * PARITY_MAX_MEMBERS); i++) {
+    seed = seed * 1103515245 + 12345;
+    buf[i] = (uint8_t)(seed >> 16);
+  }
+
+  //the elementwise kernels, starting one byte in so the vectors are misaligned
+  for (c = 0; (c < 256) && !failed; c++) {
+    memcpy(want, blocks[1], len);
+    memcpy(got, blocks[1], len);
+    parity_scalar_mul_xor(want + 1, blocks[0] + 1, (uint8_t)c, len - 1);
+    k->mulXor(got + 1, blocks[0] + 1, (uint8_t)c, len - 1);
+    failed |= memcmp(want, got, len);
+    parity_scalar_mul(want, blocks[0], (uint8_t)c, len);
+    k->mul(got, blocks[0], (uint8_t)c, len);
+    failed |= memcmp(want, got, len);
+  }
+  memcpy(want, blocks[1], len);
+  memcpy(got, blocks[1], len);
+  parity_scalar_xor(want + 1, blocks[0] + 1, len - 1);
+  k->xor(got + 1, blocks[0] + 1, len - 1);
+  failed |= memcmp(want, got, len);
+
+  //generation at every width, then recovery of every pair with the variant in use
+  kernel = k;
+  for (n = 2; (n <= PARITY_MAX_MEMBERS - 2) && !failed; n++) {
+    for (i = 0; i < n; i++) {
+      ref[i] = blocks[i];
+    }
+    ref[n] = want;
+    ref[n + 1] = got;
+    parity_scalar_gen(ref, n, 2, len);
+    k->gen(blocks, n, 2, len);
+    failed |= memcmp(blocks[n], want, len) || memcmp(blocks[n + 1], got, len);
+  }
+  n = PARITY_MAX_MEMBERS - 2;
+  for (i = 0; i < n + 2; i++) {
+    memcpy(&buf[(PARITY_MAX_MEMBERS + i) * len], blocks[i], len);
+    ref[i] = &buf[(PARITY_MAX_MEMBERS + i) * len];
+  }
+  for (x = 0; (x < n + 2) && !failed; x++) {
+    for (y = x; (y < n + 2) && !failed; y++) {
+      missing[0] = x;
+      missing[1] = y;
+      memset(blocks[x], 0xa5, len);
+      memset(blocks[y], 0x5a, len);
+      failed |= parity_recover(blocks, n, 2, missing, 1 + (y != x), len) ||
+                memcmp(blocks[x], ref[x], len) || memcmp(blocks[y], ref[y], len);
+    }
+  }
+  kernel = saved;
+  free(buf);
+  return failed ? -1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parity_init
+// Description  : Build the GF(2^8) log and exp tables and pick the kernels:
+//                the widest variant the CPU has that agrees with the scalar
+//                one
+//
+// Inputs       : none
+// Outputs      : none
+
+void parity_init(void) {
+  int i, x = 1;
+
+  for (i = 0; i < 255; i++) {
+    gfExp[i] = gfExp[i + 255] = (uint8_t)x;
+    gfLog[x] = (uint8_t)i;
+    x <<= 1;
+    if (x & 0x100) {
+      x ^= PARITY_POLY;
+    }
+  }
+  gfExp[510] = gfExp[0];
+  gfExp[511] = gfExp[1];
+
+  kernel = &parityKernels[PARITY_KERNELS - 1];
+  for (i = 0; i < PARITY_KERNELS - 1; i++) {
+    if (parityKernels[i].supported()) {
+      if (parity_check(&parityKernels[i]) == 0) {
+        kernel = &parityKernels[i];
+        break;
+      }
+      logMessage(LOG_ERROR_LEVEL, "Parity kernels %s disagree with the scalar ones, not used", parityKernels[i].name);
+    }
+  }
+  logMessage(LOG_INFO_LEVEL, "Parity kernels %s", kernel->name);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parity_kernel
+// Description  : The name of the kernel variant in use
+//
+// Inputs       : none
+// Outputs      : the name
+
+const char *parity_kernel(void) {
+  return kernel->name;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parity_selftest
+// Description  : Check every kernel variant the CPU has against the scalar
+//                one, and the recovery of every pair of blocks with each
+//
+// Inputs       : none
+// Outputs      : 0 if every variant agrees, -1 if not
+
+int parity_selftest(void) {
+  const ParityKernel *k;
+  int failed = 0;
+
+  parity_init();
+  for (k = parityKernels; k < &parityKernels[PARITY_KERNELS]; k++) {
+    if (!k->supported()) {
+      logMessage(LOG_OUTPUT_LEVEL, "Parity kernels %-7s not supported by this CPU, skipped", k->name);
+    } else if (parity_check(k)) {
+      logMessage(LOG_ERROR_LEVEL, "Parity kernels %-7s DISAGREE with the scalar kernels", k->name);
+      failed = 1;
+    } else {
+      logMessage(LOG_OUTPUT_LEVEL, "Parity kernels %-7s agree with the scalar kernels", k->name);
+    }
+  }
+  return failed ? -1 : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parity_rate
+// Description  : Run one kernel over a stripe row again and again for a
+//                while and work out its throughput
+//
+// Inputs       : k - the variant
+//                op - 0 XOR, 1 multiply-accumulate, 2 generate, 3 recover
+//                    two data blocks
+//                blocks - the row
+//                ndata, nparity - its shape
+// Outputs      : GB/s of data blocks processed
+
+static double parity_rate(const ParityKernel *k, int op, uint8_t **blocks, int ndata, int nparity) {
+  struct timespec start, now;
+  long int ns = 0, rounds = 0;
+  const ParityKernel *saved = kernel;
+  int missing[2] = { 0, ndata - 1 };
+
+  kernel = k;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (ns < PARITY_BENCH_NS) {
+    if (op == 0) {
+      k->xor(blocks[1], blocks[0], PARITY_BENCH_LEN);
+    } else if (op == 1) {
+      k->mulXor(blocks[1], blocks[0], 0x8e, PARITY_BENCH_LEN);
+    } else if (op == 2) {
+      k->gen(blocks, ndata, nparity, PARITY_BENCH_LEN);
+    } else {
+      parity_recover(blocks, ndata, nparity, missing, 2, PARITY_BENCH_LEN);
+    }
+    rounds++;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec);
+  }
+  kernel = saved;
+  return (double)rounds * ((op < 2) ? 1 : ndata) * PARITY_BENCH_LEN / ns;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parity_benchmark
+// Description  : Check every kernel variant the CPU has against the scalar
+//                one and report the throughput of each kernel, generation
+//                and recovery at the stripe widths of the layouts
+//
+// Inputs       : none
+// Outputs      : 0 if every variant agrees, -1 if not
+
+int parity_benchmark(void) {
+  //the RAID-6 and RAID-5 rows of the 9 disk array, and two narrower rows to compare them with
+  static const int widths[] = { 2, 4, 7, 8 };
+  uint8_t *buf, *blocks[PARITY_MAX_MEMBERS];
+  int i, w, failed = 0;
+  const ParityKernel *k;
+
+  parity_init();
+  if ((buf = aligned_alloc(64, (size_t)PARITY_BENCH_LEN * PARITY_MAX_MEMBERS)) == NULL) {
+    return(-1);
+  }
+  for (i = 0; i < PARITY_BENCH_LEN * PARITY_MAX_MEMBERS; i++) {
+    buf[i] = (uint8_t)(i * 2654435761u >> 13);
+  }
+  for (i = 0; i < PARITY_MAX_MEMBERS; i++) {
+    blocks[i] = &buf[i * PARITY_BENCH_LEN];
+  }
+
+  logMessage(LOG_OUTPUT_LEVEL, "Parity kernels, %d byte blocks (GB/s of data):", PARITY_BENCH_LEN);
+  for (k = parityKernels; k < &parityKernels[PARITY_KERNELS]; k++) {
+    if (!k->supported()) {
+      logMessage(LOG_OUTPUT_LEVEL, "  %-7s not supported by this CPU", k->name);
+      continue;
+    }
+    if (parity_check(k)) {
+      logMessage(LOG_ERROR_LEVEL, "  %-7s DISAGREES with the scalar kernels", k->name);
+      failed = 1;
+      continue;
+    }
+    logMessage(LOG_OUTPUT_LEVEL, "  %-7s checked, xor %.2f, mul-xor %.2f", k->name, parity_rate(k, 0, blocks, 2, 1), parity_rate(k, 1, blocks, 2, 1));
+    for (w = 0; w < (int)(sizeof(widths) / sizeof(widths[0])); w++) {
+      logMessage(LOG_OUTPUT_LEVEL, "  %-7s %2d+P %.2f, %2d+P+Q %.2f, recover 2 of %2d %.2f", k->name,
+                 widths[w], parity_rate(k, 2, blocks, widths[w], 1),
+                 widths[w], parity_rate(k, 2, blocks, widths[w], 2),
+                 widths[w], parity_rate(k, 3, blocks, widths[w], 2));
+    }
+  }
+  free(buf);
+  return failed ? -1 : 0;
+}
@@ -0,0 +1,55 @@
+#ifndef TAGLINE_PARITY_INCLUDED
+#define TAGLINE_PARITY_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : tagline_parity.h
+//  Description    : This is the header file for the parity arithmetic of the
+//                   TAGLINE striped layouts.  P is the XOR of the data blocks
+//                   of a stripe row, Q the sum of g^i times data block i in
+//                   GF(2^8) (g = 2, polynomial 0x11d), so any two blocks of a
+//                   row can be recovered from the rest.  The kernels under
+//                   these are picked at init from the CPU's vector units.
+//
+
+// Includes
+#include <stddef.h>
+#include <stdint.h>
+
+// Defines
+#define PARITY_MAX_MEMBERS 16   // Most blocks (data and parity) in one stripe row
+
+//
+// Parity interfaces
+
+void parity_init(void);
+	// Build the GF(2^8) tables and pick the kernels, called before anything else
+
+const char *parity_kernel(void);
+	// The name of the kernel variant in use (avx512, avx2, sse2, scalar)
+
+uint8_t parity_gf_mul(uint8_t a, uint8_t b);
+	// Multiply two GF(2^8) elements
+
+uint8_t parity_gf_pow(int i);
+	// The generator to the power i
+
+void parity_xor(uint8_t *dst, const uint8_t *src, size_t len);
+	// dst ^= src
+
+void parity_mul_xor(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+	// dst ^= c * src in GF(2^8)
+
+void parity_compute(uint8_t **blocks, int ndata, int nparity, size_t len);
+	// Set blocks[ndata] to P (and blocks[ndata + 1] to Q) of blocks[0..ndata-1]
+
+int parity_recover(uint8_t **blocks, int ndata, int nparity, const int *missing, int nmissing, size_t len);
+	// Recompute the missing blocks (data or parity) of a row from the others
+
+int parity_selftest(void);
+	// Check every kernel variant against the scalar one, -1 if any disagrees
+
+int parity_benchmark(void);
+	// Check every kernel variant against the scalar one and log their throughput
+
+#endif
@@ -11,13 +11,17 @@
 
 // Include Files
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -29,11 +33,13 @@
 #include <raid_cache.h>
 #include <raid_network.h>
 #include <tagline_driver.h>
+#include <tagline_parity.h>
 
 // Defines
-#define TLINE_ARGUMENTS "hvfl:a:p:"
+#define TLINE_ARGUMENTS "hvfl:a:p:c:Cw:d:HS:b:m:B:r:MR:E:g:L:sJ:P:kKQ:T:V:G"
+#define SIM_MAX_THREADS 64
 #define USAGE \
-	"USAGE: tagline_client [-h] [-v] [-l <logfile>] [-a <ip addr>] [-p <port>] [-f] <workload-file>\n" \
+	"USAGE: tagline_client [-h] [-v] [-l <logfile>] [-a <ip addr>] [-p <port>] [-f] [-c <policy>] [-C] [-w <ms>] [-d <keys>] [-H] [-S <snapshot>] [-b <blocks>] [-m <shift>] [-B <blocks>] [-r <depth>] [-M] [-R <policy>] [-E <pct>] [-g <blocks>] [-L <blocks/s>] [-s] [-J <journal>] [-P <layout>] [-k] [-K] [-G] [-Q <depth>] [-T <threads>] [-V <segments>] <workload-file>\n" \
 	"\n" \
 	"where:\n" \
 	"    -h - help mode (display this message)\n" \
@@ -42,6 +48,30 @@
 	"    -a - IP address of server to connect to.\n" \
 	"    -p - port number of server to connect to.\n" \
 	"    -f - disable disk failures\n" \
+	"    -c - cache replacement policy (LRU, ARC, 2Q, CLOCK-Pro, W-TinyLFU)\n" \
+	"    -C - compare the hit ratio of every cache policy at close\n" \
+	"    -w - write-back caching, flushing dirty blocks every <ms> milliseconds (0 = on eviction/close only)\n" \
+	"    -d - deduplicate cached blocks by content, indexing <keys> blocks per cached payload block\n" \
+	"    -H - map the cache payload on huge pages\n" \
+	"    -S - save the cache to <snapshot> at close, warm start from it at init\n" \
+	"    -b - size of the cache in blocks\n" \
+	"    -m - estimate the miss ratio curve, sampling 1 in 2^<shift> blocks\n" \
+	"    -B - resize the cache from the miss ratio curve, up to <blocks>\n" \
+	"    -r - read ahead of sequential and strided reads, up to <depth> reads\n" \
+	"    -M - send the primary and backup writes of a block concurrently\n" \
+	"    -R - replica reads are balanced by (primary, round-robin, least-outstanding, EWMA)\n" \
+	"    -E - hedge reads to the mirror of a disk slower than the <pct> percentile of read latency\n" \
+	"    -g - rebuild failed disks in the background, <blocks> between operations\n" \
+	"    -L - cap the background rebuild at <blocks/s>\n" \
+	"    -s - verify every backup against its primary at close\n" \
+	"    -J - journal the mapping to <journal> and restore it at startup\n" \
+	"    -P - keep blocks redundant by (mirror, raid5, raid6)\n" \
+	"    -k - check the parity kernels against the scalar ones, then exit (non-zero if any disagree)\n" \
+	"    -K - check and benchmark the parity kernels, then exit\n" \
+	"    -G - benchmark cache gets and puts at 1K to 1M blocks, then exit\n" \
+	"    -Q - submit reads and writes asynchronously, up to <depth> outstanding\n" \
+	"    -T - run the reads and writes on <threads> threads, each taking the taglines numbered <thread> modulo <threads> (they run side by side unless a parity layout, write-back or a rebuild needs the driver to one at a time, not with -Q or -V)\n" \
+	"    -V - gather runs of reads or of writes into vectored calls of up to <segments> segments\n" \
 	"\n" \
 	"    <workload-file> - file contain the workload to simulate\n" \
 	"\n" \
@@ -50,9 +80,58 @@
 // Global Data
 int verbose = 0;
 int disk_failures = 1;
+uint32_t cache_blocks = TAGLINE_CACHE_SIZE; // blocks in the driver cache
 char rdbuf[TAGLINE_BLOCK_SIZE*MAX_TAGLINE_BLOCK_NUMBER]; // workload simulator read buffer
 char wrbuf[TAGLINE_BLOCK_SIZE*MAX_TAGLINE_BLOCK_NUMBER]; // workload simulator write buffer
-char tmbuf[TAGLINE_BLOCK_SIZE*MAX_TAGLINE_BLOCK_NUMBER]; // workload simulator temporary buffer
+RAIDCacheView rdviews[MAX_TAGLINE_BLOCK_NUMBER]; // workload simulator read views
+
+// An asynchronous operation of the simulator, with buffers of its own
+typedef struct {
+	TaglineIO io;
+	char text[MAX_TAGLINE_BLOCK_NUMBER + 1];  // what a read should find
+	char *buf;                               // the blocks a write sends
+	RAIDCacheView *views;                    // the blocks a read gets
+} SimAsyncSlot;
+
+SimAsyncSlot *async_slots = NULL;  // one per operation outstanding (NULL for synchronous calls)
+SimAsyncSlot **async_free = NULL;  // the slots not in use
+uint32_t async_depth = 0, async_num_free = 0;
+
+// A line of the workload, kept in memory when it runs on several threads
+typedef struct {
+	char command[16];
+	TagLineNumber tagnum;
+	uint16_t num_blocks;
+	TagLineBlockNumber blocknum;
+	char text[MAX_TAGLINE_BLOCK_NUMBER + 1];
+} SimCommand;
+
+// A thread of the simulator, running the reads and writes of its own taglines
+typedef struct {
+	pthread_t thread;
+	uint32_t id;
+	SimCommand *cmds;       // the commands between two that need the whole array
+	uint32_t num_cmds;
+	char *rdbuf;            // buffers of its own
+	char *wrbuf;
+	RAIDCacheView *views;
+	long ops;               // reads and writes done
+	int err;
+} SimThread;
+
+uint32_t sim_threads = 0;  // threads the workload runs on (0 for the plain loop)
+
+// A segment of a vectored call of the simulator, with a buffer of its own
+typedef struct {
+	char text[MAX_TAGLINE_BLOCK_NUMBER + 1];  // what a read should find
+	char *buf;                               // the blocks, read or written
+	struct iovec iov[2];                     // the first block of buf, then the rest
+} SimVectorSlot;
+
+SimVectorSlot *vector_slots = NULL;  // one per segment (NULL for separate calls)
+TaglineSegment *vector_segs = NULL;
+TaglineIOType vector_type;            // what the gathered segments do
+uint32_t vector_max = 0, vector_num = 0;
 
 //
 // Functional Prototypes
@@ -61,6 +140,19 @@ int simulate_TagLines(char *wload);
 int tagline_read_block_validate(TagLineNumber tagnum, TagLineBlockNumber blocknum,
 		uint16_t num_blocks, char *text);
 int remote_raid_fail_disk(RAIDDiskID dsk);
+int simulate_async_init(uint32_t depth);
+int simulate_async_reap(uint32_t min);
+int simulate_async_submit(TaglineIOType type, TagLineNumber tagnum, TagLineBlockNumber blocknum,
+		uint16_t num_blocks, char *text);
+int simulate_threaded(char *wload);
+int simulate_global(SimCommand *cmd);
+void *simulate_thread(void *arg);
+int simulate_vector_init(uint32_t max);
+int simulate_vector_add(TaglineIOType type, TagLineNumber tagnum, TagLineBlockNumber blocknum,
+		uint16_t num_blocks, char *text);
+int simulate_vector_flush(void);
+int simulate_thread_read(SimThread *t, TagLineNumber tagnum, TagLineBlockNumber blocknum,
+		uint16_t num_blocks, char *text);
 
 //
 // Functions
@@ -77,7 +169,12 @@ int remote_raid_fail_disk(RAIDDiskID dsk);
 int main(int argc, char *argv[]) {
 
 	// Local variables
-	int ch, log_initialized = 0;
+	int ch, log_initialized = 0, compare = 0, kernels = 0, cache_bench = 0;
+	uint32_t flush_ms, dedup_keys, depth, budget = 0, ra_depth, hedge_pct = 0, rebuild_step, rebuild_limit;
+	TaglineReadPolicy read_policy = TAGLINE_READ_PRIMARY;
+	TaglineLayout layout;
+	int mrc_shift = -1;
+	RAIDCachePolicy policy = RAID_CACHE_LRU;
 
 	// Process the command line parameters
 	while ((ch = getopt(argc, argv, TLINE_ARGUMENTS)) != -1) {
@@ -108,6 +205,151 @@ int main(int argc, char *argv[]) {
             raid_network_address = (unsigned char *)strdup(optarg);
 			break;
 
+		case 'c': // Select the cache replacement policy
+			if ((policy = cache_policy_by_name(optarg)) == RAID_CACHE_POLICY_MAX) {
+				logMessage( LOG_ERROR_LEVEL, "Bad cache policy [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'C': // Compare all of the cache policies
+			compare = 1;
+			break;
+
+		case 'w': // Enable write-back caching
+			if ( sscanf(optarg, "%u", &flush_ms) != 1 ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad flush interval [%s]", optarg );
+				return(-1);
+			}
+			tagline_write_back(1, flush_ms);
+			break;
+
+		case 'b': // Set the cache size
+			if ( (sscanf(optarg, "%u", &cache_blocks) != 1) || (cache_blocks == 0) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad cache size [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'm': // Estimate the miss ratio curve
+			if ( (sscanf(optarg, "%d", &mrc_shift) != 1) || set_raid_cache_mrc(mrc_shift) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad sampling shift [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'B': // Resize the cache within a budget
+			if ( sscanf(optarg, "%u", &budget) != 1 ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad cache budget [%s]", optarg );
+				return(-1);
+			}
+			tagline_cache_budget(budget);
+			break;
+
+		case 'r': // Prefetch sequential reads
+			if ( (sscanf(optarg, "%u", &ra_depth) != 1) || tagline_read_ahead(ra_depth) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad read-ahead depth [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'M': // Mirror writes concurrently
+			tagline_mirror_writes(1);
+			break;
+
+		case 'R': // Balance reads over the replicas
+			for (read_policy = 0; (read_policy < TAGLINE_READ_POLICY_MAX) && strcasecmp(optarg, TAGLINE_READ_POLICY_LABELS[read_policy]); read_policy++);
+			if ( tagline_read_balance(read_policy, hedge_pct) ) {
+				logMessage( LOG_ERROR_LEVEL, "Unknown read balancing policy [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'E': // Hedge reads off slow disks
+			if ( (sscanf(optarg, "%u", &hedge_pct) != 1) || tagline_read_balance(read_policy, hedge_pct) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad hedge percentile [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'g': // Rebuild failed disks in the background
+			if ( (sscanf(optarg, "%u", &rebuild_step) != 1) || tagline_rebuild_rate(rebuild_step) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad rebuild rate [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'L': // Cap the rebuild bandwidth
+			if ( (sscanf(optarg, "%u", &rebuild_limit) != 1) || tagline_rebuild_limit(rebuild_limit) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad rebuild bandwidth [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 's': // Scrub the replicas at close
+			tagline_scrub_at_close(1);
+			break;
+
+		case 'S': // Persist the cache across runs
+			tagline_cache_snapshot(optarg);
+			break;
+
+		case 'J': // Journal the mapping across runs
+			tagline_journal(optarg);
+			break;
+
+		case 'P': // Choose the redundancy layout
+			for (layout = 0; (layout < TAGLINE_LAYOUT_MAX) && strcasecmp(optarg, TAGLINE_LAYOUT_LABELS[layout]); layout++);
+			if ( tagline_layout(layout) ) {
+				logMessage( LOG_ERROR_LEVEL, "Unknown redundancy layout [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'k': // Check the parity kernels
+			kernels = 1;
+			break;
+
+		case 'K': // Benchmark the parity kernels
+			kernels = 2;
+			break;
+
+		case 'G': // Benchmark the cache
+			cache_bench = 1;
+			break;
+
+		case 'Q': // Submit the operations asynchronously
+			if ( (sscanf(optarg, "%u", &depth) != 1) || tagline_queue_depth(depth) || simulate_async_init(depth) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad queue depth [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'T': // Run the workload on several threads
+			if ( (sscanf(optarg, "%u", &sim_threads) != 1) || (sim_threads == 0) || (sim_threads > SIM_MAX_THREADS) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad thread count [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'V': // Gather the reads and writes into vectored calls
+			if ( (sscanf(optarg, "%u", &depth) != 1) || simulate_vector_init(depth) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad segments per vectored call [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'H': // Put the cache payload on huge pages
+			set_raid_cache_hugepages(1);
+			break;
+
+		case 'd': // Enable the deduplicating cache
+			if ( (sscanf(optarg, "%u", &dedup_keys) != 1) || set_raid_cache_dedup(dedup_keys) ) {
+				logMessage( LOG_ERROR_LEVEL, "Bad dedup keys per block [%s]", optarg );
+				return(-1);
+			}
+			break;
+
         case 'p': // Set the network port number
 			if ( sscanf(optarg, "%hu", &raid_network_port) != 1 ) {
 			    logMessage( LOG_ERROR_LEVEL, "Bad  port number [%s]", argv[optind] );
@@ -133,6 +375,29 @@ int main(int argc, char *argv[]) {
 		logMessage(LOG_INFO_LEVEL, "Disabling disk failures.");
 	}
 
+	// The threads make their reads and writes one call at a time, they have no asynchronous or vectored mode
+	if ((sim_threads > 0) && ((async_depth > 0) || (vector_max > 0))) {
+		logMessage(LOG_ERROR_LEVEL, "-T cannot be combined with -Q or -V, aborting");
+		return(-1);
+	}
+
+	// Check or benchmark the parity kernels instead of simulating
+	if (kernels) {
+		return( (kernels == 1) ? parity_selftest() : parity_benchmark() );
+	}
+
+	set_raid_cache_policy(policy, compare);
+
+	// Benchmark the cache instead of simulating
+	if (cache_bench) {
+		return( raid_cache_benchmark() );
+	}
+
+	// The cache budget works from the miss ratio curve, sample 1 in 8 keys unless told otherwise
+	if (budget && (mrc_shift < 0)) {
+		set_raid_cache_mrc(3);
+	}
+
 	// The filename should be the next option
 	if (optind >= argc) {
 
@@ -147,6 +412,7 @@ int main(int argc, char *argv[]) {
 		logMessage(LOG_INFO_LEVEL, "Tagline simulation completed successfully.\n\n");
 	} else {
 		logMessage(LOG_INFO_LEVEL, "Tagline simulation failed.\n\n");
+		return( -1 );
 	}
 
 	// Return successfully
@@ -172,6 +438,11 @@ int simulate_TagLines(char *wload) {
 	TagLineNumber tagnum;
 	TagLineBlockNumber blocknum;
 
+	// Several threads run the workload from memory instead
+	if (sim_threads > 0) {
+		return( simulate_threaded(wload) );
+	}
+
 	// Open the workload file
 	linecount = 0;
 	if ((fhandle=fopen(wload, "r")) == NULL) {
@@ -206,7 +477,7 @@ int simulate_TagLines(char *wload) {
 				if (strncmp(command, "INIT", 5) == 0) {
 
 					// Call the initialize function for the tagline storae
-					if (tagline_driver_init(tagnum)) {
+					if (tagline_driver_init_cache(tagnum, cache_blocks)) {
 						// Error out
 						logMessage(LOG_ERROR_LEVEL, "INIT failed on raid array (%d tags)", tagnum);
 						err = 1;
@@ -214,13 +485,27 @@ int simulate_TagLines(char *wload) {
 
 				} else if (strncmp(command, "CLOSE", 5) == 0) {
 
-					// Close the tagline storage device
-					if (tagline_close()) {
+					// Close the tagline storage device, once everything queued is done
+					if (simulate_vector_flush() || simulate_async_reap(async_depth - async_num_free) || tagline_close()) {
 						// Error out
 						logMessage(LOG_ERROR_LEVEL, "Close failed on raid array.");
 						err = 1;
 					}
 
+				} else if (((strncmp(command, "READ", 6) == 0) || (strncmp(command, "WRITE", 6) == 0)) && (vector_slots != NULL)) {
+
+					// Gather it with the reads (or writes) around it, they are checked once the call is made
+					if (simulate_vector_add((command[0] == 'R') ? TAGLINE_IO_READ : TAGLINE_IO_WRITE, tagnum, blocknum, num_blocks, text)) {
+						err = 1;
+					}
+
+				} else if ((strncmp(command, "READ", 6) == 0) && (async_slots != NULL)) {
+
+					// Queue the read, it is checked when it is reaped
+					if (simulate_async_submit(TAGLINE_IO_READ, tagnum, blocknum, num_blocks, text)) {
+						err = 1;
+					}
+
 				} else if (strncmp(command, "READ", 6) == 0) {
 
 					// First check to make sure our input is sane
@@ -235,19 +520,24 @@ int simulate_TagLines(char *wload) {
 							memset(&rdbuf[i*TAGLINE_BLOCK_SIZE], text[i], TAGLINE_BLOCK_SIZE);
 						}
 
-						// Read the blocks from the tagline
-						if (tagline_read(tagnum, blocknum, num_blocks, tmbuf)) {
+						// Read the blocks from the tagline, only looking at them so no copy is needed
+						if (tagline_read_view(tagnum, blocknum, num_blocks, rdviews)) {
 							// Error out
 							logMessage(LOG_ERROR_LEVEL, "READ failed on tagline storage device (%u)", tagnum);
 							err = 1;
-						}
+						} else {
 
-						// Now compare the read bytes to see if it is correct
-						if (memcmp(rdbuf, tmbuf, num_blocks*TAGLINE_BLOCK_SIZE)) {
-							// Error out
-							logMessage(LOG_ERROR_LEVEL, "Read blocks data mismatch return from tagline storage.");
-							logMessage(LOG_ERROR_LEVEL, "Mismatch [%d] != [%d]", (int)rdbuf[0], (int)tmbuf[0]);
-							err = 1;
+							// Now compare the read bytes to see if it is correct
+							for (i=0; i<num_blocks; i++) {
+								if (memcmp(&rdbuf[i*TAGLINE_BLOCK_SIZE], rdviews[i].data, TAGLINE_BLOCK_SIZE)) {
+									// Error out
+									logMessage(LOG_ERROR_LEVEL, "Read blocks data mismatch return from tagline storage.");
+									logMessage(LOG_ERROR_LEVEL, "Mismatch [%d] != [%d]", (int)rdbuf[i*TAGLINE_BLOCK_SIZE], (int)rdviews[i].data[0]);
+									err = 1;
+									break;
+								}
+							}
+							tagline_release_view(rdviews, num_blocks);
 						}
 
 						// Log the confirmation
@@ -256,6 +546,13 @@ int simulate_TagLines(char *wload) {
 
 					}
 
+				} else if ((strncmp(command, "WRITE", 6) == 0) && (async_slots != NULL)) {
+
+					// Queue the write
+					if (simulate_async_submit(TAGLINE_IO_WRITE, tagnum, blocknum, num_blocks, text)) {
+						err = 1;
+					}
+
 				}  else if (strncmp(command, "WRITE", 6) == 0) {
 
 					// Setup the write block to send to storage device
@@ -273,6 +570,11 @@ int simulate_TagLines(char *wload) {
 
 				} else if (strncmp(command, "DISKFAIL", 8) == 0) {
 
+					// The disk fails once everything queued is done
+					if (simulate_vector_flush() || simulate_async_reap(async_depth - async_num_free)) {
+						err = 1;
+					}
+
 					// Check if the failure are enabled
 					if (disk_failures) {
 
@@ -292,6 +594,9 @@ int simulate_TagLines(char *wload) {
 
 					// Need to save some data here!
 					logMessage(LOG_INFO_LEVEL, "Getting tagline final data (%s)", command);
+					if (simulate_vector_flush() || simulate_async_reap(async_depth - async_num_free)) {
+						return(-1);
+					}
 
 					// TODO: this single block reads are only for first version
 					// do a bunch of reads to make sure that the data matches workload indicators
@@ -360,8 +665,8 @@ int tagline_read_block_validate(TagLineNumber tagnum, TagLineBlockNumber blocknu
 			memset(&rdbuf[i * TAGLINE_BLOCK_SIZE], text[i], TAGLINE_BLOCK_SIZE);
 		}
 
-		// Read the blocks from the tagline
-		if (tagline_read(tagnum, blocknum, num_blocks, tmbuf)) {
+		// Read the blocks from the tagline as views
+		if (tagline_read_view(tagnum, blocknum, num_blocks, rdviews)) {
 			// Error out
 			logMessage(LOG_ERROR_LEVEL,
 					"READ failed on tagline storage device (%u)", tagnum);
@@ -369,14 +674,556 @@ int tagline_read_block_validate(TagLineNumber tagnum, TagLineBlockNumber blocknu
 		}
 
 		// Now compare the read bytes to see if it is correct
-		if (memcmp(rdbuf, tmbuf, num_blocks * TAGLINE_BLOCK_SIZE)) {
-			// Error out
-			logMessage(LOG_ERROR_LEVEL,
-					"Read blocks data mismatch return from tagline storage.");
+		for (i = 0; i < num_blocks; i++) {
+			if (memcmp(&rdbuf[i * TAGLINE_BLOCK_SIZE], rdviews[i].data, TAGLINE_BLOCK_SIZE)) {
+				// Error out
+				logMessage(LOG_ERROR_LEVEL,
+						"Read blocks data mismatch return from tagline storage.");
+				tagline_release_view(rdviews, num_blocks);
+				return(-1);
+			}
+		}
+		tagline_release_view(rdviews, num_blocks);
+
+	}
+
+	// Return successfully
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_async_init
+// Description  : Set up the slots for asynchronous operations
+//
+// Inputs       : depth - the most operations outstanding
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_async_init(uint32_t depth) {
+
+	// Local variables
+	uint32_t i;
+
+	// One slot per operation, each with room for the largest read and write
+	async_slots = calloc(depth, sizeof(SimAsyncSlot));
+	async_free = calloc(depth, sizeof(SimAsyncSlot *));
+	if ((async_slots == NULL) || (async_free == NULL)) {
+		return(-1);
+	}
+	for (i = 0; i < depth; i++) {
+		async_slots[i].buf = malloc(TAGLINE_BLOCK_SIZE * MAX_TAGLINE_BLOCK_NUMBER);
+		async_slots[i].views = malloc(sizeof(RAIDCacheView) * MAX_TAGLINE_BLOCK_NUMBER);
+		if ((async_slots[i].buf == NULL) || (async_slots[i].views == NULL)) {
 			return(-1);
 		}
+		async_free[i] = &async_slots[i];
+	}
+	async_depth = async_num_free = depth;
+
+	// Return successfully
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_async_reap
+// Description  : Wait for asynchronous operations to complete, checking the
+//                data of every read against the workload
+//
+// Inputs       : min - the fewest operations to wait for
+// Outputs      : 0 if successful test, -1 if failure
+
+int simulate_async_reap(uint32_t min) {
+
+	// Local variables
+	TaglineIO *done[MAX_TAGLINE_BLOCK_NUMBER];
+	SimAsyncSlot *slot;
+	int n, i, j, err = 0;
+
+	while (min > 0) {
+
+		// Get at least one completion
+		if ((n = tagline_wait(done, 1, (async_depth < MAX_TAGLINE_BLOCK_NUMBER) ? async_depth : MAX_TAGLINE_BLOCK_NUMBER)) <= 0) {
+			logMessage(LOG_ERROR_LEVEL, "Waiting for tagline operations failed.");
+			return(-1);
+		}
+		min = ((uint32_t)n > min) ? 0 : min - n;
+
+		for (i = 0; i < n; i++) {
+			slot = done[i]->ctx;
+			if (done[i]->result) {
+				logMessage(LOG_ERROR_LEVEL, "%s failed on tagline storage device (%u)",
+						(done[i]->type == TAGLINE_IO_READ) ? "READ" : "WRITE", done[i]->tag);
+				err = 1;
+			} else if (done[i]->type == TAGLINE_IO_READ) {
+
+				// Now compare the read bytes to see if it is correct
+				for (j = 0; j < done[i]->blks; j++) {
+					memset(rdbuf, slot->text[j], TAGLINE_BLOCK_SIZE);
+					if (memcmp(rdbuf, slot->views[j].data, TAGLINE_BLOCK_SIZE)) {
+						logMessage(LOG_ERROR_LEVEL, "Read blocks data mismatch return from tagline storage.");
+						err = 1;
+						break;
+					}
+				}
+				tagline_release_view(slot->views, done[i]->blks);
+			}
+			async_free[async_num_free++] = slot;
+		}
+	}
+
+	// Return the result
+	return( err ? -1 : 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_async_submit
+// Description  : Queue a read or write of the workload, waiting for a slot
+//                to come free if they are all in use
+//
+// Inputs       : type - TAGLINE_IO_READ or TAGLINE_IO_WRITE
+//                tagnum - the tag line number
+//                blocknum - the first block
+//                num_blocks - the number of blocks
+//                text - the block contents, written or to validate
+// Outputs      : 0 if successful test, -1 if failure
+
+int simulate_async_submit(TaglineIOType type, TagLineNumber tagnum, TagLineBlockNumber blocknum,
+		uint16_t num_blocks, char *text) {
 
+	// Local variables
+	SimAsyncSlot *slot;
+	int i;
+
+	// First check to make sure our input is sane, and fits the 8 bit block count of an operation
+	if (strlen(text) != num_blocks) {
+		logMessage(LOG_ERROR_LEVEL, "Text/number blocks mismatch in input data");
+		return(-1);
+	}
+	if (num_blocks > UINT8_MAX) {
+		logMessage(LOG_ERROR_LEVEL, "Too many blocks (%u) for one asynchronous operation", num_blocks);
+		return(-1);
+	}
+	if ((async_num_free == 0) && simulate_async_reap(1)) {
+		return(-1);
+	}
+
+	// Fill in a slot and hand it to the driver
+	slot = async_free[--async_num_free];
+	strcpy(slot->text, text);
+	for (i = 0; (type == TAGLINE_IO_WRITE) && (i < num_blocks); i++) {
+		CMPSC_ASSERT0((text[i]!=0x0), "Bad write data from source files.");
+		memset(&slot->buf[i*TAGLINE_BLOCK_SIZE], text[i], TAGLINE_BLOCK_SIZE);
+	}
+	slot->io = (TaglineIO){ .type = type, .tag = tagnum, .bnum = blocknum, .blks = num_blocks, .buf = slot->buf,
+		.views = (type == TAGLINE_IO_READ) ? slot->views : NULL, .ctx = slot };
+	if (tagline_submit(&slot->io)) {
+		logMessage(LOG_ERROR_LEVEL, "Submitting to tagline storage failed (%u)", tagnum);
+		async_free[async_num_free++] = slot;
+		return(-1);
+	}
+
+	// Return successfully
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_vector_init
+// Description  : Set up the segments of vectored calls
+//
+// Inputs       : max - the most segments per call
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_vector_init(uint32_t max) {
+
+	// Local variables
+	uint32_t i;
+
+	if ((max == 0) || (max > MAX_TAGLINE_BLOCK_NUMBER)) {
+		return(-1);
+	}
+	vector_slots = calloc(max, sizeof(SimVectorSlot));
+	vector_segs = calloc(max, sizeof(TaglineSegment));
+	if ((vector_slots == NULL) || (vector_segs == NULL)) {
+		return(-1);
+	}
+	for (i = 0; i < max; i++) {
+		if ((vector_slots[i].buf = malloc(TAGLINE_BLOCK_SIZE * MAX_TAGLINE_BLOCK_NUMBER)) == NULL) {
+			return(-1);
+		}
+	}
+	vector_max = max;
+
+	// Return successfully
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_vector_add
+// Description  : Add a read or write of the workload to the vectored call
+//                being gathered, making the call first if it is full or does
+//                the other thing.  Each segment is split over two buffers
+//
+// Inputs       : type - TAGLINE_IO_READ or TAGLINE_IO_WRITE
+//                tagnum - the tag line number
+//                blocknum - the first block
+//                num_blocks - the number of blocks
+//                text - the block contents, written or to validate
+// Outputs      : 0 if successful test, -1 if failure
+
+int simulate_vector_add(TaglineIOType type, TagLineNumber tagnum, TagLineBlockNumber blocknum,
+		uint16_t num_blocks, char *text) {
+
+	// Local variables
+	SimVectorSlot *slot;
+	int i;
+
+	// First check to make sure our input is sane, and fits the 8 bit block count of a segment
+	if (strlen(text) != num_blocks) {
+		logMessage(LOG_ERROR_LEVEL, "Text/number blocks mismatch in input data");
+		return(-1);
+	}
+	if (num_blocks > UINT8_MAX) {
+		logMessage(LOG_ERROR_LEVEL, "Too many blocks (%u) for one vectored segment", num_blocks);
+		return(-1);
+	}
+	if (((vector_num == vector_max) || ((vector_num > 0) && (type != vector_type))) && simulate_vector_flush()) {
+		return(-1);
+	}
+
+	// Fill in the next segment
+	slot = &vector_slots[vector_num];
+	strcpy(slot->text, text);
+	for (i = 0; (type == TAGLINE_IO_WRITE) && (i < num_blocks); i++) {
+		CMPSC_ASSERT0((text[i]!=0x0), "Bad write data from source files.");
+		memset(&slot->buf[i*TAGLINE_BLOCK_SIZE], text[i], TAGLINE_BLOCK_SIZE);
+	}
+	slot->iov[0].iov_base = slot->buf;
+	slot->iov[0].iov_len = (num_blocks > 0) ? TAGLINE_BLOCK_SIZE : 0;
+	slot->iov[1].iov_base = &slot->buf[TAGLINE_BLOCK_SIZE];
+	slot->iov[1].iov_len = (num_blocks > 1) ? (num_blocks - 1) * TAGLINE_BLOCK_SIZE : 0;
+	vector_segs[vector_num] = (TaglineSegment){ tagnum, blocknum, num_blocks, slot->iov, 2 };
+	vector_type = type;
+	vector_num++;
+
+	// Return successfully
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_vector_flush
+// Description  : Make the vectored call gathered so far, checking the data of
+//                every segment read against the workload
+//
+// Inputs       : none
+// Outputs      : 0 if successful test, -1 if failure
+
+int simulate_vector_flush(void) {
+
+	// Local variables
+	uint32_t i, j, n = vector_num;
+
+	if (n == 0) {
+		return(0);
+	}
+	vector_num = 0;
+	if (vector_type == TAGLINE_IO_WRITE) {
+		if (tagline_writev(vector_segs, n)) {
+			logMessage(LOG_ERROR_LEVEL, "WRITE failed on tagline storage (%u segments)", n);
+			return(-1);
+		}
+		return(0);
+	}
+	if (tagline_readv(vector_segs, n)) {
+		logMessage(LOG_ERROR_LEVEL, "READ failed on tagline storage device (%u segments)", n);
+		return(-1);
+	}
+
+	// Now compare the read bytes to see if it is correct
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < vector_segs[i].blks; j++) {
+			memset(rdbuf, vector_slots[i].text[j], TAGLINE_BLOCK_SIZE);
+			if (memcmp(rdbuf, &vector_slots[i].buf[j*TAGLINE_BLOCK_SIZE], TAGLINE_BLOCK_SIZE)) {
+				logMessage(LOG_ERROR_LEVEL, "Read blocks data mismatch return from tagline storage.");
+				logMessage(LOG_ERROR_LEVEL, "Mismatch [%d] != [%d]", (int)vector_slots[i].text[j], (int)vector_slots[i].buf[j*TAGLINE_BLOCK_SIZE]);
+				return(-1);
+			}
+		}
+	}
+
+	// Return successfully
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_threaded
+// Description  : Run the workload on sim_threads threads.  The reads and
+//                writes between two commands that need the whole array
+//                (INIT, CLOSE and DISKFAIL) are split by tagline, each thread
+//                doing the ones of its taglines in workload order, and the
+//                threads are joined before the next such command
+//
+// Inputs       : wload - the name of the workload file
+// Outputs      : 0 if successful test, -1 if failure
+
+int simulate_threaded(char *wload) {
+
+	// Local variables
+	char line[1024], command[128], text[1204];
+	SimThread threads[SIM_MAX_THREADS];
+	SimCommand *cmds = NULL, *more;
+	uint32_t num_cmds = 0, max_cmds = 0, i, j, k;
+	struct timeval start, end;
+	FILE *fhandle;
+	long ops = 0;
+	double secs;
+	int err = 0;
+
+	// Read the whole workload in first
+	if ((fhandle=fopen(wload, "r")) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Failure opening the workload file [%s], error: %s.\n",
+			wload, strerror(errno));
+		return(-1);
+	}
+	while (fgets(line, 1024, fhandle) != NULL) {
+		if (num_cmds == max_cmds) {
+			max_cmds = (max_cmds) ? max_cmds * 2 : 4096;
+			if ((more = realloc(cmds, max_cmds * sizeof(SimCommand))) == NULL) {
+				err = 1;
+				break;
+			}
+			cmds = more;
+		}
+		if ((sscanf(line, "%s %hu %hu %u %s", command, &cmds[num_cmds].tagnum, &cmds[num_cmds].num_blocks,
+				&cmds[num_cmds].blocknum, text) != 5) || (strlen(command) >= sizeof(cmds[0].command)) ||
+				(strlen(text) > MAX_TAGLINE_BLOCK_NUMBER)) {
+			logMessage(LOG_ERROR_LEVEL, "Tagline un-parsable workload string, aborting [%s], line %u",
+					line, num_cmds + 1);
+			err = 1;
+			break;
+		}
+		strcpy(cmds[num_cmds].command, command);
+		strcpy(cmds[num_cmds].text, text);
+		num_cmds++;
+	}
+	fclose(fhandle);
+
+	// Every thread has buffers of its own
+	memset(threads, 0, sizeof(threads));
+	for (k = 0; (k < sim_threads) && !err; k++) {
+		threads[k].id = k;
+		threads[k].rdbuf = malloc(TAGLINE_BLOCK_SIZE * MAX_TAGLINE_BLOCK_NUMBER);
+		threads[k].wrbuf = malloc(TAGLINE_BLOCK_SIZE * MAX_TAGLINE_BLOCK_NUMBER);
+		threads[k].views = malloc(sizeof(RAIDCacheView) * MAX_TAGLINE_BLOCK_NUMBER);
+		if ((threads[k].rdbuf == NULL) || (threads[k].wrbuf == NULL) || (threads[k].views == NULL)) {
+			err = 1;
+		}
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; (i < num_cmds) && !err; i = j) {
+
+		// A command that needs the whole array runs on its own
+		if (!strcmp(cmds[i].command, "INIT") || !strcmp(cmds[i].command, "CLOSE") || !strcmp(cmds[i].command, "DISKFAIL")) {
+			err = simulate_global(&cmds[i]);
+			j = i + 1;
+			continue;
+		}
+
+		// The threads share out the commands up to the next one of those
+		for (j = i; (j < num_cmds) && strcmp(cmds[j].command, "INIT") && strcmp(cmds[j].command, "CLOSE") &&
+				strcmp(cmds[j].command, "DISKFAIL"); j++);
+		for (k = 0; k < sim_threads; k++) {
+			threads[k].cmds = &cmds[i];
+			threads[k].num_cmds = j - i;
+			if (pthread_create(&threads[k].thread, NULL, simulate_thread, &threads[k])) {
+				logMessage(LOG_ERROR_LEVEL, "Starting simulator thread %u failed.", k);
+				threads[k].err = 1;
+				threads[k].num_cmds = 0;
+			}
+		}
+		for (k = 0; k < sim_threads; k++) {
+			if (threads[k].num_cmds > 0) {
+				pthread_join(threads[k].thread, NULL);
+			}
+			err |= threads[k].err;
+		}
+	}
+	gettimeofday(&end, NULL);
+
+	// Report the throughput
+	for (k = 0; k < sim_threads; k++) {
+		ops += threads[k].ops;
+		free(threads[k].rdbuf);
+		free(threads[k].wrbuf);
+		free(threads[k].views);
+	}
+	free(cmds);
+	if (err) {
+		logMessage(LOG_ERROR_LEVEL, "RAID system failed, aborting [%d]", err);
+		return(-1);
+	}
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	logMessage(LOG_OUTPUT_LEVEL, "Simulated %ld reads and writes on %u threads in %.3f s, %.0f operations/s",
+			ops, sim_threads, secs, (secs > 0) ? ops / secs : 0.0);
+
+	// Return successfully
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_global
+// Description  : Run a command that needs the whole array, with no
+//                simulator thread running
+//
+// Inputs       : cmd - the command (INIT, CLOSE or DISKFAIL)
+// Outputs      : 0 if successful test, -1 if failure
+
+int simulate_global(SimCommand *cmd) {
+
+	if (!strcmp(cmd->command, "INIT")) {
+
+		// Call the initialize function for the tagline storage
+		if (tagline_driver_init_cache(cmd->tagnum, cache_blocks)) {
+			logMessage(LOG_ERROR_LEVEL, "INIT failed on raid array (%d tags)", cmd->tagnum);
+			return(-1);
+		}
+
+	} else if (!strcmp(cmd->command, "CLOSE")) {
+
+		// Close the tagline storage device
+		if (tagline_close()) {
+			logMessage(LOG_ERROR_LEVEL, "Close failed on raid array.");
+			return(-1);
+		}
+
+	} else if (disk_failures) {
+
+		// Call the disk failure in the RAID interface
+		logMessage(LOG_INFO_LEVEL, "Failing disk [%d] on raid array ...", cmd->tagnum);
+		if (remote_raid_fail_disk((RAIDDiskID)cmd->tagnum) || (raid_disk_signal())) {
+			logMessage(LOG_ERROR_LEVEL, "Simulation failed failing disk [%d] ... WAT?", cmd->tagnum);
+			return(-1);
+		}
+
+	} else {
+		// Just log it
+		logMessage(LOG_INFO_LEVEL, "Ignoring disabled disk failure  on disk [%d]", cmd->tagnum);
+	}
+
+	// Return successfully
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_thread
+// Description  : The body of a simulator thread, doing the reads, writes and
+//                validations of its taglines in workload order
+//
+// Inputs       : arg - the thread (SimThread)
+// Outputs      : NULL
+
+void *simulate_thread(void *arg) {
+
+	// Local variables
+	SimThread *t = arg;
+	SimCommand *cmd;
+	char txt[2];
+	uint32_t i;
+	int j;
+
+	for (i = 0; (i < t->num_cmds) && !t->err; i++) {
+		cmd = &t->cmds[i];
+		if (cmd->tagnum % sim_threads != t->id) {
+			continue;
+		}
+
+		if (!strcmp(cmd->command, "READ")) {
+
+			// Read the blocks and check them
+			if (simulate_thread_read(t, cmd->tagnum, cmd->blocknum, cmd->num_blocks, cmd->text)) {
+				t->err = 1;
+			}
+			t->ops++;
+
+		} else if (!strcmp(cmd->command, "WRITE")) {
+
+			// Setup the write block to send to storage device
+			for (j = 0; j < cmd->num_blocks; j++) {
+				CMPSC_ASSERT0((cmd->text[j]!=0x0), "Bad write data from source files.");
+				memset(&t->wrbuf[j*TAGLINE_BLOCK_SIZE], cmd->text[j], TAGLINE_BLOCK_SIZE);
+			}
+			if (tagline_write(cmd->tagnum, cmd->blocknum, cmd->num_blocks, t->wrbuf)) {
+				logMessage(LOG_ERROR_LEVEL, "WRITE failed on tagline storage (%d)", cmd->tagnum);
+				t->err = 1;
+			}
+			t->ops++;
+
+		} else if (!strcmp(cmd->command, "tagline")) {
+
+			// Check every block of the tagline against the workload
+			for (j = 0; (j < (int)strlen(cmd->text)) && !t->err; j++) {
+				txt[0] = cmd->text[j];
+				txt[1] = 0x0;
+				if (simulate_thread_read(t, cmd->tagnum, j, 1, txt)) {
+					logMessage(LOG_ERROR_LEVEL, "Tagline validation failed for tag line [%d], aborting.", cmd->tagnum);
+					t->err = 1;
+				}
+			}
+		}
+	}
+
+	// Return the thread
+	return( NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_thread_read
+// Description  : Read blocks as views on a simulator thread and check them
+//                against the workload
+//
+// Inputs       : t - the thread
+//                tagnum - the tag line number
+//                blocknum - the first block
+//                num_blocks - the number of blocks
+//                text - the block contents to validate
+// Outputs      : 0 if successful test, -1 if failure
+
+int simulate_thread_read(SimThread *t, TagLineNumber tagnum, TagLineBlockNumber blocknum,
+		uint16_t num_blocks, char *text) {
+
+	// Local variables
+	int i;
+
+	// First check to make sure our input is sane
+	if (strlen(text) != num_blocks) {
+		logMessage(LOG_ERROR_LEVEL, "Text/number blocks mismatch in input data");
+		return(-1);
+	}
+	if (tagline_read_view(tagnum, blocknum, num_blocks, t->views)) {
+		logMessage(LOG_ERROR_LEVEL, "READ failed on tagline storage device (%u)", tagnum);
+		return(-1);
+	}
+
+	// Now compare the read bytes to see if it is correct
+	for (i = 0; i < num_blocks; i++) {
+		memset(t->rdbuf, text[i], TAGLINE_BLOCK_SIZE);
+		if (memcmp(t->rdbuf, t->views[i].data, TAGLINE_BLOCK_SIZE)) {
+			logMessage(LOG_ERROR_LEVEL, "Read blocks data mismatch return from tagline storage.");
+			logMessage(LOG_ERROR_LEVEL, "Mismatch [%d] != [%d]", (int)text[i], (int)t->views[i].data[0]);
+			tagline_release_view(t->views, num_blocks);
+			return(-1);
+		}
 	}
+	tagline_release_view(t->views, num_blocks);
 
 	// Return successfully
 	return(0);